@@ -27,166 +27,96 @@
 #include <string.h>
 
 #include "cpu.h"
+#include "snp.h"
 #include "alc.h"
 
-uint8_t alc_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
-   struct ewm_alc_t *alc = (struct ewm_alc_t*) mem->obj;
+// The language card maps its pages itself with cpu_map_bank(), so a
+// switch is at most 48 page table updates instead of three walks of
+// the memory list. The RAM regions stay disabled in the memory list,
+// they are only there to hold the banks, which also puts them in the
+// memory state of the cpu. Pages that read from ROM read from whatever
+// region covered them before the card was installed.
+
+static void alc_map(struct cpu_t *cpu, struct ewm_alc_t *alc) {
+   for (int page = 0xd0; page <= 0xff; page++) {
+      struct mem_t *ram = (page < 0xe0) ? (alc->bank2 ? alc->ram2 : alc->ram1) : alc->ram3;
+      cpu_map_bank(cpu, page, alc->read_ram ? ram : alc->roms[page - 0xd0], alc->write_ram ? ram : NULL);
+   }
+}
+
+// Reads and writes of the soft switches have the same effect, except
+// that only two reads in a row of an odd switch enable writing.
 
-   // Always enable the right banks
-   if (addr & 0b00001000) {
-      alc->ram1->enabled = true;
-      alc->ram2->enabled = false;
-      alc->ram3->enabled = true;
+static void alc_switch(struct cpu_t *cpu, struct ewm_alc_t *alc, uint16_t addr, bool write) {
+   alc->bank2 = (addr & 0b00001000) == 0;
+
+   if (write || (addr & 0b00000001) == 0) {
+      alc->wrtcount = 0;
    } else {
-      alc->ram1->enabled = false;
-      alc->ram2->enabled = true;
-      alc->ram3->enabled = true;
+      alc->wrtcount = alc->wrtcount + 1;
    }
 
-   switch (addr) {
+   switch (addr & 0b00000011) {
       // WRTCOUNT = 0, WRITE DISABLE, READ ENABLE
-      case 0xc080:
-      case 0xc088:
-      case 0xc084:
-      case 0xc08c:
-         alc->wrtcount = 0;
-         alc->ram1->flags = MEM_FLAGS_READ;
-         alc->ram2->flags = MEM_FLAGS_READ;
-         alc->ram3->flags = MEM_FLAGS_READ;
+      case 0b00:
+         alc->read_ram = true;
+         alc->write_ram = false;
          break;
-
       // WRTCOUNT++, READ DISABLE, WRITE ENABLE IF WRTCOUNT >= 2
-      case 0xc081:
-      case 0xc089:
-      case 0xc085:
-      case 0xc08d:
-         alc->wrtcount = alc->wrtcount + 1;
-         alc->ram1->flags &= ~MEM_FLAGS_READ;
-         alc->ram2->flags &= ~MEM_FLAGS_READ;
-         alc->ram3->flags &= ~MEM_FLAGS_READ;
-         if (alc->wrtcount >= 2) {
-            alc->ram1->flags |= MEM_FLAGS_WRITE;
-            alc->ram2->flags |= MEM_FLAGS_WRITE;
-            alc->ram3->flags |= MEM_FLAGS_WRITE;
-         }
+      case 0b01:
+         alc->read_ram = false;
          break;
-
       // WRTCOUNT = 0, WRITE DISABLE, READ DISABLE
-      case 0xc082:
-      case 0xc08a:
-      case 0xc086:
-      case 0xc08e:
-         alc->wrtcount = 0;
-         alc->ram1->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram2->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram3->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram1->flags &= MEM_FLAGS_WRITE;
-         alc->ram2->flags &= MEM_FLAGS_WRITE;
-         alc->ram3->flags &= MEM_FLAGS_WRITE;
+      case 0b10:
+         alc->read_ram = false;
+         alc->write_ram = false;
          break;
-
       // WRTCOUNT++, READ ENABLE, WRITE ENABLE IF WRTCOUNT >= 2
-      case 0xc083:
-      case 0xc08b:
-      case 0xc087:
-      case 0xc08f:
-         alc->wrtcount = alc->wrtcount + 1;
-         alc->ram1->flags |= MEM_FLAGS_READ;
-         alc->ram2->flags |= MEM_FLAGS_READ;
-         alc->ram3->flags |= MEM_FLAGS_READ;
-         if (alc->wrtcount >= 2) {
-            alc->ram1->flags |= MEM_FLAGS_WRITE;
-            alc->ram2->flags |= MEM_FLAGS_WRITE;
-            alc->ram3->flags |= MEM_FLAGS_WRITE;
-         }
+      case 0b11:
+         alc->read_ram = true;
          break;
+   }
 
-      default:
-         fprintf(stderr, "[ALC] Unexpected read at $%.4X\n", addr);
-         break;
+   if (alc->wrtcount >= 2) {
+      alc->write_ram = true;
    }
 
+   alc_map(cpu, alc);
+}
+
+static uint8_t alc_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   alc_switch(cpu, (struct ewm_alc_t*) mem->obj, addr, false);
    return 0;
 }
 
 static void alc_iom_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
-   struct ewm_alc_t *alc = (struct ewm_alc_t*) mem->obj;
-
-   // Always enable the right banks
-   if (addr & 0b00001000) {
-      alc->ram1->enabled = true;
-      alc->ram2->enabled = false;
-      alc->ram3->enabled = true;
-   } else {
-      alc->ram1->enabled = false;
-      alc->ram2->enabled = true;
-      alc->ram3->enabled = true;
-   }
-
-   switch (addr) {
-      // WRTCOUNT = 0, WRITE DISABLE, READ ENABLE
-      case 0xc080:
-      case 0xc088:
-      case 0xc084:
-      case 0xc08c:
-         alc->wrtcount = 0;
-         alc->ram1->flags = MEM_FLAGS_READ;
-         alc->ram2->flags = MEM_FLAGS_READ;
-         alc->ram3->flags = MEM_FLAGS_READ;
-         break;
-
-      // WRTCOUNT = 0, READ DISABLE
-      case 0xc081:
-      case 0xc089:
-      case 0xc085:
-      case 0xc08d:
-         alc->wrtcount = 0;
-         alc->ram1->flags &= ~MEM_FLAGS_READ;
-         alc->ram2->flags &= ~MEM_FLAGS_READ;
-         alc->ram3->flags &= ~MEM_FLAGS_READ;
-         break;
-
-      // WRTCOUNT = 0, WRITE DISABLE, READ DISABLE
-      case 0xc082:
-      case 0xc08a:
-      case 0xc086:
-      case 0xc08e:
-         alc->wrtcount = 0;
-         alc->ram1->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram2->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram3->flags &= ~MEM_FLAGS_WRITE;
-         alc->ram1->flags &= MEM_FLAGS_WRITE;
-         alc->ram2->flags &= MEM_FLAGS_WRITE;
-         alc->ram3->flags &= MEM_FLAGS_WRITE;
-         break;
-
-      // WRTCOUNT = 0, READ ENABLE
-      case 0xc083:
-      case 0xc08b:
-      case 0xc087:
-      case 0xc08f:
-         alc->wrtcount = 0;
-         alc->ram1->flags |= MEM_FLAGS_READ;
-         alc->ram2->flags |= MEM_FLAGS_READ;
-         alc->ram3->flags |= MEM_FLAGS_READ;
-         break;
+   alc_switch(cpu, (struct ewm_alc_t*) mem->obj, addr, true);
+}
 
-      default:
-         fprintf(stderr, "[ALC] Unexpected write at $%.4X\n", addr);
-         break;
+static struct mem_t *alc_rom_for_page(struct cpu_t *cpu, uint8_t page) {
+   uint16_t start = page * 0x0100, end = start + 0xff;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->enabled && (mem->flags & MEM_FLAGS_READ) && mem->start <= start && mem->end >= end) {
+         return mem;
+      }
    }
+   return NULL;
 }
 
 int ewm_alc_init(struct ewm_alc_t *alc, struct cpu_t *cpu) {
    memset(alc, 0x00, sizeof(struct ewm_alc_t));
 
-   // Order is important. First added is last tried when looking up
-   // addresses. So we register the ROM first, which means we never
-   // have to disable it.
+   // Order is important. Regions added later are tried first, so the
+   // autostart ROM replaces the monitor ROM in the pages we look up.
 
    alc->rom = cpu_add_rom_file(cpu, 0xf800, "rom/341-0020.bin");
    alc->iom = cpu_add_iom(cpu, 0xc080, 0xc08f, alc, alc_iom_read, alc_iom_write);
    alc->iom->description = "iom/alc/$C080";
+
+   for (int page = 0xd0; page <= 0xff; page++) {
+      alc->roms[page - 0xd0] = alc_rom_for_page(cpu, page);
+   }
+
    alc->ram1 = cpu_add_ram(cpu, 0xd000, 0xd000 + 4096 - 1);
    alc->ram1->description = "ram/alc/$D000 (RAM1)";
    alc->ram2 = cpu_add_ram(cpu, 0xd000, 0xd000 + 4096 - 1);
@@ -198,6 +128,10 @@ int ewm_alc_init(struct ewm_alc_t *alc, struct cpu_t *cpu) {
    alc->ram2->enabled = false;
    alc->ram3->enabled = false;
 
+   // Reading ROM, writing nothing, as after power on
+   alc->bank2 = true;
+   alc_map(cpu, alc);
+
    return 0;
 }
 
@@ -209,3 +143,36 @@ struct ewm_alc_t *ewm_alc_create(struct cpu_t *cpu) {
    }
    return alc;
 }
+
+// The banks are memory regions of the cpu and go with it
+
+void ewm_alc_destroy(struct ewm_alc_t *alc) {
+   free(alc);
+}
+
+int ewm_alc_save_snapshot(struct ewm_alc_t *alc, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "ALC ");
+   ewm_snapshot_put_u32(snapshot, alc->wrtcount);
+   ewm_snapshot_put_u8(snapshot, alc->read_ram);
+   ewm_snapshot_put_u8(snapshot, alc->write_ram);
+   ewm_snapshot_put_u8(snapshot, alc->bank2);
+   ewm_snapshot_end(snapshot);
+   return snapshot->error ? -1 : 0;
+}
+
+int ewm_alc_load_snapshot(struct ewm_alc_t *alc, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "ALC ", &chunk) != 0) {
+      fprintf(stderr, "[ALC] Snapshot has no language card state\n");
+      return -1;
+   }
+   alc->wrtcount = ewm_snapshot_get_u32(&chunk);
+   alc->read_ram = ewm_snapshot_get_u8(&chunk);
+   alc->write_ram = ewm_snapshot_get_u8(&chunk);
+   alc->bank2 = ewm_snapshot_get_u8(&chunk);
+   if (chunk.error) {
+      return -1;
+   }
+   alc_map(cpu, alc);
+   return 0;
+}
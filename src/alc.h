@@ -23,8 +23,11 @@
 #ifndef EWM_ALC_H
 #define EWM_ALC_H
 
+#include <stdbool.h>
+
 struct mem_t;
 struct cpu_t;
+struct ewm_snapshot_t;
 
 struct ewm_alc_t {
    struct mem_t *ram1; // $D000 - $DFFF RAM Bank #1
@@ -32,9 +35,18 @@ struct ewm_alc_t {
    struct mem_t *ram3; // $E000 - $FFFF RAM Bank #3
    struct mem_t *rom;  // $F800 - $FFFF Autostart ROM
    struct mem_t *iom;  // $C080 - $C08F
+   struct mem_t *roms[48]; // What $D000 - $FFFF read when not reading RAM
    int wrtcount;
+   bool read_ram;
+   bool write_ram;
+   bool bank2;
 };
 
 struct ewm_alc_t *ewm_alc_create(struct cpu_t *cpu);
+void ewm_alc_destroy(struct ewm_alc_t *alc);
+
+// The banks themselves are part of the memory state of the cpu
+int ewm_alc_save_snapshot(struct ewm_alc_t *alc, struct ewm_snapshot_t *snapshot);
+int ewm_alc_load_snapshot(struct ewm_alc_t *alc, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot);
 
 #endif // EWM_ALC_H
@@ -0,0 +1,352 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "ldr.h"
+#include "rom.h"
+#include "one.h"
+#include "two.h"
+#include "thr.h"
+#include "bat.h"
+
+// A job file has one job per line, as a list of key=value settings:
+//
+//   machine=two drive1=disks/test.dsk fast-disk seconds=30 dump=text
+//   machine=one model=apple1 snapshot=test.snp seconds=5 dump=memory:0280:02ff
+//   machine=two load=bas:test.bas run seconds=5 dump=text
+//
+// Empty lines and lines starting with # are ignored. Everything is parsed
+// up front on the main thread, the jobs only run the machines.
+
+struct ewm_batch_t {
+   struct ewm_batch_job_t *jobs;
+   int count;
+   int capacity;
+   char **lines; // Settings point into these
+   int *results;
+   char **outputs;
+   size_t *output_sizes;
+};
+
+static int ewm_batch_parse_setting(struct ewm_batch_job_t *job, char *key, char *value) {
+   if (strcmp(key, "fast-disk") == 0 && value == NULL) {
+      job->fast_disk = true;
+      return 0;
+   }
+
+   if (strcmp(key, "strict") == 0 && value == NULL) {
+      job->strict = true;
+      return 0;
+   }
+
+   if (strcmp(key, "run") == 0 && value == NULL) {
+      job->run = true;
+      return 0;
+   }
+
+   if (value == NULL) {
+      return -1;
+   }
+
+   if (strcmp(key, "machine") == 0) {
+      if (strcmp(value, "one") == 0) {
+         job->machine = EWM_BATCH_MACHINE_ONE;
+      } else if (strcmp(value, "two") == 0) {
+         job->machine = EWM_BATCH_MACHINE_TWO;
+      } else {
+         return -1;
+      }
+   } else if (strcmp(key, "model") == 0) {
+      if (strcmp(value, "apple1") == 0) {
+         job->model = EWM_ONE_MODEL_APPLE1;
+      } else if (strcmp(value, "replica1") == 0) {
+         job->model = EWM_ONE_MODEL_REPLICA1;
+      } else {
+         return -1;
+      }
+   } else if (strcmp(key, "drive1") == 0) {
+      job->drive1 = value;
+   } else if (strcmp(key, "drive2") == 0) {
+      job->drive2 = value;
+   } else if (strcmp(key, "memory") == 0) {
+      struct ewm_memory_option_t *m = parse_memory_option(value);
+      if (m == NULL) {
+         return -1;
+      }
+      m->next = job->memory;
+      job->memory = m;
+   } else if (strcmp(key, "load") == 0) {
+      if (ewm_ldr_add_option(&job->loads, value) != 0) {
+         return -1;
+      }
+   } else if (strcmp(key, "script") == 0) {
+      job->script = value;
+   } else if (strcmp(key, "snapshot") == 0) {
+      job->snapshot = value;
+   } else if (strcmp(key, "seconds") == 0) {
+      job->seconds = strtoull(value, NULL, 10);
+   } else if (strcmp(key, "dump") == 0) {
+      job->dump = value;
+   } else if (strcmp(key, "output") == 0) {
+      job->output = value;
+   } else {
+      return -1;
+   }
+
+   return 0;
+}
+
+static int ewm_batch_parse_job(struct ewm_batch_job_t *job, int number, char *line) {
+   memset(job, 0, sizeof(struct ewm_batch_job_t));
+   job->line = number;
+   job->machine = EWM_BATCH_MACHINE_TWO;
+   job->model = EWM_ONE_MODEL_DEFAULT;
+
+   char *saveptr = NULL;
+   for (char *token = strtok_r(line, " \t\r\n", &saveptr); token != NULL; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      char *value = strchr(token, '=');
+      if (value != NULL) {
+         *value++ = 0x00;
+      }
+      if (ewm_batch_parse_setting(job, token, value) != 0) {
+         fprintf(stderr, "[BAT] Invalid setting %s on line %d\n", token, number);
+         return -1;
+      }
+   }
+
+   // Jobs have to end by themselves
+   if (job->seconds == 0) {
+      fprintf(stderr, "[BAT] Job on line %d has no seconds\n", number);
+      return -1;
+   }
+
+   if (job->machine == EWM_BATCH_MACHINE_ONE && (job->drive1 != NULL || job->drive2 != NULL || job->script != NULL)) {
+      fprintf(stderr, "[BAT] Job on line %d uses settings that only work for machine=two\n", number);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int ewm_batch_load(struct ewm_batch_t *batch, char *path) {
+   FILE *fp = fopen(path, "r");
+   if (fp == NULL) {
+      fprintf(stderr, "[BAT] Cannot open %s\n", path);
+      return -1;
+   }
+
+   int result = 0;
+   int number = 0;
+   char *line = NULL;
+   size_t length = 0;
+
+   while (getline(&line, &length, fp) != -1) {
+      number++;
+
+      char *p = line + strspn(line, " \t\r\n");
+      if (*p == 0x00 || *p == '#') {
+         continue;
+      }
+
+      if (batch->count == batch->capacity) {
+         batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+         batch->jobs = realloc(batch->jobs, batch->capacity * sizeof(struct ewm_batch_job_t));
+         batch->lines = realloc(batch->lines, batch->capacity * sizeof(char*));
+         if (batch->jobs == NULL || batch->lines == NULL) {
+            result = -1;
+            break;
+         }
+      }
+
+      if (ewm_batch_parse_job(&batch->jobs[batch->count], number, line) != 0) {
+         result = -1;
+         break;
+      }
+
+      // The job keeps pointers into the line
+      batch->lines[batch->count++] = line;
+      line = NULL;
+      length = 0;
+   }
+
+   free(line);
+   fclose(fp);
+
+   return result;
+}
+
+static void ewm_batch_free(struct ewm_batch_t *batch) {
+   for (int i = 0; i < batch->count; i++) {
+      struct ewm_memory_option_t *m = batch->jobs[i].memory;
+      while (m != NULL) {
+         struct ewm_memory_option_t *next = m->next;
+         free(m);
+         m = next;
+      }
+      ewm_ldr_free_options(batch->jobs[i].loads);
+      free(batch->lines[i]);
+      if (batch->outputs != NULL) {
+         free(batch->outputs[i]);
+      }
+   }
+   free(batch->jobs);
+   free(batch->lines);
+   free(batch->results);
+   free(batch->outputs);
+   free(batch->output_sizes);
+}
+
+// Output of a job goes to its own file, or is kept in memory to be
+// printed after all jobs are done, in the order of the job file.
+
+static void ewm_batch_run_job(void *ctx, int index) {
+   struct ewm_batch_t *batch = (struct ewm_batch_t*) ctx;
+   struct ewm_batch_job_t *job = &batch->jobs[index];
+
+   FILE *out;
+   if (job->output != NULL) {
+      out = fopen(job->output, "w");
+   } else {
+      out = open_memstream(&batch->outputs[index], &batch->output_sizes[index]);
+   }
+   if (out == NULL) {
+      fprintf(stderr, "[BAT] Cannot open output for job on line %d\n", job->line);
+      batch->results[index] = -1;
+      return;
+   }
+
+   switch (job->machine) {
+      case EWM_BATCH_MACHINE_ONE:
+         batch->results[index] = ewm_one_run_job(job, out);
+         break;
+      case EWM_BATCH_MACHINE_TWO:
+         batch->results[index] = ewm_two_run_job(job, out);
+         break;
+   }
+
+   fclose(out);
+}
+
+#define EWM_BATCH_OPT_HELP    (0)
+#define EWM_BATCH_OPT_THREADS (1)
+
+static struct option batch_options[] = {
+   { "help",    no_argument,       NULL, EWM_BATCH_OPT_HELP    },
+   { "threads", required_argument, NULL, EWM_BATCH_OPT_THREADS },
+   { NULL,      0,                 NULL, 0 }
+};
+
+static void usage() {
+   fprintf(stderr, "Usage: ewm batch [options] <job file>\n");
+   fprintf(stderr, "  --threads <n>     number of threads to use (default: one per cpu)\n");
+   fprintf(stderr, "\n");
+   fprintf(stderr, "Each line of the job file is a job with the following settings:\n");
+   fprintf(stderr, "  machine=one|two   machine to run (default: two)\n");
+   fprintf(stderr, "  model=<model>     apple1 or replica1 for machine=one\n");
+   fprintf(stderr, "  drive1=<path>     disk in slot 6 drive 1\n");
+   fprintf(stderr, "  drive2=<path>     disk in slot 6 drive 2\n");
+   fprintf(stderr, "  memory=<region>   add memory region (ram|rom:address:path)\n");
+   fprintf(stderr, "  script=<path>     load Lua script into the emulator\n");
+   fprintf(stderr, "  snapshot=<path>   continue from a snapshot\n");
+   fprintf(stderr, "  load=<program>    load bin:<address>:<path> or bas:<path> once booted\n");
+   fprintf(stderr, "  run               start the last loaded program\n");
+   fprintf(stderr, "  fast-disk         read DOS 3.3 sectors without going through the nibbles\n");
+   fprintf(stderr, "  strict            run emulator in strict mode\n");
+   fprintf(stderr, "  seconds=<n>       stop after n seconds of emulated time (required)\n");
+   fprintf(stderr, "  dump=<what>       print text or memory:start:end at the end\n");
+   fprintf(stderr, "  output=<path>     write the dump to path instead of to stdout\n");
+}
+
+int ewm_batch_main(int argc, char **argv) {
+   int threads = 0;
+
+   int ch;
+   while ((ch = getopt_long_only(argc, argv, "", batch_options, NULL)) != -1) {
+      switch (ch) {
+         case EWM_BATCH_OPT_HELP: {
+            usage();
+            exit(0);
+         }
+         case EWM_BATCH_OPT_THREADS:
+            threads = atoi(optarg);
+            if (threads <= 0) {
+               usage();
+               exit(1);
+            }
+            break;
+         default: {
+            usage();
+            exit(1);
+         }
+      }
+   }
+
+   if (optind != argc - 1) {
+      usage();
+      exit(1);
+   }
+
+   struct ewm_batch_t batch;
+   memset(&batch, 0, sizeof(struct ewm_batch_t));
+
+   if (ewm_batch_load(&batch, argv[optind]) != 0) {
+      ewm_batch_free(&batch);
+      return 1;
+   }
+
+   batch.results = calloc(batch.count, sizeof(int));
+   batch.outputs = calloc(batch.count, sizeof(char*));
+   batch.output_sizes = calloc(batch.count, sizeof(size_t));
+   if (batch.count != 0 && (batch.results == NULL || batch.outputs == NULL || batch.output_sizes == NULL)) {
+      ewm_batch_free(&batch);
+      return 1;
+   }
+
+   if (ewm_pool_run(batch.count, threads, ewm_batch_run_job, &batch) != 0) {
+      fprintf(stderr, "[BAT] Cannot run jobs\n");
+      ewm_batch_free(&batch);
+      return 1;
+   }
+
+   int failed = 0;
+   for (int i = 0; i < batch.count; i++) {
+      if (batch.outputs[i] != NULL) {
+         fwrite(batch.outputs[i], 1, batch.output_sizes[i], stdout);
+      }
+      fprintf(stderr, "[BAT] Job on line %d %s\n", batch.jobs[i].line, batch.results[i] == 0 ? "ok" : "failed");
+      if (batch.results[i] != 0) {
+         failed++;
+      }
+   }
+
+   fprintf(stderr, "[BAT] %d jobs, %d failed\n", batch.count, failed);
+
+   ewm_batch_free(&batch);
+   ewm_rom_purge();
+
+   return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_BAT_H
+#define EWM_BAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Runs many headless machines in one process, one machine per job, on a
+// pool of threads. Jobs are read from a file with one job per line.
+
+#define EWM_BATCH_MACHINE_ONE (0)
+#define EWM_BATCH_MACHINE_TWO (1)
+
+struct ewm_memory_option_t;
+struct ewm_ldr_option_t;
+
+struct ewm_batch_job_t {
+   int line;
+   int machine;
+   int model; // Only for the Apple 1
+   char *drive1;
+   char *drive2;
+   struct ewm_memory_option_t *memory;
+   char *script;
+   char *snapshot;
+   bool fast_disk;
+   bool strict;
+   struct ewm_ldr_option_t *loads;
+   bool run;
+   uint64_t seconds;
+   char *dump;
+   char *output;
+};
+
+int ewm_batch_main(int argc, char **argv);
+
+#endif // EWM_BAT_H
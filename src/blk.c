@@ -0,0 +1,181 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "ins.h"
+#include "mem.h"
+#include "blk.h"
+
+struct ewm_blk_cache_t *ewm_blk_create(void) {
+   struct ewm_blk_cache_t *cache = calloc(1, sizeof(struct ewm_blk_cache_t));
+   if (cache == NULL) {
+      return NULL;
+   }
+   // Empty blocks have version zero, so they never match
+   for (int page = 0; page < 256; page++) {
+      cache->versions[page] = 1;
+   }
+   return cache;
+}
+
+void ewm_blk_destroy(struct ewm_blk_cache_t *cache) {
+   free(cache);
+}
+
+static void ewm_blk_invalidate(struct ewm_blk_cache_t *cache, uint8_t page) {
+   if (++cache->versions[page] == 0) {
+      cache->versions[page] = 1;
+   }
+   memset(cache->decoded[page], 0, sizeof cache->decoded[page]);
+}
+
+void ewm_blk_flush(struct ewm_blk_cache_t *cache) {
+   for (int page = 0; page < 256; page++) {
+      ewm_blk_invalidate(cache, page);
+   }
+}
+
+// Whether the bytes of a read page can change without the page being
+// mapped again. While protected, the write page is the same as when it
+// got protected, except that its data moved to the read page.
+
+static bool ewm_blk_page_cacheable(struct cpu_t *cpu, uint8_t page) {
+   struct cpu_page_t *r = &cpu->read_pages[page], *w = &cpu->write_pages[page];
+   if (r->data == NULL || page < 2 || cpu->blocks->invalidations[page] >= EWM_BLK_INVALIDATIONS) {
+      return false; // The stack and zero page are also written through cpu->ram
+   }
+   if (w->code) {
+      return true;
+   }
+   if (w->data == r->data) {
+      w->data = NULL;
+      w->code = true;
+      return true;
+   }
+   return w->mem == NULL && !w->mixed;
+}
+
+static bool ewm_blk_same_page(struct cpu_page_t *a, struct cpu_page_t *b) {
+   return a->data == b->data && a->mem == b->mem && a->mixed == b->mixed && a->dirty == b->dirty && a->code == b->code;
+}
+
+void ewm_blk_remapped(struct cpu_t *cpu, uint8_t page, struct cpu_page_t *read, struct cpu_page_t *write) {
+   struct cpu_page_t *r = &cpu->read_pages[page], *w = &cpu->write_pages[page];
+
+   bool protected = write->code;
+   if (protected) {
+      write->data = read->data;
+      write->code = false;
+   }
+
+   if (!ewm_blk_same_page(r, read) || !ewm_blk_same_page(w, write)) {
+      ewm_blk_invalidate(cpu->blocks, page);
+   } else if (protected) {
+      w->data = NULL;
+      w->code = true;
+   }
+}
+
+// Writes to data next to the code just go through. Overwriting code
+// drops the blocks of the page, which then goes back in the write page
+// table until it is decoded from again.
+
+void ewm_blk_write(struct cpu_t *cpu, uint16_t addr, uint8_t v) {
+   struct ewm_blk_cache_t *cache = cpu->blocks;
+   uint8_t page = addr >> 8, offset = addr & 0xff;
+   uint8_t *data = cpu->read_pages[page].data;
+
+   if (cache->decoded[page][offset >> 6] & (1ULL << (offset & 0x3f))) {
+      ewm_blk_invalidate(cache, page);
+      if (cache->invalidations[page] < EWM_BLK_INVALIDATIONS) {
+         cache->invalidations[page]++;
+      }
+      cpu->write_pages[page].data = data;
+      cpu->write_pages[page].code = false;
+   }
+
+   data[offset] = v;
+   *cpu->write_pages[page].dirty = 1;
+}
+
+static bool ewm_blk_ends(uint8_t opcode) {
+   switch (opcode) {
+      case 0x00: // BRK
+      case 0x20: // JSR
+      case 0x40: // RTI
+      case 0x4c: // JMP
+      case 0x60: // RTS
+      case 0x6c: // JMP (ind)
+      case 0x7c: // JMP (abs,x) on the 65C02
+      case 0x80: // BRA on the 65C02
+         return true;
+   }
+   return false;
+}
+
+struct ewm_blk_t *ewm_blk_decode(struct cpu_t *cpu, struct ewm_blk_t *blk, uint16_t pc) {
+   uint8_t page = pc >> 8;
+   if (!ewm_blk_page_cacheable(cpu, page)) {
+      return NULL;
+   }
+
+   const uint8_t *data = cpu->read_pages[page].data;
+   int offset = pc & 0xff;
+
+   blk->count = 0;
+   while (blk->count < EWM_BLK_INSTRUCTIONS) {
+      uint8_t opcode = data[offset];
+      int bytes = cpu->opcodes[opcode].bytes;
+      if (offset + bytes > 0x100) {
+         break;
+      }
+
+      struct ewm_blk_ins_t *ins = &blk->ins[blk->count++];
+      ins->opcode = opcode;
+      ins->bytes = bytes;
+      ins->oper = (bytes == 3) ? (data[offset + 1] | (data[offset + 2] << 8)) : (bytes == 2) ? data[offset + 1] : 0;
+
+      offset += bytes;
+      if (ewm_blk_ends(opcode)) {
+         break;
+      }
+   }
+
+   // An instruction that crosses into the next page is left to the
+   // switch engine. The slot may have held another block, which is
+   // gone now.
+   if (blk->count == 0) {
+      blk->version = 0;
+      return NULL;
+   }
+
+   for (int i = pc & 0xff; i < offset; i++) {
+      cpu->blocks->decoded[page][i >> 6] |= 1ULL << (i & 0x3f);
+   }
+
+   blk->pc = pc;
+   blk->version = cpu->blocks->versions[page];
+   return blk;
+}
@@ -0,0 +1,98 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_BLK_H
+#define EWM_BLK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Decoded blocks for the block engine. A block is the straight line
+// code starting at a pc, decoded once into opcodes and operands. Blocks
+// end at a jump, call or return, at the end of the page, or after
+// EWM_BLK_INSTRUCTIONS instructions. Branches do not end a block, the
+// engine leaves it when a branch is taken.
+//
+// Only pages that are plain memory in the page table are cached. Every
+// page has a version that blocks are checked against, which is bumped
+// when the page is mapped differently or when one of its decoded bytes
+// is written to. To notice writes, RAM pages that have blocks are taken
+// out of the write page table and marked as code, so that their writes
+// are checked against the bytes that were decoded. Pages that keep
+// getting their code overwritten are not cached anymore after
+// EWM_BLK_INVALIDATIONS times.
+//
+// Code that changes RAM without going through mem_set_byte() has to
+// call ewm_blk_flush().
+
+#define EWM_BLK_CACHE_SIZE (2048) // Must be a power of two
+#define EWM_BLK_INSTRUCTIONS (16)
+#define EWM_BLK_INVALIDATIONS (16)
+
+struct ewm_blk_ins_t {
+   uint8_t opcode;
+   uint8_t bytes;
+   uint16_t oper;
+};
+
+struct ewm_blk_t {
+   uint32_t version;
+   uint16_t pc;
+   uint8_t count;
+   struct ewm_blk_ins_t ins[EWM_BLK_INSTRUCTIONS];
+};
+
+struct ewm_blk_cache_t {
+   uint32_t versions[256];
+   uint8_t invalidations[256];
+   uint64_t decoded[256][4]; // A bit per byte that is part of a block
+   struct ewm_blk_t blocks[EWM_BLK_CACHE_SIZE];
+};
+
+struct ewm_blk_cache_t *ewm_blk_create(void);
+void ewm_blk_destroy(struct ewm_blk_cache_t *cache);
+
+// Drops all blocks.
+void ewm_blk_flush(struct ewm_blk_cache_t *cache);
+
+// Called by the cpu after it mapped a page again, with the entries the
+// page had before. Blocks only go if the mapping actually changed.
+void ewm_blk_remapped(struct cpu_t *cpu, uint8_t page, struct cpu_page_t *read, struct cpu_page_t *write);
+
+// Called by mem_set_byte() for writes to pages that are marked as code.
+void ewm_blk_write(struct cpu_t *cpu, uint16_t addr, uint8_t v);
+
+// Decodes a block at pc. Returns NULL if the page cannot be cached.
+struct ewm_blk_t *ewm_blk_decode(struct cpu_t *cpu, struct ewm_blk_t *blk, uint16_t pc);
+
+static inline struct ewm_blk_t *ewm_blk_lookup(struct cpu_t *cpu, uint16_t pc) {
+   struct ewm_blk_cache_t *cache = cpu->blocks;
+   struct ewm_blk_t *blk = &cache->blocks[(pc ^ (pc >> 11)) & (EWM_BLK_CACHE_SIZE - 1)];
+   if (blk->pc == pc && blk->version == cache->versions[pc >> 8]) {
+      return blk;
+   }
+   return ewm_blk_decode(cpu, blk, pc);
+}
+
+#endif // EWM_BLK_H
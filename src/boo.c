@@ -145,11 +145,7 @@ int ewm_boo_main(int argc, char **argv) {
             ewm_tty_refresh(tty, phase, EWM_BOO_FPS);
             tty->screen_dirty = false;
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(tty->renderer, tty->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(tty->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
+            SDL_RenderCopy(tty->renderer, tty->texture, NULL, NULL);
 
             SDL_RenderPresent(tty->renderer);
          }
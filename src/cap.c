@@ -0,0 +1,376 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "thr.h"
+#include "cap.h"
+
+#define EWM_CAP_ROW_SIZE (1 + 4 * EWM_SCR_WIDTH) // Filter type and RGBA
+#define EWM_CAP_RGBA_SIZE (4 * EWM_SCR_WIDTH * EWM_SCR_HEIGHT)
+#define EWM_CAP_IDAT_SIZE (EWM_CAP_ROW_SIZE * EWM_SCR_HEIGHT)
+#define EWM_CAP_DEFLATE_BLOCK (65535)
+#define EWM_CAP_DEFLATE_BLOCKS ((EWM_CAP_IDAT_SIZE + EWM_CAP_DEFLATE_BLOCK - 1) / EWM_CAP_DEFLATE_BLOCK)
+
+// Signature, IHDR, IDAT with the zlib header, stored blocks and the
+// Adler-32, and IEND
+#define EWM_CAP_PNG_SIZE (8 + 25 + 12 + 2 + EWM_CAP_IDAT_SIZE + 5 * EWM_CAP_DEFLATE_BLOCKS + 4 + 12)
+
+// PNG. The image data is not compressed, it is stored in deflate blocks
+// as is. That keeps the writer simple and fast, and the files can be
+// compressed later by whatever looks at them.
+
+static uint32_t ewm_cap_crc_table[256];
+
+static void ewm_cap_init_crc_table() {
+   for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+         c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      ewm_cap_crc_table[n] = c;
+   }
+}
+
+static uint32_t ewm_cap_crc(const uint8_t *data, size_t length) {
+   uint32_t c = 0xffffffff;
+   for (size_t i = 0; i < length; i++) {
+      c = ewm_cap_crc_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+   }
+   return c ^ 0xffffffff;
+}
+
+static uint8_t *ewm_cap_put_u32(uint8_t *p, uint32_t v) {
+   *p++ = v >> 24;
+   *p++ = v >> 16;
+   *p++ = v >> 8;
+   *p++ = v;
+   return p;
+}
+
+// Chunks are written with their data already in place after the
+// length and type, this fills in the length and appends the CRC.
+
+static uint8_t *ewm_cap_end_chunk(uint8_t *chunk, uint8_t *end) {
+   ewm_cap_put_u32(chunk, end - chunk - 8);
+   return ewm_cap_put_u32(end, ewm_cap_crc(chunk + 4, end - chunk - 4));
+}
+
+static size_t ewm_cap_encode_png(uint8_t *png, const uint8_t *rgba) {
+   static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+   uint8_t *p = png;
+
+   memcpy(p, signature, sizeof(signature));
+   p += sizeof(signature);
+
+   uint8_t *chunk = p;
+   p = ewm_cap_put_u32(p, 0);
+   memcpy(p, "IHDR", 4);
+   p = ewm_cap_put_u32(p + 4, EWM_SCR_WIDTH);
+   p = ewm_cap_put_u32(p, EWM_SCR_HEIGHT);
+   *p++ = 8; // Bits per channel
+   *p++ = 6; // RGBA
+   *p++ = 0;
+   *p++ = 0;
+   *p++ = 0;
+   p = ewm_cap_end_chunk(chunk, p);
+
+   chunk = p;
+   p = ewm_cap_put_u32(p, 0);
+   memcpy(p, "IDAT", 4);
+   p += 4;
+   *p++ = 0x78; // Deflate with a 32K window, no compression
+   *p++ = 0x01;
+
+   uint32_t a = 1, b = 0; // Adler-32 of the uncompressed data
+   size_t left = EWM_CAP_IDAT_SIZE;
+   int row = 0, column = EWM_CAP_ROW_SIZE;
+   while (left != 0) {
+      size_t length = (left < EWM_CAP_DEFLATE_BLOCK) ? left : EWM_CAP_DEFLATE_BLOCK;
+      left -= length;
+      *p++ = (left == 0);
+      *p++ = length & 0xff;
+      *p++ = length >> 8;
+      *p++ = ~length & 0xff;
+      *p++ = (~length >> 8) & 0xff;
+      for (size_t i = 0; i < length; i++) {
+         if (column == EWM_CAP_ROW_SIZE) {
+            *p = 0; // No filter
+            column = 0;
+            row++;
+         } else {
+            *p = rgba[(row - 1) * 4 * EWM_SCR_WIDTH + column - 1];
+         }
+         column++;
+         a = (a + *p) % 65521;
+         b = (b + a) % 65521;
+         p++;
+      }
+   }
+   p = ewm_cap_put_u32(p, (b << 16) | a);
+   p = ewm_cap_end_chunk(chunk, p);
+
+   chunk = p;
+   p = ewm_cap_put_u32(p, 0);
+   memcpy(p, "IEND", 4);
+   p = ewm_cap_end_chunk(chunk, p + 4);
+
+   return p - png;
+}
+
+// Writer thread
+
+static void ewm_cap_convert(struct ewm_cap_t *cap, const uint32_t *pixels) {
+   uint8_t *p = cap->rgba;
+   for (int i = 0; i < EWM_SCR_WIDTH * EWM_SCR_HEIGHT; i++) {
+      SDL_GetRGBA(pixels[i], cap->format, &p[0], &p[1], &p[2], &p[3]);
+      p += 4;
+   }
+}
+
+static int ewm_cap_write_png(struct ewm_cap_t *cap, uint64_t number) {
+   char path[1024];
+   if (snprintf(path, sizeof(path), cap->target, (int) number) >= (int) sizeof(path)) {
+      fprintf(stderr, "[CAP] Path for frame %" PRIu64 " is too long\n", number);
+      return -1;
+   }
+
+   FILE *fp = fopen(path, "wb");
+   if (fp == NULL) {
+      fprintf(stderr, "[CAP] Cannot write %s\n", path);
+      return -1;
+   }
+
+   size_t length = ewm_cap_encode_png(cap->png, cap->rgba);
+   int result = (fwrite(cap->png, length, 1, fp) == 1) ? 0 : -1;
+   if (fclose(fp) != 0 || result != 0) {
+      fprintf(stderr, "[CAP] Cannot write %s\n", path);
+      return -1;
+   }
+   return 0;
+}
+
+static void ewm_cap_write(struct ewm_cap_t *cap) {
+   // After an error the queue is still drained, but nothing is written
+   if (cap->failed) {
+      return;
+   }
+
+   ewm_cap_convert(cap, cap->frame->pixels);
+
+   if (cap->type == EWM_CAP_TYPE_PNG) {
+      cap->failed = (ewm_cap_write_png(cap, cap->frame->number) != 0);
+   } else if (fwrite(cap->rgba, EWM_CAP_RGBA_SIZE, 1, cap->fp) != 1) {
+      fprintf(stderr, "[CAP] Cannot write frame %" PRIu64 " to %s\n", cap->frame->number, cap->target);
+      cap->failed = true;
+   }
+}
+
+static int ewm_cap_thread(void *data) {
+   struct ewm_cap_t *cap = (struct ewm_cap_t*) data;
+   while (true) {
+      if (ewm_spsc_pop(cap->queue, cap->frame)) {
+         ewm_cap_write(cap);
+      } else if (atomic_load(&cap->quit)) {
+         // Frames queued before quit was set are visible now
+         while (ewm_spsc_pop(cap->queue, cap->frame)) {
+            ewm_cap_write(cap);
+         }
+         break;
+      } else {
+         SDL_Delay(1);
+      }
+   }
+   return 0;
+}
+
+// The pattern of PNG files must take exactly one number
+
+static bool ewm_cap_valid_pattern(const char *pattern) {
+   int conversions = 0;
+   for (const char *p = pattern; *p != 0; p++) {
+      if (*p != '%') {
+         continue;
+      }
+      p++;
+      if (*p == '%') {
+         continue;
+      }
+      while (*p >= '0' && *p <= '9') {
+         p++;
+      }
+      if (*p != 'd') {
+         return false;
+      }
+      conversions++;
+   }
+   return conversions == 1;
+}
+
+static int ewm_cap_init(struct ewm_cap_t *cap, char *spec, int skip, bool changed, bool wait, const SDL_PixelFormat *format) {
+   memset(cap, 0x00, sizeof(struct ewm_cap_t));
+
+   if (strncmp(spec, "raw:", 4) == 0) {
+      cap->type = EWM_CAP_TYPE_RAW;
+   } else if (strncmp(spec, "pipe:", 5) == 0) {
+      cap->type = EWM_CAP_TYPE_PIPE;
+   } else if (strncmp(spec, "png:", 4) == 0) {
+      cap->type = EWM_CAP_TYPE_PNG;
+   } else {
+      fprintf(stderr, "[CAP] Unknown capture %s, expected raw:<path>, pipe:<command> or png:<pattern>\n", spec);
+      return -1;
+   }
+   cap->target = strchr(spec, ':') + 1;
+   cap->format = format;
+   cap->skip = skip;
+   cap->changed = changed;
+   cap->wait = wait;
+
+   switch (cap->type) {
+      case EWM_CAP_TYPE_RAW:
+         cap->fp = fopen(cap->target, "wb");
+         break;
+      case EWM_CAP_TYPE_PIPE:
+         cap->fp = popen(cap->target, "w");
+         break;
+      case EWM_CAP_TYPE_PNG:
+         if (!ewm_cap_valid_pattern(cap->target)) {
+            fprintf(stderr, "[CAP] Pattern %s needs one %%d for the frame number\n", cap->target);
+            return -1;
+         }
+         ewm_cap_init_crc_table();
+         break;
+   }
+   if (cap->type != EWM_CAP_TYPE_PNG && cap->fp == NULL) {
+      fprintf(stderr, "[CAP] Cannot open %s\n", cap->target);
+      return -1;
+   }
+
+   cap->staging = malloc(sizeof(struct ewm_cap_frame_t));
+   cap->frame = malloc(sizeof(struct ewm_cap_frame_t));
+   cap->rgba = malloc(EWM_CAP_RGBA_SIZE);
+   cap->png = (cap->type == EWM_CAP_TYPE_PNG) ? malloc(EWM_CAP_PNG_SIZE) : NULL;
+   cap->queue = ewm_spsc_create(EWM_CAP_QUEUE_SIZE, sizeof(struct ewm_cap_frame_t));
+   if (cap->staging == NULL || cap->frame == NULL || cap->rgba == NULL || cap->queue == NULL
+       || (cap->type == EWM_CAP_TYPE_PNG && cap->png == NULL)) {
+      return -1;
+   }
+
+   atomic_init(&cap->quit, false);
+   cap->thread = SDL_CreateThread(ewm_cap_thread, "capture", cap);
+   if (cap->thread == NULL) {
+      fprintf(stderr, "[CAP] Could not create writer thread: %s\n", SDL_GetError());
+      return -1;
+   }
+
+   return 0;
+}
+
+static void ewm_cap_free(struct ewm_cap_t *cap) {
+   if (cap->fp != NULL) {
+      if (cap->type == EWM_CAP_TYPE_PIPE) {
+         pclose(cap->fp);
+      } else {
+         fclose(cap->fp);
+      }
+   }
+   if (cap->queue != NULL) {
+      ewm_spsc_destroy(cap->queue);
+   }
+   free(cap->staging);
+   free(cap->frame);
+   free(cap->rgba);
+   free(cap->png);
+   free(cap);
+}
+
+struct ewm_cap_t *ewm_cap_create(char *spec, int skip, bool changed, bool wait, const SDL_PixelFormat *format) {
+   struct ewm_cap_t *cap = malloc(sizeof(struct ewm_cap_t));
+   if (cap == NULL) {
+      return NULL;
+   }
+   if (ewm_cap_init(cap, spec, skip, changed, wait, format) != 0) {
+      ewm_cap_free(cap);
+      cap = NULL;
+   }
+   return cap;
+}
+
+void ewm_cap_destroy(struct ewm_cap_t *cap) {
+   atomic_store(&cap->quit, true);
+   SDL_WaitThread(cap->thread, NULL);
+
+   if (cap->failed) {
+      fprintf(stderr, "[CAP] Stopped writing frames after an error\n");
+   } else {
+      fprintf(stderr, "[CAP] Captured %" PRIu64 " of %" PRIu64 " frames", cap->captured, cap->frames);
+      if (cap->dropped != 0) {
+         fprintf(stderr, ", dropped %" PRIu64 " because the writer could not keep up", cap->dropped);
+      }
+      fprintf(stderr, "\n");
+   }
+
+   ewm_cap_free(cap);
+}
+
+// FNV-1a over the pixels, which is plenty to tell frames apart
+
+static uint64_t ewm_cap_hash(const uint32_t *pixels) {
+   uint64_t hash = 0xcbf29ce484222325;
+   for (int i = 0; i < EWM_SCR_WIDTH * EWM_SCR_HEIGHT; i++) {
+      hash = (hash ^ pixels[i]) * 0x100000001b3;
+   }
+   return hash;
+}
+
+void ewm_cap_frame(struct ewm_cap_t *cap, const uint32_t *pixels) {
+   uint64_t number = cap->frames++;
+   if (cap->skip != 0 && (number % (cap->skip + 1)) != 0) {
+      return;
+   }
+
+   if (cap->changed) {
+      uint64_t hash = ewm_cap_hash(pixels);
+      if (cap->hashed && hash == cap->hash) {
+         return;
+      }
+      cap->hash = hash;
+      cap->hashed = true;
+   }
+
+   cap->staging->number = number;
+   memcpy(cap->staging->pixels, pixels, sizeof(cap->staging->pixels));
+   while (!ewm_spsc_push(cap->queue, cap->staging)) {
+      if (!cap->wait) {
+         cap->dropped++;
+         cap->hashed = false; // So that the next frame is not taken as unchanged
+         return;
+      }
+      SDL_Delay(1);
+   }
+   cap->captured++;
+}
@@ -0,0 +1,103 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_CAP_H
+#define EWM_CAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <SDL2/SDL.h>
+
+#include "scr.h"
+
+// Frame capture. Frames are taken from the pixels of the screen after
+// it rendered and go through a bounded queue to a writer thread, so
+// that the emulator never waits for the disk or an encoder. When the
+// queue is full the frame is dropped and counted, unless the capture
+// was asked to wait for room. That is for runs without a window, where
+// losing frames is worse than running slower. Frames are written
+// as 8 bit RGBA, to one of:
+//
+//   raw:<path>      all frames back to back in one file
+//   pipe:<command>  all frames back to back to the input of a command
+//   png:<pattern>   a PNG file per frame, the pattern has one %d for
+//                   the frame number, like shots/%05d.png
+//
+// Frames are numbered from 0 for every frame that was offered, so that
+// numbers of PNG files still tell the time when frames are skipped.
+
+struct ewm_spsc_t;
+
+#define EWM_CAP_TYPE_RAW  (0)
+#define EWM_CAP_TYPE_PIPE (1)
+#define EWM_CAP_TYPE_PNG  (2)
+
+#define EWM_CAP_QUEUE_SIZE (16)
+
+struct ewm_cap_frame_t {
+   uint64_t number;
+   uint32_t pixels[EWM_SCR_WIDTH * EWM_SCR_HEIGHT];
+};
+
+struct ewm_cap_t {
+   int type;
+   char *target; // Path, command or pattern
+   FILE *fp;     // NULL for PNG
+   const SDL_PixelFormat *format;
+   int skip;     // Frames to skip after every frame that is captured
+   bool changed; // Only capture frames that differ from the last one
+   bool wait;    // Wait for room in the queue instead of dropping frames
+
+   // Owned by the emulator
+   uint64_t frames;
+   uint64_t hash;
+   bool hashed;
+   uint64_t captured;
+   uint64_t dropped;
+   struct ewm_cap_frame_t *staging;
+
+   // Owned by the writer
+   struct ewm_cap_frame_t *frame;
+   uint8_t *rgba;
+   uint8_t *png;
+   bool failed;
+
+   struct ewm_spsc_t *queue;
+   SDL_Thread *thread;
+   atomic_bool quit;
+};
+
+// Format is that of the pixels that will be captured
+struct ewm_cap_t *ewm_cap_create(char *spec, int skip, bool changed, bool wait, const SDL_PixelFormat *format);
+
+// Writes the frames that are still queued, stops the writer and
+// reports what was captured and dropped.
+void ewm_cap_destroy(struct ewm_cap_t *cap);
+
+// Offers the frame in pixels, EWM_SCR_WIDTH by EWM_SCR_HEIGHT in the
+// format of the capture. Only blocks when the capture waits for room.
+void ewm_cap_frame(struct ewm_cap_t *cap, const uint32_t *pixels);
+
+#endif // EWM_CAP_H
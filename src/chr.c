@@ -20,175 +20,92 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/stat.h>
 
 #include <SDL2/SDL.h>
 
 #include "sdl.h"
 #include "chr.h"
+#include "rom.h"
 
-static int _load_rom_data(char *rom_path, uint8_t rom_data[2048]) {
-   int fd = open(rom_path, O_RDONLY);
-   if (fd == -1) {
-      return -1;
-   }
-
-   struct stat file_info;
-   if (fstat(fd, &file_info) == -1) {
-      close(fd);
-      return -1;
-   }
-
-   if (file_info.st_size  != 2048) {
-      close(fd);
-      return -1;
-   }
-
-   if (read(fd, rom_data, file_info.st_size) != file_info.st_size) {
-      close(fd);
-      return -1;
-   }
-
-   close(fd);
-
-   return 0;
-}
-
-static void _set_pixel(SDL_Surface * surface, int x, int y, Uint32 color) {
-   uint32_t *pixel = (uint32_t*) ((uint8_t*) surface->pixels + (y * surface->pitch) + (x * sizeof(uint32_t)));
-   *pixel = color;
-}
-
-static SDL_Texture *_generate_texture(SDL_Renderer *renderer, uint8_t rom_data[2048], int c, bool inverse) {
-   SDL_Texture *texture = NULL;
-
-   uint8_t character_data[8];
-   for (int i = 0; i < 8; i++) {
-      character_data[i] = rom_data[(c * 8) + i + 1];
+static void _generate_mask(uint8_t masks[][EWM_CHR_GLYPH_PIXELS], const uint8_t *rom_data, int glyph, int c, bool inverse) {
+   uint8_t *p = masks[glyph];
+   for (int y = 0; y < 8; y++) {
+      uint8_t character_data = rom_data[(c * 8) + y + 1];
       if (inverse) {
-         character_data[i] ^= 0xff;
+         character_data ^= 0xff;
       }
-   }
-
-   SDL_Surface *surface = SDL_CreateRGBSurface(0, 7, 8, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
-   if (surface != NULL) {
-      for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            if (character_data[y] & (1 << x)) {
-               _set_pixel(surface, (6-x), y, 0xffffffff);
-            }
-         }
-      }
-      texture = SDL_CreateTextureFromSurface(renderer, surface);
-      if (texture == NULL) {
-         fprintf(stderr, "Cannot generate RGBSurface: %s\n", SDL_GetError());
-      }
-   } else {
-      fprintf(stderr, "Cannot generate Texture: %s\n", SDL_GetError());
-   }
-
-   return texture;
-}
-
-static uint32_t *_generate_bitmap(struct ewm_chr_t *chr, uint8_t rom_data[2048], int c, bool inverse) {
-   uint32_t *pixels = (uint32_t*) malloc(4 * ewm_chr_width(chr) * ewm_chr_height(chr));
-   if (pixels != NULL) {
-      memset(pixels, 0x00, 4 * ewm_chr_width(chr) * ewm_chr_height(chr));
-
-      uint8_t character_data[8];
-      for (int i = 0; i < 8; i++) {
-         character_data[i] = rom_data[(c * 8) + i + 1];
-         if (inverse) {
-            character_data[i] ^= 0xff;
-         }
-      }
-
-      uint32_t *p = pixels;
-      for (int y = 0; y < 8; y++) {
-         for (int x = 6; x >= 0; x--) {
-            if (character_data[y] & (1 << x)) {
-               *p++ = chr->color;
-            } else {
-               *p++ = 0x00000000;
-            }
-         }
+      for (int x = 6; x >= 0; x--) {
+         *p++ = (character_data & (1 << x)) != 0;
       }
    }
-
-   return pixels;
 }
 
-static int ewm_chr_init(struct ewm_chr_t *chr, char *rom_path, int rom_type, SDL_Renderer *renderer) {
-   if (rom_type != EWM_CHR_ROM_TYPE_2716) {
-      return -1;
-   }
-   memset(chr, 0x00, sizeof(struct ewm_chr_t));
-
-   chr->renderer = renderer;
-   chr->color = ewm_sdl_green(renderer);
+// Glyph masks. Characters that are not in the ROM, and the blank glyph,
+// are left empty. These are decoded once and shared through the rom
+// cache, only the atlas is per instance.
 
-   uint8_t rom_data[2048];
-   if (_load_rom_data(rom_path, rom_data) != 0) {
-      return -1;
-   }
-
-   // Bitmaps
+static void _decode_masks(const uint8_t *rom_data, size_t size, void *decoded) {
+   uint8_t (*masks)[EWM_CHR_GLYPH_PIXELS] = decoded;
 
    // Normal Text
    for (int c = 0; c < 32; c++) {
-      chr->bitmaps[0xc0 + c] = _generate_bitmap(chr, rom_data, c, false);
+      _generate_mask(masks, rom_data, 0xc0 + c, c, false);
    }
    for (int c = 32; c < 64; c++) {
-      chr->bitmaps[0xa0 + (c-32)] = _generate_bitmap(chr, rom_data, c, false);
+      _generate_mask(masks, rom_data, 0xa0 + (c-32), c, false);
    }
 
    // Inverse Text
    for (int c = 0; c < 32; c++) {
-      chr->bitmaps[0x00 + c] = _generate_bitmap(chr, rom_data, c, true);
+      _generate_mask(masks, rom_data, 0x00 + c, c, true);
    }
    for (int c = 32; c < 64; c++) {
-      chr->bitmaps[0x20 + (c-32)] = _generate_bitmap(chr, rom_data, c, true);
+      _generate_mask(masks, rom_data, 0x20 + (c-32), c, true);
    }
 
-   // TODO Flashing - Currently simply rendered as inverse
+   // Flashing - Rendered as inverse, the blank glyph is the off phase
    for (int c = 0; c < 32; c++) {
-      chr->bitmaps[0x40 + c] = _generate_bitmap(chr, rom_data, c, true);
+      _generate_mask(masks, rom_data, 0x40 + c, c, true);
    }
    for (int c = 32; c < 64; c++) {
-      chr->bitmaps[0x60 + (c-32)] = _generate_bitmap(chr, rom_data, c, true);
+      _generate_mask(masks, rom_data, 0x60 + (c-32), c, true);
    }
+}
 
-   // Textures
-
-   // Normal Text
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0xc0 + c] = _generate_texture(renderer, rom_data, c, false);
-   }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0xa0 + (c-32)] = _generate_texture(renderer, rom_data, c, false);
+static int ewm_chr_init(struct ewm_chr_t *chr, char *rom_path, int rom_type, SDL_Renderer *renderer) {
+   if (rom_type != EWM_CHR_ROM_TYPE_2716) {
+      return -1;
    }
+   memset(chr, 0x00, sizeof(struct ewm_chr_t));
 
-   // Inverse Text
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0x00 + c] = _generate_texture(renderer, rom_data, c, true);
+   chr->renderer = renderer;
+
+   chr->rom = ewm_rom_acquire(rom_path);
+   if (chr->rom == NULL) {
+      return -1;
    }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0x20 + (c-32)] = _generate_texture(renderer, rom_data, c, true);
+
+   if (chr->rom->size != 2048) {
+      ewm_rom_release(chr->rom);
+      return -1;
    }
 
-   // TODO Flashing - Currently simply rendered as inverse
-   for (int c = 0; c < 32; c++) {
-      chr->textures[0x40 + c] = _generate_texture(renderer, rom_data, c, true);
+   chr->masks = ewm_rom_decoded(chr->rom, EWM_CHR_GLYPH_COUNT * EWM_CHR_GLYPH_PIXELS, _decode_masks);
+   if (chr->masks == NULL) {
+      ewm_rom_release(chr->rom);
+      return -1;
    }
-   for (int c = 32; c < 64; c++) {
-      chr->textures[0x60 + (c-32)] = _generate_texture(renderer, rom_data, c, true);
+
+   // Start with green, like the original monitor
+   if (ewm_chr_set_color(chr, ewm_sdl_green(renderer)) != 0) {
+      free(chr->atlas);
+      ewm_rom_release(chr->rom);
+      return -1;
    }
 
    return 0;
@@ -204,23 +121,60 @@ struct ewm_chr_t* ewm_chr_create(char *rom_path, int rom_type, SDL_Renderer *ren
    return chr;
 }
 
+void ewm_chr_destroy(struct ewm_chr_t *chr) {
+   ewm_rom_release(chr->rom);
+   free(chr->atlas);
+   free(chr);
+}
+
 int ewm_chr_width(struct ewm_chr_t* chr) {
-   return 7; // TODO Should be based on the ROM type?
+   return EWM_CHR_WIDTH; // TODO Should be based on the ROM type?
 }
 
 int ewm_chr_height(struct ewm_chr_t* chr) {
-   return 8; // TODO Should be based on the ROM type?
+   return EWM_CHR_HEIGHT; // TODO Should be based on the ROM type?
 }
 
-void ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color) {
-   for (int i = 0; i < 255; i++) {
-      uint32_t *bitmap = chr->bitmaps[i];
-      if (bitmap != NULL) {
-         for (int j = 0; j < ewm_chr_width(chr) * ewm_chr_height(chr); j++) {
-            if (bitmap[j] != 0) {
-               bitmap[j] = color;
-            }
-         }
+// Adds the glyphs in the given color to the atlas, if they are not in
+// there yet. Returns the index of the color, or -1 if there are too
+// many colors in use.
+
+int ewm_chr_add_color(struct ewm_chr_t* chr, uint32_t color) {
+   for (int i = 0; i < chr->color_count; i++) {
+      if (chr->colors[i] == color) {
+         return i;
+      }
+   }
+
+   if (chr->color_count == EWM_CHR_MAX_COLORS) {
+      return -1;
+   }
+
+   size_t glyphs_size = EWM_CHR_GLYPH_COUNT * EWM_CHR_GLYPH_PIXELS * sizeof(uint32_t);
+   uint32_t *atlas = realloc(chr->atlas, (chr->color_count + 1) * glyphs_size);
+   if (atlas == NULL) {
+      return -1;
+   }
+   chr->atlas = atlas;
+
+   int index = chr->color_count++;
+   chr->colors[index] = color;
+
+   for (int c = 0; c < EWM_CHR_GLYPH_COUNT; c++) {
+      uint32_t *glyph = ewm_chr_glyph_with_color(chr, index, c);
+      for (int i = 0; i < EWM_CHR_GLYPH_PIXELS; i++) {
+         glyph[i] = chr->masks[c][i] ? color : 0;
       }
    }
+
+   return index;
+}
+
+int ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color) {
+   int index = ewm_chr_add_color(chr, color);
+   if (index == -1) {
+      return -1;
+   }
+   chr->color = index;
+   return 0;
 }
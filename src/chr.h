@@ -23,20 +23,49 @@
 #ifndef EWM_CHR_H
 #define EWM_CHR_H
 
+#include <stdint.h>
 #include <SDL2/SDL.h>
 
 #define EWM_CHR_ROM_TYPE_2716 (2716)
 
+#define EWM_CHR_WIDTH  (7)
+#define EWM_CHR_HEIGHT (8)
+
+// The atlas contains all glyphs pre-rendered in every color that is
+// in use. Each glyph is stored as 8 rows of 7 pixels, so a row can be
+// copied to the screen in one go. After the 256 characters there is a
+// blank glyph, which is used for the off phase of flashing text.
+
+#define EWM_CHR_GLYPH_BLANK  (256)
+#define EWM_CHR_GLYPH_COUNT  (257)
+#define EWM_CHR_GLYPH_PIXELS (EWM_CHR_WIDTH * EWM_CHR_HEIGHT)
+#define EWM_CHR_MAX_COLORS   (8)
+
+struct ewm_rom_t;
+
 struct ewm_chr_t {
    SDL_Renderer *renderer;
-   SDL_Texture *textures[256];
-   uint32_t *bitmaps[256];
-   uint32_t color;
+   struct ewm_rom_t *rom;
+   const uint8_t (*masks)[EWM_CHR_GLYPH_PIXELS]; // Shared by all instances
+   uint32_t *atlas;
+   uint32_t colors[EWM_CHR_MAX_COLORS];
+   int color_count;
+   int color; // Index of the color used by ewm_chr_glyph()
 };
 
 struct ewm_chr_t* ewm_chr_create(char *rom_path, int rom_type, SDL_Renderer *renderer);
+void ewm_chr_destroy(struct ewm_chr_t *chr);
 int ewm_chr_width(struct ewm_chr_t* chr);
 int ewm_chr_height(struct ewm_chr_t* chr);
-void ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color);
+int ewm_chr_add_color(struct ewm_chr_t* chr, uint32_t color);
+int ewm_chr_set_color(struct ewm_chr_t* chr, uint32_t color);
+
+static inline uint32_t *ewm_chr_glyph_with_color(struct ewm_chr_t *chr, int color, int c) {
+   return chr->atlas + ((color * EWM_CHR_GLYPH_COUNT) + c) * EWM_CHR_GLYPH_PIXELS;
+}
+
+static inline uint32_t *ewm_chr_glyph(struct ewm_chr_t *chr, int c) {
+   return ewm_chr_glyph_with_color(chr, chr->color, c);
+}
 
 #endif
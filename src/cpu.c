@@ -22,7 +22,7 @@
 
 #include <assert.h>
 #include <ctype.h>
-#include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,8 +35,12 @@
 
 #include "cpu.h"
 #include "ins.h"
+#include "blk.h"
 #include "mem.h"
 #include "fmt.h"
+#include "snp.h"
+#include "rom.h"
+#include "trc.h"
 
 #if defined(EWM_LUA)
 #include "lua.h"
@@ -70,11 +74,23 @@ uint8_t _cpu_stack_used(struct cpu_t *cpu) {
    return 0xff - cpu->state.sp;
 }
 
-// Because we keep the processor status bits in separate fields, we
-// need a function to combine them into a single register. This is
-// only used when we need to push the register on the stack for
-// interupt handlers. If this turns out to be inefficient then they
-// can be stored in their native form in a byte.
+// When we keep the processor status bits in separate fields, we need
+// a function to combine them into a single register. This is only
+// used when we need to push the register on the stack for interupt
+// handlers. With EWM_CPU_PACKED_STATUS they are stored in their native
+// form in a byte and these are trivial.
+
+#if defined(EWM_CPU_PACKED_STATUS)
+
+uint8_t _cpu_get_status(struct cpu_t *cpu) {
+  return 0x30 | cpu->state.p;
+}
+
+void _cpu_set_status(struct cpu_t *cpu, uint8_t status) {
+  cpu->state.p = status;
+}
+
+#else
 
 uint8_t _cpu_get_status(struct cpu_t *cpu) {
   return 0x30
@@ -97,105 +113,185 @@ void _cpu_set_status(struct cpu_t *cpu, uint8_t status) {
   cpu->state.c = (status & (1 << 0));
 }
 
+#endif
+
+static inline void cpu_call_handler(struct cpu_t *cpu, const struct cpu_opcode_t *o, uint16_t pc) {
+   void *handler = ins_opcode_handler(o);
+   switch (o->bytes) {
+      case 1:
+         ((cpu_instruction_handler_t) handler)(cpu);
+         break;
+      case 2:
+         ((cpu_instruction_handler_byte_t) handler)(cpu, mem_get_byte(cpu, pc+1));
+         break;
+      case 3:
+         ((cpu_instruction_handler_word_t) handler)(cpu, mem_get_word(cpu, pc+1));
+         break;
+   }
+}
+
+static void cpu_trace_instruction(struct cpu_t *cpu, const struct cpu_opcode_t *o, uint16_t pc) {
+   // Unimplemented instructions are traced as just their opcode
+   int length = o->bytes ? o->bytes : 1;
+   uint8_t bytes[3] = { mem_get_byte(cpu, pc), 0, 0 };
+   for (int n = 1; n < length; n++) {
+      bytes[n] = mem_get_byte(cpu, pc + n);
+   }
+   ewm_trace_record(cpu->trace, pc, bytes, length, cpu->state.a, cpu->state.x, cpu->state.y,
+                    cpu->state.sp, _cpu_get_status(cpu));
+}
+
+static void cpu_profile_instruction(struct cpu_t *cpu, const struct cpu_opcode_t *o, uint16_t pc, int cycles) {
+   struct cpu_profile_t *profile = cpu->profile;
+   uint8_t opcode = o - cpu->opcodes;
+   profile->instructions++;
+   profile->cycles += cycles;
+   profile->opcode_count[opcode]++;
+   profile->opcode_cycles[opcode] += cycles;
+   profile->page_cycles[pc >> 8] += cycles;
+   profile->pc_cycles[pc] += cycles;
+}
+
 static int cpu_execute_instruction(struct cpu_t *cpu) {
    // Fetch instruction
-   struct cpu_instruction_t *i = &cpu->instructions[mem_get_byte(cpu, cpu->state.pc)];
+   const struct cpu_opcode_t *o = &cpu->opcodes[mem_get_byte(cpu, cpu->state.pc)];
+
+   if (cpu->trace != NULL) {
+      cpu_trace_instruction(cpu, o, cpu->state.pc);
+   }
 
    // Remember and advance the pc
    uint16_t pc = cpu->state.pc;
-   cpu->state.pc += i->bytes;
+   uint64_t start = cpu->counter;
+   cpu->state.pc += o->bytes;
 
-#if defined(EWM_LUA)
-   if (i->lua_before_handler != LUA_NOREF) {
-      lua_rawgeti(cpu->lua->state, LUA_REGISTRYINDEX, i->lua_before_handler);
-      ewm_lua_push_cpu(cpu->lua, cpu);
-      lua_pushinteger(cpu->lua->state, i->opcode);
-      switch (i->bytes) {
-         case 1:
-            lua_pushinteger(cpu->lua->state, 0);
-            break;
-         case 2:
-            lua_pushinteger(cpu->lua->state, mem_get_byte(cpu, pc+1));
-            break;
-         case 3:
-            lua_pushinteger(cpu->lua->state, mem_get_word(cpu, pc+1));
-            break;
-      }
-      if (lua_pcall(cpu->lua->state, 3, 0, 0) != 0) {
-         printf("cpu: script error: %s\n", lua_tostring(cpu->lua->state, -1));
-      }
+   /* Execute instruction */
+   cpu_call_handler(cpu, o, pc);
+
+   // The handler added the cycles that depend on the operands
+   cpu->counter += o->cycles;
+   int cycles = cpu->counter - start;
+
+   if (cpu->profile != NULL) {
+      cpu_profile_instruction(cpu, o, pc, cycles);
    }
-#endif
 
-   /* Execute instruction */
-   switch (i->bytes) {
+   return cycles;
+}
+
+#if defined(EWM_LUA)
+
+// Lua hooks live in a side table that is only allocated when a script
+// registers its first hook. Until then cpu_step() and cpu_run() take
+// the exact same paths as a build without Lua.
+
+struct cpu_lua_hooks_t {
+   int before[256];
+   int after[256];
+};
+
+static void cpu_call_lua_hook(struct cpu_t *cpu, int ref, uint8_t opcode, uint16_t pc) {
+   lua_rawgeti(cpu->lua->state, LUA_REGISTRYINDEX, ref);
+   ewm_lua_push_cpu(cpu->lua, cpu);
+   lua_pushinteger(cpu->lua->state, opcode);
+   switch (cpu->opcodes[opcode].bytes) {
       case 1:
-         ((cpu_instruction_handler_t) i->handler)(cpu);
+         lua_pushinteger(cpu->lua->state, 0);
          break;
       case 2:
-         ((cpu_instruction_handler_byte_t) i->handler)(cpu, mem_get_byte(cpu, pc+1));
+         lua_pushinteger(cpu->lua->state, mem_get_byte(cpu, pc+1));
          break;
       case 3:
-         ((cpu_instruction_handler_word_t) i->handler)(cpu, mem_get_word(cpu, pc+1));
+         lua_pushinteger(cpu->lua->state, mem_get_word(cpu, pc+1));
          break;
    }
+   if (lua_pcall(cpu->lua->state, 3, 0, 0) != 0) {
+      printf("cpu: script error: %s\n", lua_tostring(cpu->lua->state, -1));
+   }
+}
 
-#if defined(EWM_LUA)
-   if (i->lua_after_handler != LUA_NOREF) {
-      lua_rawgeti(cpu->lua->state, LUA_REGISTRYINDEX, i->lua_after_handler);
-      ewm_lua_push_cpu(cpu->lua, cpu);
-      lua_pushinteger(cpu->lua->state, i->opcode);
-      switch (i->bytes) {
-         case 1:
-            lua_pushinteger(cpu->lua->state, 0);
-            break;
-         case 2:
-            lua_pushinteger(cpu->lua->state, mem_get_byte(cpu, pc+1));
-            break;
-         case 3:
-            lua_pushinteger(cpu->lua->state, mem_get_word(cpu, pc+1));
-            break;
-      }
-      if (lua_pcall(cpu->lua->state, 3, 0, 0) != 0) {
-         printf("cpu: script error: %s\n", lua_tostring(cpu->lua->state, -1));
-      }
+static int cpu_execute_instruction_hooked(struct cpu_t *cpu) {
+   // Fetch instruction
+   uint8_t opcode = mem_get_byte(cpu, cpu->state.pc);
+   const struct cpu_opcode_t *o = &cpu->opcodes[opcode];
+
+   if (cpu->trace != NULL) {
+      cpu_trace_instruction(cpu, o, cpu->state.pc);
    }
-#endif
 
-   cpu->counter += i->cycles;
+   // Remember and advance the pc
+   uint16_t pc = cpu->state.pc;
+   uint64_t start = cpu->counter;
+   cpu->state.pc += o->bytes;
 
-   return i->cycles;
-}
+   if (cpu->lua_hooks->before[opcode] != LUA_NOREF) {
+      cpu_call_lua_hook(cpu, cpu->lua_hooks->before[opcode], opcode, pc);
+   }
 
-/* Public API */
+   /* Execute instruction */
+   cpu_call_handler(cpu, o, pc);
 
-static bool cpu_initialized = false;
+   if (cpu->lua_hooks->after[opcode] != LUA_NOREF) {
+      cpu_call_lua_hook(cpu, cpu->lua_hooks->after[opcode], opcode, pc);
+   }
 
-static void cpu_initialize() {
-   for (int i = 0; i <= 255; i++) {
-      if (instructions_65C02[i].handler == NULL) {
-         instructions_65C02[i] = instructions[i];
-      }
+   // The handler added the cycles that depend on the operands
+   cpu->counter += o->cycles;
+   int cycles = cpu->counter - start;
+
+   if (cpu->profile != NULL) {
+      cpu_profile_instruction(cpu, o, pc, cycles);
    }
+
+   return cycles;
 }
 
-static int cpu_init(struct cpu_t *cpu, int model) {
-   if (!cpu_initialized) {
-      cpu_initialize();
-      cpu_initialized = true;
+static struct cpu_lua_hooks_t *cpu_lua_hooks(struct cpu_t *cpu) {
+   if (cpu->lua_hooks == NULL) {
+      cpu->lua_hooks = malloc(sizeof(struct cpu_lua_hooks_t));
+      for (int i = 0; i < 256; i++) {
+         cpu->lua_hooks->before[i] = LUA_NOREF;
+         cpu->lua_hooks->after[i] = LUA_NOREF;
+      }
    }
+   return cpu->lua_hooks;
+}
+
+#endif
+
+/* Public API */
 
+static_assert(offsetof(struct cpu_t, blocks) + sizeof(void*) <= 64, "hot fields of cpu_t do not fit in a cache line");
+
+static int cpu_init(struct cpu_t *cpu, int model, int engine) {
    memset(cpu, 0x00, sizeof(struct cpu_t));
    cpu->model = model;
-   cpu->instructions = malloc(sizeof instructions);
-   memcpy(cpu->instructions, (cpu->model == EWM_CPU_MODEL_6502) ? instructions : instructions_65C02, sizeof instructions);
+   cpu->engine = engine;
+   cpu->breakpoint = EWM_CPU_NO_BREAKPOINT;
+   cpu->instructions = (model == EWM_CPU_MODEL_65C02) ? instructions_65C02 : instructions;
+
+   cpu->opcodes = malloc(256 * sizeof(struct cpu_opcode_t));
+   if (cpu->opcodes == NULL || ins_init_opcodes(cpu->opcodes, cpu->instructions) != 0) {
+      return -1;
+   }
+
+   if (engine == EWM_CPU_ENGINE_BLOCK && (cpu->blocks = ewm_blk_create()) == NULL) {
+      return -1;
+   }
 
    return 0;
 }
 
 struct cpu_t *cpu_create(int model) {
-   struct cpu_t *cpu = malloc(sizeof(struct cpu_t));
-   if (cpu_init(cpu, model) != 0) {
+   return cpu_create_with_engine(model, EWM_CPU_ENGINE_BLOCK);
+}
+
+struct cpu_t *cpu_create_with_engine(int model, int engine) {
+   struct cpu_t *cpu = aligned_alloc(_Alignof(struct cpu_t), sizeof(struct cpu_t));
+   if (cpu == NULL) {
+      return NULL;
+   }
+   if (cpu_init(cpu, model, engine) != 0) {
       cpu_destroy(cpu);
       free(cpu);
       cpu = NULL;
@@ -204,12 +300,27 @@ struct cpu_t *cpu_create(int model) {
 }
 
 void cpu_destroy(struct cpu_t *cpu) {
-   if (cpu->instructions != NULL) {
-      free(cpu->instructions);
+   free(cpu->opcodes);
+   free(cpu->profile);
+   free(cpu->watches);
+   ewm_blk_destroy(cpu->blocks);
+#if defined(EWM_LUA)
+   if (cpu->lua_hooks != NULL) {
+      free(cpu->lua_hooks);
+      cpu->lua_hooks = NULL;
    }
-   if (cpu->trace != NULL) {
-      (void) fclose(cpu->trace);
-      cpu->trace = NULL;
+#endif
+   while (cpu->mem != NULL) {
+      struct mem_t *next = cpu->mem->next;
+      if (cpu->mem->owned) {
+         free(cpu->mem->obj);
+      }
+      if (cpu->mem->rom != NULL) {
+         ewm_rom_release(cpu->mem->rom);
+      }
+      free(cpu->mem->dirty);
+      free(cpu->mem);
+      cpu->mem = next;
    }
 }
 
@@ -224,6 +335,8 @@ static struct mem_t *cpu_mem_for_page(struct cpu_t *cpu, uint8_t page) {
    return NULL;
 }
 
+static void cpu_map_pages(struct cpu_t *cpu, uint8_t first, uint8_t last);
+
 struct mem_t *cpu_add_mem(struct cpu_t *cpu, struct mem_t *mem) {
   if (cpu->mem == NULL) {
     cpu->mem = mem;
@@ -232,6 +345,7 @@ struct mem_t *cpu_add_mem(struct cpu_t *cpu, struct mem_t *mem) {
     mem->next = cpu->mem;
     cpu->mem = mem;
   }
+  cpu_map_pages(cpu, mem->start >> 8, mem->end >> 8);
   return mem;
 }
 
@@ -246,7 +360,9 @@ static void _ram_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint
 }
 
 struct mem_t *cpu_add_ram(struct cpu_t *cpu, uint16_t start, uint16_t end) {
-   return cpu_add_ram_data(cpu, start, end, calloc(end-start+1, 0x01));
+   struct mem_t *mem = cpu_add_ram_data(cpu, start, end, calloc(end-start+1, 0x01));
+   mem->owned = true;
+   return mem;
 }
 
 struct mem_t *cpu_add_ram_data(struct cpu_t *cpu, uint16_t start, uint16_t end, uint8_t *data) {
@@ -259,6 +375,7 @@ struct mem_t *cpu_add_ram_data(struct cpu_t *cpu, uint16_t start, uint16_t end,
   mem->end = end;
   mem->read_handler = _ram_read;
   mem->write_handler = _ram_write;
+  mem->dirty = calloc(((end - start) >> 8) + 1, 1);
   mem->next = NULL;
   return cpu_add_mem(cpu, mem);
 }
@@ -288,7 +405,9 @@ struct mem_t *cpu_add_ram_file(struct cpu_t *cpu, uint16_t start, char *path) {
 
    close(fd);
 
-   return cpu_add_ram_data(cpu, start, start + file_info.st_size - 1, (uint8_t*) data);
+   struct mem_t *mem = cpu_add_ram_data(cpu, start, start + file_info.st_size - 1, (uint8_t*) data);
+   mem->owned = true;
+   return mem;
 }
 
 // ROM Memory
@@ -311,33 +430,22 @@ struct mem_t *cpu_add_rom_data(struct cpu_t *cpu, uint16_t start, uint16_t end,
   return cpu_add_mem(cpu, mem);
 }
 
-struct mem_t *cpu_add_rom_file(struct cpu_t *cpu, uint16_t start, char *path) {
-   int fd = open(path, O_RDONLY);
-   if (fd == -1) {
-      return NULL;
-   }
-
-   struct stat file_info;
-   if (fstat(fd, &file_info) == -1) {
-      close(fd);
-      return NULL;
-   }
+// ROM images come from the rom cache, so that machines share them
 
-   if (file_info.st_size  > (64 * 1024 - start)) {
-      close(fd);
+struct mem_t *cpu_add_rom_file(struct cpu_t *cpu, uint16_t start, char *path) {
+   struct ewm_rom_t *rom = ewm_rom_acquire(path);
+   if (rom == NULL) {
       return NULL;
    }
 
-   char *data = calloc(file_info.st_size, 1);
-   if (read(fd, data, file_info.st_size) != file_info.st_size) {
-      close(fd);
+   if (rom->size > (size_t) (64 * 1024 - start)) {
+      ewm_rom_release(rom);
       return NULL;
    }
 
-   close(fd);
-
-   struct mem_t *result = cpu_add_rom_data(cpu, start, start + file_info.st_size - 1, (uint8_t*) data);
+   struct mem_t *result = cpu_add_rom_data(cpu, start, start + rom->size - 1, (uint8_t*) rom->data);
    result->description = path;
+   result->rom = rom;
    return result;
 }
 
@@ -357,6 +465,131 @@ struct mem_t *cpu_add_iom(struct cpu_t *cpu, uint16_t start, uint16_t end, void
   return cpu_add_mem(cpu, mem);
 }
 
+// Page table. The resolution rules are the same as the ones of the
+// memory list walk: for reads the first enabled and readable region
+// wins, for writes the first enabled region wins, even if it is not
+// writable. A page is only mapped to a single region if that region
+// covers the whole page and no region before it touches the page.
+// While profiling, RAM and ROM pages are mapped to their handlers
+// instead of their data, so that accesses get counted. The same goes
+// for watched pages, so that accesses get checked.
+
+static bool cpu_mem_overlaps_page(struct mem_t *mem, uint16_t start, uint16_t end) {
+   return mem->enabled && mem->start <= end && mem->end >= start;
+}
+
+static bool cpu_mem_covers_page(struct mem_t *mem, uint16_t start, uint16_t end) {
+   return mem->start <= start && mem->end >= end;
+}
+
+static void cpu_map_read_mem(struct cpu_t *cpu, struct cpu_page_t *p, struct mem_t *mem, uint16_t start) {
+   if (cpu->profile == NULL && !p->watched && (mem->read_handler == _ram_read || mem->read_handler == _rom_read)) {
+      p->data = (uint8_t*) mem->obj + (start - mem->start);
+   } else {
+      p->mem = mem;
+   }
+}
+
+static void cpu_map_read_page(struct cpu_t *cpu, uint8_t page) {
+   uint16_t start = page * 0x0100, end = start + 0xff;
+   struct cpu_page_t *p = &cpu->read_pages[page];
+   memset(p, 0, sizeof(struct cpu_page_t));
+   p->watched = cpu->watches != NULL && (cpu->watches->pages[page] & EWM_CPU_WATCH_READ);
+
+   if (cpu->banks[page].banked) {
+      if (cpu->banks[page].read != NULL) {
+         cpu_map_read_mem(cpu, p, cpu->banks[page].read, start);
+      }
+      return;
+   }
+
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      if (!cpu_mem_overlaps_page(mem, start, end) || mem->read_handler == NULL || !(mem->flags & MEM_FLAGS_READ)) {
+         continue;
+      }
+      if (!cpu_mem_covers_page(mem, start, end)) {
+         p->mixed = true;
+      } else {
+         cpu_map_read_mem(cpu, p, mem, start);
+      }
+      return;
+   }
+}
+
+// A handler on top of RAM may well write to that RAM, so its page is
+// considered dirty after every write too.
+
+static uint8_t *cpu_ram_dirty_for_page(struct mem_t *mem, uint16_t start, uint16_t end) {
+   for (; mem != NULL; mem = mem->next) {
+      if (cpu_mem_overlaps_page(mem, start, end) && mem->write_handler == _ram_write && cpu_mem_covers_page(mem, start, end)) {
+         return &mem->dirty[(start - mem->start) >> 8];
+      }
+   }
+   return NULL;
+}
+
+static void cpu_map_write_mem(struct cpu_t *cpu, struct cpu_page_t *p, struct mem_t *mem, uint16_t start, uint16_t end) {
+   if (mem->write_handler == _ram_write) {
+      bool direct = cpu->profile == NULL && !p->watched;
+      p->data = direct ? (uint8_t*) mem->obj + (start - mem->start) : NULL;
+      p->mem = direct ? NULL : mem;
+      p->dirty = &mem->dirty[(start - mem->start) >> 8];
+   } else {
+      p->mem = mem;
+      p->dirty = cpu_ram_dirty_for_page(mem->next, start, end);
+   }
+}
+
+static void cpu_map_write_page(struct cpu_t *cpu, uint8_t page) {
+   uint16_t start = page * 0x0100, end = start + 0xff;
+   struct cpu_page_t *p = &cpu->write_pages[page];
+   memset(p, 0, sizeof(struct cpu_page_t));
+   p->watched = cpu->watches != NULL && (cpu->watches->pages[page] & EWM_CPU_WATCH_WRITE);
+
+   if (cpu->banks[page].banked) {
+      if (cpu->banks[page].write != NULL) {
+         cpu_map_write_mem(cpu, p, cpu->banks[page].write, start, end);
+      }
+      return;
+   }
+
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      if (!cpu_mem_overlaps_page(mem, start, end)) {
+         continue;
+      }
+      if (!cpu_mem_covers_page(mem, start, end)) {
+         p->mixed = true;
+      } else if (mem->write_handler != NULL && (mem->flags & MEM_FLAGS_WRITE)) {
+         cpu_map_write_mem(cpu, p, mem, start, end);
+      }
+      return;
+   }
+}
+
+static void cpu_map_pages(struct cpu_t *cpu, uint8_t first, uint8_t last) {
+   for (int page = first; page <= last; page++) {
+      struct cpu_page_t read = cpu->read_pages[page], write = cpu->write_pages[page];
+      cpu_map_read_page(cpu, page);
+      cpu_map_write_page(cpu, page);
+      if (cpu->blocks != NULL) {
+         ewm_blk_remapped(cpu, page, &read, &write);
+      }
+   }
+}
+
+void cpu_remap_mem(struct cpu_t *cpu, struct mem_t *mem) {
+   cpu_map_pages(cpu, mem->start >> 8, mem->end >> 8);
+}
+
+void cpu_map_bank(struct cpu_t *cpu, uint8_t page, struct mem_t *read, struct mem_t *write) {
+   struct cpu_bank_t *bank = &cpu->banks[page];
+   if (bank->banked && bank->read == read && bank->write == write) {
+      return;
+   }
+   *bank = (struct cpu_bank_t) { .banked = true, .read = read, .write = write };
+   cpu_map_pages(cpu, page, page);
+}
+
 // For now, as a good optimization, this emulator is going to assume
 // that there is a memory region covering at least the first two pages
 // of memory. This will probably break on the IIe where $0200 to $BFFF
@@ -376,205 +609,830 @@ void cpu_strict(struct cpu_t *cpu, bool strict) {
    cpu->strict = strict;
 }
 
-int cpu_trace(struct cpu_t *cpu, char *path) {
-   if (cpu->trace != NULL) {
-      (void) fclose(cpu->trace);
-      cpu->trace = NULL;
-   }
+void cpu_trace(struct cpu_t *cpu, struct ewm_trace_t *trace) {
+   cpu->trace = trace;
+}
+
+// Profiling
 
-   if (path != NULL) {
-      cpu->trace = fopen(path, "w");
-      if (cpu->trace == NULL) {
-         return errno;
+int cpu_profile(struct cpu_t *cpu, bool enabled) {
+   free(cpu->profile);
+   cpu->profile = NULL;
+
+   if (enabled) {
+      cpu->profile = calloc(1, sizeof(struct cpu_profile_t));
+      if (cpu->profile == NULL) {
+         return -1;
+      }
+      for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+         mem->reads = mem->writes = 0;
       }
    }
 
+   cpu_map_pages(cpu, 0x00, 0xff);
+
    return 0;
 }
 
+struct cpu_profile_entry_t {
+   uint64_t value;
+   int index;
+};
+
+static int cpu_profile_entry_compare(const void *a, const void *b) {
+   const struct cpu_profile_entry_t *ea = a, *eb = b;
+   if (ea->value != eb->value) {
+      return (ea->value < eb->value) ? 1 : -1;
+   }
+   return ea->index - eb->index;
+}
+
+// Sorts the counters, biggest first, and returns how many are not zero
+static int cpu_profile_sort(struct cpu_profile_entry_t *entries, int count) {
+   qsort(entries, count, sizeof(struct cpu_profile_entry_t), cpu_profile_entry_compare);
+   int used = 0;
+   while (used < count && entries[used].value != 0) {
+      used++;
+   }
+   return used;
+}
+
+static double cpu_profile_percentage(struct cpu_profile_t *profile, uint64_t cycles) {
+   return profile->cycles ? (100.0 * cycles) / profile->cycles : 0.0;
+}
+
+static const char *cpu_mem_kind(struct mem_t *mem) {
+   if (mem->read_handler == _ram_read) {
+      return "RAM";
+   }
+   if (mem->read_handler == _rom_read) {
+      return "ROM";
+   }
+   return "IOM";
+}
+
+void cpu_profile_report(struct cpu_t *cpu, FILE *fp, int top) {
+   struct cpu_profile_t *profile = cpu->profile;
+   if (profile == NULL) {
+      return;
+   }
+
+   struct cpu_profile_entry_t *entries = malloc(64 * 1024 * sizeof(struct cpu_profile_entry_t));
+   if (entries == NULL) {
+      return;
+   }
+
+   fprintf(fp, "[PRF] %" PRIu64 " instructions, %" PRIu64 " cycles\n", profile->instructions, profile->cycles);
+
+   for (int i = 0; i < 256; i++) {
+      entries[i] = (struct cpu_profile_entry_t) { profile->opcode_cycles[i], i };
+   }
+   int used = cpu_profile_sort(entries, 256);
+   fprintf(fp, "[PRF] Opcodes by cycles\n");
+   for (int i = 0; i < used && i < top; i++) {
+      int opcode = entries[i].index;
+      const char *name = cpu->instructions[opcode].name ? cpu->instructions[opcode].name : "???";
+      fprintf(fp, "[PRF]   %.2X %-4s %6.2f%% %12" PRIu64 " cycles %12" PRIu64 " times\n", opcode, name,
+              cpu_profile_percentage(profile, entries[i].value), entries[i].value, profile->opcode_count[opcode]);
+   }
+
+   for (int i = 0; i < 256; i++) {
+      entries[i] = (struct cpu_profile_entry_t) { profile->page_cycles[i], i };
+   }
+   used = cpu_profile_sort(entries, 256);
+   fprintf(fp, "[PRF] Pages by cycles\n");
+   for (int i = 0; i < used && i < top; i++) {
+      fprintf(fp, "[PRF]   $%.2X00 %6.2f%% %12" PRIu64 " cycles\n", entries[i].index,
+              cpu_profile_percentage(profile, entries[i].value), entries[i].value);
+   }
+
+   for (int i = 0; i < 64 * 1024; i++) {
+      entries[i] = (struct cpu_profile_entry_t) { profile->pc_cycles[i], i };
+   }
+   used = cpu_profile_sort(entries, 64 * 1024);
+   fprintf(fp, "[PRF] Instructions by cycles\n");
+   for (int i = 0; i < used && i < top; i++) {
+      uint16_t pc = entries[i].index;
+      const struct cpu_instruction_t *instruction = &cpu->instructions[mem_get_byte(cpu, pc)];
+      fprintf(fp, "[PRF]   $%.4X %-4s %6.2f%% %12" PRIu64 " cycles\n", pc, instruction->name ? instruction->name : "???",
+              cpu_profile_percentage(profile, entries[i].value), entries[i].value);
+   }
+
+   fprintf(fp, "[PRF] Memory regions by accesses\n");
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->reads != 0 || mem->writes != 0) {
+         fprintf(fp, "[PRF]   %s $%.4X-$%.4X %12" PRIu64 " reads %12" PRIu64 " writes %s\n", cpu_mem_kind(mem),
+                 mem->start, mem->end, mem->reads, mem->writes, mem->description ? mem->description : "");
+      }
+   }
+
+   free(entries);
+}
+
 void cpu_reset(struct cpu_t *cpu) {
    cpu->state.pc = mem_get_word(cpu, EWM_VECTOR_RES);
    cpu->state.a = 0x00;
    cpu->state.x = 0x00;
    cpu->state.y = 0x00;
-   cpu->state.n = 0;
-   cpu->state.v = 0;
-   cpu->state.b = 0;
-   cpu->state.d = 0;
-   cpu->state.i = 1;
-   cpu->state.z = 0;
-   cpu->state.c = 0;
+   _cpu_set_status(cpu, EWM_CPU_FLAG_i);
    cpu->state.sp = 0xff;
 
    cpu_optimize_memory(cpu);
 }
 
-int cpu_irq(struct cpu_t *cpu) {
+// BRK pushes the address after its padding byte with B set. Hardware
+// interrupts push the address of the interrupted instruction with B
+// clear and take 7 cycles. The 65C02 also clears the decimal flag.
+
+static int cpu_interrupt(struct cpu_t *cpu, uint16_t pc, uint8_t status, uint16_t vector) {
    if (cpu->strict && _cpu_stack_free(cpu) < 3) {
       return EWM_CPU_ERR_STACK_OVERFLOW;
    }
 
-   _cpu_push_word(cpu, cpu->state.pc + 1); // TODO +1?? Spec says +2 but test fails then
-   _cpu_push_byte(cpu, _cpu_get_status(cpu));
-   cpu->state.i = 1;
-   cpu->state.pc = mem_get_word(cpu, EWM_VECTOR_IRQ);
+   _cpu_push_word(cpu, pc);
+   _cpu_push_byte(cpu, status);
+   cpu_set_flag(cpu, i, 1);
+   cpu->state.pc = mem_get_word(cpu, vector);
 
    return 0;
 }
 
-int cpu_nmi(struct cpu_t *cpu) {
-   if (cpu->strict && _cpu_stack_free(cpu) < 3) {
-      return EWM_CPU_ERR_STACK_OVERFLOW;
+int cpu_brk(struct cpu_t *cpu) {
+   return cpu_interrupt(cpu, cpu->state.pc + 1, _cpu_get_status(cpu) | EWM_CPU_FLAG_b, EWM_VECTOR_IRQ);
+}
+
+static int cpu_hardware_interrupt(struct cpu_t *cpu, uint16_t vector) {
+   int ret = cpu_interrupt(cpu, cpu->state.pc, _cpu_get_status(cpu) & ~EWM_CPU_FLAG_b, vector);
+   if (ret == 0) {
+      if (cpu->model == EWM_CPU_MODEL_65C02) {
+         cpu_set_flag(cpu, d, 0);
+      }
+      cpu->counter += 7;
    }
+   return ret;
+}
 
-   _cpu_push_word(cpu, cpu->state.pc + 1); // TODO +1?? Spec says +2 but test fails then
-   _cpu_push_byte(cpu, _cpu_get_status(cpu));
-   cpu->state.i = 1;
-   cpu->state.pc = mem_get_word(cpu, EWM_VECTOR_NMI);
+int cpu_irq(struct cpu_t *cpu) {
+   return cpu_hardware_interrupt(cpu, EWM_VECTOR_IRQ);
+}
 
-   return 0;
+int cpu_nmi(struct cpu_t *cpu) {
+   return cpu_hardware_interrupt(cpu, EWM_VECTOR_NMI);
 }
 
 int cpu_step(struct cpu_t *cpu) {
+   if (cpu->watches != NULL && (cpu->watches->pages[cpu->state.pc >> 8] & EWM_CPU_WATCH_EXECUTE)) {
+      cpu_watched(cpu, EWM_CPU_WATCH_EXECUTE, cpu->state.pc, 0);
+   }
+#if defined(EWM_LUA)
+   if (cpu->lua_hooks != NULL) {
+      return cpu_execute_instruction_hooked(cpu);
+   }
+#endif
    return cpu_execute_instruction(cpu);
 }
 
+// Tracing, profiling, Lua hooks and execute watches are only supported
+// by cpu_step(), so when those are enabled we always fall back to the
+// step engine.
+
+static bool cpu_needs_step_engine(struct cpu_t *cpu) {
 #if defined(EWM_LUA)
+   if (cpu->lua_hooks != NULL) {
+      return true;
+   }
+#endif
+   if (cpu->watches != NULL && (cpu->watches->kinds & EWM_CPU_WATCH_EXECUTE)) {
+      return true;
+   }
+   return cpu->engine == EWM_CPU_ENGINE_STEP || cpu->trace != NULL || cpu->profile != NULL;
+}
 
-//
-// Lua support
-//
+// Event scheduler
 
-// cpu state functions
+static void cpu_events_swap(struct cpu_t *cpu, int a, int b) {
+   struct cpu_event_t t = cpu->events[a];
+   cpu->events[a] = cpu->events[b];
+   cpu->events[b] = t;
+}
 
-static int cpu_lua_index(lua_State *state) {
-   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
-   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+static void cpu_events_sift_up(struct cpu_t *cpu, int i) {
+   while (i > 0 && cpu->events[(i - 1) / 2].when > cpu->events[i].when) {
+      cpu_events_swap(cpu, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+   }
+}
 
-   if (!lua_isstring(state, 2)) {
-      printf("TODO lua_cpu_index: arg 2 is not a string\n");
+static void cpu_events_sift_down(struct cpu_t *cpu, int i) {
+   while (true) {
+      int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+      if (l < cpu->event_count && cpu->events[l].when < cpu->events[smallest].when) {
+         smallest = l;
+      }
+      if (r < cpu->event_count && cpu->events[r].when < cpu->events[smallest].when) {
+         smallest = r;
+      }
+      if (smallest == i) {
+         break;
+      }
+      cpu_events_swap(cpu, i, smallest);
+      i = smallest;
+   }
+}
+
+static void cpu_events_remove(struct cpu_t *cpu, int i) {
+   cpu->event_count--;
+   if (i != cpu->event_count) {
+      cpu->events[i] = cpu->events[cpu->event_count];
+      cpu_events_sift_up(cpu, i);
+      cpu_events_sift_down(cpu, i);
+   }
+}
+
+void cpu_cancel(struct cpu_t *cpu, cpu_event_handler_t handler, void *obj) {
+   for (int i = 0; i < cpu->event_count; i++) {
+      if (cpu->events[i].handler == handler && cpu->events[i].obj == obj) {
+         cpu_events_remove(cpu, i);
+         return;
+      }
+   }
+}
+
+int cpu_schedule(struct cpu_t *cpu, uint64_t delay, cpu_event_handler_t handler, void *obj) {
+   cpu_cancel(cpu, handler, obj);
+
+   if (cpu->event_count == EWM_CPU_MAX_EVENTS) {
+      fprintf(stderr, "[CPU] Event queue is full\n");
+      return -1;
+   }
+
+   struct cpu_event_t *event = &cpu->events[cpu->event_count];
+   event->when = cpu->counter + delay;
+   event->handler = handler;
+   event->obj = obj;
+   cpu_events_sift_up(cpu, cpu->event_count++);
+
+   // If we are in the middle of a slice, make sure we stop in time
+   if (cpu->counter + delay < cpu->deadline) {
+      cpu->deadline = cpu->counter + delay;
+   }
+
+   return 0;
+}
+
+static void cpu_run_events(struct cpu_t *cpu) {
+   while (cpu->event_count != 0 && cpu->events[0].when <= cpu->counter) {
+      struct cpu_event_t event = cpu->events[0];
+      cpu_events_remove(cpu, 0);
+      event.handler(cpu, event.obj);
+   }
+}
+
+static int cpu_run_step_engine(struct cpu_t *cpu) {
+   while (cpu->counter < cpu->deadline) {
+      int ret = cpu_step(cpu);
+      if (ret < 0) {
+         return ret;
+      }
+      if (cpu->state.pc == cpu->breakpoint) {
+         break;
+      }
+   }
+   return 0;
+}
+
+// Interrupts are only checked between engine runs. A masked IRQ stays
+// pending until the next cpu_run() call after the I flag is cleared.
+
+static int cpu_service_interrupts(struct cpu_t *cpu) {
+   if (cpu->pending & EWM_CPU_PENDING_NMI) {
+      cpu->pending &= ~EWM_CPU_PENDING_NMI;
+      return cpu_nmi(cpu);
+   }
+   if ((cpu->pending & EWM_CPU_PENDING_IRQ) && !cpu_flag(cpu, i)) {
+      cpu->pending &= ~EWM_CPU_PENDING_IRQ;
+      return cpu_irq(cpu);
+   }
+   return 0;
+}
+
+int cpu_run(struct cpu_t *cpu, int cycles) {
+   uint64_t start = cpu->counter;
+   uint64_t end = start + cycles;
+
+   while (cpu->counter < end) {
+      cpu_run_events(cpu);
+
+      int ret = cpu_service_interrupts(cpu);
+      if (ret < 0) {
+         return ret;
+      }
+
+      cpu->deadline = end;
+      if (cpu->event_count != 0 && cpu->events[0].when < end) {
+         cpu->deadline = cpu->events[0].when;
+      }
+
+      if (cpu_needs_step_engine(cpu)) {
+         ret = cpu_run_step_engine(cpu);
+         if (ret < 0) {
+            return ret;
+         }
+      } else if (cpu->engine == EWM_CPU_ENGINE_BLOCK) {
+         if (cpu->model == EWM_CPU_MODEL_6502) {
+            ins_run_blocks_6502(cpu);
+         } else {
+            ins_run_blocks_65C02(cpu);
+         }
+      } else if (cpu->model == EWM_CPU_MODEL_6502) {
+         ins_run_6502(cpu);
+      } else {
+         ins_run_65C02(cpu);
+      }
+
+      if (cpu->state.pc == cpu->breakpoint) {
+         break;
+      }
+   }
+
+   cpu_run_events(cpu);
+
+   // Nothing can be skipped until the next cpu_run()
+   cpu->deadline = 0;
+
+   return cpu->counter - start;
+}
+
+uint64_t cpu_idle_cycles(struct cpu_t *cpu, uint16_t start, uint16_t end) {
+#if defined(EWM_LUA)
+   if (cpu->lua_hooks != NULL) {
       return 0;
    }
+#endif
+   if (cpu->trace != NULL || cpu->profile != NULL || cpu->watches != NULL) {
+      return 0;
+   }
+   if (cpu->breakpoint >= start && cpu->breakpoint <= end) {
+      return 0;
+   }
+   if (cpu->deadline <= cpu->counter + 1) {
+      return 0;
+   }
+   return cpu->deadline - cpu->counter - 1;
+}
 
-   const char *name = lua_tostring(state, 2);
+uint8_t cpu_instruction_cycles(struct cpu_t *cpu, uint8_t opcode) {
+   return cpu->opcodes[opcode].cycles;
+}
 
-   if (strcmp(name, "a") == 0) {
-      lua_pushnumber(state, cpu->state.a);
-      return 1;
+// The pc is already past the load when its read handler runs
+
+bool cpu_skip_poll_loop(struct cpu_t *cpu, uint16_t addr) {
+   uint16_t pc = cpu->state.pc - 3;
+   uint8_t opcode = mem_get_byte(cpu, pc);
+   if ((opcode != 0xad && opcode != 0x2c) || mem_get_word(cpu, pc + 1) != addr) {
+      return false;
+   }
+   if (mem_get_byte(cpu, pc + 3) != 0x10 || mem_get_byte(cpu, pc + 4) != 0xfb) {
+      return false;
    }
 
-   if (strcmp(name, "x") == 0) {
-      lua_pushnumber(state, cpu->state.x);
-      return 1;
+   // The BPL is taken, which costs one more cycle or two if the loop
+   // straddles a page
+   uint64_t cycles = cpu_instruction_cycles(cpu, opcode) + cpu_instruction_cycles(cpu, 0x10)
+      + 1 + (((pc ^ (pc + 5)) >> 8) & 1);
+   uint64_t budget = cpu_idle_cycles(cpu, pc, pc + 4);
+   cpu->counter += (budget / cycles) * cycles;
+   return budget >= cycles;
+}
+
+// Watches
+
+static void cpu_watches_update(struct cpu_t *cpu) {
+   struct cpu_watches_t *watches = cpu->watches;
+   memset(watches->pages, 0, sizeof(watches->pages));
+   memset(watches->bits, 0, sizeof(watches->bits));
+   watches->kinds = 0;
+
+   for (int i = 0; i < EWM_CPU_MAX_WATCHES; i++) {
+      struct cpu_watch_t *watch = &watches->watches[i];
+      if (watch->handler == NULL) {
+         continue;
+      }
+      watches->kinds |= watch->kind;
+      for (int kind = 0; kind < 3; kind++) {
+         if (watch->kind & (1 << kind)) {
+            for (int addr = watch->lo; addr <= watch->hi; addr++) {
+               watches->pages[addr >> 8] |= 1 << kind;
+               watches->bits[kind][addr >> 3] |= 1 << (addr & 7);
+            }
+         }
+      }
    }
 
-   if (strcmp(name, "y") == 0) {
-      lua_pushnumber(state, cpu->state.y);
-      return 1;
+   cpu_map_pages(cpu, 0x00, 0xff);
+}
+
+int cpu_watch(struct cpu_t *cpu, uint8_t kind, uint16_t lo, uint16_t hi, cpu_watch_handler_t handler, void *obj) {
+   if (cpu->watches == NULL && (cpu->watches = calloc(1, sizeof(struct cpu_watches_t))) == NULL) {
+      return -1;
    }
 
-   if (strcmp(name, "s") == 0) {
-      lua_pushnumber(state, _cpu_get_status(cpu));
-      return 1;
+   for (int i = 0; i < EWM_CPU_MAX_WATCHES; i++) {
+      struct cpu_watch_t *watch = &cpu->watches->watches[i];
+      if (watch->handler == NULL) {
+         *watch = (struct cpu_watch_t) { .kind = kind, .lo = lo, .hi = hi, .handler = handler, .obj = obj };
+         cpu_watches_update(cpu);
+         return i;
+      }
    }
 
-   if (strcmp(name, "pc") == 0) {
-      lua_pushnumber(state, cpu->state.pc);
-      return 1;
+   fprintf(stderr, "[CPU] Too many watches\n");
+   return -1;
+}
+
+void cpu_unwatch(struct cpu_t *cpu, int id) {
+   if (cpu->watches != NULL && id >= 0 && id < EWM_CPU_MAX_WATCHES) {
+      cpu->watches->watches[id].handler = NULL;
+      cpu_watches_update(cpu);
    }
+}
 
-   if (strcmp(name, "sp") == 0) {
-      lua_pushnumber(state, cpu->state.sp);
-      return 1;
+void cpu_watched(struct cpu_t *cpu, uint8_t kind, uint16_t addr, uint8_t value) {
+   struct cpu_watches_t *watches = cpu->watches;
+   int bit = kind >> 1; // 1, 2 and 4 to 0, 1 and 2
+   if (watches->active || !(watches->bits[bit][addr >> 3] & (1 << (addr & 7)))) {
+      return;
    }
 
-   if (strcmp(name, "model") == 0) {
-      switch (cpu->model) {
-         case EWM_CPU_MODEL_6502:
-            lua_pushstring(state, "6502");
-            break;
-         case EWM_CPU_MODEL_65C02:
-            lua_pushstring(state, "65C02");
-            break;
+   watches->active = true;
+   if (kind == EWM_CPU_WATCH_EXECUTE) {
+      value = mem_get_byte(cpu, addr);
+   }
+   for (int i = 0; i < EWM_CPU_MAX_WATCHES; i++) {
+      struct cpu_watch_t *watch = &watches->watches[i];
+      if (watch->handler != NULL && (watch->kind & kind) && addr >= watch->lo && addr <= watch->hi) {
+         watch->handler(cpu, watch->obj, addr, value);
       }
-      return 1;
    }
+   watches->active = false;
+}
 
-   if (strcmp(name, "memory") == 0) {
-      void *cpu_data = lua_newuserdata(state, sizeof(struct cpu_t*));
-      *((struct cpu_t**) cpu_data) = cpu;
-      luaL_getmetatable(state, "mem_meta_table");
-      lua_setmetatable(state, -2);
-      return 1;
+void cpu_request_irq(struct cpu_t *cpu) {
+   cpu->pending |= EWM_CPU_PENDING_IRQ;
+   cpu->deadline = 0;
+}
+
+void cpu_request_nmi(struct cpu_t *cpu) {
+   cpu->pending |= EWM_CPU_PENDING_NMI;
+   cpu->deadline = 0;
+}
+
+void cpu_set_breakpoint(struct cpu_t *cpu, int addr) {
+   cpu->breakpoint = addr;
+}
+
+uint64_t cpu_scheduled(struct cpu_t *cpu, cpu_event_handler_t handler, void *obj) {
+   for (int i = 0; i < cpu->event_count; i++) {
+      if (cpu->events[i].handler == handler && cpu->events[i].obj == obj) {
+         return cpu->events[i].when;
+      }
    }
+   return 0;
+}
 
-   luaL_getmetatable(state, "cpu_methods_meta_table");
-   lua_pushvalue(state, 2);
-   lua_rawget(state, -2);
+// Snapshots. The cpu chunk has the registers and the cycle counter. The
+// memory chunk has the state of every memory region, in the order of
+// the memory list, and the contents of RAM regions. Only RAM pages that
+// are not all zeroes are stored, a bitmap tells which ones.
 
-   return 1;
+#define EWM_CPU_SNAPSHOT_PAGE_SIZE (256)
+
+static bool cpu_page_is_empty(uint8_t *page, size_t length) {
+   for (size_t i = 0; i < length; i++) {
+      if (page[i] != 0) {
+         return false;
+      }
+   }
+   return true;
 }
 
-static int cpu_lua_newindex(lua_State *state) {
-   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
-   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+int cpu_save_snapshot(struct cpu_t *cpu, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "CPU ");
+   ewm_snapshot_put_u8(snapshot, cpu->model);
+   ewm_snapshot_put_u8(snapshot, cpu->state.a);
+   ewm_snapshot_put_u8(snapshot, cpu->state.x);
+   ewm_snapshot_put_u8(snapshot, cpu->state.y);
+   ewm_snapshot_put_u8(snapshot, cpu->state.sp);
+   ewm_snapshot_put_u8(snapshot, _cpu_get_status(cpu));
+   ewm_snapshot_put_u16(snapshot, cpu->state.pc);
+   ewm_snapshot_put_u64(snapshot, cpu->counter);
+   ewm_snapshot_put_u8(snapshot, cpu->pending);
+   ewm_snapshot_end(snapshot);
+
+   int count = 0;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      count++;
+   }
 
-   if(!lua_isstring(state, 2)) {
-      printf("TODO lua_cpu_new_index: arg 2 is not a string\n");
-      return 0;
+   ewm_snapshot_begin(snapshot, "MEM ");
+   ewm_snapshot_put_u16(snapshot, count);
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      bool ram = (mem->write_handler == _ram_write);
+      ewm_snapshot_put_u16(snapshot, mem->start);
+      ewm_snapshot_put_u16(snapshot, mem->end);
+      ewm_snapshot_put_u8(snapshot, mem->enabled);
+      ewm_snapshot_put_u8(snapshot, mem->flags);
+      ewm_snapshot_put_u8(snapshot, ram);
+      if (ram && !snapshot->without_memory) {
+         size_t length = mem->end - mem->start + 1;
+         int pages = (length + EWM_CPU_SNAPSHOT_PAGE_SIZE - 1) / EWM_CPU_SNAPSHOT_PAGE_SIZE;
+         uint8_t *data = (uint8_t*) mem->obj;
+
+         for (int i = 0; i < pages; i += 8) {
+            uint8_t bits = 0;
+            for (int j = i; j < i + 8 && j < pages; j++) {
+               size_t offset = j * EWM_CPU_SNAPSHOT_PAGE_SIZE;
+               size_t size = (length - offset < EWM_CPU_SNAPSHOT_PAGE_SIZE) ? length - offset : EWM_CPU_SNAPSHOT_PAGE_SIZE;
+               if (!cpu_page_is_empty(data + offset, size)) {
+                  bits |= (1 << (j - i));
+               }
+            }
+            ewm_snapshot_put_u8(snapshot, bits);
+         }
+
+         for (int j = 0; j < pages; j++) {
+            size_t offset = j * EWM_CPU_SNAPSHOT_PAGE_SIZE;
+            size_t size = (length - offset < EWM_CPU_SNAPSHOT_PAGE_SIZE) ? length - offset : EWM_CPU_SNAPSHOT_PAGE_SIZE;
+            if (!cpu_page_is_empty(data + offset, size)) {
+               ewm_snapshot_put_data(snapshot, data + offset, size);
+            }
+         }
+      }
    }
+   ewm_snapshot_end(snapshot);
 
-   if(!lua_isnumber(state, 3)) {
-      printf("TODO lua_cpu_new_index: arg 3 is not a string\n");
+   return snapshot->error ? -1 : 0;
+}
 
-      return 0;
+// Scheduled events are dropped, the devices that own them schedule
+// them again when they load their own state.
+
+int cpu_load_snapshot(struct cpu_t *cpu, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "CPU ", &chunk) != 0) {
+      fprintf(stderr, "[CPU] Snapshot has no cpu state\n");
+      return -1;
    }
 
-   const char *name = lua_tostring(state, 2);
-   int value = lua_tointeger(state, 3);
+   if (ewm_snapshot_get_u8(&chunk) != cpu->model) {
+      fprintf(stderr, "[CPU] Snapshot is of another cpu model\n");
+      return -1;
+   }
 
-   if (strcmp(name, "a") == 0) {
-      cpu->state.a = (uint8_t) value;
-      return 0;
+   cpu->state.a = ewm_snapshot_get_u8(&chunk);
+   cpu->state.x = ewm_snapshot_get_u8(&chunk);
+   cpu->state.y = ewm_snapshot_get_u8(&chunk);
+   cpu->state.sp = ewm_snapshot_get_u8(&chunk);
+   _cpu_set_status(cpu, ewm_snapshot_get_u8(&chunk));
+   cpu->state.pc = ewm_snapshot_get_u16(&chunk);
+   cpu->counter = ewm_snapshot_get_u64(&chunk);
+   cpu->pending = ewm_snapshot_get_u8(&chunk);
+   cpu->event_count = 0;
+
+   // Memory is about to be replaced behind the page table's back
+   if (cpu->blocks != NULL) {
+      ewm_blk_flush(cpu->blocks);
    }
 
-   if (strcmp(name, "x") == 0) {
-      cpu->state.x = (uint8_t) value;
-      return 0;
+   if (chunk.error) {
+      fprintf(stderr, "[CPU] Snapshot has a truncated cpu state\n");
+      return -1;
    }
 
-   if (strcmp(name, "y") == 0) {
-      cpu->state.y = (uint8_t) value;
-      return 0;
+   if (ewm_snapshot_chunk(snapshot, "MEM ", &chunk) != 0) {
+      fprintf(stderr, "[CPU] Snapshot has no memory\n");
+      return -1;
+   }
+
+   int count = ewm_snapshot_get_u16(&chunk);
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      count--;
+   }
+   if (count != 0) {
+      fprintf(stderr, "[CPU] Snapshot has a different memory layout\n");
+      return -1;
+   }
+
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      uint16_t start = ewm_snapshot_get_u16(&chunk);
+      uint16_t end = ewm_snapshot_get_u16(&chunk);
+      bool enabled = ewm_snapshot_get_u8(&chunk);
+      uint8_t flags = ewm_snapshot_get_u8(&chunk);
+      bool ram = ewm_snapshot_get_u8(&chunk);
+
+      if (chunk.error || start != mem->start || end != mem->end || ram != (mem->write_handler == _ram_write)) {
+         fprintf(stderr, "[CPU] Snapshot has a different memory layout\n");
+         return -1;
+      }
+
+      if (ram && !snapshot->without_memory) {
+         size_t length = mem->end - mem->start + 1;
+         int pages = (length + EWM_CPU_SNAPSHOT_PAGE_SIZE - 1) / EWM_CPU_SNAPSHOT_PAGE_SIZE;
+         uint8_t *data = (uint8_t*) mem->obj;
+         memset(mem->dirty, 1, ((mem->end - mem->start) >> 8) + 1);
+
+         uint8_t bitmap[(65536 / EWM_CPU_SNAPSHOT_PAGE_SIZE) / 8];
+         ewm_snapshot_get_data(&chunk, bitmap, (pages + 7) / 8);
+
+         for (int j = 0; j < pages; j++) {
+            size_t offset = j * EWM_CPU_SNAPSHOT_PAGE_SIZE;
+            size_t size = (length - offset < EWM_CPU_SNAPSHOT_PAGE_SIZE) ? length - offset : EWM_CPU_SNAPSHOT_PAGE_SIZE;
+            if (bitmap[j / 8] & (1 << (j % 8))) {
+               ewm_snapshot_get_data(&chunk, data + offset, size);
+            } else {
+               memset(data + offset, 0, size);
+            }
+         }
+      }
+
+      mem->enabled = enabled;
+      mem->flags = flags;
+      cpu_remap_mem(cpu, mem);
+   }
+
+   if (chunk.error) {
+      fprintf(stderr, "[CPU] Snapshot has truncated memory\n");
+      return -1;
    }
 
-   if (strcmp(name, "s") == 0) {
-      _cpu_set_status(cpu, (uint8_t) value);
+   return 0;
+}
+
+#if defined(EWM_LUA)
+
+//
+// Lua support
+//
+
+// cpu state functions
+
+// Keys are told apart by their length and first character instead of
+// a chain of strcmp() calls, __index and __newindex run a lot from
+// instruction hooks.
+
+#define CPU_LUA_KEY_UNKNOWN (0)
+#define CPU_LUA_KEY_A       (1)
+#define CPU_LUA_KEY_X       (2)
+#define CPU_LUA_KEY_Y       (3)
+#define CPU_LUA_KEY_S       (4)
+#define CPU_LUA_KEY_PC      (5)
+#define CPU_LUA_KEY_SP      (6)
+#define CPU_LUA_KEY_MODEL   (7)
+#define CPU_LUA_KEY_MEMORY  (8)
+
+static int cpu_lua_key(lua_State *state, int index) {
+   size_t len;
+   const char *name = lua_tolstring(state, index, &len);
+   switch (len) {
+      case 1:
+         switch (name[0]) {
+            case 'a': return CPU_LUA_KEY_A;
+            case 'x': return CPU_LUA_KEY_X;
+            case 'y': return CPU_LUA_KEY_Y;
+            case 's': return CPU_LUA_KEY_S;
+         }
+         break;
+      case 2:
+         if (name[1] == 'c' && name[0] == 'p') {
+            return CPU_LUA_KEY_PC;
+         }
+         if (name[1] == 'p' && name[0] == 's') {
+            return CPU_LUA_KEY_SP;
+         }
+         break;
+      case 5:
+         if (memcmp(name, "model", 5) == 0) {
+            return CPU_LUA_KEY_MODEL;
+         }
+         break;
+      case 6:
+         if (memcmp(name, "memory", 6) == 0) {
+            return CPU_LUA_KEY_MEMORY;
+         }
+         break;
+   }
+   return CPU_LUA_KEY_UNKNOWN;
+}
+
+// The methods table and the memory userdata are upvalues of __index
+
+static int cpu_lua_index(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   if (lua_type(state, 2) != LUA_TSTRING) {
+      printf("TODO lua_cpu_index: arg 2 is not a string\n");
       return 0;
    }
 
-   if (strcmp(name, "pc") == 0) {
-      cpu->state.pc = (uint16_t) value;
+   switch (cpu_lua_key(state, 2)) {
+      case CPU_LUA_KEY_A:
+         lua_pushinteger(state, cpu->state.a);
+         return 1;
+      case CPU_LUA_KEY_X:
+         lua_pushinteger(state, cpu->state.x);
+         return 1;
+      case CPU_LUA_KEY_Y:
+         lua_pushinteger(state, cpu->state.y);
+         return 1;
+      case CPU_LUA_KEY_S:
+         lua_pushinteger(state, _cpu_get_status(cpu));
+         return 1;
+      case CPU_LUA_KEY_PC:
+         lua_pushinteger(state, cpu->state.pc);
+         return 1;
+      case CPU_LUA_KEY_SP:
+         lua_pushinteger(state, cpu->state.sp);
+         return 1;
+      case CPU_LUA_KEY_MODEL:
+         switch (cpu->model) {
+            case EWM_CPU_MODEL_6502:
+               lua_pushstring(state, "6502");
+               break;
+            case EWM_CPU_MODEL_65C02:
+               lua_pushstring(state, "65C02");
+               break;
+         }
+         return 1;
+      case CPU_LUA_KEY_MEMORY:
+         lua_pushvalue(state, lua_upvalueindex(2));
+         return 1;
+   }
+
+   lua_pushvalue(state, 2);
+   lua_rawget(state, lua_upvalueindex(1));
+
+   return 1;
+}
+
+static int cpu_lua_newindex(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   if (lua_type(state, 2) != LUA_TSTRING) {
+      printf("TODO lua_cpu_new_index: arg 2 is not a string\n");
       return 0;
    }
 
-   if (strcmp(name, "sp") == 0) {
-      cpu->state.pc = (uint16_t) value;
+   if(!lua_isnumber(state, 3)) {
+      printf("TODO lua_cpu_new_index: arg 3 is not a string\n");
+
       return 0;
    }
 
+   int value = lua_tointeger(state, 3);
+
+   switch (cpu_lua_key(state, 2)) {
+      case CPU_LUA_KEY_A:
+         cpu->state.a = (uint8_t) value;
+         break;
+      case CPU_LUA_KEY_X:
+         cpu->state.x = (uint8_t) value;
+         break;
+      case CPU_LUA_KEY_Y:
+         cpu->state.y = (uint8_t) value;
+         break;
+      case CPU_LUA_KEY_S:
+         _cpu_set_status(cpu, (uint8_t) value);
+         break;
+      case CPU_LUA_KEY_PC:
+         cpu->state.pc = (uint16_t) value;
+         break;
+      case CPU_LUA_KEY_SP:
+         cpu->state.sp = (uint8_t) value;
+         break;
+   }
+
    return 0;
 }
 
 // mem
 
+// memory[addr] reads and writes a single byte. memory:read(addr, len)
+// returns len bytes as a string and memory:write(addr, bytes) stores a
+// string. Both wrap around at the end of the address space and go
+// through the memory map, like the cpu would.
+
 static int cpu_lua_mem_index(lua_State *state) {
    void *cpu_data = luaL_checkudata(state, 1, "mem_meta_table");
    struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
 
    if (lua_type(state, 2) != LUA_TNUMBER) {
-      printf("First arg fail\n");
-      return 0;
+      // The methods table is the upvalue of __index
+      lua_pushvalue(state, 2);
+      lua_rawget(state, lua_upvalueindex(1));
+      return 1;
    }
 
    uint16_t addr = lua_tointeger(state, 2);
@@ -584,8 +1442,6 @@ static int cpu_lua_mem_index(lua_State *state) {
 }
 
 static int cpu_lua_mem_newindex(lua_State *state) {
-   printf("mem_newindex()\n");
-
    void *cpu_data = luaL_checkudata(state, 1, "mem_meta_table");
    struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
 
@@ -606,6 +1462,50 @@ static int cpu_lua_mem_newindex(lua_State *state) {
    return 0;
 }
 
+static int cpu_lua_mem_read(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "mem_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   uint16_t addr = luaL_checkinteger(state, 2);
+   lua_Integer len = luaL_checkinteger(state, 3);
+   if (len < 0 || len > 0x10000) {
+      return luaL_error(state, "memory:read: invalid length %d", (int) len);
+   }
+
+   luaL_Buffer buffer;
+   luaL_buffinit(state, &buffer);
+   while (len != 0) {
+      char chunk[256];
+      size_t n = len < (lua_Integer) sizeof(chunk) ? (size_t) len : sizeof(chunk);
+      for (size_t i = 0; i < n; i++) {
+         chunk[i] = mem_get_byte(cpu, addr++);
+      }
+      luaL_addlstring(&buffer, chunk, n);
+      len -= n;
+   }
+   luaL_pushresult(&buffer);
+
+   return 1;
+}
+
+static int cpu_lua_mem_write(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "mem_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   uint16_t addr = luaL_checkinteger(state, 2);
+   size_t len;
+   const char *bytes = luaL_checklstring(state, 3, &len);
+   if (len > 0x10000) {
+      return luaL_error(state, "memory:write: string too long");
+   }
+
+   for (size_t i = 0; i < len; i++) {
+      mem_set_byte(cpu, addr++, bytes[i]);
+   }
+
+   return 0;
+}
+
 static int cpu_lua_reset(lua_State *state) {
    void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
    struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
@@ -613,6 +1513,49 @@ static int cpu_lua_reset(lua_State *state) {
    return 0;
 }
 
+// cpu:profile(enabled) starts or stops the profiler. While it runs the
+// counters can be looked at with profileOpcode(), profilePage() and
+// profileAt(), which return nothing when the profiler is not running.
+
+static int cpu_lua_profile(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+   cpu_profile(cpu, lua_toboolean(state, 2));
+   return 0;
+}
+
+static int cpu_lua_profileOpcode(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+   if (cpu->profile == NULL || lua_type(state, 2) != LUA_TNUMBER) {
+      return 0;
+   }
+   uint8_t opcode = lua_tointeger(state, 2);
+   lua_pushnumber(state, cpu->profile->opcode_count[opcode]);
+   lua_pushnumber(state, cpu->profile->opcode_cycles[opcode]);
+   return 2;
+}
+
+static int cpu_lua_profilePage(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+   if (cpu->profile == NULL || lua_type(state, 2) != LUA_TNUMBER) {
+      return 0;
+   }
+   lua_pushnumber(state, cpu->profile->page_cycles[(uint8_t) lua_tointeger(state, 2)]);
+   return 1;
+}
+
+static int cpu_lua_profileAt(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+   if (cpu->profile == NULL || lua_type(state, 2) != LUA_TNUMBER) {
+      return 0;
+   }
+   lua_pushnumber(state, cpu->profile->pc_cycles[(uint16_t) lua_tointeger(state, 2)]);
+   return 1;
+}
+
 // cpu module functions
 
 // onBeforeExecution(op, fn)
@@ -638,7 +1581,7 @@ static int cpu_lua_onBeforeExecuteInstruction(lua_State *state) {
    uint8_t opcode = lua_tointeger(state, 2);
 
    lua_pushvalue(state, 3);
-   cpu->instructions[opcode].lua_before_handler = luaL_ref(state, LUA_REGISTRYINDEX);
+   cpu_lua_hooks(cpu)->before[opcode] = luaL_ref(state, LUA_REGISTRYINDEX);
 
    return 0;
 }
@@ -666,7 +1609,72 @@ static int cpu_lua_onAfterExecuteInstruction(lua_State *state) {
    uint8_t opcode = lua_tointeger(state, 2);
 
    lua_pushvalue(state, 3);
-   cpu->instructions[opcode].lua_after_handler = luaL_ref(state, LUA_REGISTRYINDEX);
+   cpu_lua_hooks(cpu)->after[opcode] = luaL_ref(state, LUA_REGISTRYINDEX);
+
+   return 0;
+}
+
+// Watches. The function of a watch is called with the cpu, the address
+// and the value, see cpu_watch(). Returns an id for unwatch(id).
+
+static void cpu_lua_watch_handler(struct cpu_t *cpu, void *obj, uint16_t addr, uint8_t value) {
+   lua_rawgeti(cpu->lua->state, LUA_REGISTRYINDEX, (int) (intptr_t) obj);
+   ewm_lua_push_cpu(cpu->lua, cpu);
+   lua_pushinteger(cpu->lua->state, addr);
+   lua_pushinteger(cpu->lua->state, value);
+   if (lua_pcall(cpu->lua->state, 3, 0, 0) != 0) {
+      printf("cpu: script error: %s\n", lua_tostring(cpu->lua->state, -1));
+   }
+}
+
+static int cpu_lua_watch(lua_State *state, uint8_t kind, int fn) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   uint16_t lo = luaL_checkinteger(state, 2);
+   uint16_t hi = (fn == 3) ? lo : luaL_checkinteger(state, 3);
+   luaL_checktype(state, fn, LUA_TFUNCTION);
+
+   lua_pushvalue(state, fn);
+   int ref = luaL_ref(state, LUA_REGISTRYINDEX);
+
+   int id = cpu_watch(cpu, kind, lo, hi, cpu_lua_watch_handler, (void*) (intptr_t) ref);
+   if (id == -1) {
+      luaL_unref(state, LUA_REGISTRYINDEX, ref);
+      return luaL_error(state, "too many watches");
+   }
+
+   lua_pushinteger(state, id);
+   return 1;
+}
+
+// onExecute(pc, fn)
+static int cpu_lua_onExecute(lua_State *state) {
+   return cpu_lua_watch(state, EWM_CPU_WATCH_EXECUTE, 3);
+}
+
+// onRead(lo, hi, fn)
+static int cpu_lua_onRead(lua_State *state) {
+   return cpu_lua_watch(state, EWM_CPU_WATCH_READ, 4);
+}
+
+// onWrite(lo, hi, fn)
+static int cpu_lua_onWrite(lua_State *state) {
+   return cpu_lua_watch(state, EWM_CPU_WATCH_WRITE, 4);
+}
+
+// unwatch(id)
+static int cpu_lua_unwatch(lua_State *state) {
+   void *cpu_data = luaL_checkudata(state, 1, "cpu_meta_table");
+   struct cpu_t *cpu = *((struct cpu_t**) cpu_data);
+
+   lua_Integer id = luaL_checkinteger(state, 2);
+   if (cpu->watches == NULL || id < 0 || id >= EWM_CPU_MAX_WATCHES || cpu->watches->watches[id].handler != cpu_lua_watch_handler) {
+      return 0;
+   }
+
+   luaL_unref(state, LUA_REGISTRYINDEX, (int) (intptr_t) cpu->watches->watches[id].obj);
+   cpu_unwatch(cpu, id);
 
    return 0;
 }
@@ -678,38 +1686,67 @@ int ewm_cpu_init_lua(struct cpu_t *cpu, struct ewm_lua_t *lua) {
 
    cpu->lua = lua;
 
-   luaL_Reg functions[] = {
-      {"__index", cpu_lua_index},
-      {"__newindex", cpu_lua_newindex},
+   // The cpu.memory userdata and its read/write methods
+
+   luaL_Reg mem_methods[] = {
+      {"read", cpu_lua_mem_read},
+      {"write", cpu_lua_mem_write},
+      {NULL, NULL}
+   };
+   lua_newtable(lua->state);
+   luaL_setfuncs(lua->state, mem_methods, 0);
+
+   luaL_Reg mem_functions[] = {
+      {"__index", cpu_lua_mem_index},
+      {"__newindex", cpu_lua_mem_newindex},
       {NULL, NULL}
    };
-   ewm_lua_register_component(lua, "cpu", functions);
+   luaL_newmetatable(lua->state, "mem_meta_table");
+   lua_pushvalue(lua->state, -2);
+   luaL_setfuncs(lua->state, mem_functions, 1);
+   lua_pop(lua->state, 2);
+
+   void *mem_data = lua_newuserdata(lua->state, sizeof(struct cpu_t*));
+   *((struct cpu_t**) mem_data) = cpu;
+   luaL_getmetatable(lua->state, "mem_meta_table");
+   lua_setmetatable(lua->state, -2);
+
+   // The cpu methods
 
    luaL_Reg cpu_methods[] = {
       {"onBeforeExecuteInstruction", cpu_lua_onBeforeExecuteInstruction},
       {"onAfterExecuteInstruction", cpu_lua_onAfterExecuteInstruction},
+      {"onExecute", cpu_lua_onExecute},
+      {"onRead", cpu_lua_onRead},
+      {"onWrite", cpu_lua_onWrite},
+      {"unwatch", cpu_lua_unwatch},
       {"reset", cpu_lua_reset},
+      {"profile", cpu_lua_profile},
+      {"profileOpcode", cpu_lua_profileOpcode},
+      {"profilePage", cpu_lua_profilePage},
+      {"profileAt", cpu_lua_profileAt},
       {NULL, NULL}
    };
-   ewm_lua_register_component(lua, "cpu_methods", cpu_methods);
-
-   // Register a global cpu instance
-
-   void *cpu_data = lua_newuserdata(lua->state, sizeof(struct cpu_t*));
-   *((struct cpu_t**) cpu_data) = cpu;
-
-   luaL_getmetatable(lua->state, "cpu_meta_table");
-   lua_setmetatable(lua->state, -2);
-   lua_setglobal(lua->state, "cpu");
+   lua_newtable(lua->state);
+   luaL_setfuncs(lua->state, cpu_methods, 0);
 
-   // Register cpu.memory
+   // The cpu metatable, with the methods and cpu.memory as upvalues
 
-   luaL_Reg mem_functions[] = {
-      {"__index", cpu_lua_mem_index},
-      {"__newindex", cpu_lua_mem_newindex},
+   luaL_Reg functions[] = {
+      {"__index", cpu_lua_index},
+      {"__newindex", cpu_lua_newindex},
       {NULL, NULL}
    };
-   ewm_lua_register_component(lua, "mem", mem_functions);
+   luaL_newmetatable(lua->state, "cpu_meta_table");
+   lua_pushvalue(lua->state, -2);
+   lua_pushvalue(lua->state, -4);
+   luaL_setfuncs(lua->state, functions, 2);
+   lua_pop(lua->state, 3);
+
+   // Register a global cpu instance, the same one that hooks are called with
+
+   ewm_lua_push_cpu(lua, cpu);
+   lua_setglobal(lua->state, "cpu");
 
    return 0;
 }
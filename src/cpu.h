@@ -30,16 +30,66 @@
 #define EWM_CPU_MODEL_6502  0
 #define EWM_CPU_MODEL_65C02 1
 
+// The step engine dispatches every instruction through the dispatch
+// table and is what cpu_step() uses. The switch engine runs a loop
+// with all the instruction handlers inlined. The block engine is the
+// switch engine running from a cache of decoded instructions, see blk.h,
+// and is what cpu_create() uses.
+
+#define EWM_CPU_ENGINE_STEP   0
+#define EWM_CPU_ENGINE_SWITCH 1
+#define EWM_CPU_ENGINE_BLOCK  2
+
 #define EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION (-1)
 #define EWM_CPU_ERR_STACK_OVERFLOW            (-2)
 #define EWM_CPU_ERR_STACK_UNDERFLOW           (-3)
 
+#define EWM_CPU_PENDING_IRQ 0x01
+#define EWM_CPU_PENDING_NMI 0x02
+
+#define EWM_CPU_NO_BREAKPOINT (-1)
+
 #define EWM_VECTOR_NMI 0xfffa
 #define EWM_VECTOR_RES 0xfffc
 #define EWM_VECTOR_IRQ 0xfffe
 
+struct cpu_t;
 struct cpu_instruction_t;
+struct cpu_opcode_t;
+struct cpu_lua_hooks_t;
+struct ewm_blk_cache_t;
 struct ewm_lua_t;
+struct ewm_rom_t;
+struct ewm_trace_t;
+struct ewm_snapshot_t;
+struct mem_t;
+
+// By default the status flags are kept in separate fields. Building
+// with EWM_CPU_PACKED_STATUS keeps them as bits of a native P register
+// instead, which makes pushing and pulling the status register cheap.
+// Code should always use cpu_flag() and cpu_set_flag() to access them.
+
+#define EWM_CPU_FLAG_n 0x80
+#define EWM_CPU_FLAG_v 0x40
+#define EWM_CPU_FLAG_b 0x10
+#define EWM_CPU_FLAG_d 0x08
+#define EWM_CPU_FLAG_i 0x04
+#define EWM_CPU_FLAG_z 0x02
+#define EWM_CPU_FLAG_c 0x01
+
+#if defined(EWM_CPU_PACKED_STATUS)
+
+struct cpu_state_t {
+  uint8_t a, x, y, s, sp;
+  uint16_t pc;
+  uint8_t p;
+};
+
+#define cpu_flag(cpu, flag) ((cpu)->state.p & EWM_CPU_FLAG_##flag)
+#define cpu_set_flag(cpu, flag, value) \
+   ((cpu)->state.p = ((cpu)->state.p & ~EWM_CPU_FLAG_##flag) | ((value) ? EWM_CPU_FLAG_##flag : 0))
+
+#else
 
 struct cpu_state_t {
   uint8_t a, x, y, s, sp;
@@ -47,20 +97,149 @@ struct cpu_state_t {
   uint8_t n, v, b, d, i, z, c;
 };
 
-struct cpu_t {
-   int model;
-   struct cpu_state_t state;
-   FILE *trace;
-   bool strict;
+#define cpu_flag(cpu, flag) ((cpu)->state.flag)
+#define cpu_set_flag(cpu, flag, value) ((cpu)->state.flag = (value))
+
+#endif
+
+// Every 256 byte page of the address space has an entry in both the
+// read and the write page table. If data is set then the page is
+// plain memory that can be accessed directly. Otherwise accesses go
+// through the handlers of mem. If both are NULL then the page is not
+// mapped at all, unless mixed is set, which means multiple regions
+// share the page and we have to walk the memory list.
+//
+// Write pages that end up in RAM point dirty at the byte that RAM
+// keeps for that page, which is set on every write. This includes
+// pages with a handler on top of RAM, like the video pages.
+//
+// Write pages of RAM that the block engine has decoded code from are
+// marked as code, and have their data moved to the read page.
+//
+// Pages with a read or write watch on them are marked as watched and
+// never have data set, so that their accesses go past the watches.
+
+struct cpu_page_t {
+   uint8_t *data;
    struct mem_t *mem;
-   struct cpu_instruction_t *instructions;
+   bool mixed;
+   bool code;
+   bool watched;
+   uint8_t *dirty;
+};
+
+// Bank switched memory, like the language card, picks the regions of
+// its pages itself instead of leaving that to the memory list. A
+// banked page reads from read and writes to write, either of which can
+// be NULL to leave that side unmapped. Both have to cover the page.
+
+struct cpu_bank_t {
+   bool banked;
+   struct mem_t *read;
+   struct mem_t *write;
+};
+
+// Devices that need to do something at a specific point in time, for
+// example a paddle timer running out, schedule an event. cpu_run()
+// always stops at the next event, so that nothing has to poll the
+// cycle counter.
+
+#define EWM_CPU_MAX_EVENTS 32
+
+typedef void (*cpu_event_handler_t)(struct cpu_t *cpu, void *obj);
+
+struct cpu_event_t {
+   uint64_t when;
+   cpu_event_handler_t handler;
+   void *obj;
+};
+
+// Watches call a handler when the cpu executes, reads or writes an
+// address in a range. Every page has a bit per kind of watch that is
+// set if any watch touches it, and a bitmap has a bit per address and
+// kind, so only accesses of watched pages are checked. Read and write
+// handlers get the value that was read or written, execute handlers
+// the opcode, before it is executed. Instruction fetches are reads
+// too. Accesses made by handlers do not trigger watches. Like the
+// profiler, watches do not see stack and zero page pointer accesses
+// through cpu->ram. Execute watches run on the step engine, read and
+// write watches work with all engines.
+
+#define EWM_CPU_WATCH_EXECUTE 0x01
+#define EWM_CPU_WATCH_READ    0x02
+#define EWM_CPU_WATCH_WRITE   0x04
+
+#define EWM_CPU_MAX_WATCHES 64
+
+typedef void (*cpu_watch_handler_t)(struct cpu_t *cpu, void *obj, uint16_t addr, uint8_t value);
+
+struct cpu_watch_t {
+   uint8_t kind;
+   uint16_t lo, hi;
+   cpu_watch_handler_t handler; // NULL if the slot is free
+   void *obj;
+};
+
+struct cpu_watches_t {
+   uint8_t pages[256];
+   uint8_t bits[3][64 * 1024 / 8]; // Execute, read and write
+   uint8_t kinds;                  // Kinds of all watches together
+   bool active;                    // Set while a handler runs
+   struct cpu_watch_t watches[EWM_CPU_MAX_WATCHES];
+};
+
+// The profiler counts executed instructions and cycles per opcode, per
+// page and per pc. While profiling, the page table sends all accesses
+// through the memory handlers, where they are counted per region.
+// Stack and zero page pointer accesses through cpu->ram are not seen.
+
+struct cpu_profile_t {
+   uint64_t instructions;
+   uint64_t cycles;
+   uint64_t opcode_count[256];
+   uint64_t opcode_cycles[256];
+   uint64_t page_cycles[256];
+   uint32_t pc_cycles[64 * 1024];
+};
+
+// The fields that the engines touch on every instruction all fit in
+// the first cache line, everything else comes after.
+
+struct cpu_t {
+   _Alignas(64) struct cpu_state_t state;
+   uint8_t pending;
+   int breakpoint;
    uint64_t counter;
 
+   // The engines run until counter reaches deadline. Setting it to
+   // zero ends the current cpu_run() slice at the next instruction.
+   uint64_t deadline;
+
    uint8_t *ram;
+   struct cpu_opcode_t *opcodes;   // What the step engine needs of each opcode
+   struct ewm_blk_cache_t *blocks; // NULL unless on the block engine
+
+   int model;
+   int engine;
+   struct ewm_trace_t *trace; // Owned by the machine
+   struct cpu_profile_t *profile; // NULL unless profiling
+   struct cpu_watches_t *watches; // NULL until the first watch
+   bool strict;
+   struct mem_t *mem;
+   const struct cpu_instruction_t *instructions; // Names and stack use, for everything but running
    size_t ram_size;
 
+   // Min-heap of scheduled events, ordered by when
+   struct cpu_event_t events[EWM_CPU_MAX_EVENTS];
+   int event_count;
+
+   struct cpu_page_t read_pages[256];
+   struct cpu_page_t write_pages[256];
+   struct cpu_bank_t banks[256];
+
 #if defined(EWM_LUA)
    struct ewm_lua_t *lua;
+   struct cpu_lua_hooks_t *lua_hooks;
 #endif
 };
 
@@ -83,6 +262,10 @@ struct mem_t {
   mem_read_handler_t read_handler;
   mem_write_handler_t write_handler;
   char *description;
+  uint8_t *dirty; // One byte per page of RAM, cleared by whoever looks at it
+  bool owned;     // Set if obj was allocated by the cpu and goes with it
+  struct ewm_rom_t *rom; // Set if obj is a shared image from the rom cache
+  uint64_t reads, writes; // Accesses that went through the handlers
   struct mem_t *next;
 };
 
@@ -100,6 +283,7 @@ uint8_t _cpu_get_status(struct cpu_t *cpu);
 void _cpu_set_status(struct cpu_t *cpu, uint8_t status);
 
 struct cpu_t *cpu_create(int model);
+struct cpu_t *cpu_create_with_engine(int model, int engine);
 void cpu_destroy(struct cpu_t *cpu);
 
 struct mem_t *cpu_add_mem(struct cpu_t *cpu, struct mem_t *mem);
@@ -110,17 +294,84 @@ struct mem_t *cpu_add_rom_data(struct cpu_t *cpu, uint16_t start, uint16_t end,
 struct mem_t *cpu_add_rom_file(struct cpu_t *cpu, uint16_t start, char *path);
 struct mem_t *cpu_add_iom(struct cpu_t *cpu, uint16_t start, uint16_t end, void *obj, mem_read_handler_t read_handler, mem_write_handler_t write_handler);
 
+// Must be called after changing the enabled or flags fields of a
+// memory region, so that the page table is updated.
+void cpu_remap_mem(struct cpu_t *cpu, struct mem_t *mem);
+
+// Maps a page as banked, see cpu_bank_t. Mapping the same regions
+// again does nothing, so a switch can simply map all its pages.
+void cpu_map_bank(struct cpu_t *cpu, uint8_t page, struct mem_t *read, struct mem_t *write);
+
 void cpu_optimize_memory(struct cpu_t *cpu);
 
 void cpu_strict(struct cpu_t *cpu, bool strict);
-int cpu_trace(struct cpu_t *cpu, char *path);
+void cpu_trace(struct cpu_t *cpu, struct ewm_trace_t *trace);
+
+// Starting the profiler clears all counters. Like tracing, profiling
+// runs on the step engine. The report lists the top entries of each
+// kind of counter.
+
+#define EWM_CPU_PROFILE_TOP (20)
+
+int cpu_profile(struct cpu_t *cpu, bool enabled);
+void cpu_profile_report(struct cpu_t *cpu, FILE *fp, int top);
 
 void cpu_reset(struct cpu_t *cpu);
+int cpu_brk(struct cpu_t *cpu);
 int cpu_irq(struct cpu_t *cpu);
 int cpu_nmi(struct cpu_t *cpu);
 
 int cpu_step(struct cpu_t *cpu);
 
+// Run instructions for a slice of the given number of cycles. Returns
+// the number of cycles executed, which is less than requested if the
+// cpu stopped at the breakpoint, or a negative EWM_CPU_ERR_* value.
+// Interrupts requested during the slice are serviced by cpu_run().
+int cpu_run(struct cpu_t *cpu, int cycles);
+
+// Adds a watch of the given kind for lo to hi. Returns an id for
+// cpu_unwatch(), or -1 if there are too many watches.
+int cpu_watch(struct cpu_t *cpu, uint8_t kind, uint16_t lo, uint16_t hi, cpu_watch_handler_t handler, void *obj);
+void cpu_unwatch(struct cpu_t *cpu, int id);
+
+// Called by mem_get_byte() and mem_set_byte() after an access of a
+// watched page, with kind EWM_CPU_WATCH_READ or EWM_CPU_WATCH_WRITE.
+void cpu_watched(struct cpu_t *cpu, uint8_t kind, uint16_t addr, uint8_t value);
+
+void cpu_request_irq(struct cpu_t *cpu);
+void cpu_request_nmi(struct cpu_t *cpu);
+void cpu_set_breakpoint(struct cpu_t *cpu, int addr);
+
+// Idle loops. A device that sees the cpu poll it in a loop without
+// other side effects can skip iterations of that loop by advancing the
+// counter. cpu_idle_cycles() returns how many cycles it may skip from
+// inside a read handler, which is zero outside of cpu_run(), while
+// something needs to see every instruction, or if the breakpoint is
+// between start and end. Remaining short of the deadline guarantees
+// that the slice ends in exactly the same state as without skipping.
+uint64_t cpu_idle_cycles(struct cpu_t *cpu, uint16_t start, uint16_t end);
+
+// Base number of cycles of an instruction of the model
+uint8_t cpu_instruction_cycles(struct cpu_t *cpu, uint8_t opcode);
+
+// Skips the most common idle loop, a load or bit test of addr followed
+// by a BPL back to it, from inside the read handler of addr. Returns
+// true if it did.
+bool cpu_skip_poll_loop(struct cpu_t *cpu, uint16_t addr);
+
+// Schedule handler to be called with obj after the given number of
+// cycles. An event with the same handler and obj that is already
+// scheduled is replaced. Returns -1 if the event queue is full.
+int cpu_schedule(struct cpu_t *cpu, uint64_t delay, cpu_event_handler_t handler, void *obj);
+void cpu_cancel(struct cpu_t *cpu, cpu_event_handler_t handler, void *obj);
+
+// Returns the cycle at which the event is scheduled, or zero if it is
+// not scheduled.
+uint64_t cpu_scheduled(struct cpu_t *cpu, cpu_event_handler_t handler, void *obj);
+
+int cpu_save_snapshot(struct cpu_t *cpu, struct ewm_snapshot_t *snapshot);
+int cpu_load_snapshot(struct cpu_t *cpu, struct ewm_snapshot_t *snapshot);
+
 uint16_t cpu_memory_get_word(struct cpu_t *cpu, uint16_t addr);
 uint8_t cpu_memory_get_byte(struct cpu_t *cpu, uint16_t addr);
 
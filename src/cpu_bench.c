@@ -20,6 +20,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -32,10 +34,10 @@
 
 #define CPU_BENCH_ITERATIONS (10 * 1000 * 1000)
 
-void test(struct cpu_t *cpu, uint8_t opcode) {
+uint64_t test(struct cpu_t *cpu, uint8_t opcode) {
    uint64_t runs[3];
 
-   struct cpu_instruction_t *ins = &cpu->instructions[opcode];
+   const struct cpu_instruction_t *ins = &cpu->instructions[opcode];
 
    for (int run = 0; run < 3; run++) {
       struct timespec start;
@@ -74,27 +76,142 @@ void test(struct cpu_t *cpu, uint8_t opcode) {
       runs[run] = duration_ms;
    }
 
-   printf("$%.2X %s %8llu %8llu %8llu -> %8llu\n",
-          opcode, ins->name, runs[0], runs[1], runs[2],
-          (runs[0] + runs[1] + runs[2]) / 3);
+   uint64_t average = (runs[0] + runs[1] + runs[2]) / 3;
+
+   printf("$%.2X %s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " -> %8" PRIu64 "\n",
+          opcode, ins->name, runs[0], runs[1], runs[2], average);
+
+   return average;
+}
+
+// The footprint run executes a long straight line of common opcodes,
+// picked at random, so that a good part of the dispatch table and the
+// handlers has to stay in the L1 cache. It reports how much memory the
+// engines touch for dispatch and how fast each engine runs the code.
+// Branches jump to the next instruction, so that they keep the line
+// straight while still costing a cycle more when they are taken.
+
+#define CPU_BENCH_FOOTPRINT_START  (0x1000)
+#define CPU_BENCH_FOOTPRINT_END    (0x7000)
+#define CPU_BENCH_FOOTPRINT_CYCLES (100 * 1000 * 1000)
+
+static const uint8_t footprint_opcodes[] = {
+   0xa9, 0xa2, 0xa0, 0x69, 0xe9, 0x29, 0x09, 0x49, 0xc9, 0xe0, 0xc0, // Immediate
+   0xe8, 0xc8, 0xca, 0x88, 0xaa, 0xa8, 0x8a, 0x98, 0x18, 0x38, 0xb8, // Implied
+   0xea, 0x0a, 0x4a, 0x2a, 0x6a,
+   0xa5, 0x85, 0xe6, 0xc6, 0x24, 0xb5, 0x65, 0x05,                   // Zero page
+   0xad, 0x8d, 0x6d, 0xcd, 0x9d, 0xbd, 0xb9, 0x2e,                   // Absolute
+   0xb1,                                                             // Indirect
+   0xd0, 0xf0, 0x10, 0x30, 0x90, 0xb0                                // Branches
+};
+
+static bool footprint_is_branch(uint8_t opcode) {
+   return (opcode & 0x1f) == 0x10;
+}
+
+// Returns the number of instructions in the loop
+
+static int footprint_program(struct cpu_t *cpu) {
+   srandom(6502);
+   uint16_t addr = CPU_BENCH_FOOTPRINT_START;
+   int count = 2;
+   mem_set_byte(cpu, addr++, 0xd8); // CLD
+   while (addr < CPU_BENCH_FOOTPRINT_END) {
+      uint8_t opcode = footprint_opcodes[random() % sizeof(footprint_opcodes)];
+      mem_set_byte(cpu, addr++, opcode);
+      count++;
+      switch (cpu->opcodes[opcode].bytes) {
+         case 2:
+            if (footprint_is_branch(opcode)) {
+               mem_set_byte(cpu, addr++, 0x00);
+            } else {
+               mem_set_byte(cpu, addr++, 0x10 + (random() & 0x3f)); // Also used as zero page address
+            }
+            break;
+         case 3:
+            mem_set_word(cpu, addr, 0x8000 + (random() & 0xff));
+            addr += 2;
+            break;
+      }
+   }
+   mem_set_byte(cpu, addr++, 0x4c); // JMP START
+   mem_set_word(cpu, addr, CPU_BENCH_FOOTPRINT_START);
+   return count;
+}
+
+static void footprint(void) {
+   printf("cpu_t           %5zu bytes, hot fields in the first %zu\n", sizeof(struct cpu_t),
+          offsetof(struct cpu_t, blocks) + sizeof(void*));
+   printf("opcode table    %5zu bytes, %zu per opcode\n", 256 * sizeof(struct cpu_opcode_t), sizeof(struct cpu_opcode_t));
+   printf("instructions    %5zu bytes, %zu per opcode\n", sizeof(instructions), sizeof(struct cpu_instruction_t));
+
+   int engines[] = { EWM_CPU_ENGINE_STEP, EWM_CPU_ENGINE_SWITCH, EWM_CPU_ENGINE_BLOCK };
+   char *names[] = { "step", "switch", "block" };
+
+   for (int e = 0; e < 3; e++) {
+      struct cpu_t *cpu = cpu_create_with_engine(EWM_CPU_MODEL_6502, engines[e]);
+      cpu_add_ram_data(cpu, 0, 0xffff, calloc(0x10000, 1));
+      cpu_reset(cpu);
+      int count = footprint_program(cpu);
+      cpu->state.pc = CPU_BENCH_FOOTPRINT_START;
+
+      // MHz depends on how many cycles the instructions take, so also
+      // report millions of instructions per second, from one pass
+      cpu_set_breakpoint(cpu, CPU_BENCH_FOOTPRINT_START);
+      int pass = cpu_run(cpu, CPU_BENCH_FOOTPRINT_CYCLES);
+      cpu_set_breakpoint(cpu, EWM_CPU_NO_BREAKPOINT);
+
+      double best = 0.0;
+      for (int run = 0; run < 3; run++) {
+         struct timespec start, now;
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         cpu_run(cpu, CPU_BENCH_FOOTPRINT_CYCLES);
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         double duration = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+         double mhz = CPU_BENCH_FOOTPRINT_CYCLES / duration / 1000000.0;
+         if (mhz > best) {
+            best = mhz;
+         }
+      }
+
+      printf("footprint %-6s %8.2f MHz %8.2f MIPS, %.2f cycles per instruction\n", names[e], best,
+             best * count / pass, (double) pass / count);
+      cpu_destroy(cpu);
+      free(cpu);
+   }
 }
 
 int main(int argc, char **argv) {
+   if (argc == 2 && strcmp(argv[1], "--footprint") == 0) {
+      footprint();
+      return 0;
+   }
+
    struct cpu_t *cpu = cpu_create(EWM_CPU_MODEL_65C02);
-   cpu_add_ram_data(cpu, 0, 0xffff, malloc(0xffff));
+   cpu_add_ram_data(cpu, 0, 0xffff, calloc(0x10000, 1));
    cpu_reset(cpu);
 
+#if defined(EWM_CPU_PACKED_STATUS)
+   printf("Status flags: packed\n");
+#else
+   printf("Status flags: separate\n");
+#endif
+
+   uint64_t total = 0;
+
    if (argc > 1) {
       for (int i = 1; i < argc; i++) {
          for (int opcode = 0; opcode <= 255; opcode++) {
             if (strcmp(cpu->instructions[opcode].name, argv[i]) == 0) {
-               test(cpu, opcode);
+               total += test(cpu, opcode);
             }
          }
       }
    } else {
       for (int opcode = 0; opcode <= 255; opcode++) {
-         test(cpu, opcode);
+         total += test(cpu, opcode);
       }
    }
+
+   printf("Total %" PRIu64 "\n", total);
 }
@@ -20,112 +20,662 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <getopt.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
 #include "cpu.h"
+#include "ins.h"
 #include "mem.h"
+#include "thr.h"
 #include "utl.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
 
-int test(int model, uint16_t start_addr, uint16_t success_addr, char *rom_path, int with_lua) {
-   struct cpu_t *cpu = cpu_create(model);
-   cpu_add_ram_file(cpu, 0x0000, rom_path);
+// Every combination of test ROM and engine is a job on the thread pool.
+// Output of a job is kept in memory and printed after all jobs are done,
+// in the order of the jobs.
+
+struct test_t {
+   char *name;
+   int model;
+   int engine;
+   uint16_t start_addr;
+   uint16_t success_addr;
+   char *rom_path;
+   int with_lua;
+   int result;
+   char *output;
+   size_t output_size;
+};
+
+// The test ROMs end in a JMP to itself on success and in a branch to
+// itself on failure. Instead of checking after every instruction we
+// run in short slices and then look at where the cpu ended up. The
+// success address is set as a breakpoint so that we stop exactly
+// there. Since the tests are full of branches to self that are not
+// taken, we step once more to see if the branch actually loops.
+
+#define TEST_SLICE_CYCLES 1000
+
+static bool test_is_deadlock(struct cpu_t *cpu) {
+   uint16_t pc = cpu->state.pc;
+   uint8_t i = mem_get_byte(cpu, pc);
+   if (i == 0x10 || i == 0x30 || i == 0x50 || i == 0x70 || i == 0x90 || i == 0xb0 || i == 0xd0 || i == 0xf0) {
+      if (mem_get_byte(cpu, pc + 1) == 0xfe) {
+         (void) cpu_step(cpu);
+         return cpu->state.pc == pc;
+      }
+   }
+   return false;
+}
+
+static void test_destroy_cpu(struct cpu_t *cpu) {
+   if (cpu != NULL) {
+#if defined(EWM_LUA)
+      if (cpu->lua != NULL) {
+         ewm_lua_destroy(cpu->lua);
+      }
+#endif
+      cpu_destroy(cpu);
+      free(cpu);
+   }
+}
+
+static struct cpu_t *test_create_cpu(struct test_t *t, int engine) {
+   struct cpu_t *cpu = cpu_create_with_engine(t->model, engine);
+   if (cpu == NULL) {
+      return NULL;
+   }
+   if (cpu_add_ram_file(cpu, 0x0000, t->rom_path) == NULL) {
+      test_destroy_cpu(cpu);
+      return NULL;
+   }
    cpu_reset(cpu);
-   cpu->state.pc = start_addr;
+   cpu->state.pc = t->start_addr;
+   return cpu;
+}
+
+static double test_seconds(struct timespec *start) {
+   struct timespec now;
+   if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+      perror("Cannot get time");
+      exit(1);
+   }
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static int test(struct test_t *t, FILE *out) {
+   struct cpu_t *cpu = test_create_cpu(t, t->engine);
+   if (cpu == NULL) {
+      fprintf(out, "TEST   Cannot load %s\n", t->rom_path);
+      return -1;
+   }
+
+   int result = -1;
+   cpu_set_breakpoint(cpu, t->success_addr);
 
 #if defined(EWM_LUA)
-   if (with_lua) {
+   if (t->with_lua) {
       cpu->lua = ewm_lua_create();
       ewm_cpu_init_lua(cpu, cpu->lua);
 
       if (ewm_lua_load_script(cpu->lua, "cpu_test.lua") != 0) {
-         printf("Lua script failed to load\n"); // TODO Move errors reporting into C code
-         exit(1);
+         fprintf(out, "TEST   Lua script failed to load\n");
+         goto done;
       }
    }
 #endif
-   
-   uint16_t last_pc = cpu->state.pc;
 
    struct timespec start;
-   if (clock_gettime(CLOCK_REALTIME, &start) != 0) {
+   if (clock_gettime(CLOCK_MONOTONIC, &start) != 0) {
       perror("Cannot get time");
       exit(1);
    }
 
    while (true) {
-      int ret = cpu_step(cpu);
+      int ret = cpu_run(cpu, TEST_SLICE_CYCLES);
       if (ret < 0) {
          switch (ret) {
             case EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION:
-               fprintf(stderr, "TEST   Unimplemented instruction 0x%.2x at 0x%.4x\n",
+               fprintf(out, "TEST   Unimplemented instruction 0x%.2x at 0x%.4x\n",
                        mem_get_byte(cpu, cpu->state.pc), cpu->state.pc);
-               return -1;
+               goto done;
             default:
-               fprintf(stderr, "TEST   Unexpected error %d\n", ret);
-               return -1;
+               fprintf(out, "TEST   Unexpected error %d\n", ret);
+               goto done;
          }
       }
 
-      // End of the tests is at 0x3399. This is hard coded and not
-      // ideal. Is there a better way to detect this?
+      // The success addresses are hard coded and not ideal. Is there a
+      // better way to detect this?
+
+      if (cpu->state.pc == t->success_addr) {
+         double duration = test_seconds(&start);
+         double mhz = (double) cpu->counter / duration / 1000000.0;
+         fprintf(out, "TEST   Success; executed %" PRIu64 " cycles in %.4f at %.4f MHz\n",
+                 cpu->counter, duration, mhz);
+         result = 0;
+         goto done;
+      }
+
+      if (test_is_deadlock(cpu)) {
+         fprintf(out, "TEST   Failure at 0x%.4x \n", cpu->state.pc);
+         goto done;
+      }
+   }
+
+done:
+   test_destroy_cpu(cpu);
+   return result;
+}
+
+// In lockstep mode the engine runs next to the step engine, one
+// instruction at a time. After every instruction the registers and the
+// cycle counter have to be the same, and so do the bytes that the step
+// engine wrote. Its writes are logged through a watch on all of memory.
+// The engine itself runs without watches, which would keep blocks from
+// being cached, so writes it should not have done are only found by
+// comparing all of memory every TEST_LOCKSTEP_COMPARE instructions.
+
+#define TEST_LOG_SIZE 8
+#define TEST_LOCKSTEP_COMPARE 4096
+
+struct test_log_t {
+   int count;
+   uint16_t addr[TEST_LOG_SIZE];
+   uint8_t value[TEST_LOG_SIZE];
+};
+
+static void test_log_write(struct cpu_t *cpu, void *obj, uint16_t addr, uint8_t value) {
+   struct test_log_t *log = (struct test_log_t*) obj;
+   if (log->count < TEST_LOG_SIZE) {
+      log->addr[log->count] = addr;
+      log->value[log->count] = value;
+      log->count++;
+   }
+}
+
+static bool test_same_state(struct cpu_t *a, struct cpu_t *b) {
+   return a->state.a == b->state.a && a->state.x == b->state.x && a->state.y == b->state.y
+      && a->state.sp == b->state.sp && a->state.pc == b->state.pc
+      && _cpu_get_status(a) == _cpu_get_status(b) && a->counter == b->counter;
+}
+
+// Only the last write to an address counts, an instruction may write
+// the same address twice.
+
+static bool test_same_writes(struct test_log_t *log, struct cpu_t *cpu) {
+   for (int i = 0; i < log->count; i++) {
+      bool last = true;
+      for (int j = i + 1; j < log->count; j++) {
+         last &= log->addr[j] != log->addr[i];
+      }
+      if (last && cpu->ram[log->addr[i]] != log->value[i]) {
+         return false;
+      }
+   }
+   return true;
+}
+
+static void test_print_state(FILE *out, char *name, struct cpu_t *cpu, struct test_log_t *log) {
+   fprintf(out, "TEST     %-6s PC=%.4X A=%.2X X=%.2X Y=%.2X S=%.2X P=%.2X cycles=%" PRIu64,
+           name, cpu->state.pc, cpu->state.a, cpu->state.x, cpu->state.y, cpu->state.sp,
+           _cpu_get_status(cpu), cpu->counter);
+   for (int i = 0; i < log->count; i++) {
+      fprintf(out, " %.4X=%.2X", log->addr[i], cpu->ram[log->addr[i]]);
+   }
+   fputc('\n', out);
+}
 
-      if (cpu->state.pc == success_addr) {
-	 struct timespec now;
-	 if (clock_gettime(CLOCK_REALTIME, &now) != 0) {
-	    perror("Cannot get time");
-	    exit(1);
-	 }
+static int test_compare_memory(struct cpu_t *reference, struct cpu_t *cpu, FILE *out, uint64_t instructions) {
+   if (memcmp(reference->ram, cpu->ram, 0x10000) == 0) {
+      return 0;
+   }
+   int addr = 0;
+   while (reference->ram[addr] == cpu->ram[addr]) {
+      addr++;
+   }
+   fprintf(out, "TEST   Memory at 0x%.4x differs after instruction %" PRIu64 ", written in the last %d instructions\n",
+           addr, instructions, TEST_LOCKSTEP_COMPARE);
+   return -1;
+}
 
-	 // Taking a shortcut here because our test will never run so
-	 // long that it will overflow an uint64_t
+static int test_lockstep(struct test_t *t, FILE *out) {
+   struct cpu_t *reference = test_create_cpu(t, EWM_CPU_ENGINE_STEP);
+   struct cpu_t *cpu = test_create_cpu(t, t->engine);
+   int result = -1;
+   if (reference == NULL || cpu == NULL) {
+      fprintf(out, "TEST   Cannot load %s\n", t->rom_path);
+      goto done;
+   }
 
-	 uint64_t duration_ms = (now.tv_sec * 1000 + (now.tv_nsec / 1000000))
-	    - (start.tv_sec * 1000 + (start.tv_nsec / 1000000));
-	 double duration  = (double) duration_ms / 1000.0;
-	 double mhz = (double) cpu->counter * (1.0 / duration) / 1000000.0;
-	 
-	 fprintf(stderr, "TEST   Success; executed %" PRIu64 " cycles in %.4f at %.4f MHz\n",
-		 cpu->counter, duration, mhz);
+   struct test_log_t log;
+   if (cpu_watch(reference, EWM_CPU_WATCH_WRITE, 0x0000, 0xffff, test_log_write, &log) == -1) {
+      fprintf(out, "TEST   Cannot watch memory\n");
+      goto done;
+   }
 
-         return 0;
+   struct timespec start;
+   if (clock_gettime(CLOCK_MONOTONIC, &start) != 0) {
+      perror("Cannot get time");
+      exit(1);
+   }
+
+   // Every engine stops at the deadline after a single instruction
+   uint64_t instructions = 0;
+   while (true) {
+      uint16_t pc = reference->state.pc;
+
+      log.count = 0;
+      int reference_ret = cpu_run(reference, 1);
+      int ret = cpu_run(cpu, 1);
+      if (reference_ret < 0 || ret < 0) {
+         fprintf(out, "TEST   Error %d and %d at 0x%.4x\n", reference_ret, ret, pc);
+         goto done;
+      }
+      instructions++;
+
+      if (!test_same_state(reference, cpu) || !test_same_writes(&log, cpu)) {
+         fprintf(out, "TEST   Engines differ after instruction %" PRIu64 " at 0x%.4x\n", instructions, pc);
+         test_print_state(out, "step", reference, &log);
+         test_print_state(out, t->name, cpu, &log);
+         goto done;
       }
 
-      // We detect a test failure because we are in a branch deadlock,
-      // which we can easily detect by remembering the previous pc and
-      // then looking at what we are about to execute.
+      if ((instructions % TEST_LOCKSTEP_COMPARE) == 0 && test_compare_memory(reference, cpu, out, instructions) != 0) {
+         goto done;
+      }
+
+      if (reference->state.pc == pc) {
+         break;
+      }
+   }
+
+   if (test_compare_memory(reference, cpu, out, instructions) != 0) {
+      goto done;
+   }
+
+   if (reference->state.pc != t->success_addr) {
+      fprintf(out, "TEST   Failure at 0x%.4x \n", reference->state.pc);
+      goto done;
+   }
+
+   fprintf(out, "TEST   Success; %" PRIu64 " instructions in lockstep in %.4f\n", instructions, test_seconds(&start));
+   result = 0;
 
-      if (cpu->state.pc == last_pc) {
-         uint8_t i = mem_get_byte(cpu, cpu->state.pc);
-         if (i == 0x10 || i == 0x30 || i == 0x50 || i == 0x70 || i == 0x90 || i == 0xb0 || i == 0xd0 || i == 0xf0) {
-            if (mem_get_byte(cpu, cpu->state.pc + 1) == 0xfe) {
-               fprintf(stderr, "TEST   Failure at 0x%.4x \n", cpu->state.pc);
+done:
+   test_destroy_cpu(reference);
+   test_destroy_cpu(cpu);
+   return result;
+}
+
+// Cycle timing. Each case runs a single instruction on every engine
+// and checks the cycles it took, to cover what the test ROMs do not:
+// page crossings, taken branches and the differences between models.
+// The instruction is at pc, the pointer at $80 points to $10FF.
+
+struct test_timing_t {
+   char *name;
+   int model;
+   uint16_t pc;
+   uint8_t code[3];
+   uint8_t x, y, p;
+   int cycles;
+};
+
+#define TEST_TIMING_N (0x80)
+#define TEST_TIMING_V (0x40)
+#define TEST_TIMING_D (0x08)
+#define TEST_TIMING_Z (0x02)
+#define TEST_TIMING_C (0x01)
+
+static struct test_timing_t test_timings[] = {
+   { "LDA abs,X",            EWM_CPU_MODEL_6502,  0x0200, { 0xbd, 0xff, 0x10 }, 0, 0, 0, 4 },
+   { "LDA abs,X crossing",   EWM_CPU_MODEL_6502,  0x0200, { 0xbd, 0xff, 0x10 }, 1, 0, 0, 5 },
+   { "LDA abs,Y crossing",   EWM_CPU_MODEL_6502,  0x0200, { 0xb9, 0xff, 0x10 }, 0, 1, 0, 5 },
+   { "LDA (zp),Y",           EWM_CPU_MODEL_6502,  0x0200, { 0xb1, 0x80, 0x00 }, 0, 0, 0, 5 },
+   { "LDA (zp),Y crossing",  EWM_CPU_MODEL_6502,  0x0200, { 0xb1, 0x80, 0x00 }, 0, 1, 0, 6 },
+   { "STA abs,X",            EWM_CPU_MODEL_6502,  0x0200, { 0x9d, 0xff, 0x10 }, 0, 0, 0, 5 },
+   { "STA abs,X crossing",   EWM_CPU_MODEL_6502,  0x0200, { 0x9d, 0xff, 0x10 }, 1, 0, 0, 5 },
+   { "STA (zp),Y crossing",  EWM_CPU_MODEL_6502,  0x0200, { 0x91, 0x80, 0x00 }, 0, 1, 0, 6 },
+   { "INC abs,X crossing",   EWM_CPU_MODEL_6502,  0x0200, { 0xfe, 0xff, 0x10 }, 1, 0, 0, 7 },
+   { "BNE not taken",        EWM_CPU_MODEL_6502,  0x0200, { 0xd0, 0x10, 0x00 }, 0, 0, TEST_TIMING_Z, 2 },
+   { "BNE taken",            EWM_CPU_MODEL_6502,  0x0200, { 0xd0, 0x10, 0x00 }, 0, 0, 0, 3 },
+   { "BNE taken crossing",   EWM_CPU_MODEL_6502,  0x02fc, { 0xd0, 0x10, 0x00 }, 0, 0, 0, 4 },
+   { "BNE back crossing",    EWM_CPU_MODEL_6502,  0x0300, { 0xd0, 0xfc, 0x00 }, 0, 0, 0, 4 },
+   { "ADC decimal",          EWM_CPU_MODEL_6502,  0x0200, { 0x69, 0x01, 0x00 }, 0, 0, TEST_TIMING_D, 2 },
+   { "SBC zpg",              EWM_CPU_MODEL_6502,  0x0200, { 0xe5, 0x80, 0x00 }, 0, 0, 0, 3 },
+   { "SBC abs",              EWM_CPU_MODEL_6502,  0x0200, { 0xed, 0xff, 0x10 }, 0, 0, 0, 4 },
+   { "SBC abs,X crossing",   EWM_CPU_MODEL_6502,  0x0200, { 0xfd, 0xff, 0x10 }, 1, 0, 0, 5 },
+   { "SBC (zp),Y",           EWM_CPU_MODEL_6502,  0x0200, { 0xf1, 0x80, 0x00 }, 0, 0, 0, 5 },
+   { "SBC (zp),Y crossing",  EWM_CPU_MODEL_6502,  0x0200, { 0xf1, 0x80, 0x00 }, 0, 1, 0, 6 },
+   { "JMP (abs)",            EWM_CPU_MODEL_6502,  0x0200, { 0x6c, 0xff, 0x10 }, 0, 0, 0, 5 },
+   { "LDA abs,X crossing",   EWM_CPU_MODEL_65C02, 0x0200, { 0xbd, 0xff, 0x10 }, 1, 0, 0, 5 },
+   { "BRA",                  EWM_CPU_MODEL_65C02, 0x0200, { 0x80, 0x10, 0x00 }, 0, 0, 0, 3 },
+   { "BRA crossing",         EWM_CPU_MODEL_65C02, 0x02fc, { 0x80, 0x10, 0x00 }, 0, 0, 0, 4 },
+   { "ADC decimal",          EWM_CPU_MODEL_65C02, 0x0200, { 0x69, 0x01, 0x00 }, 0, 0, TEST_TIMING_D, 3 },
+   { "SBC decimal",          EWM_CPU_MODEL_65C02, 0x0200, { 0xe9, 0x01, 0x00 }, 0, 0, TEST_TIMING_D, 3 },
+   { "SBC abs",              EWM_CPU_MODEL_65C02, 0x0200, { 0xed, 0xff, 0x10 }, 0, 0, 0, 4 },
+   { "SBC (zp),Y crossing",  EWM_CPU_MODEL_65C02, 0x0200, { 0xf1, 0x80, 0x00 }, 0, 1, 0, 6 },
+   { "BBR0 not taken",       EWM_CPU_MODEL_65C02, 0x0200, { 0x0f, 0x80, 0x10 }, 0, 0, 0, 5 },
+   { "BBS0 taken",           EWM_CPU_MODEL_65C02, 0x0200, { 0x8f, 0x80, 0x10 }, 0, 0, 0, 6 },
+   { "BBS0 taken crossing",  EWM_CPU_MODEL_65C02, 0x02fc, { 0x8f, 0x80, 0x10 }, 0, 0, 0, 7 },
+   { "JMP (abs)",            EWM_CPU_MODEL_65C02, 0x0200, { 0x6c, 0xff, 0x10 }, 0, 0, 0, 6 },
+};
+
+// The base cycles of every documented opcode, without page crossings
+// or taken branches, and 0 for the opcodes that are not documented.
+
+static const uint8_t test_base_cycles_6502[256] = {
+   7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0, // 00
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 10
+   6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0, // 20
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 30
+   6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0, // 40
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 50
+   6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0, // 60
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 70
+   0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0, // 80
+   2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0, // 90
+   2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // A0
+   2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0, // B0
+   2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // C0
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // D0
+   2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // E0
+   2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // F0
+};
+
+static const uint8_t test_base_cycles_65C02[256] = {
+   7, 6, 0, 0, 5, 3, 5, 5, 3, 2, 2, 0, 6, 4, 6, 5, // 00
+   2, 5, 5, 0, 5, 4, 6, 5, 2, 4, 2, 0, 6, 4, 7, 5, // 10
+   6, 6, 0, 0, 3, 3, 5, 5, 4, 2, 2, 0, 4, 4, 6, 5, // 20
+   2, 5, 5, 0, 4, 4, 6, 5, 2, 4, 2, 0, 4, 4, 7, 5, // 30
+   6, 6, 0, 0, 0, 3, 5, 5, 3, 2, 2, 0, 3, 4, 6, 5, // 40
+   2, 5, 5, 0, 0, 4, 6, 5, 2, 4, 3, 0, 0, 4, 7, 5, // 50
+   6, 6, 0, 0, 3, 3, 5, 5, 4, 2, 2, 0, 6, 4, 6, 5, // 60
+   2, 5, 5, 0, 4, 4, 6, 5, 2, 4, 4, 0, 6, 4, 7, 5, // 70
+   3, 6, 0, 0, 3, 3, 3, 5, 2, 2, 2, 0, 4, 4, 4, 5, // 80
+   2, 6, 5, 0, 4, 4, 4, 5, 2, 5, 2, 0, 4, 5, 5, 5, // 90
+   2, 6, 2, 0, 3, 3, 3, 5, 2, 2, 2, 0, 4, 4, 4, 5, // A0
+   2, 5, 5, 0, 4, 4, 4, 5, 2, 4, 2, 0, 4, 4, 4, 5, // B0
+   2, 6, 0, 0, 3, 3, 5, 5, 2, 2, 2, 0, 4, 4, 6, 5, // C0
+   2, 5, 5, 0, 0, 4, 6, 5, 2, 4, 3, 0, 0, 4, 7, 5, // D0
+   2, 6, 0, 0, 3, 3, 5, 5, 2, 2, 2, 0, 4, 4, 6, 5, // E0
+   2, 5, 5, 0, 0, 4, 6, 5, 2, 4, 4, 0, 0, 4, 7, 5, // F0
+};
+
+static const int test_engines[] = { EWM_CPU_ENGINE_STEP, EWM_CPU_ENGINE_SWITCH, EWM_CPU_ENGINE_BLOCK };
+static const char *test_engine_names[] = { "step", "switch", "block" };
+
+// Returns the cycles the instruction took, or -1 if there was no cpu.
+
+static int test_timing_run(struct test_timing_t *t, int engine) {
+   struct cpu_t *cpu = cpu_create_with_engine(t->model, engine);
+   if (cpu == NULL || cpu_add_ram(cpu, 0x0000, 0xffff) == NULL) {
+      test_destroy_cpu(cpu);
+      return -1;
+   }
+   cpu_reset(cpu);
+   mem_set_byte(cpu, 0x0080, 0xff);
+   mem_set_byte(cpu, 0x0081, 0x10);
+   for (int n = 0; n < 3; n++) {
+      mem_set_byte(cpu, t->pc + n, t->code[n]);
+   }
+   cpu->state.pc = t->pc;
+   cpu->state.x = t->x;
+   cpu->state.y = t->y;
+   _cpu_set_status(cpu, t->p);
+
+   int cycles = cpu_run(cpu, 1);
+   test_destroy_cpu(cpu);
+   return cycles;
+}
+
+static int test_timing_check(FILE *out, struct test_timing_t *t) {
+   int failures = 0;
+   for (int e = 0; e < 3; e++) {
+      int cycles = test_timing_run(t, test_engines[e]);
+      if (cycles == -1) {
+         fprintf(out, "TEST   Cannot create cpu\n");
+         return -1;
+      }
+      if (cycles != t->cycles) {
+         fprintf(out, "TEST   Failure; %s %s on the %s engine took %d cycles instead of %d\n",
+                 t->model == EWM_CPU_MODEL_6502 ? "6502" : "65C02", t->name, test_engine_names[e], cycles, t->cycles);
+         failures++;
+      }
+   }
+   return failures;
+}
+
+// Every documented opcode runs with its operand at $80 or $1080 and the
+// flags set so that a branch is not taken. BRA, which is always taken,
+// branches forward to stay on the page. BBS tests zp $90, which is
+// clear, instead of the pointer at $80.
+
+static struct test_timing_t test_base_timing(int model, int opcode, int cycles) {
+   const struct cpu_instruction_t *table = model == EWM_CPU_MODEL_6502 ? instructions : instructions_65C02;
+   struct test_timing_t t = { table[opcode].name, model, 0x0200, { opcode, 0x80, 0x10 }, 0, 0, 0, cycles };
+   switch (opcode) {
+      case 0x10: t.p = TEST_TIMING_N; break;
+      case 0x50: t.p = TEST_TIMING_V; break;
+      case 0x90: t.p = TEST_TIMING_C; break;
+      case 0xd0: t.p = TEST_TIMING_Z; break;
+   }
+   if (model == EWM_CPU_MODEL_65C02 && opcode == 0x80) {
+      t.code[1] = 0x10;
+   }
+   if (model == EWM_CPU_MODEL_65C02 && (opcode & 0x8f) == 0x8f) {
+      t.code[1] = 0x90;
+   }
+   return t;
+}
+
+static int test_timing(FILE *out) {
+   int failures = 0, count = 0;
+   for (size_t i = 0; i < sizeof(test_timings) / sizeof(test_timings[0]); i++) {
+      int ret = test_timing_check(out, &test_timings[i]);
+      if (ret < 0) {
+         return -1;
+      }
+      failures += ret;
+      count += 3;
+   }
+
+   for (int opcode = 0; opcode < 256; opcode++) {
+      struct test_timing_t timings[2] = {
+         test_base_timing(EWM_CPU_MODEL_6502, opcode, test_base_cycles_6502[opcode]),
+         test_base_timing(EWM_CPU_MODEL_65C02, opcode, test_base_cycles_65C02[opcode]),
+      };
+      for (int m = 0; m < 2; m++) {
+         if (timings[m].cycles != 0) {
+            int ret = test_timing_check(out, &timings[m]);
+            if (ret < 0) {
                return -1;
             }
+            failures += ret;
+            count += 3;
          }
       }
+   }
 
-      last_pc = cpu->state.pc;
+   if (failures == 0) {
+      fprintf(out, "TEST   Success; %d instructions took the right number of cycles\n", count);
    }
+   return failures == 0 ? 0 : -1;
 }
 
+// Interrupts. An IRQ or NMI is requested before a NOP at $0200, or a
+// BRK is executed there. The first slice should end at the RTI that
+// the vector points to, the second one back at the return address.
+// The address and status that were pushed are still on the stack page.
+
+struct test_interrupt_t {
+   char *name;
+   uint8_t opcode;
+   int kind;
+   uint16_t vector;
+   uint16_t return_addr;
+   uint8_t b;
+   int cycles; // Of the first slice, 0 to not check
+};
+
+#define TEST_INTERRUPT_NONE 0
+#define TEST_INTERRUPT_IRQ  1
+#define TEST_INTERRUPT_NMI  2
+
+static struct test_interrupt_t test_interrupts[] = {
+   { "IRQ", 0xea, TEST_INTERRUPT_IRQ,  0xfffe, 0x0200, 0x00, 7 },
+   { "NMI", 0xea, TEST_INTERRUPT_NMI,  0xfffa, 0x0200, 0x00, 7 },
+   { "BRK", 0x00, TEST_INTERRUPT_NONE, 0xfffe, 0x0202, 0x10, 0 },
+};
+
+static int test_interrupt(FILE *out) {
+   static const int models[] = { EWM_CPU_MODEL_6502, EWM_CPU_MODEL_65C02 };
+
+   int failures = 0, count = 0;
+   for (size_t i = 0; i < sizeof(test_interrupts) / sizeof(test_interrupts[0]); i++) {
+      struct test_interrupt_t *t = &test_interrupts[i];
+      for (int m = 0; m < 2; m++) {
+         for (int e = 0; e < 3; e++) {
+            struct cpu_t *cpu = cpu_create_with_engine(models[m], test_engines[e]);
+            if (cpu == NULL || cpu_add_ram(cpu, 0x0000, 0xffff) == NULL) {
+               fprintf(out, "TEST   Cannot create cpu\n");
+               test_destroy_cpu(cpu);
+               return -1;
+            }
+            cpu_reset(cpu);
+            mem_set_byte(cpu, 0x0200, t->opcode);
+            mem_set_byte(cpu, 0x0300, 0x40); // RTI
+            mem_set_byte(cpu, t->vector, 0x00);
+            mem_set_byte(cpu, t->vector + 1, 0x03);
+            cpu->state.pc = 0x0200;
+            _cpu_set_status(cpu, EWM_CPU_FLAG_c);
+
+            if (t->kind == TEST_INTERRUPT_IRQ) {
+               cpu_request_irq(cpu);
+            } else if (t->kind == TEST_INTERRUPT_NMI) {
+               cpu_request_nmi(cpu);
+            }
+
+            int cycles = cpu_run(cpu, 1);
+            uint16_t vector_pc = cpu->state.pc;
+            (void) cpu_run(cpu, 1);
+            uint16_t return_addr = mem_get_byte(cpu, 0x01fe) | (mem_get_byte(cpu, 0x01ff) << 8);
+            uint8_t status = mem_get_byte(cpu, 0x01fd);
+
+            if (vector_pc != 0x0300 || return_addr != t->return_addr || cpu->state.pc != t->return_addr
+                || (status & EWM_CPU_FLAG_b) != t->b || (status & EWM_CPU_FLAG_c) == 0
+                || (t->cycles != 0 && cycles != t->cycles))
+            {
+               fprintf(out, "TEST   Failure; %s %s on the %s engine took %d cycles, pushed 0x%.4x P=%.2X and returned to 0x%.4x\n",
+                       models[m] == EWM_CPU_MODEL_6502 ? "6502" : "65C02", t->name, test_engine_names[e],
+                       cycles, return_addr, status, cpu->state.pc);
+               failures++;
+            }
+            count++;
+            test_destroy_cpu(cpu);
+         }
+      }
+   }
+
+   if (failures == 0) {
+      fprintf(out, "TEST   Success; %d interrupts returned to the right address\n", count);
+   }
+   return failures == 0 ? 0 : -1;
+}
+
+static bool lockstep = false;
+
+static void test_run_job(void *ctx, int index) {
+   struct test_t *t = &((struct test_t*) ctx)[index];
+
+   FILE *out = open_memstream(&t->output, &t->output_size);
+   if (out == NULL) {
+      t->result = -1;
+      return;
+   }
+   t->result = lockstep ? test_lockstep(t, out) : test(t, out);
+   fclose(out);
+}
+
+#define TEST_OPT_THREADS  (0)
+#define TEST_OPT_LOCKSTEP (1)
+
+static struct option test_options[] = {
+   { "threads",  required_argument, NULL, TEST_OPT_THREADS  },
+   { "lockstep", no_argument,       NULL, TEST_OPT_LOCKSTEP },
+   { NULL,       0,                 NULL, 0 }
+};
+
+#define TEST_6502(name, engine, lua) \
+   { name, EWM_CPU_MODEL_6502, engine, 0x0400, 0x3399, "rom/6502_functional_test.bin", lua, 0, NULL, 0 }
+#define TEST_65C02(name, engine, lua) \
+   { name, EWM_CPU_MODEL_65C02, engine, 0x0400, 0x24a8, "rom/65C02_extended_opcodes_test.bin", lua, 0, NULL, 0 }
+
 int main(int argc, char **argv) {
-   fprintf(stderr, "TEST Running 6502 tests\n");
-   test(EWM_CPU_MODEL_6502,  0x0400, 0x3399, "rom/6502_functional_test.bin", 0);
-   fprintf(stderr, "TEST Running 65C02 tests\n");
-   test(EWM_CPU_MODEL_65C02, 0x0400, 0x24a8, "rom/65C02_extended_opcodes_test.bin", 0);
+   int threads = 0;
 
+   int ch;
+   while ((ch = getopt_long_only(argc, argv, "", test_options, NULL)) != -1) {
+      switch (ch) {
+         case TEST_OPT_THREADS:
+            threads = atoi(optarg);
+            break;
+         case TEST_OPT_LOCKSTEP:
+            lockstep = true;
+            break;
+         default:
+            fprintf(stderr, "Usage: cpu_test [--threads <n>] [--lockstep]\n");
+            exit(1);
+      }
+   }
+
+   struct test_t tests[] = {
+      TEST_6502("step", EWM_CPU_ENGINE_STEP, 0),
+      TEST_65C02("step", EWM_CPU_ENGINE_STEP, 0),
+      TEST_6502("switch", EWM_CPU_ENGINE_SWITCH, 0),
+      TEST_65C02("switch", EWM_CPU_ENGINE_SWITCH, 0),
+      TEST_6502("block", EWM_CPU_ENGINE_BLOCK, 0),
+      TEST_65C02("block", EWM_CPU_ENGINE_BLOCK, 0),
 #if defined(EWM_LUA)
-   fprintf(stderr, "TEST Running 6502 tests - With Lua\n");
-   test(EWM_CPU_MODEL_6502,  0x0400, 0x3399, "rom/6502_functional_test.bin", 1);
-   fprintf(stderr, "TEST Running 65C02 tests - With Lua\n");
-   test(EWM_CPU_MODEL_65C02, 0x0400, 0x24a8, "rom/65C02_extended_opcodes_test.bin", 1);
+      TEST_6502("Lua", EWM_CPU_ENGINE_SWITCH, 1),
+      TEST_65C02("Lua", EWM_CPU_ENGINE_SWITCH, 1),
 #endif
+   };
+
+   // The step engine is the reference in lockstep mode
+   struct test_t *jobs = lockstep ? &tests[2] : tests;
+   int count = lockstep ? 4 : (int) (sizeof(tests) / sizeof(tests[0]));
+
+   if (ewm_pool_run(count, threads, test_run_job, jobs) != 0) {
+      fprintf(stderr, "TEST Cannot start the tests\n");
+      exit(1);
+   }
+
+   fprintf(stderr, "TEST Running cycle timing tests\n");
+   int failures = test_timing(stderr) != 0;
+
+   fprintf(stderr, "TEST Running interrupt tests\n");
+   failures += test_interrupt(stderr) != 0;
+
+   for (int i = 0; i < count; i++) {
+      struct test_t *t = &jobs[i];
+      fprintf(stderr, "TEST Running %s tests - %s%s\n", t->model == EWM_CPU_MODEL_6502 ? "6502" : "65C02",
+              t->with_lua ? "With Lua" : t->name, t->with_lua ? "" : (lockstep ? " engine in lockstep" : " engine"));
+      if (t->output != NULL) {
+         fputs(t->output, stderr);
+         free(t->output);
+      }
+      failures += t->result != 0;
+   }
+
+   return failures == 0 ? 0 : 1;
 }
@@ -21,15 +21,18 @@
 // SOFTWARE.
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "mem.h"
 #include "cpu.h"
 #include "utl.h"
+#include "snp.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
@@ -68,6 +71,12 @@
 #define EWM_DSK_MODE_READ 0
 #define EWM_DSK_MODE_WRITE 1
 
+// The disk spins by one nibble every 32 cycles. After the drive is
+// turned off the motor keeps spinning for about a second.
+
+#define EWM_DSK_CYCLES_PER_NIBBLE (32)
+#define EWM_DSK_MOTOR_OFF_DELAY   (1023000)
+
 static uint8_t dsk_rom[] = {
    0xa2,0x20,0xa0,0x00,0xa2,0x03,0x86,0x3c,0x8a,0x0a,0x24,0x3c,0xf0,0x10,0x05,0x3c,
    0x49,0xff,0x29,0x7e,0xb0,0x08,0x4a,0xd0,0xfb,0x98,0x9d,0x56,0x03,0xc8,0xe8,0x10,
@@ -88,7 +97,7 @@ static uint8_t dsk_rom[] = {
 };
 
 // See Beneath Apple DOS 3-21
-static uint8_t dsk_wr_table[] = {
+static const uint8_t dsk_wr_table[] = {
    0x96, 0x97, 0x9a, 0x9b, 0x9d, 0x9e, 0x9f, 0xa6,
    0xa7, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb2, 0xb3,
    0xb4, 0xb5, 0xb6, 0xb7, 0xb9, 0xba, 0xbb, 0xbc,
@@ -99,7 +108,51 @@ static uint8_t dsk_wr_table[] = {
    0xf7, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
 
-static int dsk_phase_delta[4][4] = {
+// The read data field (READ16) and read address field (RDADR16)
+// routines of the DOS 3.3 RWTS, which is what fast disk mode looks
+// for. The pages of the buffers and the nibble table are left out, so
+// that a relocated RWTS matches too.
+
+static const int16_t dsk_rwts_read16[] = {
+   0xa0,0x20,0x88,0xf0,0x61,0xbd,0x8c,0xc0,0x10,0xfb,0x49,0xd5,
+   0xd0,0xf4,0xea,0xbd,0x8c,0xc0,0x10,0xfb,0xc9,0xaa,0xd0,0xf2,
+   0xa0,0x56,0xbd,0x8c,0xc0,0x10,0xfb,0xc9,0xad,0xd0,0xe7,0xa9,
+   0x00,0x88,0x84,0x26,0xbc,0x8c,0xc0,0x10,0xfb,0x59,0x00,  -1,
+   0xa4,0x26,0x99,0x00,  -1,0xd0,0xee,0x84,0x26,0xbc,0x8c,0xc0,
+   0x10,0xfb,0x59,0x00,  -1,0xa4,0x26,0x99,0x00,  -1,0xc8,0xd0,
+   0xee,0xbc,0x8c,0xc0,0x10,0xfb,0xd9,0x00,  -1,0xd0,0x13,0xbd,
+   0x8c,0xc0,0x10,0xfb,0xc9,0xde,0xd0,0x0a,0xea,0xbd,0x8c,0xc0,
+   0x10,0xfb,0xc9,0xaa,0xf0,0x5c,0x38,0x60
+};
+
+static const int16_t dsk_rwts_rdadr16[] = {
+   0xa0,0xfc,0x84,0x26,0xc8,0xd0,0x04,0xe6,0x26,0xf0,0xf3,0xbd,
+   0x8c,0xc0,0x10,0xfb,0xc9,0xd5,0xd0,0xf0,0xea,0xbd,0x8c,0xc0,
+   0x10,0xfb,0xc9,0xaa,0xd0,0xf2,0xa0,0x03,0xbd,0x8c,0xc0,0x10,
+   0xfb,0xc9,0x96,0xd0,0xe7,0xa9,0x00,0x85,0x27,0xbd,0x8c,0xc0,
+   0x10,0xfb,0x2a,0x85,0x26,0xbd,0x8c,0xc0,0x10,0xfb,0x25,0x26,
+   0x99,0x2c,0x00,0x45,0x27,0x88,0x10,0xe7,0xa8,0xd0,0xb7,0xbd,
+   0x8c,0xc0,0x10,0xfb,0xc9,0xde,0xd0,0xae,0xea,0xbd,0x8c,0xc0,
+   0x10,0xfb,0xc9,0xaa,0xd0,0xa4,0x18,0x60
+};
+
+// Offsets of the first read of the disk in both routines, and of the
+// operands in READ16 that point to the nibble table and the buffers.
+
+#define EWM_DSK_READ16_FIRST_READ  (0x05)
+#define EWM_DSK_READ16_TABLE       (0x2e)
+#define EWM_DSK_READ16_NBUF2       (0x33)
+#define EWM_DSK_READ16_NBUF1       (0x44)
+#define EWM_DSK_RDADR16_FIRST_READ (0x0b)
+
+// RDADR16 gives up after about 768 nibbles and READ16 after 32
+#define EWM_DSK_RDADR16_SEARCH (768)
+#define EWM_DSK_READ16_SEARCH  (32)
+
+// What we charge for reading a field in fast disk mode
+#define EWM_DSK_FAST_CYCLES (1024)
+
+static const int dsk_phase_delta[4][4] = {
    { 0, 1, 2,-1},
    {-1, 0, 1, 2},
    {-2,-1, 0, 1},
@@ -110,6 +163,8 @@ static struct ewm_dsk_drive_t *dsk_drive(struct ewm_dsk_t *dsk) {
    return &dsk->drives[dsk->drive];
 }
 
+static struct ewm_dsk_track_t *dsk_track(struct ewm_dsk_drive_t *drive, int track_idx);
+
 static void dsk_phase(struct ewm_dsk_t *dsk, int phase, bool on) {
    if (on) {
       //printf("[DSK] Disk #%d phase %d on\n", dsk->drive, phase);
@@ -126,6 +181,11 @@ static void dsk_phase(struct ewm_dsk_t *dsk, int phase, bool on) {
          drive->track = 0;
       }
 
+      // Get the track ready while the head settles
+      if (drive->loaded) {
+         dsk_track(drive, drive->track >> 1);
+      }
+
       //printf("[DSK]     Disk #%d track = %d\n", dsk->drive, drive->track);
    } else {
       //printf("[DSK] Disk #%d phase %d off\n", dsk->drive, phase);
@@ -138,31 +198,257 @@ static void dsk_write_next(struct ewm_dsk_t *dsk, uint8_t v) {
    }
 }
 
-static uint8_t dsk_read_next(struct ewm_dsk_t *dsk) {
-   uint8_t result = 0;
-   if (dsk->skip || dsk->mode == EWM_DSK_MODE_WRITE) {
-      struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
-      struct ewm_dsk_track_t track = drive->tracks[drive->track >> 1]; // TODO Because drv->track actually goes to 70?
+// In read mode the head position follows the cycle counter. Reading
+// more than once per nibble returns an empty latch, reading less often
+// skips nibbles, just like on real hardware. In write mode every
+// access writes the latch to the next position.
 
-      //printf("Reading track.data[%d] (track.length = %zu): %.2X\n", drive->head, track.length, track.data[drive->head]);
+static uint8_t dsk_read_next(struct ewm_dsk_t *dsk, struct cpu_t *cpu) {
+   uint8_t result = 0;
+   struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
+   struct ewm_dsk_track_t track = *dsk_track(drive, drive->track >> 1); // TODO Because drv->track actually goes to 70?
 
+   // Written tracks are decoded back into the image when the drive is
+   // turned off.
+   if (dsk->mode == EWM_DSK_MODE_WRITE) {
       if (drive->head >= track.length) {
          drive->head = 0;
       }
+      track.data[drive->head] = dsk->latch;
+      drive->head += 1;
+      drive->tracks[drive->track >> 1].dirty = true;
+      drive->dirty = true;
+      return result;
+   }
 
-      if (dsk->mode == EWM_DSK_MODE_WRITE) {
-         track.data[drive->head] = dsk->latch; // TODO Implement write support
-      } else {
-         result = track.data[drive->head];
+   uint64_t nibbles = (cpu->counter - dsk->nibble_time) / EWM_DSK_CYCLES_PER_NIBBLE;
+   if (nibbles != 0) {
+      dsk->nibble_time += nibbles * EWM_DSK_CYCLES_PER_NIBBLE;
+      drive->head = (drive->head + (int) ((nibbles - 1) % track.length)) % track.length;
+      result = track.data[drive->head];
+      drive->head = (drive->head + 1) % track.length;
+   }
+
+   return result;
+}
+
+// Fast disk mode. When the cpu starts reading the disk at the first
+// read of READ16 or RDADR16, we find the field on the track ourselves,
+// store what the routine would have stored and return from it as if it
+// read all the nibbles. Code that does not look exactly like the RWTS,
+// or a field that does not read back cleanly, takes the normal nibble
+// path. That path is also all there is without fast mode, which is
+// what copy protected disks need.
+
+static uint8_t dsk_defourxfour(uint8_t h, uint8_t l) {
+   return ((h << 1) | 0x01) & l;
+}
+
+static bool dsk_matches(struct cpu_t *cpu, uint16_t addr, const int16_t *code, size_t length) {
+   for (size_t i = 0; i < length; i++) {
+      if (code[i] != -1 && mem_get_byte(cpu, addr + i) != code[i]) {
+         return false;
       }
+   }
+   return true;
+}
 
-      drive->head += 1;
+// Let the disk spin for the time that passed since the last read, and
+// return the position under the head.
+static int dsk_fast_spin(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track) {
+   uint64_t nibbles = (cpu->counter - dsk->nibble_time) / EWM_DSK_CYCLES_PER_NIBBLE;
+   dsk->nibble_time += nibbles * EWM_DSK_CYCLES_PER_NIBBLE;
+   return (drive->head + (int) (nibbles % track->length)) % track->length;
+}
+
+// Find the field with the given third prologue nibble within search
+// nibbles from head. Returns the position right after the prologue.
+static int dsk_fast_find(struct ewm_dsk_track_t *track, int head, int search, uint8_t prologue) {
+   int length = track->length;
+   uint8_t *data = track->data;
+   for (int n = 0; n < search; n++) {
+      int pos = (head + n) % length;
+      if (data[pos] == 0xd5 && data[(pos + 1) % length] == 0xaa && data[(pos + 2) % length] == prologue) {
+         return (pos + 3) % length;
+      }
    }
+   return -1;
+}
 
-   dsk->skip += 1;
-   dsk->skip %= 4;
+// Translate the nibbles of a data field at pos through the nibble table
+// of the code that reads it, just like the code does. Returns false if
+// the checksum does not match.
+static bool dsk_fast_translate(struct cpu_t *cpu, struct ewm_dsk_track_t *track, int pos, uint16_t table, uint8_t nibbles[0x156]) {
+   uint8_t last = 0;
+   for (int i = 0; i < 0x156; i++) {
+      last ^= mem_get_byte(cpu, table + track->data[(pos + i) % track->length]);
+      nibbles[i] = last;
+   }
+   return mem_get_byte(cpu, table + track->data[(pos + 0x156) % track->length]) == last;
+}
 
-   return result;
+static uint8_t dsk_fast_address_byte(struct ewm_dsk_track_t *track, int pos, int i) {
+   return dsk_defourxfour(track->data[(pos + i * 2) % track->length], track->data[(pos + i * 2 + 1) % track->length]);
+}
+
+static void dsk_fast_done(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_dsk_drive_t *drive, int head) {
+   drive->head = head;
+   cpu->counter += EWM_DSK_FAST_CYCLES;
+   dsk->nibble_time = cpu->counter;
+}
+
+static void dsk_fast_return(struct cpu_t *cpu, uint8_t y) {
+   cpu->state.y = y;
+   cpu_set_flag(cpu, c, 0);
+   cpu->state.pc = _cpu_pull_word(cpu) + 1;
+}
+
+static bool dsk_fast_read_address(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track) {
+   int pos = dsk_fast_find(track, dsk_fast_spin(dsk, cpu, drive, track), EWM_DSK_RDADR16_SEARCH, 0x96);
+   if (pos == -1) {
+      return false;
+   }
+
+   uint8_t checksum = 0;
+   for (int i = 0; i < 4; i++) {
+      checksum ^= dsk_fast_address_byte(track, pos, i);
+   }
+
+   if (checksum != 0 || track->data[(pos + 8) % track->length] != 0xde || track->data[(pos + 9) % track->length] != 0xaa) {
+      return false;
+   }
+
+   // Volume, track, sector and checksum go to $2F down to $2C
+   for (int i = 0; i < 4; i++) {
+      mem_set_byte(cpu, 0x002f - i, dsk_fast_address_byte(track, pos, i));
+   }
+
+   dsk_fast_done(dsk, cpu, drive, (pos + 10) % track->length);
+   dsk_fast_return(cpu, 0x00);
+   return true;
+}
+
+static bool dsk_fast_read_data(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track, uint16_t entry) {
+   uint16_t table = mem_get_word(cpu, entry + EWM_DSK_READ16_TABLE);
+   uint16_t nbuf2 = mem_get_word(cpu, entry + EWM_DSK_READ16_NBUF2);
+   uint16_t nbuf1 = mem_get_word(cpu, entry + EWM_DSK_READ16_NBUF1);
+
+   int pos = dsk_fast_find(track, dsk_fast_spin(dsk, cpu, drive, track), EWM_DSK_READ16_SEARCH, 0xad);
+   if (pos == -1) {
+      return false;
+   }
+
+   uint8_t nibbles[0x156];
+   if (!dsk_fast_translate(cpu, track, pos, table, nibbles)) {
+      return false;
+   }
+
+   if (track->data[(pos + 0x157) % track->length] != 0xde || track->data[(pos + 0x158) % track->length] != 0xaa) {
+      return false;
+   }
+
+   for (int i = 0; i < 0x56; i++) {
+      mem_set_byte(cpu, nbuf2 + 0x55 - i, nibbles[i]);
+   }
+   for (int i = 0; i < 0x100; i++) {
+      mem_set_byte(cpu, nbuf1 + i, nibbles[0x56 + i]);
+   }
+
+   dsk_fast_done(dsk, cpu, drive, (pos + 0x159) % track->length);
+   dsk_fast_return(cpu, track->data[(pos + 0x156) % track->length]);
+   return true;
+}
+
+// The boot rom reads the sector in $3D of the track in $41 into the
+// page at $26 and the 2-bit parts into $0300. We do the same, and then
+// continue where it puts the two parts together.
+
+#define EWM_DSK_ROM_FIRST_READ (0xc65e)
+#define EWM_DSK_ROM_TABLE      (0x02d6)
+#define EWM_DSK_ROM_NBUF2      (0x0300)
+#define EWM_DSK_ROM_POSTNIB    (0xc6d5)
+
+static bool dsk_fast_read_boot(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track) {
+   uint8_t sector = mem_get_byte(cpu, 0x3d);
+   uint8_t track_num = mem_get_byte(cpu, 0x41);
+
+   // Look at most two revolutions for the address field
+   int head = dsk_fast_spin(dsk, cpu, drive, track);
+   for (int n = 0; n < 2 * track->length; ) {
+      int pos = dsk_fast_find(track, head, 2 * track->length - n, 0x96);
+      if (pos == -1) {
+         return false;
+      }
+      n += (pos - head + track->length) % track->length;
+      head = pos;
+
+      if (dsk_fast_address_byte(track, pos, 1) != track_num || dsk_fast_address_byte(track, pos, 2) != sector) {
+         continue;
+      }
+
+      pos = dsk_fast_find(track, pos + 8, EWM_DSK_READ16_SEARCH, 0xad);
+      if (pos == -1) {
+         return false;
+      }
+
+      uint8_t nibbles[0x156];
+      if (!dsk_fast_translate(cpu, track, pos, EWM_DSK_ROM_TABLE, nibbles)) {
+         return false;
+      }
+
+      for (int i = 0; i < 0x56; i++) {
+         mem_set_byte(cpu, EWM_DSK_ROM_NBUF2 + 0x55 - i, nibbles[i]);
+      }
+      uint16_t buffer = mem_get_word(cpu, 0x26);
+      for (int i = 0; i < 0x100; i++) {
+         mem_set_byte(cpu, buffer + i, nibbles[0x56 + i]);
+      }
+      mem_set_byte(cpu, 0x40, track_num);
+
+      dsk_fast_done(dsk, cpu, drive, (pos + 0x157) % track->length);
+      _cpu_pull_byte(cpu); // The status that the rom pushed
+      cpu->state.pc = EWM_DSK_ROM_POSTNIB;
+      return true;
+   }
+
+   return false;
+}
+
+static bool dsk_fast_read(struct ewm_dsk_t *dsk, struct cpu_t *cpu, uint8_t *result) {
+   struct ewm_dsk_drive_t *drive = dsk_drive(dsk);
+   struct ewm_dsk_track_t *track = dsk_track(drive, drive->track >> 1);
+
+   // The read is part of an LDA $C08C,X, so pc already points to the next instruction
+   uint16_t pc = cpu->state.pc - 3;
+
+   if (pc == EWM_DSK_ROM_FIRST_READ) {
+      return dsk_fast_read_boot(dsk, cpu, drive, track);
+   }
+
+   uint16_t entry = pc - EWM_DSK_READ16_FIRST_READ;
+   if (dsk_matches(cpu, entry, dsk_rwts_read16, sizeof(dsk_rwts_read16) / sizeof(int16_t))) {
+      if (dsk_fast_read_data(dsk, cpu, drive, track, entry)) {
+         *result = 0xaa; // The last nibble that the routine reads
+         return true;
+      }
+      return false;
+   }
+
+   entry = pc - EWM_DSK_RDADR16_FIRST_READ;
+   if (dsk_matches(cpu, entry, dsk_rwts_rdadr16, sizeof(dsk_rwts_rdadr16) / sizeof(int16_t))) {
+      if (dsk_fast_read_address(dsk, cpu, drive, track)) {
+         *result = 0xaa;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static void dsk_motor_off(struct cpu_t *cpu, void *obj) {
+   struct ewm_dsk_t *dsk = (struct ewm_dsk_t*) obj;
+   dsk->on = false;
+   // TODO Drive light
 }
 
 static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
@@ -198,11 +484,12 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
 
       case EWM_DISKII_DRIVEOFF:
          //printf("[DSK] Drive #%d off\n", dsk->drive);
-         dsk->on = false;
-         // TODO Drive light
+         cpu_schedule(cpu, EWM_DSK_MOTOR_OFF_DELAY, dsk_motor_off, dsk);
+         ewm_dsk_flush(dsk);
          break;
       case EWM_DISKII_DRIVEON:
          //printf("[DSK] Drive #%d on\n", dsk->drive);
+         cpu_cancel(cpu, dsk_motor_off, dsk);
          dsk->on = true;
          // TODO Drive light
          break;
@@ -221,7 +508,7 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
       case EWM_DISKII_READMODE:
          dsk->mode = EWM_DSK_MODE_READ;
          if (dsk_drive(dsk)->loaded) {
-            result = (dsk_read_next(dsk) & 0x7f) | (dsk_drive(dsk)->readonly ? 0x80 : 0x00);
+            result = (dsk_read_next(dsk, cpu) & 0x7f) | (dsk_drive(dsk)->readonly ? 0x80 : 0x00);
          }
          break;
       case EWM_DISKII_WRITEMODE:
@@ -230,7 +517,10 @@ static uint8_t dsk_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
 
       case EWM_DISKII_READ:
          if (dsk_drive(dsk)->loaded) {
-            result = dsk_read_next(dsk);
+            if (dsk->fast && dsk->mode == EWM_DSK_MODE_READ && dsk_fast_read(dsk, cpu, &result)) {
+               break;
+            }
+            result = dsk_read_next(dsk, cpu);
          }
          break;
       case EWM_DISKII_WRITE:
@@ -296,15 +586,15 @@ static uint8_t dsk_fourxfour_lo(uint8_t v) {
    return (v & 0b01010101) | 0b10101010;
 }
 
-static uint8_t dsk_sector_ordering_do[EWM_DSK_SECTORS] = {
+static const uint8_t dsk_sector_ordering_do[EWM_DSK_SECTORS] = {
    0x00,0x0d,0x0b,0x09,0x07,0x05,0x03,0x01,0x0e,0x0c,0x0a,0x08,0x06,0x04,0x02,0x0f
 };
 
-static uint8_t dsk_sector_ordering_po[EWM_DSK_SECTORS] = {
+static const uint8_t dsk_sector_ordering_po[EWM_DSK_SECTORS] = {
    0x00,0x02,0x04,0x06,0x08,0x0a,0x0c,0x0e,0x01,0x03,0x05,0x07,0x09,0x0b,0x0d,0x0f
 };
 
-static uint8_t *dsk_convert_sector(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t *drive, int track_idx, int sector_idx, uint8_t *src, uint8_t *dst) {
+static uint8_t *dsk_convert_sector(struct ewm_dsk_drive_t *drive, int track_idx, int sector_idx, uint8_t *src, uint8_t *dst) {
    // Gap 1
    if (sector_idx == 0) {
       for (int i = 0; i < 0x80; i++) {
@@ -349,11 +639,11 @@ static uint8_t *dsk_convert_sector(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t
    *dst++ = 0xaa;
    *dst++ = 0xad;
 
-   uint8_t nibbles[0x156];
+   uint8_t nibbles[0x158]; // The loop below writes two nibbles past the data
    uint8_t ptr2 = 0;
    uint8_t ptr6 = 0x56;
 
-   for (int i = 0; i < 0x156; i++) {
+   for (int i = 0; i < 0x158; i++) {
       nibbles[i] = 0;
    }
 
@@ -393,22 +683,26 @@ static uint8_t *dsk_convert_sector(struct ewm_dsk_t *dsk, struct ewm_dsk_drive_t
    return dst;
 }
 
-static struct ewm_dsk_track_t dsk_convert_track(struct ewm_dsk_t *disk, struct ewm_dsk_drive_t *drive, uint8_t *data, int track_idx, int type) {
-   struct ewm_dsk_track_t track;
-   track.length = dsk_native_track_length(track_idx);
-   track.data = malloc(track.length);
+static void dsk_convert_track(struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track, int track_idx) {
+   const uint8_t *sector_ordering = (drive->type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
 
-   uint8_t *sector_ordering = (type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
-
-   uint8_t *dst = track.data;
+   uint8_t *dst = track->data;
    for (int sector_idx = 0; sector_idx < EWM_DSK_SECTORS; sector_idx++) {
       int _s = 15 - sector_idx;
-      uint8_t *src = data
+      uint8_t *src = drive->image
          + (track_idx * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE) // Start of track_idx
          + (_s * EWM_DSK_SECTOR_SIZE);    // Start of sector_idx
-      dst = dsk_convert_sector(disk, drive, track_idx, sector_ordering[_s], src, dst);
+      dst = dsk_convert_sector(drive, track_idx, sector_ordering[_s], src, dst);
    }
 
+   track->nibblized = true;
+}
+
+static struct ewm_dsk_track_t *dsk_track(struct ewm_dsk_drive_t *drive, int track_idx) {
+   struct ewm_dsk_track_t *track = &drive->tracks[track_idx];
+   if (!track->nibblized) {
+      dsk_convert_track(drive, track, track_idx);
+   }
    return track;
 }
 
@@ -421,7 +715,7 @@ static int ewm_dsk_init(struct ewm_dsk_t *dsk, struct cpu_t *cpu) {
    dsk->rom = cpu_add_rom_data(cpu, 0xc600, 0xc6ff, dsk_rom);
    dsk->rom->description = "rom/dsk/$C600";
    dsk->iom = cpu_add_iom(cpu, 0xc0e0, 0xc0ef, dsk, dsk_read, dsk_write);
-   dsk->rom->description = "iom/dsk/$C0E0";
+   dsk->iom->description = "iom/dsk/$C0E0";
    return 0;
 }
 
@@ -431,8 +725,18 @@ struct ewm_dsk_t *ewm_dsk_create(struct cpu_t *cpu) {
    return dsk;
 }
 
-static uint8_t dsk_defourxfour(uint8_t h, uint8_t l) {
-   return ((h << 1) | 0x01) & l;
+static void dsk_eject(struct ewm_dsk_drive_t *drive);
+
+// The memory regions of the controller go with the cpu.
+
+void ewm_dsk_destroy(struct ewm_dsk_t *dsk) {
+   for (int i = 0; i < 2; i++) {
+      struct ewm_dsk_drive_t *drive = &dsk->drives[i];
+      dsk_eject(drive);
+      free(drive->buffer);
+      free(drive->arena);
+   }
+   free(dsk);
 }
 
 static uint8_t dsk_locate_volume_number(struct ewm_dsk_track_t *track) {
@@ -444,7 +748,127 @@ static uint8_t dsk_locate_volume_number(struct ewm_dsk_track_t *track) {
    return 0;
 }
 
-int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type) {
+// Decoding of tracks that were written to. This finds the address
+// fields on the track and decodes the data field that follows each of
+// them back into the sector of the image. Sectors that do not decode
+// cleanly are left alone.
+
+static bool dsk_decode_data(uint8_t *table, uint8_t *data, int length, int pos, uint8_t *dst) {
+   uint8_t nibbles[0x156];
+   uint8_t last = 0;
+   for (int i = 0; i < 0x156; i++) {
+      uint8_t val = table[data[(pos + i) % length]];
+      if (val == 0xff) {
+         return false;
+      }
+      last ^= val;
+      nibbles[i] = last;
+   }
+
+   if (table[data[(pos + 0x156) % length]] != last) {
+      return false;
+   }
+
+   for (int i = 0; i < 0x100; i++) {
+      uint8_t val2;
+      if (i < 0x56) {
+         val2 = nibbles[i];
+      } else if (i < 0xac) {
+         val2 = nibbles[i - 0x56] >> 2;
+      } else {
+         val2 = nibbles[i - 0xac] >> 4;
+      }
+      dst[i] = (nibbles[0x56 + i] << 2) | ((val2 & 0x01) << 1) | ((val2 & 0x02) >> 1);
+   }
+
+   return true;
+}
+
+static void dsk_decode_track(struct ewm_dsk_drive_t *drive, struct ewm_dsk_track_t *track, int track_idx) {
+   uint8_t table[256];
+   memset(table, 0xff, sizeof(table));
+   for (int i = 0; i < 64; i++) {
+      table[dsk_wr_table[i]] = i;
+   }
+
+   const uint8_t *sector_ordering = (drive->type == EWM_DSK_TYPE_DO) ? dsk_sector_ordering_do : dsk_sector_ordering_po;
+
+   int length = track->length;
+   uint8_t *data = track->data;
+
+   for (int i = 0; i < length; i++) {
+      if (data[i] != 0xd5 || data[(i + 1) % length] != 0xaa || data[(i + 2) % length] != 0x96) {
+         continue;
+      }
+
+      uint8_t volume = dsk_defourxfour(data[(i + 3) % length], data[(i + 4) % length]);
+      uint8_t track_num = dsk_defourxfour(data[(i + 5) % length], data[(i + 6) % length]);
+      uint8_t sector_num = dsk_defourxfour(data[(i + 7) % length], data[(i + 8) % length]);
+      uint8_t checksum = dsk_defourxfour(data[(i + 9) % length], data[(i + 10) % length]);
+      if ((volume ^ track_num ^ sector_num) != checksum || track_num != track_idx || sector_num >= EWM_DSK_SECTORS) {
+         continue;
+      }
+
+      // The data field starts a few sync nibbles after the address field
+      for (int j = i + 14; j < i + 14 + 32; j++) {
+         if (data[j % length] == 0xd5 && data[(j + 1) % length] == 0xaa && data[(j + 2) % length] == 0xad) {
+            for (int s = 0; s < EWM_DSK_SECTORS; s++) {
+               if (sector_ordering[s] == sector_num) {
+                  uint8_t *dst = drive->image
+                     + (track_idx * EWM_DSK_SECTORS * EWM_DSK_SECTOR_SIZE)
+                     + (s * EWM_DSK_SECTOR_SIZE);
+                  dsk_decode_data(table, data, length, (j + 3) % length, dst);
+               }
+            }
+            break;
+         }
+      }
+   }
+}
+
+static void dsk_flush_drive(struct ewm_dsk_drive_t *drive) {
+   if (!drive->loaded || !drive->dirty || drive->readonly) {
+      return;
+   }
+
+   // Nibbles of .nib images are written in place
+   if (drive->type != EWM_DSK_TYPE_NIB) {
+      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+         if (drive->tracks[t].dirty) {
+            dsk_decode_track(drive, &drive->tracks[t], t);
+         }
+      }
+   }
+
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      drive->tracks[t].dirty = false;
+   }
+
+   if (drive->map != NULL) {
+      if (msync(drive->map, drive->map_size, MS_ASYNC) == -1) {
+         fprintf(stderr, "[DSK] Could not write disk image: %s\n", strerror(errno));
+      }
+   }
+
+   drive->dirty = false;
+}
+
+static void dsk_eject(struct ewm_dsk_drive_t *drive) {
+   dsk_flush_drive(drive);
+   if (drive->map != NULL) {
+      munmap(drive->map, drive->map_size);
+      drive->map = NULL;
+      drive->map_size = 0;
+   }
+   drive->image = NULL;
+   drive->loaded = false;
+}
+
+// Insert a disk. If map is true then data is a mapping of the image
+// file that the drive takes ownership of and that it modifies in place.
+// Otherwise the data is copied.
+
+static int dsk_insert(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, uint8_t *data, size_t length, int type, bool map) {
    if (type == EWM_DSK_TYPE_UNKNOWN) {
       return -1;
    }
@@ -464,16 +888,56 @@ int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, v
    }
 
    struct ewm_dsk_drive_t *drive = &dsk->drives[index];
+   dsk_eject(drive);
 
-   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-      if (drive->tracks[t].data != NULL) {
-         free(drive->tracks[t].data);
-         drive->tracks[t].data = NULL;
-         drive->tracks[t].length = 0;
+   // All tracks live in a single arena, which is kept around when
+   // another disk of the same kind is inserted. Mapped .nib images do
+   // not need one, their tracks are used in place.
+
+   uint8_t *track_data;
+
+   if (type == EWM_DSK_TYPE_NIB && map) {
+      track_data = data;
+   } else {
+      size_t arena_size = 0;
+      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+         arena_size += (type == EWM_DSK_TYPE_NIB) ? EWM_DSK_NIBBLES_PER_TRACK : dsk_native_track_length(t);
       }
+
+      if (drive->arena_size != arena_size) {
+         uint8_t *arena = realloc(drive->arena, arena_size);
+         if (arena == NULL) {
+            return -1;
+         }
+         drive->arena = arena;
+         drive->arena_size = arena_size;
+      }
+
+      track_data = drive->arena;
+   }
+
+   if (type != EWM_DSK_TYPE_NIB) {
+      if (map) {
+         drive->image = data;
+      } else {
+         if (drive->buffer == NULL) {
+            drive->buffer = malloc(length);
+            if (drive->buffer == NULL) {
+               return -1;
+            }
+         }
+         memcpy(drive->buffer, data, length);
+         drive->image = drive->buffer;
+      }
+   }
+
+   if (map) {
+      drive->map = data;
+      drive->map_size = length;
    }
 
    drive->loaded = true;
+   drive->type = type;
    drive->volume = 254; // Default volume number
    drive->track = 0;
    drive->head = 0;
@@ -481,15 +945,21 @@ int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, v
    drive->readonly = readonly;
    drive->dirty = false;
 
-   if (type == EWM_DSK_TYPE_DO || type == EWM_DSK_TYPE_PO) {
-      for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-         drive->tracks[t] = dsk_convert_track(dsk, drive, data, t, type);
+   for (int t = 0; t < EWM_DSK_TRACKS; t++) {
+      struct ewm_dsk_track_t *track = &drive->tracks[t];
+      track->length = (type == EWM_DSK_TYPE_NIB) ? EWM_DSK_NIBBLES_PER_TRACK : dsk_native_track_length(t);
+      track->data = track_data;
+      track->nibblized = false;
+      track->dirty = false;
+      track_data += track->length;
+   }
+
+   if (type == EWM_DSK_TYPE_NIB) {
+      if (!map) {
+         memcpy(drive->arena, data, length);
       }
-   } else if (type == EWM_DSK_TYPE_NIB) {
       for (int t = 0; t < EWM_DSK_TRACKS; t++) {
-         drive->tracks[t].length = 6656;
-         drive->tracks[t].data = malloc(6656);
-         memcpy(drive->tracks[t].data, data + (t * 6656), 6656);
+         drive->tracks[t].nibblized = true;
       }
 
       uint8_t volume = dsk_locate_volume_number(&drive->tracks[0]);
@@ -501,6 +971,10 @@ int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, v
    return 0;
 }
 
+int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type) {
+   return dsk_insert(dsk, index, readonly, data, length, type, false);
+}
+
 static int ewm_dsk_type_from_path(char *path) {
    if (ewm_utl_endswith(path, ".dsk") || ewm_utl_endswith(path, ".do")) {
       return EWM_DSK_TYPE_DO;
@@ -514,15 +988,27 @@ static int ewm_dsk_type_from_path(char *path) {
    return EWM_DSK_TYPE_UNKNOWN;
 }
 
+// Disk images are mapped into memory. Unless the disk is read only the
+// mapping is shared, so that modified tracks end up in the file when
+// they are flushed. Images that cannot be opened for writing are
+// inserted as read only.
+
 int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t drive, bool readonly, char *path) {
    int type = ewm_dsk_type_from_path(path);
    if (type == EWM_DSK_TYPE_UNKNOWN) {
       return -1;
    }
 
-   int fd = open(path, O_RDONLY);
+   int fd = -1;
+   if (!readonly) {
+      fd = open(path, O_RDWR);
+   }
    if (fd == -1) {
-      return -1;
+      fd = open(path, O_RDONLY);
+      if (fd == -1) {
+         return -1;
+      }
+      readonly = true;
    }
 
    struct stat file_info;
@@ -543,20 +1029,86 @@ int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t drive, bool readonly, c
       }
    }
 
-   char *data = calloc(file_info.st_size, 1);
-   if (read(fd, data, file_info.st_size) != file_info.st_size) {
-      close(fd);
+   // Read only images are mapped privately, so that writes by the
+   // emulated machine stay in memory.
+   void *data = mmap(NULL, file_info.st_size, PROT_READ | PROT_WRITE, readonly ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (data == MAP_FAILED) {
       return -1;
    }
 
-   close(fd);
-
-   int result = ewm_dsk_set_disk_data(dsk, drive, readonly, data, file_info.st_size, type);
-   free(data);
+   int result = dsk_insert(dsk, drive, readonly, data, file_info.st_size, type, true);
+   if (result != 0) {
+      munmap(data, file_info.st_size);
+   }
 
    return result;
 }
 
+void ewm_dsk_set_fast(struct ewm_dsk_t *dsk, bool fast) {
+   dsk->fast = fast;
+}
+
+void ewm_dsk_flush(struct ewm_dsk_t *dsk) {
+   for (int i = 0; i < 2; i++) {
+      dsk_flush_drive(&dsk->drives[i]);
+   }
+}
+
+int ewm_dsk_save_snapshot(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "DSK ");
+   ewm_snapshot_put_u8(snapshot, dsk->on);
+   ewm_snapshot_put_u8(snapshot, dsk->mode);
+   ewm_snapshot_put_u8(snapshot, dsk->latch);
+   ewm_snapshot_put_u8(snapshot, dsk->drive);
+   ewm_snapshot_put_u64(snapshot, dsk->nibble_time);
+   ewm_snapshot_put_u64(snapshot, cpu_scheduled(cpu, dsk_motor_off, dsk));
+   for (int i = 0; i < 2; i++) {
+      struct ewm_dsk_drive_t *drive = &dsk->drives[i];
+      ewm_snapshot_put_u8(snapshot, drive->track);
+      ewm_snapshot_put_u8(snapshot, drive->phase);
+      ewm_snapshot_put_u16(snapshot, drive->head);
+   }
+   ewm_snapshot_end(snapshot);
+
+   return snapshot->error ? -1 : 0;
+}
+
+int ewm_dsk_load_snapshot(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "DSK ", &chunk) != 0) {
+      fprintf(stderr, "[DSK] Snapshot has no disk controller state\n");
+      return -1;
+   }
+
+   dsk->on = ewm_snapshot_get_u8(&chunk);
+   dsk->mode = ewm_snapshot_get_u8(&chunk);
+   dsk->latch = ewm_snapshot_get_u8(&chunk);
+   dsk->drive = ewm_snapshot_get_u8(&chunk) & 0x01;
+   dsk->nibble_time = ewm_snapshot_get_u64(&chunk);
+   uint64_t motor_off = ewm_snapshot_get_u64(&chunk);
+   for (int i = 0; i < 2; i++) {
+      struct ewm_dsk_drive_t *drive = &dsk->drives[i];
+      drive->track = ewm_snapshot_get_u8(&chunk) % (EWM_DSK_TRACKS * 2);
+      drive->phase = ewm_snapshot_get_u8(&chunk) & 0x03;
+      drive->head = ewm_snapshot_get_u16(&chunk);
+      if (drive->loaded && drive->head >= dsk_track(drive, drive->track >> 1)->length) {
+         drive->head = 0;
+      }
+   }
+
+   if (chunk.error) {
+      return -1;
+   }
+
+   if (motor_off != 0) {
+      cpu_schedule(cpu, (motor_off > cpu->counter) ? motor_off - cpu->counter : 0, dsk_motor_off, dsk);
+   }
+
+   return 0;
+}
+
 #if defined(EWM_LUA)
 
 //
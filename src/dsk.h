@@ -32,6 +32,7 @@
 
 struct cpu_t;
 struct mem_t;
+struct ewm_snapshot_t;
 
 #define EWM_DSK_DRIVE1 (0)
 #define EWM_DSK_DRIVE2 (1)
@@ -41,17 +42,31 @@ struct mem_t;
 #define EWM_DSK_SECTOR_SIZE (256)
 #define EWM_DSK_NIBBLES_PER_TRACK (6656)
 
+// Tracks of .dsk and .po images are nibblized the first time the head
+// gets to them. Until then data points to reserved space in the arena
+// of the drive and nibblized is false. Tracks that have been written
+// to are dirty until they are decoded back into the image.
+
 struct ewm_dsk_track_t {
    int length;
    uint8_t *data;
+   bool nibblized;
+   bool dirty;
 };
 
 struct ewm_dsk_drive_t {
    bool loaded;
+   int type;
    uint8_t volume;
    int track, head, phase;
    bool readonly;
    bool dirty;
+   uint8_t *image;  // Sector data of .dsk and .po images
+   uint8_t *buffer; // Copy of the image when it is not mapped
+   uint8_t *map;    // Mapped image file
+   size_t map_size;
+   uint8_t *arena;  // Nibbles of all tracks, unless they are mapped
+   size_t arena_size;
    struct ewm_dsk_track_t tracks[EWM_DSK_TRACKS];
 };
 
@@ -64,7 +79,8 @@ struct ewm_dsk_t {
    uint8_t latch;
    struct ewm_dsk_drive_t drives[2];
    uint8_t drive; // 0 based
-   int skip;
+   uint64_t nibble_time; // Cycle counter at the last nibble that was read
+   bool fast;
 #if defined(EWM_LUA)
    struct ewm_lua_t *lua;
 #endif
@@ -76,9 +92,24 @@ struct ewm_dsk_t {
 #define EWM_DSK_TYPE_NIB (2)
 
 struct ewm_dsk_t *ewm_dsk_create(struct cpu_t *cpu);
+void ewm_dsk_destroy(struct ewm_dsk_t *dsk);
 int ewm_dsk_set_disk_data(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, void *data, size_t length, int type);
 int ewm_dsk_set_disk_file(struct ewm_dsk_t *dsk, uint8_t index, bool readonly, char *path);
 
+// In fast mode sectors read by the DOS 3.3 RWTS are copied straight
+// into memory instead of going through the nibble path.
+void ewm_dsk_set_fast(struct ewm_dsk_t *dsk, bool fast);
+
+// Write tracks that were modified back to the disk images.
+void ewm_dsk_flush(struct ewm_dsk_t *dsk);
+
+// The state of the controller and the drives. The disks themselves are
+// not part of it, the same disks are expected to be inserted when the
+// snapshot is loaded. Call ewm_dsk_flush() first to bring the images
+// up to date.
+int ewm_dsk_save_snapshot(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot);
+int ewm_dsk_load_snapshot(struct ewm_dsk_t *dsk, struct cpu_t *cpu, struct ewm_snapshot_t *snapshot);
+
 #if defined(EWM_LUA)
 int ewm_dsk_init_lua(struct ewm_dsk_t *dsk, struct ewm_lua_t *lua);
 #endif
@@ -27,6 +27,8 @@
 #include "one.h"
 #include "two.h"
 #include "boo.h"
+#include "bat.h"
+#include "trc.h"
 
 static void usage() {
    fprintf(stderr, "Usage: ewm [--help|-h] [<command> [--help|-h] [args]]\n");
@@ -35,6 +37,8 @@ static void usage() {
    fprintf(stderr, "  one     Run the Apple 1 emulator\n");
    fprintf(stderr, "  two     Run the Apple ][+ emulator\n");
    fprintf(stderr, "  boo     Run the 'bootloader' (default)\n");
+   fprintf(stderr, "  batch   Run a file of jobs on headless machines\n");
+   fprintf(stderr, "  trace-dump  Print a cpu trace made with --trace\n");
    fprintf(stderr, "\n");
    fprintf(stderr, "If no command is specified, the 'bootloader' will be run, which\n");
    fprintf(stderr, "allows the user to interactively select what emulator to start.\n");
@@ -73,6 +77,16 @@ int main(int argc, char **argv) {
          return ewm_two_main(argc-1, &argv[1]);
       }
 
+      // Run many headless machines at once
+      if (strcmp(argv[1], "batch") == 0) {
+         return ewm_batch_main(argc-1, &argv[1]);
+      }
+
+      // Turn a binary trace into text
+      if (strcmp(argv[1], "trace-dump") == 0) {
+         return ewm_trace_dump_main(argc-1, &argv[1]);
+      }
+
       // Delegate to the bootloader
       if (strcmp(argv[1], "boo") == 0) {
          return ewm_boo_main(argc-1, &argv[1]);
@@ -0,0 +1,494 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Benchmarks whole workloads instead of single handlers: the Klaus test
+// ROMs, a DOS 3.3 boot, an Applesoft loop and full screen renders. Every
+// workload is deterministic, so a run that is not timed counts the
+// instructions with the profiler and the timed runs use the normal
+// engine. Results are the median and p99 of the timed runs, as text or
+// as JSON to compare between commits.
+//
+//   ewm_bench [--runs N] [--warmup N] [--json] [--disk path] [workload...]
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "two.h"
+#include "scr.h"
+#include "dsk.h"
+#include "rom.h"
+
+#define EWM_BENCH_RUNS_DEFAULT (5)
+#define EWM_BENCH_WARMUP_DEFAULT (1)
+#define EWM_BENCH_DISK_DEFAULT "../disks/DOS33-SystemMaster.dsk"
+
+#define EWM_BENCH_SLICE_CYCLES (EWM_TWO_SPEED / EWM_TWO_FPS_DEFAULT)
+#define EWM_BENCH_BOOT_SECONDS (10)
+#define EWM_BENCH_BASIC_SECONDS (10)
+#define EWM_BENCH_FRAMES (500)
+
+struct ewm_bench_result_t {
+   uint64_t ns;
+   uint64_t cycles;
+   uint64_t instructions;
+   uint64_t frames;
+};
+
+struct ewm_bench_t;
+typedef int (*ewm_bench_fn_t)(struct ewm_bench_t *bench, const void *arg, bool count, struct ewm_bench_result_t *result);
+
+struct ewm_bench_workload_t {
+   char *name;
+   ewm_bench_fn_t fn;
+   const void *arg;
+};
+
+struct ewm_bench_t {
+   int runs;
+   int warmup;
+   bool json;
+   char *disk;
+};
+
+static uint64_t ewm_bench_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+// Klaus Dormann's test suites. They end in a JMP to itself on success,
+// which is set as a breakpoint, and in a branch to itself on failure.
+
+struct ewm_bench_klaus_t {
+   int model;
+   uint16_t start;
+   uint16_t success;
+   char *path;
+};
+
+static const struct ewm_bench_klaus_t ewm_bench_klaus_6502 = {
+   EWM_CPU_MODEL_6502, 0x0400, 0x3399, "rom/6502_functional_test.bin"
+};
+
+static const struct ewm_bench_klaus_t ewm_bench_klaus_65c02 = {
+   EWM_CPU_MODEL_65C02, 0x0400, 0x24a8, "rom/65C02_extended_opcodes_test.bin"
+};
+
+static bool ewm_bench_is_deadlock(struct cpu_t *cpu) {
+   uint16_t pc = cpu->state.pc;
+   uint8_t i = mem_get_byte(cpu, pc);
+   if ((i & 0x1f) == 0x10 && mem_get_byte(cpu, pc + 1) == 0xfe) {
+      (void) cpu_step(cpu);
+      return cpu->state.pc == pc;
+   }
+   return false;
+}
+
+static int ewm_bench_klaus(struct ewm_bench_t *bench, const void *arg, bool count, struct ewm_bench_result_t *result) {
+   const struct ewm_bench_klaus_t *klaus = arg;
+
+   struct cpu_t *cpu = cpu_create(klaus->model);
+   if (cpu == NULL) {
+      return -1;
+   }
+
+   if (cpu_add_ram_file(cpu, 0x0000, klaus->path) == NULL) {
+      fprintf(stderr, "[BENCH] Cannot load %s\n", klaus->path);
+      cpu_destroy(cpu);
+      free(cpu);
+      return -1;
+   }
+
+   cpu_reset(cpu);
+   cpu->state.pc = klaus->start;
+   cpu_set_breakpoint(cpu, klaus->success);
+   if (count) {
+      cpu_profile(cpu, true);
+   }
+
+   int ret = 0;
+   uint64_t start = ewm_bench_now();
+   while (cpu->state.pc != klaus->success) {
+      if ((ret = cpu_run(cpu, 100000)) < 0 || ewm_bench_is_deadlock(cpu)) {
+         fprintf(stderr, "[BENCH] %s failed at 0x%.4x\n", klaus->path, cpu->state.pc);
+         ret = -1;
+         break;
+      }
+   }
+   result->ns = ewm_bench_now() - start;
+   result->cycles = cpu->counter;
+   if (count) {
+      result->instructions = cpu->profile->instructions;
+   }
+
+   cpu_destroy(cpu);
+   free(cpu);
+   return ret < 0 ? -1 : 0;
+}
+
+static int ewm_bench_run_two(struct ewm_two_t *two, uint64_t cycles) {
+   uint64_t limit = two->cpu->counter + cycles;
+   while (two->cpu->counter < limit) {
+      if (cpu_run(two->cpu, EWM_BENCH_SLICE_CYCLES) < 0) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Boots DOS 3.3 from a read only copy of the disk, which loads the DOS
+// through the RWTS nibble path and then runs the HELLO program.
+
+static int ewm_bench_boot(struct ewm_bench_t *bench, const void *arg, bool count, struct ewm_bench_result_t *result) {
+   struct ewm_two_t *two = ewm_two_create(EWM_TWO_TYPE_APPLE2PLUS, NULL, NULL);
+   if (two == NULL) {
+      return -1;
+   }
+
+   if (ewm_dsk_set_disk_file(two->dsk, EWM_DSK_DRIVE1, true, bench->disk) != 0) {
+      fprintf(stderr, "[BENCH] Cannot load %s\n", bench->disk);
+      ewm_two_destroy(two);
+      return -1;
+   }
+
+   cpu_reset(two->cpu);
+   if (count) {
+      cpu_profile(two->cpu, true);
+   }
+
+   uint64_t start = ewm_bench_now();
+   int ret = ewm_bench_run_two(two, (uint64_t) EWM_BENCH_BOOT_SECONDS * EWM_TWO_SPEED);
+   result->ns = ewm_bench_now() - start;
+   result->cycles = two->cpu->counter;
+   if (count) {
+      result->instructions = two->cpu->profile->instructions;
+   }
+
+   ewm_two_destroy(two);
+   return ret;
+}
+
+// Without a disk the ROM keeps looking for one, so a second reset is
+// the Ctrl-Reset that drops into Applesoft. The program is typed in and
+// only running it is timed.
+
+static char *ewm_bench_basic_program =
+   "10 FOR I = 1 TO 30000\r"
+   "20 A = A + I * 2 / 3\r"
+   "30 B$ = STR$(A)\r"
+   "40 NEXT\r"
+   "50 GOTO 10\r"
+   "RUN\r";
+
+static int ewm_bench_basic(struct ewm_bench_t *bench, const void *arg, bool count, struct ewm_bench_result_t *result) {
+   struct ewm_two_t *two = ewm_two_create(EWM_TWO_TYPE_APPLE2PLUS, NULL, NULL);
+   if (two == NULL) {
+      return -1;
+   }
+
+   cpu_reset(two->cpu);
+   int ret = ewm_bench_run_two(two, EWM_TWO_SPEED / 2);
+   cpu_reset(two->cpu);
+   if (ret == 0) {
+      ret = ewm_bench_run_two(two, EWM_TWO_SPEED / 2);
+   }
+
+   for (char *p = ewm_bench_basic_program; ret == 0 && *p != 0x00; ) {
+      if ((two->key & 0x80) == 0) {
+         two->key = *p++ | 0x80;
+      }
+      ret = ewm_bench_run_two(two, 10000);
+   }
+
+   if (count) {
+      cpu_profile(two->cpu, true);
+   }
+
+   uint64_t counter = two->cpu->counter;
+   uint64_t start = ewm_bench_now();
+   if (ret == 0) {
+      ret = ewm_bench_run_two(two, (uint64_t) EWM_BENCH_BASIC_SECONDS * EWM_TWO_SPEED);
+   }
+   result->ns = ewm_bench_now() - start;
+   result->cycles = two->cpu->counter - counter;
+   if (count) {
+      result->instructions = two->cpu->profile->instructions;
+   }
+
+   ewm_two_destroy(two);
+   return ret;
+}
+
+// Full screen renders of random screen contents, as in scr_test, but
+// into the surface only.
+
+struct ewm_bench_render_t {
+   int screen_mode;
+   int graphics_mode;
+   int color_scheme;
+};
+
+static const struct ewm_bench_render_t ewm_bench_render_txt = {
+   EWM_A2P_SCREEN_MODE_TEXT, EWM_A2P_SCREEN_GRAPHICS_MODE_LGR, EWM_SCR_COLOR_SCHEME_MONOCHROME
+};
+
+static const struct ewm_bench_render_t ewm_bench_render_lgr = {
+   EWM_A2P_SCREEN_MODE_GRAPHICS, EWM_A2P_SCREEN_GRAPHICS_MODE_LGR, EWM_SCR_COLOR_SCHEME_COLOR
+};
+
+static const struct ewm_bench_render_t ewm_bench_render_hgr = {
+   EWM_A2P_SCREEN_MODE_GRAPHICS, EWM_A2P_SCREEN_GRAPHICS_MODE_HGR, EWM_SCR_COLOR_SCHEME_MONOCHROME
+};
+
+static const struct ewm_bench_render_t ewm_bench_render_hgr_color = {
+   EWM_A2P_SCREEN_MODE_GRAPHICS, EWM_A2P_SCREEN_GRAPHICS_MODE_HGR, EWM_SCR_COLOR_SCHEME_COLOR
+};
+
+static int ewm_bench_render(struct ewm_bench_t *bench, const void *arg, bool count, struct ewm_bench_result_t *result) {
+   const struct ewm_bench_render_t *render = arg;
+
+   struct ewm_two_t *two = ewm_two_create(EWM_TWO_TYPE_APPLE2PLUS, NULL, NULL);
+   if (two == NULL) {
+      return -1;
+   }
+
+   cpu_reset(two->cpu);
+
+   two->screen_mode = render->screen_mode;
+   two->screen_graphics_mode = render->graphics_mode;
+   two->screen_graphics_style = EWM_A2P_SCREEN_GRAPHICS_STYLE_FULL;
+   two->screen_page = EWM_A2P_SCREEN_PAGE1;
+   ewm_scr_set_color_scheme(two->scr, render->color_scheme);
+
+   srand(6502);
+   for (uint16_t a = 0x0400; a <= 0x5fff; a++) {
+      uint8_t v = rand();
+      if (a < 0x0c00 && render->screen_mode == EWM_A2P_SCREEN_MODE_TEXT) {
+         v = 0xa0 + (v % 64);
+      }
+      mem_set_byte(two->cpu, a, v);
+   }
+
+   uint64_t start = ewm_bench_now();
+   for (int i = 0; i < EWM_BENCH_FRAMES; i++) {
+      two->screen_dirty = true;
+      ewm_scr_update(two->scr, 0, 0);
+   }
+   result->ns = ewm_bench_now() - start;
+   result->frames = EWM_BENCH_FRAMES;
+
+   ewm_two_destroy(two);
+   return 0;
+}
+
+static struct ewm_bench_workload_t ewm_bench_workloads[] = {
+   { "klaus_6502",    ewm_bench_klaus,  &ewm_bench_klaus_6502 },
+   { "klaus_65c02",   ewm_bench_klaus,  &ewm_bench_klaus_65c02 },
+   { "dos33_boot",    ewm_bench_boot,   NULL },
+   { "applesoft",     ewm_bench_basic,  NULL },
+   { "render_txt",    ewm_bench_render, &ewm_bench_render_txt },
+   { "render_lgr",    ewm_bench_render, &ewm_bench_render_lgr },
+   { "render_hgr",    ewm_bench_render, &ewm_bench_render_hgr },
+   { "render_hgr_color", ewm_bench_render, &ewm_bench_render_hgr_color },
+   { NULL, NULL, NULL }
+};
+
+static int ewm_bench_compare(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+   return (x > y) - (x < y);
+}
+
+// Nearest rank, so with few runs the p99 is simply the slowest run.
+static uint64_t ewm_bench_percentile(uint64_t *sorted, int n, int percentile) {
+   int rank = (n * percentile + 99) / 100;
+   return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static int ewm_bench_run(struct ewm_bench_t *bench, struct ewm_bench_workload_t *workload, bool first) {
+   // Instructions are counted in a run of its own because the profiler
+   // sends all memory accesses through the slow path.
+   struct ewm_bench_result_t counted = { 0 };
+   if (workload->fn(bench, workload->arg, true, &counted) != 0) {
+      return -1;
+   }
+
+   for (int i = 0; i < bench->warmup; i++) {
+      struct ewm_bench_result_t result = { 0 };
+      if (workload->fn(bench, workload->arg, false, &result) != 0) {
+         return -1;
+      }
+   }
+
+   uint64_t *ns = calloc(bench->runs, sizeof(uint64_t));
+   struct ewm_bench_result_t result = { 0 };
+   for (int i = 0; i < bench->runs; i++) {
+      if (workload->fn(bench, workload->arg, false, &result) != 0) {
+         free(ns);
+         return -1;
+      }
+      ns[i] = result.ns;
+   }
+
+   qsort(ns, bench->runs, sizeof(uint64_t), ewm_bench_compare);
+   uint64_t median = ewm_bench_percentile(ns, bench->runs, 50);
+   uint64_t p99 = ewm_bench_percentile(ns, bench->runs, 99);
+   uint64_t min = ns[0];
+   free(ns);
+
+   double seconds = (double) median / 1e9;
+   double mhz = result.cycles != 0 ? (double) result.cycles / seconds / 1e6 : 0.0;
+   double ns_per_instruction = counted.instructions != 0 ? (double) median / (double) counted.instructions : 0.0;
+   double fps = result.frames != 0 ? (double) result.frames / seconds : 0.0;
+
+   if (bench->json) {
+      printf("%s\n    {\"name\": \"%s\", \"runs\": %d, \"median_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64
+             ", \"cycles\": %" PRIu64 ", \"instructions\": %" PRIu64 ", \"frames\": %" PRIu64
+             ", \"mhz\": %.3f, \"ns_per_instruction\": %.3f, \"frames_per_second\": %.1f}",
+             first ? "" : ",", workload->name, bench->runs, median, p99, min,
+             result.cycles, counted.instructions, result.frames, mhz, ns_per_instruction, fps);
+   } else {
+      printf("%-18s %10.3f ms %10.3f ms", workload->name, (double) median / 1e6, (double) p99 / 1e6);
+      if (result.frames != 0) {
+         printf(" %12.1f frames/s\n", fps);
+      } else {
+         printf(" %8.2f MHz %8.2f ns/ins\n", mhz, ns_per_instruction);
+      }
+   }
+   fflush(stdout);
+
+   return 0;
+}
+
+static bool ewm_bench_selected(struct ewm_bench_workload_t *workload, int argc, char **argv) {
+   if (argc == 0) {
+      return true;
+   }
+   for (int i = 0; i < argc; i++) {
+      if (strcmp(argv[i], workload->name) == 0) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static void ewm_bench_usage() {
+   fprintf(stderr, "Usage: ewm_bench [--runs N] [--warmup N] [--json] [--disk path] [workload...]\n");
+   fprintf(stderr, "Workloads:");
+   for (struct ewm_bench_workload_t *w = ewm_bench_workloads; w->name != NULL; w++) {
+      fprintf(stderr, " %s", w->name);
+   }
+   fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+   struct ewm_bench_t bench = {
+      .runs = EWM_BENCH_RUNS_DEFAULT,
+      .warmup = EWM_BENCH_WARMUP_DEFAULT,
+      .json = false,
+      .disk = EWM_BENCH_DISK_DEFAULT
+   };
+
+   struct option options[] = {
+      { "runs",   required_argument, NULL, 'r' },
+      { "warmup", required_argument, NULL, 'w' },
+      { "json",   no_argument,       NULL, 'j' },
+      { "disk",   required_argument, NULL, 'd' },
+      { "help",   no_argument,       NULL, 'h' },
+      { NULL,     0,                 NULL, 0 }
+   };
+
+   int ch;
+   while ((ch = getopt_long(argc, argv, "", options, NULL)) != -1) {
+      switch (ch) {
+         case 'r':
+            bench.runs = atoi(optarg);
+            break;
+         case 'w':
+            bench.warmup = atoi(optarg);
+            break;
+         case 'j':
+            bench.json = true;
+            break;
+         case 'd':
+            bench.disk = optarg;
+            break;
+         default:
+            ewm_bench_usage();
+            return 1;
+      }
+   }
+
+   if (bench.runs < 1 || bench.warmup < 0) {
+      ewm_bench_usage();
+      return 1;
+   }
+
+   argc -= optind;
+   argv += optind;
+
+   for (int i = 0; i < argc; i++) {
+      struct ewm_bench_workload_t *w = ewm_bench_workloads;
+      while (w->name != NULL && strcmp(w->name, argv[i]) != 0) {
+         w++;
+      }
+      if (w->name == NULL) {
+         fprintf(stderr, "[BENCH] Unknown workload %s\n", argv[i]);
+         ewm_bench_usage();
+         return 1;
+      }
+   }
+
+   if (bench.json) {
+      printf("{\"runs\": %d, \"warmup\": %d, \"workloads\": [", bench.runs, bench.warmup);
+   } else {
+      printf("%-18s %13s %13s\n", "workload", "median", "p99");
+   }
+
+   int failures = 0;
+   bool first = true;
+   for (struct ewm_bench_workload_t *w = ewm_bench_workloads; w->name != NULL; w++) {
+      if (ewm_bench_selected(w, argc, argv)) {
+         if (ewm_bench_run(&bench, w, first) != 0) {
+            fprintf(stderr, "[BENCH] Workload %s failed\n", w->name);
+            failures++;
+         } else {
+            first = false;
+         }
+      }
+   }
+
+   if (bench.json) {
+      printf("\n]}\n");
+   }
+
+   ewm_rom_purge();
+
+   return failures == 0 ? 0 : 1;
+}
@@ -32,14 +32,14 @@ void cpu_format_state(struct cpu_t *cpu, char *buffer) {
    sprintf(buffer, "A=%.2X X=%.2X Y=%.2X S=%.2X SP=%.2X %c%c%c%c%c%c%c%c",
            cpu->state.a, cpu->state.x, cpu->state.y, _cpu_get_status(cpu), cpu->state.sp,
 
-           cpu->state.n ? 'N' : '-',
-           cpu->state.v ? 'V' : '-',
+           cpu_flag(cpu, n) ? 'N' : '-',
+           cpu_flag(cpu, v) ? 'V' : '-',
            '-',
-           cpu->state.b ? 'B' : '-',
-           cpu->state.d ? 'D' : '-',
-           cpu->state.i ? 'I' : '-',
-           cpu->state.z ? 'Z' : '-',
-           cpu->state.c ? 'C' : '-');
+           cpu_flag(cpu, b) ? 'B' : '-',
+           cpu_flag(cpu, d) ? 'D' : '-',
+           cpu_flag(cpu, i) ? 'I' : '-',
+           cpu_flag(cpu, z) ? 'Z' : '-',
+           cpu_flag(cpu, c) ? 'C' : '-');
 }
 
 void cpu_format_stack(struct cpu_t *cpu, char buffer[764]) {
@@ -64,7 +64,7 @@ void cpu_format_instruction(struct cpu_t *cpu, char *buffer) {
    *buffer = 0x00;
 
    uint8_t opcode = mem_get_byte(cpu, cpu->state.pc);
-   struct cpu_instruction_t *i = &cpu->instructions[opcode];
+   const struct cpu_instruction_t *i = &cpu->instructions[opcode];
 
    if (i->handler == NULL) {
       sprintf(buffer, "???");
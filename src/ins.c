@@ -32,24 +32,37 @@
 #include "ins.h"
 #include "cpu.h"
 #include "mem.h"
+#include "blk.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
 
 static void update_zn(struct cpu_t *cpu, uint8_t v) {
+#if defined(EWM_CPU_PACKED_STATUS)
+  cpu->state.p = (cpu->state.p & ~(EWM_CPU_FLAG_n | EWM_CPU_FLAG_z)) | (v & EWM_CPU_FLAG_n) | (v == 0x00 ? EWM_CPU_FLAG_z : 0);
+#else
   cpu->state.z = (v == 0x00);
   cpu->state.n = (v & 0x80);
+#endif
 }
 
 // EWM_CPU_MODEL_6502
 
 /* ADC */
 
-static void adc(struct cpu_t *cpu, uint8_t m) {
-   uint8_t c = cpu->state.c ? 1 : 0;
-   if (cpu->state.d) {
+// The model is a constant in every caller, so the checks on it fold
+// away. The NMOS 6502 takes n and v from the sum before the high digit
+// is adjusted and z from the binary sum, the 65C02 takes n and z from
+// the decimal result.
+
+static inline void adc(struct cpu_t *cpu, uint8_t m, int model) {
+   uint8_t c = cpu_flag(cpu, c) ? 1 : 0;
+   if (cpu_flag(cpu, d)) {
       uint8_t cb = 0;
 
+      // The 65C02 takes a cycle more to get the flags right
+      cpu->counter += (model == EWM_CPU_MODEL_65C02);
+
       uint8_t low = (cpu->state.a & 0x0f) + (m & 0x0f) + c;
       if ((low & 0xff) > 9) {
          low += 6;
@@ -59,58 +72,64 @@ static void adc(struct cpu_t *cpu, uint8_t m) {
       }
 
       uint8_t high = (cpu->state.a >> 4) + (m >> 4) + cb;
+      uint8_t t = (low & 0x0f) | ((high << 4) & 0xf0);
       if ((high & 0xff) > 9) {
          high += 6;
       }
       uint8_t r = (low & 0x0F) | ((high<<4)&0xF0);
 
-      cpu->state.c = (high > 15);
-      cpu->state.z = (r == 0);
-      cpu->state.n = (r & 0b10000000); // TODO Only on 6502? Does the 6502 test still pass?
-      cpu->state.v = 0;
+      cpu_set_flag(cpu, c, (high > 15));
+      cpu_set_flag(cpu, v, (cpu->state.a^t) & (m^t) & 0x80);
+      if (model == EWM_CPU_MODEL_6502) {
+         cpu_set_flag(cpu, z, ((uint8_t) (cpu->state.a + m + c) == 0));
+         cpu_set_flag(cpu, n, (t & 0b10000000));
+      } else {
+         cpu_set_flag(cpu, z, (r == 0));
+         cpu_set_flag(cpu, n, (r & 0b10000000));
+      }
 
       cpu->state.a = r;
    } else {
       uint16_t t = (uint16_t)cpu->state.a + (uint16_t)m + (uint16_t)c;
       uint8_t r = (int8_t)t;
-      cpu->state.c = (t & 0x0100) != 0;
-      cpu->state.v = (cpu->state.a^r) & (m^r) & 0x80;
+      cpu_set_flag(cpu, c, (t & 0x0100) != 0);
+      cpu_set_flag(cpu, v, (cpu->state.a^r) & (m^r) & 0x80);
       cpu->state.a = r;
       update_zn(cpu, cpu->state.a);
    }
 }
 
-static void adc_imm(struct cpu_t *cpu, uint8_t oper) {
-  adc(cpu, oper);
-}
-
-static void adc_zpg(struct cpu_t *cpu, uint8_t oper) {
-  adc(cpu, mem_get_byte_zpg(cpu, oper));
-}
-
-static void adc_zpgx(struct cpu_t *cpu, uint8_t oper) {
-  adc(cpu, mem_get_byte_zpgx(cpu, oper));
-}
-
-static void adc_abs(struct cpu_t *cpu, uint16_t oper) {
-  adc(cpu, mem_get_byte_abs(cpu, oper));
-}
-
-static void adc_absx(struct cpu_t *cpu, uint16_t oper) {
-  adc(cpu, mem_get_byte_absx(cpu, oper));
-}
-
-static void adc_absy(struct cpu_t *cpu, uint16_t oper) {
-  adc(cpu, mem_get_byte_absy(cpu, oper));
-}
-
-static void adc_indx(struct cpu_t *cpu, uint8_t oper) {
-  adc(cpu, mem_get_byte_indx(cpu, oper));
-}
+// The handlers of instructions that behave differently per model are
+// generated for each model from the same source.
+
+#define EWM_ADC_HANDLERS(model) \
+  static void adc_imm_##model(struct cpu_t *cpu, uint8_t oper) { \
+    adc(cpu, oper, EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_zpg_##model(struct cpu_t *cpu, uint8_t oper) { \
+    adc(cpu, mem_get_byte_zpg(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_zpgx_##model(struct cpu_t *cpu, uint8_t oper) { \
+    adc(cpu, mem_get_byte_zpgx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_abs_##model(struct cpu_t *cpu, uint16_t oper) { \
+    adc(cpu, mem_get_byte_abs(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_absx_##model(struct cpu_t *cpu, uint16_t oper) { \
+    adc(cpu, mem_get_byte_absx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_absy_##model(struct cpu_t *cpu, uint16_t oper) { \
+    adc(cpu, mem_get_byte_absy(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_indx_##model(struct cpu_t *cpu, uint8_t oper) { \
+    adc(cpu, mem_get_byte_indx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void adc_indy_##model(struct cpu_t *cpu, uint8_t oper) { \
+    adc(cpu, mem_get_byte_indy(cpu, oper), EWM_CPU_MODEL_##model); \
+  }
 
-static void adc_indy(struct cpu_t *cpu, uint8_t oper) {
-  adc(cpu, mem_get_byte_indy(cpu, oper));
-}
+EWM_ADC_HANDLERS(6502)
+EWM_ADC_HANDLERS(65C02)
 
 /* AND */
 
@@ -154,10 +173,10 @@ static void and_indy(struct cpu_t *cpu, uint8_t oper) {
 /* ASL */
 
 static uint8_t asl(struct cpu_t *cpu, uint8_t b) {
-  cpu->state.c = (b & 0x80);
+  cpu_set_flag(cpu, c, (b & 0x80));
   b <<= 1;
-  cpu->state.n = (b & 0x80);
-  cpu->state.z = (b == 0);
+  cpu_set_flag(cpu, n, (b & 0x80));
+  cpu_set_flag(cpu, z, (b == 0));
   return b;
 }
 
@@ -185,9 +204,9 @@ static void asl_absx(struct cpu_t *cpu, uint16_t oper) {
 
 static void bit(struct cpu_t *cpu, uint8_t m) {
   uint8_t t = cpu->state.a & m;
-  cpu->state.n = (m & 0x80);
-  cpu->state.v = (m & 0x40);
-  cpu->state.z = (t == 0);
+  cpu_set_flag(cpu, n, (m & 0x80));
+  cpu_set_flag(cpu, v, (m & 0x40));
+  cpu_set_flag(cpu, z, (t == 0));
 }
 
 static void bit_zpg(struct cpu_t *cpu, uint8_t oper) {
@@ -200,89 +219,88 @@ static void bit_abs(struct cpu_t *cpu, uint16_t oper) {
 
 /* Bxx Branches */
 
+// A taken branch costs a cycle, and another one when it lands on a
+// different page than the next instruction. Both are added without
+// branching on the condition.
+
+static inline void branch(struct cpu_t *cpu, bool taken, uint8_t oper) {
+  uint16_t target = cpu->state.pc + (int8_t) oper;
+  cpu->counter += taken + (taken & ((cpu->state.pc ^ target) >> 8) & 1);
+  cpu->state.pc = taken ? target : cpu->state.pc;
+}
+
 static void bcc(struct cpu_t *cpu, uint8_t oper) {
-  if (cpu->state.c == 0) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, cpu_flag(cpu, c) == 0, oper);
 }
 
 static void bcs(struct cpu_t *cpu, uint8_t oper) {
-  if (cpu->state.c) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, cpu_flag(cpu, c), oper);
 }
 
 static void beq(struct cpu_t *cpu, uint8_t oper) {
-  if (cpu->state.z) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, cpu_flag(cpu, z), oper);
 }
 
 static void bmi(struct cpu_t *cpu, uint8_t oper) {
-  if (cpu->state.n) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, cpu_flag(cpu, n), oper);
 }
 
 static void bne(struct cpu_t *cpu, uint8_t oper) {
-  if (!cpu->state.z) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, !cpu_flag(cpu, z), oper);
 }
 
 static void bpl(struct cpu_t *cpu, uint8_t oper) {
-  if (!cpu->state.n) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, !cpu_flag(cpu, n), oper);
 }
 
 static void bvc(struct cpu_t *cpu, uint8_t oper) {
-  if (!cpu->state.v) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, !cpu_flag(cpu, v), oper);
 }
 
 static void bvs(struct cpu_t *cpu, uint8_t oper) {
-  if (cpu->state.v) {
-    cpu->state.pc += (int8_t) oper;
-  }
+  branch(cpu, cpu_flag(cpu, v), oper);
 }
 
 /* BRK */
 
-static void brk(struct cpu_t *cpu) {
-  cpu->state.b = 1;
-  if (cpu->model == EWM_CPU_MODEL_65C02) {
-     cpu->state.d = 0;
-  }
-  cpu_irq(cpu);
+// Only the 65C02 clears the decimal flag
+
+static void brk_6502(struct cpu_t *cpu) {
+  cpu_set_flag(cpu, b, 1);
+  cpu_brk(cpu);
+}
+
+static void brk_65C02(struct cpu_t *cpu) {
+  cpu_set_flag(cpu, b, 1);
+  cpu_set_flag(cpu, d, 0);
+  cpu_brk(cpu);
 }
 
 /* CLx */
 
 static void clc(struct cpu_t *cpu) {
-  cpu->state.c = 0;
+  cpu_set_flag(cpu, c, 0);
 }
 
 static void cld(struct cpu_t *cpu) {
-  cpu->state.d = 0;
+  cpu_set_flag(cpu, d, 0);
 }
 
 static void cli(struct cpu_t *cpu) {
-  cpu->state.i = 0;
+  cpu_set_flag(cpu, i, 0);
 }
 
 static void clv(struct cpu_t *cpu) {
-  cpu->state.v = 0;
+  cpu_set_flag(cpu, v, 0);
 }
 
 /* CMP */
 
 static void cmp(struct cpu_t *cpu, uint8_t m) {
   uint8_t t = cpu->state.a - m;
-  cpu->state.c = (cpu->state.a >= m);
-  cpu->state.n = (t & 0x80);
-  cpu->state.z = (t == 0);
+  cpu_set_flag(cpu, c, (cpu->state.a >= m));
+  cpu_set_flag(cpu, n, (t & 0x80));
+  cpu_set_flag(cpu, z, (t == 0));
 }
 
 static void cmp_imm(struct cpu_t *cpu, uint8_t oper) {
@@ -321,7 +339,7 @@ static void cmp_indy(struct cpu_t *cpu, uint8_t oper) {
 
 static void cpx(struct cpu_t *cpu, uint8_t m) {
   uint8_t t = cpu->state.x - m;
-  cpu->state.c = (cpu->state.x >= m);
+  cpu_set_flag(cpu, c, (cpu->state.x >= m));
   update_zn(cpu, t);
 }
 
@@ -341,7 +359,7 @@ static void cpx_abs(struct cpu_t *cpu, uint16_t oper) {
 
 static void cpy(struct cpu_t *cpu, uint8_t m) {
   uint8_t t = cpu->state.y - m;
-  cpu->state.c = (cpu->state.y >= m);
+  cpu_set_flag(cpu, c, (cpu->state.y >= m));
   update_zn(cpu, t);
 }
 
@@ -470,7 +488,16 @@ static void jmp_abs(struct cpu_t *cpu, uint16_t oper) {
   cpu->state.pc = oper;
 }
 
-static void jmp_ind(struct cpu_t *cpu, uint16_t oper) {
+// The 6502 does not carry into the high byte of the pointer, so a
+// pointer at $xxFF takes its high byte from $xx00. The 65C02 fixed
+// that, at the cost of a cycle.
+
+static void jmp_ind_6502(struct cpu_t *cpu, uint16_t oper) {
+  uint16_t hi = (oper & 0xff00) | ((oper + 1) & 0x00ff);
+  cpu->state.pc = mem_get_byte(cpu, oper) | (mem_get_byte(cpu, hi) << 8);
+}
+
+static void jmp_ind_65C02(struct cpu_t *cpu, uint16_t oper) {
   cpu->state.pc = mem_get_word(cpu, oper);
 }
 
@@ -580,7 +607,7 @@ static void ldy_absx(struct cpu_t *cpu, uint16_t oper) {
 /* LSR */
 
 static uint8_t lsr(struct cpu_t *cpu, uint8_t b) {
-  cpu->state.c = (b & 1);
+  cpu_set_flag(cpu, c, (b & 1));
   b >>= 1;
   update_zn(cpu, b);
   return b;
@@ -672,8 +699,8 @@ static void plp(struct cpu_t *cpu) {
 /* ROL */
 
 static uint8_t rol(struct cpu_t* cpu, uint8_t b) {
-  uint8_t carry = cpu->state.c ? 1 : 0;
-  cpu->state.c = (b & 0x80);
+  uint8_t carry = cpu_flag(cpu, c) ? 1 : 0;
+  cpu_set_flag(cpu, c, (b & 0x80));
   b = (b << 1) | carry;
   update_zn(cpu, b);
   return b;
@@ -702,8 +729,8 @@ static void rol_absx(struct cpu_t *cpu, uint16_t oper) {
 /* ROR */
 
 static uint8_t ror(struct cpu_t* cpu, uint8_t b) {
-  uint8_t carry = cpu->state.c ? 1 : 0;
-  cpu->state.c = (b & 0x01);
+  uint8_t carry = cpu_flag(cpu, c) ? 1 : 0;
+  cpu_set_flag(cpu, c, (b & 0x01));
   b = (b >> 1) | (carry << 7);
   update_zn(cpu, b);
   return b;
@@ -744,11 +771,16 @@ static void rts(struct cpu_t *cpu) {
 
 /* SBC */
 
-static void sbc(struct cpu_t *cpu, uint8_t m) {
-   uint8_t c = cpu->state.c ? 1 : 0;
-   if (cpu->state.d) {
+// In decimal mode the flags are those of the binary subtraction, but
+// the 65C02 takes n and z from the decimal result.
+
+static inline void sbc(struct cpu_t *cpu, uint8_t m, int model) {
+   uint8_t c = cpu_flag(cpu, c) ? 1 : 0;
+   if (cpu_flag(cpu, d)) {
       uint8_t cb = 0;
 
+      cpu->counter += (model == EWM_CPU_MODEL_65C02);
+
       if (c == 0) {
          c = 1;
       } else {
@@ -768,63 +800,68 @@ static void sbc(struct cpu_t *cpu, uint8_t m) {
          high -= 6;
       }
 
-      int8_t result = (low & 0x0F) | (high << 4);
+      uint8_t result = (low & 0x0F) | (high << 4);
+
+      uint16_t t = (uint16_t) cpu->state.a - (uint16_t) m - (uint16_t) c;
+      uint8_t r = (uint8_t) t;
 
-      cpu->state.c = (high & 0xff) < 15;
-      cpu->state.z = (result == 0);
-      cpu->state.n = (result & 0b10000000); // TODO Only on 6502? Does the 6502 test still pass?
-      cpu->state.v = 0;
+      cpu_set_flag(cpu, c, (t & 0x0100) == 0);
+      cpu_set_flag(cpu, v, (cpu->state.a^m) & (cpu->state.a^r) & 0x80);
+      if (model == EWM_CPU_MODEL_6502) {
+         cpu_set_flag(cpu, z, (r == 0));
+         cpu_set_flag(cpu, n, (r & 0b10000000));
+      } else {
+         cpu_set_flag(cpu, z, (result == 0));
+         cpu_set_flag(cpu, n, (result & 0b10000000));
+      }
 
       cpu->state.a = result;
    } else {
-      adc(cpu, m ^ 0xff);
+      adc(cpu, m ^ 0xff, model);
    }
 }
 
-static void sbc_imm(struct cpu_t *cpu, uint8_t oper) {
-  sbc(cpu, oper);
-}
-
-static void sbc_zpg(struct cpu_t *cpu, uint8_t oper) {
-  sbc(cpu, mem_get_byte_zpg(cpu, oper));
-}
-
-static void sbc_zpgx(struct cpu_t *cpu, uint8_t oper) {
-  sbc(cpu, mem_get_byte_zpgx(cpu, oper));
-}
-
-static void sbc_abs(struct cpu_t *cpu, uint16_t oper) {
-  sbc(cpu, mem_get_byte_abs(cpu, oper));
-}
-
-static void sbc_absx(struct cpu_t *cpu, uint16_t oper) {
-  sbc(cpu, mem_get_byte_absx(cpu, oper));
-}
-
-static void sbc_absy(struct cpu_t *cpu, uint16_t oper) {
-  sbc(cpu, mem_get_byte_absy(cpu, oper));
-}
-
-static void sbc_indx(struct cpu_t *cpu, uint8_t oper) {
-  sbc(cpu, mem_get_byte_indx(cpu, oper));
-}
+#define EWM_SBC_HANDLERS(model) \
+  static void sbc_imm_##model(struct cpu_t *cpu, uint8_t oper) { \
+    sbc(cpu, oper, EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_zpg_##model(struct cpu_t *cpu, uint8_t oper) { \
+    sbc(cpu, mem_get_byte_zpg(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_zpgx_##model(struct cpu_t *cpu, uint8_t oper) { \
+    sbc(cpu, mem_get_byte_zpgx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_abs_##model(struct cpu_t *cpu, uint16_t oper) { \
+    sbc(cpu, mem_get_byte_abs(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_absx_##model(struct cpu_t *cpu, uint16_t oper) { \
+    sbc(cpu, mem_get_byte_absx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_absy_##model(struct cpu_t *cpu, uint16_t oper) { \
+    sbc(cpu, mem_get_byte_absy(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_indx_##model(struct cpu_t *cpu, uint8_t oper) { \
+    sbc(cpu, mem_get_byte_indx(cpu, oper), EWM_CPU_MODEL_##model); \
+  } \
+  static void sbc_indy_##model(struct cpu_t *cpu, uint8_t oper) { \
+    sbc(cpu, mem_get_byte_indy(cpu, oper), EWM_CPU_MODEL_##model); \
+  }
 
-static void sbc_indy(struct cpu_t *cpu, uint8_t oper) {
-  sbc(cpu, mem_get_byte_indy(cpu, oper));
-}
+EWM_SBC_HANDLERS(6502)
+EWM_SBC_HANDLERS(65C02)
 
 /* SEx */
 
 static void sec(struct cpu_t *cpu) {
-  cpu->state.c = 1;
+  cpu_set_flag(cpu, c, 1);
 }
 
 static void sed(struct cpu_t *cpu) {
-  cpu->state.d = 1;
+  cpu_set_flag(cpu, d, 1);
 }
 
 static void sei(struct cpu_t *cpu) {
-  cpu->state.i = 1;
+  cpu_set_flag(cpu, i, 1);
 }
 
 /* STA */
@@ -922,274 +959,286 @@ static void unimplemented(struct cpu_t *cpu) {
 
 /* Instruction dispatch table */
 
-struct cpu_instruction_t instructions[256] = {
-  /* 0x00 */ { "BRK", 0x00, 1, 2,  3, (void*) brk, -2, -2 },
-  /* 0x01 */ { "ORA", 0x01, 2, 6,  0, (void*) ora_indx, -2, -2 },
-  /* 0x02 */ { "???", 0x02, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x03 */ { "???", 0x03, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x04 */ { "???", 0x04, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x05 */ { "ORA", 0x05, 2, 2,  0, (void*) ora_zpg, -2, -2 },
-  /* 0x06 */ { "ASL", 0x06, 2, 5,  0, (void*) asl_zpg, -2, -2 },
-  /* 0x07 */ { "???", 0x07, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x08 */ { "PHP", 0x08, 1, 3,  0, (void*) php, -2, -2 },
-  /* 0x09 */ { "ORA", 0x09, 2, 2,  0, (void*) ora_imm, -2, -2 },
-  /* 0x0a */ { "ASL", 0x0a, 1, 2,  0, (void*) asl_acc, -2, -2 },
-  /* 0x0b */ { "???", 0x0b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x0c */ { "???", 0x0c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x0d */ { "ORA", 0x0d, 3, 4,  0, (void*) ora_abs, -2, -2 },
-  /* 0x0e */ { "ASL", 0x0e, 3, 6,  0, (void*) asl_abs, -2, -2 },
-  /* 0x0f */ { "???", 0x0f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x10 */ { "BPL", 0x10, 2, 2,  0, (void*) bpl, -2, -2 },
-  /* 0x11 */ { "ORA", 0x11, 2, 5,  0, (void*) ora_indy, -2, -2 },
-  /* 0x12 */ { "???", 0x12, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x13 */ { "???", 0x13, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x14 */ { "???", 0x14, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x15 */ { "ORA", 0x15, 2, 3,  0, (void*) ora_zpgx, -2, -2 },
-  /* 0x16 */ { "ASL", 0x16, 2, 6,  0, (void*) asl_zpgx, -2, -2 },
-  /* 0x17 */ { "???", 0x17, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x18 */ { "CLC", 0x18, 1, 2,  0, (void*) clc, -2, -2 },
-  /* 0x19 */ { "ORA", 0x19, 3, 4,  0, (void*) ora_absy, -2, -2 },
-  /* 0x1a */ { "???", 0x1a, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x1b */ { "???", 0x1b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x1c */ { "???", 0x1c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x1d */ { "ORA", 0x1d, 3, 4,  0, (void*) ora_absx, -2, -2 },
-  /* 0x1e */ { "ASL", 0x1e, 3, 7,  0, (void*) asl_absx, -2, -2 },
-  /* 0x1f */ { "???", 0x1f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0x20 */ { "JSR", 0x20, 3, 6,  2, (void*) jsr_abs, -2, -2 },
-  /* 0x21 */ { "AND", 0x21, 2, 6,  0, (void*) and_indx, -2, -2 },
-  /* 0x22 */ { "???", 0x22, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x23 */ { "???", 0x23, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x24 */ { "BIT", 0x24, 2, 3,  0, (void*) bit_zpg, -2, -2 },
-  /* 0x25 */ { "AND", 0x25, 2, 3,  0, (void*) and_zpg, -2, -2 },
-  /* 0x26 */ { "ROL", 0x26, 2, 5,  0, (void*) rol_zpg, -2, -2 },
-  /* 0x27 */ { "???", 0x27, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x28 */ { "PLP", 0x28, 1, 4,  0, (void*) plp, -2, -2 },
-  /* 0x29 */ { "AND", 0x29, 2, 2,  0, (void*) and_imm, -2, -2 },
-  /* 0x2a */ { "ROL", 0x2a, 1, 2,  0, (void*) rol_acc, -2, -2 },
-  /* 0x2b */ { "???", 0x2b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x2c */ { "BIT", 0x2c, 3, 4,  0, (void*) bit_abs, -2, -2 },
-  /* 0x2d */ { "AND", 0x2d, 3, 4,  0, (void*) and_abs, -2, -2 },
-  /* 0x2e */ { "ROL", 0x2e, 3, 6,  0, (void*) rol_abs, -2, -2 },
-  /* 0x2f */ { "???", 0x2f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x30 */ { "BMI", 0x30, 2, 2,  0, (void*) bmi, -2, -2 },
-  /* 0x31 */ { "AND", 0x31, 2, 5,  0, (void*) and_indy, -2, -2 },
-  /* 0x32 */ { "???", 0x32, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x33 */ { "???", 0x33, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x34 */ { "???", 0x34, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x35 */ { "AND", 0x35, 2, 4,  0, (void*) and_zpgx, -2, -2 },
-  /* 0x36 */ { "ROL", 0x36, 2, 6,  0, (void*) rol_zpgx, -2, -2 },
-  /* 0x37 */ { "???", 0x37, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x38 */ { "SEC", 0x38, 1, 2,  0, (void*) sec, -2, -2 },
-  /* 0x39 */ { "AND", 0x39, 3, 4,  0, (void*) and_absy, -2, -2 },
-  /* 0x3a */ { "???", 0x3a, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x3b */ { "???", 0x3b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x3c */ { "???", 0x3c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x3d */ { "AND", 0x3d, 3, 4,  0, (void*) and_absx, -2, -2 },
-  /* 0x3e */ { "ROL", 0x3e, 3, 7,  0, (void*) rol_absx, -2, -2 },
-  /* 0x3f */ { "???", 0x3f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0x40 */ { "RTI", 0x40, 1, 6, -3, (void*) rti, -2, -2 },
-  /* 0x41 */ { "EOR", 0x41, 2, 6,  0, (void*) eor_indx, -2, -2 },
-  /* 0x42 */ { "???", 0x42, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x43 */ { "???", 0x43, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x44 */ { "???", 0x44, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x45 */ { "EOR", 0x45, 2, 3,  0, (void*) eor_zpg, -2, -2 },
-  /* 0x46 */ { "LSR", 0x46, 2, 5,  0, (void*) lsr_zpg, -2, -2 },
-  /* 0x47 */ { "???", 0x47, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x48 */ { "PHA", 0x48, 1, 3,  1, (void*) pha, -2, -2 },
-  /* 0x49 */ { "EOR", 0x49, 2, 2,  0, (void*) eor_imm, -2, -2 },
-  /* 0x4a */ { "LSR", 0x4a, 1, 2,  0, (void*) lsr_acc, -2, -2 },
-  /* 0x4b */ { "???", 0x4b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x4c */ { "JMP", 0x4c, 3, 3,  0, (void*) jmp_abs, -2, -2 },
-  /* 0x4d */ { "EOR", 0x4d, 3, 4,  0, (void*) eor_abs, -2, -2 },
-  /* 0x4e */ { "LSR", 0x4e, 3, 6,  0, (void*) lsr_abs, -2, -2 },
-  /* 0x4f */ { "???", 0x4f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x50 */ { "BVC", 0x50, 2, 2,  0, (void*) bvc, -2, -2 },
-  /* 0x51 */ { "EOR", 0x51, 2, 5,  0, (void*) eor_indy, -2, -2 },
-  /* 0x52 */ { "???", 0x52, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x53 */ { "???", 0x53, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x54 */ { "???", 0x54, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x55 */ { "EOR", 0x55, 2, 4,  0, (void*) eor_zpgx, -2, -2 },
-  /* 0x56 */ { "LSR", 0x56, 2, 6,  0, (void*) lsr_zpgx, -2, -2 },
-  /* 0x57 */ { "???", 0x57, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x58 */ { "CLI", 0x58, 1, 2,  0, (void*) cli, -2, -2 },
-  /* 0x59 */ { "EOR", 0x59, 3, 4,  0, (void*) eor_absy, -2, -2 },
-  /* 0x5a */ { "???", 0x5a, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x5b */ { "???", 0x5b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x5c */ { "???", 0x5c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x5d */ { "EOR", 0x5d, 3, 4,  0, (void*) eor_absx, -2, -2 },
-  /* 0x5e */ { "LSR", 0x5e, 3, 7,  0, (void*) lsr_absx, -2, -2 },
-  /* 0x5f */ { "???", 0x5f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0x60 */ { "RTS", 0x60, 1, 6, -2, (void*) rts, -2, -2 },
-  /* 0x61 */ { "ADC", 0x61, 2, 6,  0, (void*) adc_indx, -2, -2 },
-  /* 0x62 */ { "???", 0x62, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x63 */ { "???", 0x63, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x64 */ { "???", 0x64, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x65 */ { "ADC", 0x65, 2, 3,  0, (void*) adc_zpg, -2, -2 },
-  /* 0x66 */ { "ROR", 0x66, 2, 5,  0, (void*) ror_zpg, -2, -2 },
-  /* 0x67 */ { "???", 0x67, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x68 */ { "PLA", 0x68, 1, 4, -1, (void*) pla, -2, -2 },
-  /* 0x69 */ { "ADC", 0x69, 2, 2,  0, (void*) adc_imm, -2, -2 },
-  /* 0x6a */ { "ROR", 0x6a, 1, 2,  0, (void*) ror_acc, -2, -2 },
-  /* 0x6b */ { "???", 0x6b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x6c */ { "JMP", 0x6c, 3, 5,  0, (void*) jmp_ind, -2, -2 },
-  /* 0x6d */ { "ADC", 0x6d, 3, 4,  0, (void*) adc_abs, -2, -2 },
-  /* 0x6e */ { "ROR", 0x6e, 3, 6,  0, (void*) ror_abs, -2, -2 },
-  /* 0x6f */ { "???", 0x6f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x70 */ { "BVS", 0x70, 2, 2,  0, (void*) bvs, -2, -2 },
-  /* 0x71 */ { "ADC", 0x71, 2, 5,  0, (void*) adc_indy, -2, -2 },
-  /* 0x72 */ { "???", 0x72, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x73 */ { "???", 0x73, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x74 */ { "???", 0x74, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x75 */ { "ADC", 0x75, 2, 4,  0, (void*) adc_zpgx, -2, -2 },
-  /* 0x76 */ { "ROR", 0x76, 2, 6,  0, (void*) ror_zpgx, -2, -2 },
-  /* 0x77 */ { "???", 0x77, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x78 */ { "SEI", 0x78, 1, 2,  0, (void*) sei, -2, -2 },
-  /* 0x79 */ { "ADC", 0x79, 3, 4,  0, (void*) adc_absy, -2, -2 },
-  /* 0x7a */ { "???", 0x7a, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x7b */ { "???", 0x7b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x7c */ { "???", 0x7c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x7d */ { "ADC", 0x7d, 3, 4,  0, (void*) adc_absx, -2, -2 },
-  /* 0x7e */ { "ROR", 0x7e, 3, 7,  0, (void*) ror_absx, -2, -2 },
-  /* 0x7f */ { "???", 0x7f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0x80 */ { "???", 0x80, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x81 */ { "STA", 0x81, 2, 6,  0, (void*) sta_indx, -2, -2 },
-  /* 0x82 */ { "???", 0x82, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x83 */ { "???", 0x83, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x84 */ { "STY", 0x84, 2, 3,  0, (void*) sty_zpg, -2, -2 },
-  /* 0x85 */ { "STA", 0x85, 2, 3,  0, (void*) sta_zpg, -2, -2 },
-  /* 0x86 */ { "STX", 0x86, 2, 3,  0, (void*) stx_zpg, -2, -2 },
-  /* 0x87 */ { "???", 0x87, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x88 */ { "DEY", 0x88, 1, 2,  0, (void*) dey, -2, -2 },
-  /* 0x89 */ { "???", 0x89, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x8a */ { "TXA", 0x8a, 1, 2,  0, (void*) txa, -2, -2 },
-  /* 0x8b */ { "???", 0x8b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x8c */ { "STY", 0x8c, 3, 4,  0, (void*) sty_abs, -2, -2 },
-  /* 0x8d */ { "STA", 0x8d, 3, 4,  0, (void*) sta_abs, -2, -2 },
-  /* 0x8e */ { "STX", 0x8e, 3, 4,  0, (void*) stx_abs, -2, -2 },
-  /* 0x8f */ { "???", 0x8f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x90 */ { "BCC", 0x90, 2, 2,  0, (void*) bcc, -2, -2 },
-  /* 0x91 */ { "STA", 0x91, 2, 6,  0, (void*) sta_indy, -2, -2 },
-  /* 0x92 */ { "???", 0x92, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x93 */ { "???", 0x93, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x94 */ { "STY", 0x94, 2, 4,  0, (void*) sty_zpgx, -2, -2 },
-  /* 0x95 */ { "STA", 0x95, 2, 4,  0, (void*) sta_zpgx, -2, -2 },
-  /* 0x96 */ { "STX", 0x96, 2, 4,  0, (void*) stx_zpgy, -2, -2 },
-  /* 0x97 */ { "???", 0x97, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x98 */ { "TYA", 0x98, 1, 2,  0, (void*) tya, -2, -2 },
-  /* 0x99 */ { "STA", 0x99, 3, 5,  0, (void*) sta_absy, -2, -2 },
-  /* 0x9a */ { "TXS", 0x9a, 1, 2,  0, (void*) txs, -2, -2 },
-  /* 0x9b */ { "???", 0x9b, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x9c */ { "???", 0x9c, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x9d */ { "STA", 0x9d, 3, 5,  0, (void*) sta_absx, -2, -2 },
-  /* 0x9e */ { "???", 0x9e, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0x9f */ { "???", 0x9f, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0xa0 */ { "LDY", 0xa0, 2, 2,  0, (void*) ldy_imm, -2, -2 },
-  /* 0xa1 */ { "LDA", 0xa1, 2, 6,  0, (void*) lda_indx, -2, -2 },
-  /* 0xa2 */ { "LDX", 0xa2, 2, 2,  0, (void*) ldx_imm, -2, -2 },
-  /* 0xa3 */ { "???", 0xa3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xa4 */ { "LDY", 0xa4, 2, 3,  0, (void*) ldy_zpg, -2, -2 },
-  /* 0xa5 */ { "LDA", 0xa5, 2, 3,  0, (void*) lda_zpg, -2, -2 },
-  /* 0xa6 */ { "LDX", 0xa6, 2, 3,  0, (void*) ldx_zpg, -2, -2 },
-  /* 0xa7 */ { "???", 0xa7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xa8 */ { "TAY", 0xa8, 1, 2,  0, (void*) tay, -2, -2 },
-  /* 0xa9 */ { "LDA", 0xa9, 2, 2,  0, (void*) lda_imm, -2, -2 },
-  /* 0xaa */ { "TAX", 0xaa, 1, 2,  0, (void*) tax, -2, -2 },
-  /* 0xab */ { "???", 0xab, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xac */ { "LDY", 0xac, 3, 4,  0, (void*) ldy_abs, -2, -2 },
-  /* 0xad */ { "LDA", 0xad, 3, 4,  0, (void*) lda_abs, -2, -2 },
-  /* 0xae */ { "LDX", 0xae, 3, 4,  0, (void*) ldx_abs, -2, -2 },
-  /* 0xaf */ { "???", 0xaf, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xb0 */ { "BCS", 0xb0, 2, 2,  0, (void*) bcs, -2, -2 },
-  /* 0xb1 */ { "LDA", 0xb1, 2, 5,  0, (void*) lda_indy, -2, -2 },
-  /* 0xb2 */ { "???", 0xb2, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xb3 */ { "???", 0xb3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xb4 */ { "LDY", 0xb4, 2, 4,  0, (void*) ldy_zpgx, -2, -2 },
-  /* 0xb5 */ { "LDA", 0xb5, 2, 4,  0, (void*) lda_zpgx, -2, -2 },
-  /* 0xb6 */ { "LDX", 0xb6, 2, 4,  0, (void*) ldx_zpgy, -2, -2 },
-  /* 0xb7 */ { "???", 0xb7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xb8 */ { "CLV", 0xb8, 1, 2,  0, (void*) clv, -2, -2 },
-  /* 0xb9 */ { "LDA", 0xb9, 3, 4,  0, (void*) lda_absy, -2, -2 },
-  /* 0xba */ { "TSX", 0xba, 1, 2,  0, (void*) tsx, -2, -2 },
-  /* 0xbb */ { "???", 0xbb, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xbc */ { "LDY", 0xbc, 3, 4,  0, (void*) ldy_absx, -2, -2 },
-  /* 0xbd */ { "LDA", 0xbd, 3, 4,  0, (void*) lda_absx, -2, -2 },
-  /* 0xbe */ { "LDX", 0xbe, 3, 4,  0, (void*) ldx_absy, -2, -2 },
-  /* 0xbf */ { "???", 0xbf, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0xc0 */ { "CPY", 0xc0, 2, 2,  0, (void*) cpy_imm, -2, -2 },
-  /* 0xc1 */ { "CMP", 0xc1, 2, 6,  0, (void*) cmp_indx, -2, -2 },
-  /* 0xc2 */ { "???", 0xc2, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xc3 */ { "???", 0xc3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xc4 */ { "CPY", 0xc4, 2, 3,  0, (void*) cpy_zpg, -2, -2 },
-  /* 0xc5 */ { "CMP", 0xc5, 2, 3,  0, (void*) cmp_zpg, -2, -2 },
-  /* 0xc6 */ { "DEC", 0xc6, 2, 5,  0, (void*) dec_zpg, -2, -2 },
-  /* 0xc7 */ { "???", 0xc7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xc8 */ { "INY", 0xc8, 1, 2,  0, (void*) iny, -2, -2 },
-  /* 0xc9 */ { "CMP", 0xc9, 2, 2,  0, (void*) cmp_imm, -2, -2 },
-  /* 0xca */ { "DEX", 0xca, 1, 2,  0, (void*) dex, -2, -2 },
-  /* 0xcb */ { "???", 0xcb, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xcc */ { "CPY", 0xcc, 3, 4,  0, (void*) cpy_abs, -2, -2 },
-  /* 0xcd */ { "CMP", 0xcd, 3, 4,  0, (void*) cmp_abs, -2, -2 },
-  /* 0xce */ { "DEC", 0xce, 3, 3,  0, (void*) dec_abs, -2, -2 },
-  /* 0xcf */ { "???", 0xcf, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xd0 */ { "BNE", 0xd0, 2, 2,  0, (void*) bne, -2, -2 },
-  /* 0xd1 */ { "CMP", 0xd1, 2, 5,  0, (void*) cmp_indy, -2, -2 },
-  /* 0xd2 */ { "???", 0xd2, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xd3 */ { "???", 0xd3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xd4 */ { "???", 0xd4, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xd5 */ { "CMP", 0xd5, 2, 4,  0, (void*) cmp_zpgx, -2, -2 },
-  /* 0xd6 */ { "DEC", 0xd6, 2, 6,  0, (void*) dec_zpgx, -2, -2 },
-  /* 0xd7 */ { "???", 0xd7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xd8 */ { "CLD", 0xd8, 1, 2,  0, (void*) cld, -2, -2 },
-  /* 0xd9 */ { "CMP", 0xd9, 3, 4,  0, (void*) cmp_absy, -2, -2 },
-  /* 0xda */ { "???", 0xda, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xdb */ { "???", 0xdb, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xdc */ { "???", 0xdc, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xdd */ { "CMP", 0xdd, 3, 4,  0, (void*) cmp_absx, -2, -2 },
-  /* 0xde */ { "DEC", 0xde, 3, 7,  0, (void*) dec_absx, -2, -2 },
-  /* 0xdf */ { "???", 0xdf, 1, 2,  0, (void*) unimplemented, -2, -2 },
-
-  /* 0xe0 */ { "CPX", 0xe0, 2, 2,  0, (void*) cpx_imm, -2, -2 },
-  /* 0xe1 */ { "SBC", 0xe1, 2, 2,  0, (void*) sbc_indx, -2, -2 },
-  /* 0xe2 */ { "???", 0xe2, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xe3 */ { "???", 0xe3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xe4 */ { "CPX", 0xe4, 2, 3,  0, (void*) cpx_zpg, -2, -2 },
-  /* 0xe5 */ { "SBC", 0xe5, 2, 2,  0, (void*) sbc_zpg, -2, -2 },
-  /* 0xe6 */ { "INC", 0xe6, 2, 5,  0, (void*) inc_zpg, -2, -2 },
-  /* 0xe7 */ { "???", 0xe7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xe8 */ { "INX", 0xe8, 1, 2,  0, (void*) inx, -2, -2 },
-  /* 0xe9 */ { "SBC", 0xe9, 2, 2,  0, (void*) sbc_imm, -2, -2 },
-  /* 0xea */ { "NOP", 0xea, 1, 2,  0, (void*) nop, -2, -2 },
-  /* 0xeb */ { "???", 0xeb, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xec */ { "CPX", 0xec, 3, 4,  0, (void*) cpx_abs, -2, -2 },
-  /* 0xed */ { "SBC", 0xed, 3, 2,  0, (void*) sbc_abs, -2, -2 },
-  /* 0xee */ { "INC", 0xee, 3, 6,  0, (void*) inc_abs, -2, -2 },
-  /* 0xef */ { "???", 0xef, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xf0 */ { "BEQ", 0xf0, 2, 2,  0, (void*) beq, -2, -2 },
-  /* 0xf1 */ { "SBC", 0xf1, 2, 2,  0, (void*) sbc_indy, -2, -2 },
-  /* 0xf2 */ { "???", 0xf2, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xf3 */ { "???", 0xf3, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xf4 */ { "???", 0xf4, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xf5 */ { "SBC", 0xf5, 2, 2,  0, (void*) sbc_zpgx, -2, -2 },
-  /* 0xf6 */ { "INC", 0xf6, 2, 6,  0, (void*) inc_zpgx, -2, -2 },
-  /* 0xf7 */ { "???", 0xf7, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xf8 */ { "SED", 0xf8, 1, 2,  0, (void*) sed, -2, -2 },
-  /* 0xf9 */ { "SBC", 0xf9, 3, 2,  0, (void*) sbc_absy, -2, -2 },
-  /* 0xfa */ { "???", 0xfa, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xfb */ { "???", 0xfb, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xfc */ { "???", 0xfc, 1, 2,  0, (void*) unimplemented, -2, -2 },
-  /* 0xfd */ { "SBC", 0xfd, 3, 2,  0, (void*) sbc_absx, -2, -2 },
-  /* 0xfe */ { "INC", 0xfe, 3, 7,  0, (void*) inc_absx, -2, -2 },
-  /* 0xff */ { "???", 0xff, 1, 2,  0, (void*) unimplemented, -2, -2 }
+// The instructions are listed as INS(opcode, name, bytes, cycles,
+// stack, handler) entries so that both the dispatch tables and the
+// switch based engine at the bottom of this file can be generated
+// from the same list.
+
+#define EWM_INSTRUCTION_ENTRY(opcode, name, bytes, cycles, stack, handler) \
+  [opcode] = { name, opcode, bytes, cycles, stack, (void*) handler },
+
+#define EWM_6502_INSTRUCTIONS(INS) \
+  INS(0x00, "BRK", 1, 7,  3, brk_6502) \
+  INS(0x01, "ORA", 2, 6,  0, ora_indx) \
+  INS(0x02, "???", 1, 2,  0, unimplemented) \
+  INS(0x03, "???", 1, 2,  0, unimplemented) \
+  INS(0x04, "???", 1, 2,  0, unimplemented) \
+  INS(0x05, "ORA", 2, 3,  0, ora_zpg) \
+  INS(0x06, "ASL", 2, 5,  0, asl_zpg) \
+  INS(0x07, "???", 1, 2,  0, unimplemented) \
+  INS(0x08, "PHP", 1, 3,  0, php) \
+  INS(0x09, "ORA", 2, 2,  0, ora_imm) \
+  INS(0x0a, "ASL", 1, 2,  0, asl_acc) \
+  INS(0x0b, "???", 1, 2,  0, unimplemented) \
+  INS(0x0c, "???", 1, 2,  0, unimplemented) \
+  INS(0x0d, "ORA", 3, 4,  0, ora_abs) \
+  INS(0x0e, "ASL", 3, 6,  0, asl_abs) \
+  INS(0x0f, "???", 1, 2,  0, unimplemented) \
+  INS(0x10, "BPL", 2, 2,  0, bpl) \
+  INS(0x11, "ORA", 2, 5,  0, ora_indy) \
+  INS(0x12, "???", 1, 2,  0, unimplemented) \
+  INS(0x13, "???", 1, 2,  0, unimplemented) \
+  INS(0x14, "???", 1, 2,  0, unimplemented) \
+  INS(0x15, "ORA", 2, 4,  0, ora_zpgx) \
+  INS(0x16, "ASL", 2, 6,  0, asl_zpgx) \
+  INS(0x17, "???", 1, 2,  0, unimplemented) \
+  INS(0x18, "CLC", 1, 2,  0, clc) \
+  INS(0x19, "ORA", 3, 4,  0, ora_absy) \
+  INS(0x1a, "???", 1, 2,  0, unimplemented) \
+  INS(0x1b, "???", 1, 2,  0, unimplemented) \
+  INS(0x1c, "???", 1, 2,  0, unimplemented) \
+  INS(0x1d, "ORA", 3, 4,  0, ora_absx) \
+  INS(0x1e, "ASL", 3, 7,  0, asl_absx) \
+  INS(0x1f, "???", 1, 2,  0, unimplemented) \
+  INS(0x20, "JSR", 3, 6,  2, jsr_abs) \
+  INS(0x21, "AND", 2, 6,  0, and_indx) \
+  INS(0x22, "???", 1, 2,  0, unimplemented) \
+  INS(0x23, "???", 1, 2,  0, unimplemented) \
+  INS(0x24, "BIT", 2, 3,  0, bit_zpg) \
+  INS(0x25, "AND", 2, 3,  0, and_zpg) \
+  INS(0x26, "ROL", 2, 5,  0, rol_zpg) \
+  INS(0x27, "???", 1, 2,  0, unimplemented) \
+  INS(0x28, "PLP", 1, 4,  0, plp) \
+  INS(0x29, "AND", 2, 2,  0, and_imm) \
+  INS(0x2a, "ROL", 1, 2,  0, rol_acc) \
+  INS(0x2b, "???", 1, 2,  0, unimplemented) \
+  INS(0x2c, "BIT", 3, 4,  0, bit_abs) \
+  INS(0x2d, "AND", 3, 4,  0, and_abs) \
+  INS(0x2e, "ROL", 3, 6,  0, rol_abs) \
+  INS(0x2f, "???", 1, 2,  0, unimplemented) \
+  INS(0x30, "BMI", 2, 2,  0, bmi) \
+  INS(0x31, "AND", 2, 5,  0, and_indy) \
+  INS(0x32, "???", 1, 2,  0, unimplemented) \
+  INS(0x33, "???", 1, 2,  0, unimplemented) \
+  INS(0x34, "???", 1, 2,  0, unimplemented) \
+  INS(0x35, "AND", 2, 4,  0, and_zpgx) \
+  INS(0x36, "ROL", 2, 6,  0, rol_zpgx) \
+  INS(0x37, "???", 1, 2,  0, unimplemented) \
+  INS(0x38, "SEC", 1, 2,  0, sec) \
+  INS(0x39, "AND", 3, 4,  0, and_absy) \
+  INS(0x3a, "???", 1, 2,  0, unimplemented) \
+  INS(0x3b, "???", 1, 2,  0, unimplemented) \
+  INS(0x3c, "???", 1, 2,  0, unimplemented) \
+  INS(0x3d, "AND", 3, 4,  0, and_absx) \
+  INS(0x3e, "ROL", 3, 7,  0, rol_absx) \
+  INS(0x3f, "???", 1, 2,  0, unimplemented) \
+  INS(0x40, "RTI", 1, 6, -3, rti) \
+  INS(0x41, "EOR", 2, 6,  0, eor_indx) \
+  INS(0x42, "???", 1, 2,  0, unimplemented) \
+  INS(0x43, "???", 1, 2,  0, unimplemented) \
+  INS(0x44, "???", 1, 2,  0, unimplemented) \
+  INS(0x45, "EOR", 2, 3,  0, eor_zpg) \
+  INS(0x46, "LSR", 2, 5,  0, lsr_zpg) \
+  INS(0x47, "???", 1, 2,  0, unimplemented) \
+  INS(0x48, "PHA", 1, 3,  1, pha) \
+  INS(0x49, "EOR", 2, 2,  0, eor_imm) \
+  INS(0x4a, "LSR", 1, 2,  0, lsr_acc) \
+  INS(0x4b, "???", 1, 2,  0, unimplemented) \
+  INS(0x4c, "JMP", 3, 3,  0, jmp_abs) \
+  INS(0x4d, "EOR", 3, 4,  0, eor_abs) \
+  INS(0x4e, "LSR", 3, 6,  0, lsr_abs) \
+  INS(0x4f, "???", 1, 2,  0, unimplemented) \
+  INS(0x50, "BVC", 2, 2,  0, bvc) \
+  INS(0x51, "EOR", 2, 5,  0, eor_indy) \
+  INS(0x52, "???", 1, 2,  0, unimplemented) \
+  INS(0x53, "???", 1, 2,  0, unimplemented) \
+  INS(0x54, "???", 1, 2,  0, unimplemented) \
+  INS(0x55, "EOR", 2, 4,  0, eor_zpgx) \
+  INS(0x56, "LSR", 2, 6,  0, lsr_zpgx) \
+  INS(0x57, "???", 1, 2,  0, unimplemented) \
+  INS(0x58, "CLI", 1, 2,  0, cli) \
+  INS(0x59, "EOR", 3, 4,  0, eor_absy) \
+  INS(0x5a, "???", 1, 2,  0, unimplemented) \
+  INS(0x5b, "???", 1, 2,  0, unimplemented) \
+  INS(0x5c, "???", 1, 2,  0, unimplemented) \
+  INS(0x5d, "EOR", 3, 4,  0, eor_absx) \
+  INS(0x5e, "LSR", 3, 7,  0, lsr_absx) \
+  INS(0x5f, "???", 1, 2,  0, unimplemented) \
+  INS(0x60, "RTS", 1, 6, -2, rts) \
+  INS(0x61, "ADC", 2, 6,  0, adc_indx_6502) \
+  INS(0x62, "???", 1, 2,  0, unimplemented) \
+  INS(0x63, "???", 1, 2,  0, unimplemented) \
+  INS(0x64, "???", 1, 2,  0, unimplemented) \
+  INS(0x65, "ADC", 2, 3,  0, adc_zpg_6502) \
+  INS(0x66, "ROR", 2, 5,  0, ror_zpg) \
+  INS(0x67, "???", 1, 2,  0, unimplemented) \
+  INS(0x68, "PLA", 1, 4, -1, pla) \
+  INS(0x69, "ADC", 2, 2,  0, adc_imm_6502) \
+  INS(0x6a, "ROR", 1, 2,  0, ror_acc) \
+  INS(0x6b, "???", 1, 2,  0, unimplemented) \
+  INS(0x6c, "JMP", 3, 5,  0, jmp_ind_6502) \
+  INS(0x6d, "ADC", 3, 4,  0, adc_abs_6502) \
+  INS(0x6e, "ROR", 3, 6,  0, ror_abs) \
+  INS(0x6f, "???", 1, 2,  0, unimplemented) \
+  INS(0x70, "BVS", 2, 2,  0, bvs) \
+  INS(0x71, "ADC", 2, 5,  0, adc_indy_6502) \
+  INS(0x72, "???", 1, 2,  0, unimplemented) \
+  INS(0x73, "???", 1, 2,  0, unimplemented) \
+  INS(0x74, "???", 1, 2,  0, unimplemented) \
+  INS(0x75, "ADC", 2, 4,  0, adc_zpgx_6502) \
+  INS(0x76, "ROR", 2, 6,  0, ror_zpgx) \
+  INS(0x77, "???", 1, 2,  0, unimplemented) \
+  INS(0x78, "SEI", 1, 2,  0, sei) \
+  INS(0x79, "ADC", 3, 4,  0, adc_absy_6502) \
+  INS(0x7a, "???", 1, 2,  0, unimplemented) \
+  INS(0x7b, "???", 1, 2,  0, unimplemented) \
+  INS(0x7c, "???", 1, 2,  0, unimplemented) \
+  INS(0x7d, "ADC", 3, 4,  0, adc_absx_6502) \
+  INS(0x7e, "ROR", 3, 7,  0, ror_absx) \
+  INS(0x7f, "???", 1, 2,  0, unimplemented) \
+  INS(0x80, "???", 1, 2,  0, unimplemented) \
+  INS(0x81, "STA", 2, 6,  0, sta_indx) \
+  INS(0x82, "???", 1, 2,  0, unimplemented) \
+  INS(0x83, "???", 1, 2,  0, unimplemented) \
+  INS(0x84, "STY", 2, 3,  0, sty_zpg) \
+  INS(0x85, "STA", 2, 3,  0, sta_zpg) \
+  INS(0x86, "STX", 2, 3,  0, stx_zpg) \
+  INS(0x87, "???", 1, 2,  0, unimplemented) \
+  INS(0x88, "DEY", 1, 2,  0, dey) \
+  INS(0x89, "???", 1, 2,  0, unimplemented) \
+  INS(0x8a, "TXA", 1, 2,  0, txa) \
+  INS(0x8b, "???", 1, 2,  0, unimplemented) \
+  INS(0x8c, "STY", 3, 4,  0, sty_abs) \
+  INS(0x8d, "STA", 3, 4,  0, sta_abs) \
+  INS(0x8e, "STX", 3, 4,  0, stx_abs) \
+  INS(0x8f, "???", 1, 2,  0, unimplemented) \
+  INS(0x90, "BCC", 2, 2,  0, bcc) \
+  INS(0x91, "STA", 2, 6,  0, sta_indy) \
+  INS(0x92, "???", 1, 2,  0, unimplemented) \
+  INS(0x93, "???", 1, 2,  0, unimplemented) \
+  INS(0x94, "STY", 2, 4,  0, sty_zpgx) \
+  INS(0x95, "STA", 2, 4,  0, sta_zpgx) \
+  INS(0x96, "STX", 2, 4,  0, stx_zpgy) \
+  INS(0x97, "???", 1, 2,  0, unimplemented) \
+  INS(0x98, "TYA", 1, 2,  0, tya) \
+  INS(0x99, "STA", 3, 5,  0, sta_absy) \
+  INS(0x9a, "TXS", 1, 2,  0, txs) \
+  INS(0x9b, "???", 1, 2,  0, unimplemented) \
+  INS(0x9c, "???", 1, 2,  0, unimplemented) \
+  INS(0x9d, "STA", 3, 5,  0, sta_absx) \
+  INS(0x9e, "???", 1, 2,  0, unimplemented) \
+  INS(0x9f, "???", 1, 2,  0, unimplemented) \
+  INS(0xa0, "LDY", 2, 2,  0, ldy_imm) \
+  INS(0xa1, "LDA", 2, 6,  0, lda_indx) \
+  INS(0xa2, "LDX", 2, 2,  0, ldx_imm) \
+  INS(0xa3, "???", 1, 2,  0, unimplemented) \
+  INS(0xa4, "LDY", 2, 3,  0, ldy_zpg) \
+  INS(0xa5, "LDA", 2, 3,  0, lda_zpg) \
+  INS(0xa6, "LDX", 2, 3,  0, ldx_zpg) \
+  INS(0xa7, "???", 1, 2,  0, unimplemented) \
+  INS(0xa8, "TAY", 1, 2,  0, tay) \
+  INS(0xa9, "LDA", 2, 2,  0, lda_imm) \
+  INS(0xaa, "TAX", 1, 2,  0, tax) \
+  INS(0xab, "???", 1, 2,  0, unimplemented) \
+  INS(0xac, "LDY", 3, 4,  0, ldy_abs) \
+  INS(0xad, "LDA", 3, 4,  0, lda_abs) \
+  INS(0xae, "LDX", 3, 4,  0, ldx_abs) \
+  INS(0xaf, "???", 1, 2,  0, unimplemented) \
+  INS(0xb0, "BCS", 2, 2,  0, bcs) \
+  INS(0xb1, "LDA", 2, 5,  0, lda_indy) \
+  INS(0xb2, "???", 1, 2,  0, unimplemented) \
+  INS(0xb3, "???", 1, 2,  0, unimplemented) \
+  INS(0xb4, "LDY", 2, 4,  0, ldy_zpgx) \
+  INS(0xb5, "LDA", 2, 4,  0, lda_zpgx) \
+  INS(0xb6, "LDX", 2, 4,  0, ldx_zpgy) \
+  INS(0xb7, "???", 1, 2,  0, unimplemented) \
+  INS(0xb8, "CLV", 1, 2,  0, clv) \
+  INS(0xb9, "LDA", 3, 4,  0, lda_absy) \
+  INS(0xba, "TSX", 1, 2,  0, tsx) \
+  INS(0xbb, "???", 1, 2,  0, unimplemented) \
+  INS(0xbc, "LDY", 3, 4,  0, ldy_absx) \
+  INS(0xbd, "LDA", 3, 4,  0, lda_absx) \
+  INS(0xbe, "LDX", 3, 4,  0, ldx_absy) \
+  INS(0xbf, "???", 1, 2,  0, unimplemented) \
+  INS(0xc0, "CPY", 2, 2,  0, cpy_imm) \
+  INS(0xc1, "CMP", 2, 6,  0, cmp_indx) \
+  INS(0xc2, "???", 1, 2,  0, unimplemented) \
+  INS(0xc3, "???", 1, 2,  0, unimplemented) \
+  INS(0xc4, "CPY", 2, 3,  0, cpy_zpg) \
+  INS(0xc5, "CMP", 2, 3,  0, cmp_zpg) \
+  INS(0xc6, "DEC", 2, 5,  0, dec_zpg) \
+  INS(0xc7, "???", 1, 2,  0, unimplemented) \
+  INS(0xc8, "INY", 1, 2,  0, iny) \
+  INS(0xc9, "CMP", 2, 2,  0, cmp_imm) \
+  INS(0xca, "DEX", 1, 2,  0, dex) \
+  INS(0xcb, "???", 1, 2,  0, unimplemented) \
+  INS(0xcc, "CPY", 3, 4,  0, cpy_abs) \
+  INS(0xcd, "CMP", 3, 4,  0, cmp_abs) \
+  INS(0xce, "DEC", 3, 6,  0, dec_abs) \
+  INS(0xcf, "???", 1, 2,  0, unimplemented) \
+  INS(0xd0, "BNE", 2, 2,  0, bne) \
+  INS(0xd1, "CMP", 2, 5,  0, cmp_indy) \
+  INS(0xd2, "???", 1, 2,  0, unimplemented) \
+  INS(0xd3, "???", 1, 2,  0, unimplemented) \
+  INS(0xd4, "???", 1, 2,  0, unimplemented) \
+  INS(0xd5, "CMP", 2, 4,  0, cmp_zpgx) \
+  INS(0xd6, "DEC", 2, 6,  0, dec_zpgx) \
+  INS(0xd7, "???", 1, 2,  0, unimplemented) \
+  INS(0xd8, "CLD", 1, 2,  0, cld) \
+  INS(0xd9, "CMP", 3, 4,  0, cmp_absy) \
+  INS(0xda, "???", 1, 2,  0, unimplemented) \
+  INS(0xdb, "???", 1, 2,  0, unimplemented) \
+  INS(0xdc, "???", 1, 2,  0, unimplemented) \
+  INS(0xdd, "CMP", 3, 4,  0, cmp_absx) \
+  INS(0xde, "DEC", 3, 7,  0, dec_absx) \
+  INS(0xdf, "???", 1, 2,  0, unimplemented) \
+  INS(0xe0, "CPX", 2, 2,  0, cpx_imm) \
+  INS(0xe1, "SBC", 2, 6,  0, sbc_indx_6502) \
+  INS(0xe2, "???", 1, 2,  0, unimplemented) \
+  INS(0xe3, "???", 1, 2,  0, unimplemented) \
+  INS(0xe4, "CPX", 2, 3,  0, cpx_zpg) \
+  INS(0xe5, "SBC", 2, 3,  0, sbc_zpg_6502) \
+  INS(0xe6, "INC", 2, 5,  0, inc_zpg) \
+  INS(0xe7, "???", 1, 2,  0, unimplemented) \
+  INS(0xe8, "INX", 1, 2,  0, inx) \
+  INS(0xe9, "SBC", 2, 2,  0, sbc_imm_6502) \
+  INS(0xea, "NOP", 1, 2,  0, nop) \
+  INS(0xeb, "???", 1, 2,  0, unimplemented) \
+  INS(0xec, "CPX", 3, 4,  0, cpx_abs) \
+  INS(0xed, "SBC", 3, 4,  0, sbc_abs_6502) \
+  INS(0xee, "INC", 3, 6,  0, inc_abs) \
+  INS(0xef, "???", 1, 2,  0, unimplemented) \
+  INS(0xf0, "BEQ", 2, 2,  0, beq) \
+  INS(0xf1, "SBC", 2, 5,  0, sbc_indy_6502) \
+  INS(0xf2, "???", 1, 2,  0, unimplemented) \
+  INS(0xf3, "???", 1, 2,  0, unimplemented) \
+  INS(0xf4, "???", 1, 2,  0, unimplemented) \
+  INS(0xf5, "SBC", 2, 4,  0, sbc_zpgx_6502) \
+  INS(0xf6, "INC", 2, 6,  0, inc_zpgx) \
+  INS(0xf7, "???", 1, 2,  0, unimplemented) \
+  INS(0xf8, "SED", 1, 2,  0, sed) \
+  INS(0xf9, "SBC", 3, 4,  0, sbc_absy_6502) \
+  INS(0xfa, "???", 1, 2,  0, unimplemented) \
+  INS(0xfb, "???", 1, 2,  0, unimplemented) \
+  INS(0xfc, "???", 1, 2,  0, unimplemented) \
+  INS(0xfd, "SBC", 3, 4,  0, sbc_absx_6502) \
+  INS(0xfe, "INC", 3, 7,  0, inc_absx) \
+  INS(0xff, "???", 1, 2,  0, unimplemented)
+
+const struct cpu_instruction_t instructions[256] = {
+  EWM_6502_INSTRUCTIONS(EWM_INSTRUCTION_ENTRY)
 };
 
 // EWM_CPU_MODEL_65C02
 
+// The 65C02 turned the unused opcodes into NOPs of various lengths.
+
+static void nop_imm(struct cpu_t *cpu, uint8_t oper) {
+}
+
+static void nop_abs(struct cpu_t *cpu, uint16_t oper) {
+}
+
 static void ora_ind(struct cpu_t *cpu, uint8_t oper) {
    ora(cpu, mem_get_byte_ind(cpu, oper));
 }
@@ -1203,7 +1252,7 @@ static void eor_ind(struct cpu_t *cpu, uint8_t oper) {
 }
 
 static void adc_ind(struct cpu_t *cpu, uint8_t oper) {
-   adc(cpu, mem_get_byte_ind(cpu, oper));
+   adc(cpu, mem_get_byte_ind(cpu, oper), EWM_CPU_MODEL_65C02);
 }
 
 static void sta_ind(struct cpu_t *cpu, uint8_t oper) {
@@ -1220,12 +1269,12 @@ static void cmp_ind(struct cpu_t *cpu, uint8_t oper) {
 }
 
 static void sbc_ind(struct cpu_t *cpu, uint8_t oper) {
-   sbc(cpu, mem_get_byte_ind(cpu, oper));
+   sbc(cpu, mem_get_byte_ind(cpu, oper), EWM_CPU_MODEL_65C02);
 }
 
 static void bit_imm(struct cpu_t *cpu, uint8_t oper) {
   uint8_t t = cpu->state.a & oper;
-  cpu->state.z = (t == 0);
+  cpu_set_flag(cpu, z, (t == 0));
 }
 
 static void bit_zpgx(struct cpu_t *cpu, uint8_t oper) {
@@ -1251,7 +1300,9 @@ static void jmp_absx(struct cpu_t *cpu, uint16_t oper) {
 }
 
 static void bra(struct cpu_t *cpu, uint8_t oper) {
-   cpu->state.pc += (int8_t) oper;
+   uint16_t target = cpu->state.pc + (int8_t) oper;
+   cpu->counter += ((cpu->state.pc ^ target) >> 8) & 1;
+   cpu->state.pc = target;
 }
 
 static void phx(struct cpu_t *cpu) {
@@ -1289,33 +1340,31 @@ static void stz_absx(struct cpu_t *cpu, uint16_t oper) {
 }
 
 static void trb_zpg(struct cpu_t *cpu, uint8_t oper) {
-   cpu->state.z = (mem_get_byte(cpu, oper) & cpu->state.a) == 0;
+   cpu_set_flag(cpu, z, (mem_get_byte(cpu, oper) & cpu->state.a) == 0);
    uint8_t r = mem_get_byte(cpu, oper) & ~cpu->state.a;
    mem_set_byte_zpg(cpu, oper, r);
 }
 
 static void trb_abs(struct cpu_t *cpu, uint16_t oper) {
-   cpu->state.z = (mem_get_byte(cpu, oper) & cpu->state.a) == 0;
+   cpu_set_flag(cpu, z, (mem_get_byte(cpu, oper) & cpu->state.a) == 0);
    uint8_t r = mem_get_byte(cpu, oper) & (cpu->state.a ^ 0xff);
    mem_set_byte_abs(cpu, oper, r);
 }
 
 static void tsb_zpg(struct cpu_t *cpu, uint8_t oper) {
-   cpu->state.z = (mem_get_byte(cpu, oper) & cpu->state.a) == 0;
+   cpu_set_flag(cpu, z, (mem_get_byte(cpu, oper) & cpu->state.a) == 0);
    uint8_t r = mem_get_byte(cpu, oper) | cpu->state.a;
    mem_set_byte_zpg(cpu, oper, r);
 }
 
 static void tsb_abs(struct cpu_t *cpu, uint16_t oper) {
-   cpu->state.z = (mem_get_byte(cpu, oper) & cpu->state.a) == 0;
+   cpu_set_flag(cpu, z, (mem_get_byte(cpu, oper) & cpu->state.a) == 0);
    uint8_t r = mem_get_byte(cpu, oper) | cpu->state.a;
    mem_set_byte_abs(cpu, oper, r);
 }
 
 static void bbr(struct cpu_t *cpu, uint8_t bit, uint8_t zp, int8_t label) {
-   if ((mem_get_byte_zpg(cpu, zp) & bit) == 0) {
-      cpu->state.pc += label;
-   }
+   branch(cpu, (mem_get_byte_zpg(cpu, zp) & bit) == 0, label);
 }
 
 static void bbr0(struct cpu_t *cpu, uint16_t oper) {
@@ -1351,9 +1400,7 @@ static void bbr7(struct cpu_t *cpu, uint16_t oper) {
 }
 
 static void bbs(struct cpu_t *cpu, uint8_t bit, uint8_t zp, int8_t label) {
-   if ((mem_get_byte_zpg(cpu, zp) & bit) != 0) {
-      cpu->state.pc += label;
-   }
+   branch(cpu, (mem_get_byte_zpg(cpu, zp) & bit) != 0, label);
 }
 
 static void bbs0(struct cpu_t *cpu, uint16_t oper) {
@@ -1462,276 +1509,289 @@ static void smb7(struct cpu_t *cpu, uint8_t oper) {
 
 /* Instruction dispatch table */
 
-struct cpu_instruction_t instructions_65C02[256] = {
-  /* 0x00 */ { "???", 0x00, 0, 0,  0, NULL, -2, -2 },
-  /* 0x01 */ { "???", 0x01, 0, 0,  0, NULL, -2, -2 },
-  /* 0x02 */ { "NOP", 0x02, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0x03 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x04 */ { "TSB", 0x04, 2, 5,  0, (void*) tsb_zpg, -2, -2 },
-  /* 0x05 */ { "???", 0x05, 0, 0,  0, NULL, -2, -2 },
-  /* 0x06 */ { "???", 0x06, 0, 0,  0, NULL, -2, -2 },
-  /* 0x07 */ { "RMB", 0x07, 2, 5,  0, (void*) rmb0, -2, -2 },
-  /* 0x08 */ { "???", 0x08, 0, 0,  0, NULL, -2, -2 },
-  /* 0x09 */ { "???", 0x09, 0, 0,  0, NULL, -2, -2 },
-  /* 0x0a */ { "???", 0x0a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x0b */ { "NOP", 0x0b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x0c */ { "TSB", 0x0c, 3, 6,  0, (void*) tsb_abs, -2, -2 },
-  /* 0x0d */ { "???", 0x0d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x0e */ { "???", 0x0e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x0f */ { "BBR", 0x0f, 3, 5,  0, (void*) bbr0, -2, -2 },
-
-  /* 0x10 */ { "???", 0x10, 0, 0,  0, NULL, -2, -2 },
-  /* 0x11 */ { "???", 0x12, 0, 0,  0, NULL, -2, -2 },
-  /* 0x12 */ { "ORA", 0x12, 2, 5,  0, (void*) ora_ind, -2, -2 },
-  /* 0x13 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x14 */ { "TRB", 0x14, 2, 5,  0, (void*) trb_zpg, -2, -2 },
-  /* 0x15 */ { "???", 0x15, 0, 0,  0, NULL, -2, -2 },
-  /* 0x16 */ { "???", 0x16, 0, 0,  0, NULL, -2, -2 },
-  /* 0x17 */ { "RMB", 0x17, 2, 5,  0, (void*) rmb1, -2, -2 },
-  /* 0x18 */ { "???", 0x18, 0, 0,  0, NULL, -2, -2 },
-  /* 0x19 */ { "???", 0x19, 0, 0,  0, NULL, -2, -2 },
-  /* 0x1a */ { "INC", 0x1a, 1, 2,  0, (void*) inc_acc, -2, -2 },
-  /* 0x1b */ { "NOP", 0x1b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x1c */ { "TRB", 0x1c, 3, 6,  0, (void*) trb_abs, -2, -2 },
-  /* 0x1d */ { "???", 0x1d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x1e */ { "???", 0x1e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x1f */ { "BBR", 0x1f, 3, 5,  0, (void*) bbr1, -2, -2 },
-
-  /* 0x20 */ { "???", 0x20, 0, 0,  0, NULL, -2, -2 },
-  /* 0x21 */ { "???", 0x21, 0, 0,  0, NULL, -2, -2 },
-  /* 0x22 */ { "NOP", 0x22, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0x23 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x24 */ { "???", 0x24, 0, 0,  0, NULL, -2, -2 },
-  /* 0x25 */ { "???", 0x25, 0, 0,  0, NULL, -2, -2 },
-  /* 0x26 */ { "???", 0x26, 0, 0,  0, NULL, -2, -2 },
-  /* 0x27 */ { "RMB", 0x27, 2, 5,  0, (void*) rmb2, -2, -2 },
-  /* 0x28 */ { "???", 0x28, 0, 0,  0, NULL, -2, -2 },
-  /* 0x29 */ { "???", 0x29, 0, 0,  0, NULL, -2, -2 },
-  /* 0x2a */ { "???", 0x2a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x2b */ { "NOP", 0x2b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x2c */ { "???", 0x2c, 0, 0,  0, NULL, -2, -2 },
-  /* 0x2d */ { "???", 0x2d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x2e */ { "???", 0x2e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x2f */ { "BBR", 0x2f, 3, 5,  0, (void*) bbr2, -2, -2 },
-
-  /* 0x30 */ { "???", 0x30, 0, 0,  0, NULL, -2, -2 },
-  /* 0x31 */ { "???", 0x31, 0, 0,  0, NULL, -2, -2 },
-  /* 0x32 */ { "AND", 0x32, 2, 5,  0, (void*) and_ind, -2, -2 },
-  /* 0x33 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x34 */ { "BIT", 0x34, 2, 4,  0, (void*) bit_zpgx, -2, -2 },
-  /* 0x35 */ { "???", 0x35, 0, 0,  0, NULL, -2, -2 },
-  /* 0x36 */ { "???", 0x36, 0, 0,  0, NULL, -2, -2 },
-  /* 0x37 */ { "RMB", 0x37, 2, 5,  0, (void*) rmb3, -2, -2 },
-  /* 0x38 */ { "???", 0x38, 0, 0,  0, NULL, -2, -2 },
-  /* 0x39 */ { "???", 0x39, 0, 0,  0, NULL, -2, -2 },
-  /* 0x3a */ { "DEC", 0x3a, 1, 2,  0, (void*) dec_acc, -2, -2 },
-  /* 0x3b */ { "NOP", 0x3b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x3c */ { "BIT", 0x3c, 3, 4,  0, (void*) bit_absx, -2, -2 },
-  /* 0x3d */ { "???", 0x3d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x3e */ { "???", 0x3e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x3f */ { "BBR", 0x3f, 3, 5,  0, (void*) bbr3, -2, -2 },
-
-  /* 0x40 */ { "???", 0x40, 0, 0,  0, NULL, -2, -2 },
-  /* 0x41 */ { "???", 0x41, 0, 0,  0, NULL, -2, -2 },
-  /* 0x42 */ { "NOP", 0x42, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0x43 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x44 */ { "NOP", 0x44, 2, 3,  0, (void*) nop, -2, -2 },
-  /* 0x45 */ { "???", 0x45, 0, 0,  0, NULL, -2, -2 },
-  /* 0x46 */ { "???", 0x46, 0, 0,  0, NULL, -2, -2 },
-  /* 0x47 */ { "RMB", 0x47, 2, 5,  0, (void*) rmb4, -2, -2 },
-  /* 0x48 */ { "???", 0x48, 0, 0,  0, NULL, -2, -2 },
-  /* 0x49 */ { "???", 0x49, 0, 0,  0, NULL, -2, -2 },
-  /* 0x4a */ { "???", 0x4a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x4b */ { "NOP", 0x4b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x4c */ { "???", 0x4c, 0, 0,  0, NULL, -2, -2 },
-  /* 0x4d */ { "???", 0x4d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x4e */ { "???", 0x4e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x4f */ { "BBR", 0x4f, 3, 5,  0, (void*) bbr4, -2, -2 },
-
-  /* 0x50 */ { "???", 0x50, 0, 0,  0, NULL, -2, -2 },
-  /* 0x51 */ { "???", 0x51, 0, 0,  0, NULL, -2, -2 },
-  /* 0x52 */ { "EOR", 0x52, 2, 5,  0, (void*) eor_ind, -2, -2 },
-  /* 0x53 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x54 */ { "NOP", 0x54, 2, 4,  0, (void*) nop, -2, -2 },
-  /* 0x55 */ { "???", 0x55, 0, 0,  0, NULL, -2, -2 },
-  /* 0x56 */ { "???", 0x56, 0, 0,  0, NULL, -2, -2 },
-  /* 0x57 */ { "RMB", 0x57, 2, 5,  0, (void*) rmb5, -2, -2 },
-  /* 0x58 */ { "???", 0x58, 0, 0,  0, NULL, -2, -2 },
-  /* 0x59 */ { "???", 0x59, 0, 0,  0, NULL, -2, -2 },
-  /* 0x5a */ { "PHY", 0x5a, 1, 3,  0, (void*) phy, -2, -2 },
-  /* 0x5b */ { "NOP", 0x5b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x5c */ { "NOP", 0x5c, 3, 8,  0, (void*) nop, -2, -2 },
-  /* 0x5d */ { "???", 0x5d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x5e */ { "???", 0x5e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x5f */ { "BBR", 0x5f, 3, 5,  0, (void*) bbr5, -2, -2 },
-
-  /* 0x60 */ { "???", 0x60, 0, 0,  0, NULL, -2, -2 },
-  /* 0x61 */ { "???", 0x61, 0, 0,  0, NULL, -2, -2 },
-  /* 0x62 */ { "NOP", 0x62, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0x63 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x64 */ { "STZ", 0x64, 2, 3,  0, (void*) stz_zpg, -2, -2 },
-  /* 0x65 */ { "???", 0x65, 0, 0,  0, NULL, -2, -2 },
-  /* 0x66 */ { "???", 0x66, 0, 0,  0, NULL, -2, -2 },
-  /* 0x67 */ { "RMB", 0x67, 2, 5,  0, (void*) rmb6, -2, -2 },
-  /* 0x68 */ { "???", 0x68, 0, 0,  0, NULL, -2, -2 },
-  /* 0x69 */ { "???", 0x69, 0, 0,  0, NULL, -2, -2 },
-  /* 0x6a */ { "???", 0x6a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x6b */ { "NOP", 0x6b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x6c */ { "???", 0x6c, 0, 0,  0, NULL, -2, -2 },
-  /* 0x6d */ { "???", 0x6d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x6e */ { "???", 0x6e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x6f */ { "BBR", 0x6f, 3, 5,  0, (void*) bbr6, -2, -2 },
-
-  /* 0x70 */ { "???", 0x70, 0, 0,  0, NULL, -2, -2 },
-  /* 0x71 */ { "???", 0x71, 0, 0,  0, NULL, -2, -2 },
-  /* 0x72 */ { "ADC", 0x72, 2, 5,  0, (void*) adc_ind, -2, -2 },
-  /* 0x73 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x74 */ { "STZ", 0x74, 2, 4,  0, (void*) stz_zpgx, -2, -2 },
-  /* 0x75 */ { "???", 0x75, 0, 0,  0, NULL, -2, -2 },
-  /* 0x76 */ { "???", 0x76, 0, 0,  0, NULL, -2, -2 },
-  /* 0x77 */ { "RMB", 0x77, 2, 5,  0, (void*) rmb7, -2, -2 },
-  /* 0x78 */ { "???", 0x78, 0, 0,  0, NULL, -2, -2 },
-  /* 0x79 */ { "???", 0x79, 0, 0,  0, NULL, -2, -2 },
-  /* 0x7a */ { "PLY", 0x7a, 1, 4,  0, (void*) ply, -2, -2 },
-  /* 0x7b */ { "NOP", 0x7b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x7c */ { "JMP", 0x7c, 3, 6,  0, (void*) jmp_absx, -2, -2 },
-  /* 0x7d */ { "???", 0x7d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x7e */ { "???", 0x7e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x7f */ { "BBR", 0x7f, 3, 5,  0, (void*) bbr7, -2, -2 },
-
-  /* 0x80 */ { "BRA", 0x80, 2, 3,  0, (void*) bra, -2, -2 },
-  /* 0x81 */ { "???", 0x81, 0, 0,  0, NULL, -2, -2 },
-  /* 0x82 */ { "NOP", 0x82, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0x83 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x84 */ { "???", 0x84, 0, 0,  0, NULL, -2, -2 },
-  /* 0x85 */ { "???", 0x85, 0, 0,  0, NULL, -2, -2 },
-  /* 0x86 */ { "???", 0x86, 0, 0,  0, NULL, -2, -2 },
-  /* 0x87 */ { "SMB", 0x87, 2, 5,  0, (void*) smb0, -2, -2 },
-  /* 0x88 */ { "???", 0x88, 0, 0,  0, NULL, -2, -2 },
-  /* 0x89 */ { "BIT", 0x89, 2, 2,  0, (void*) bit_imm, -2, -2 },
-  /* 0x8a */ { "???", 0x8a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x8b */ { "NOP", 0x8b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x8c */ { "???", 0x8c, 0, 0,  0, NULL, -2, -2 },
-  /* 0x8d */ { "???", 0x8d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x8e */ { "???", 0x8e, 0, 0,  0, NULL, -2, -2 },
-  /* 0x8f */ { "BBS", 0x8f, 3, 5,  0, (void*) bbs0, -2, -2 },
-
-  /* 0x90 */ { "???", 0x90, 0, 0,  0, NULL, -2, -2 },
-  /* 0x91 */ { "???", 0x91, 0, 0,  0, NULL, -2, -2 },
-  /* 0x92 */ { "STA", 0x92, 2, 5,  0, (void*) sta_ind, -2, -2 },
-  /* 0x93 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x94 */ { "???", 0x94, 0, 0,  0, NULL, -2, -2 },
-  /* 0x95 */ { "???", 0x95, 0, 0,  0, NULL, -2, -2 },
-  /* 0x96 */ { "???", 0x96, 0, 0,  0, NULL, -2, -2 },
-  /* 0x97 */ { "SMB", 0x97, 2, 5,  0, (void*) smb1, -2, -2 },
-  /* 0x98 */ { "???", 0x98, 0, 0,  0, NULL, -2, -2 },
-  /* 0x99 */ { "???", 0x99, 0, 0,  0, NULL, -2, -2 },
-  /* 0x9a */ { "???", 0x9a, 0, 0,  0, NULL, -2, -2 },
-  /* 0x9b */ { "NOP", 0x9b, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0x9c */ { "STZ", 0x9c, 3, 4,  0, (void*) stz_abs, -2, -2 },
-  /* 0x9d */ { "???", 0x9d, 0, 0,  0, NULL, -2, -2 },
-  /* 0x9e */ { "STZ", 0x9e, 3, 5,  0, (void*) stz_absx, -2, -2 },
-  /* 0x9f */ { "BBS", 0x9f, 3, 5,  0, (void*) bbs1, -2, -2 },
-
-  /* 0xa0 */ { "???", 0xa0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa1 */ { "???", 0xa1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa2 */ { "???", 0xa2, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xa4 */ { "???", 0xa4, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa5 */ { "???", 0xa5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa6 */ { "???", 0xa6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa7 */ { "SMB", 0xa7, 2, 5,  0, (void*) smb2, -2, -2 },
-  /* 0xa8 */ { "???", 0xa8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xa9 */ { "???", 0xa9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xaa */ { "???", 0xaa, 0, 0,  0, NULL, -2, -2 },
-  /* 0xab */ { "NOP", 0xab, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xac */ { "???", 0xac, 0, 0,  0, NULL, -2, -2 },
-  /* 0xad */ { "???", 0xad, 0, 0,  0, NULL, -2, -2 },
-  /* 0xae */ { "???", 0xae, 0, 0,  0, NULL, -2, -2 },
-  /* 0xaf */ { "BBS", 0xaf, 3, 5,  0, (void*) bbs2, -2, -2 },
-
-  /* 0xb0 */ { "???", 0xb0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb1 */ { "???", 0xb1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb2 */ { "LDA", 0xb2, 2, 5,  0, (void*) lda_ind, -2, -2 },
-  /* 0xb3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xb4 */ { "???", 0xb4, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb5 */ { "???", 0xb5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb6 */ { "???", 0xb6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb7 */ { "SMB", 0xb7, 2, 5,  0, (void*) smb3, -2, -2 },
-  /* 0xb8 */ { "???", 0xb8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xb9 */ { "???", 0xb9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xba */ { "???", 0xba, 0, 0,  0, NULL, -2, -2 },
-  /* 0xbb */ { "NOP", 0xbb, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xbc */ { "???", 0xbc, 0, 0,  0, NULL, -2, -2 },
-  /* 0xbd */ { "???", 0xbd, 0, 0,  0, NULL, -2, -2 },
-  /* 0xbe */ { "???", 0xbe, 0, 0,  0, NULL, -2, -2 },
-  /* 0xbf */ { "BBS", 0xbf, 3, 5,  0, (void*) bbs3, -2, -2 },
-
-  /* 0xc0 */ { "???", 0xc0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc1 */ { "???", 0xc1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc2 */ { "NOP", 0xc2, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0xc3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xc4 */ { "???", 0xc4, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc5 */ { "???", 0xc5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc6 */ { "???", 0xc6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc7 */ { "SMB", 0xc7, 2, 5,  0, (void*) smb4, -2, -2 },
-  /* 0xc8 */ { "???", 0xc8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xc9 */ { "???", 0xc9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xca */ { "???", 0xca, 0, 0,  0, NULL, -2, -2 },
-  /* 0xcb */ { "NOP", 0xcb, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xcc */ { "???", 0xcc, 0, 0,  0, NULL, -2, -2 },
-  /* 0xcd */ { "???", 0xcd, 0, 0,  0, NULL, -2, -2 },
-  /* 0xce */ { "???", 0xce, 0, 0,  0, NULL, -2, -2 },
-  /* 0xcf */ { "BBS", 0xcf, 3, 5,  0, (void*) bbs4, -2, -2 },
-
-  /* 0xd0 */ { "???", 0xd0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xd1 */ { "???", 0xd1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xd2 */ { "CMP", 0xd2, 2, 5,  0, (void*) cmp_ind, -2, -2 },
-  /* 0xd3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xd4 */ { "NOP", 0xd4, 2, 4,  0, (void*) nop, -2, -2 },
-  /* 0xd5 */ { "???", 0xd5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xd6 */ { "???", 0xd6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xd7 */ { "SMB", 0xd7, 2, 5,  0, (void*) smb5, -2, -2 },
-  /* 0xd8 */ { "???", 0xd8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xd9 */ { "???", 0xd9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xda */ { "PHX", 0xda, 1, 3,  0, (void*) phx, -2, -2 },
-  /* 0xdb */ { "NOP", 0xdb, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xdc */ { "NOP", 0xdc, 3, 4,  0, (void*) nop, -2, -2 },
-  /* 0xdd */ { "???", 0xdd, 0, 0,  0, NULL, -2, -2 },
-  /* 0xde */ { "???", 0xde, 0, 0,  0, NULL, -2, -2 },
-  /* 0xdf */ { "BBS", 0xdf, 3, 5,  0, (void*) bbs5, -2, -2 },
-
-  /* 0xe0 */ { "???", 0xe0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe1 */ { "???", 0xe1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe2 */ { "NOP", 0xe2, 2, 2,  0, (void*) nop, -2, -2 },
-  /* 0xe3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xe4 */ { "???", 0xe4, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe5 */ { "???", 0xe5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe6 */ { "???", 0xe6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe7 */ { "SMB", 0xe7, 2, 5,  0, (void*) smb6, -2, -2 },
-  /* 0xe8 */ { "???", 0xe8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xe9 */ { "???", 0xe9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xea */ { "???", 0xea, 0, 0,  0, NULL, -2, -2 },
-  /* 0xeb */ { "NOP", 0xeb, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xec */ { "???", 0xec, 0, 0,  0, NULL, -2, -2 },
-  /* 0xed */ { "???", 0xed, 0, 0,  0, NULL, -2, -2 },
-  /* 0xee */ { "???", 0xee, 0, 0,  0, NULL, -2, -2 },
-  /* 0xef */ { "BBS", 0xef, 3, 5,  0, (void*) bbs6, -2, -2 },
-
-  /* 0xf0 */ { "???", 0xf0, 0, 0,  0, NULL, -2, -2 },
-  /* 0xf1 */ { "???", 0xf1, 0, 0,  0, NULL, -2, -2 },
-  /* 0xf2 */ { "SBC", 0xf2, 2, 5,  0, (void*) sbc_ind, -2, -2 },
-  /* 0xf3 */ { "NOP", 0x03, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xf4 */ { "NOP", 0xf4, 2, 4,  0, (void*) nop, -2, -2 },
-  /* 0xf5 */ { "???", 0xf5, 0, 0,  0, NULL, -2, -2 },
-  /* 0xf6 */ { "???", 0xf6, 0, 0,  0, NULL, -2, -2 },
-  /* 0xf7 */ { "SMB", 0xf7, 2, 5,  0, (void*) smb7, -2, -2 },
-  /* 0xf8 */ { "???", 0xf8, 0, 0,  0, NULL, -2, -2 },
-  /* 0xf9 */ { "???", 0xf9, 0, 0,  0, NULL, -2, -2 },
-  /* 0xfa */ { "PLX", 0xfa, 1, 4,  0, (void*) plx, -2, -2 },
-  /* 0xfb */ { "NOP", 0xfb, 1, 1,  0, (void*) nop, -2, -2 },
-  /* 0xfc */ { "NOP", 0xfc, 3, 4,  0, (void*) nop, -2, -2 },
-  /* 0xfd */ { "???", 0xfd, 0, 0,  0, NULL, -2, -2 },
-  /* 0xfe */ { "???", 0xfe, 0, 0,  0, NULL, -2, -2 },
-  /* 0xff */ { "BBS", 0xff, 3, 5,  0, (void*) bbs7, -2, -2 }
+// Only the instructions that differ from the 6502 are listed. The
+// table is the 6502 list with these entries on top of it, which is
+// what the designated initializers do when they name an opcode twice.
+
+#define EWM_65C02_INSTRUCTIONS(INS) \
+  INS(0x00, "BRK", 1, 7,  3, brk_65C02) \
+  INS(0x02, "NOP", 2, 2,  0, nop_imm) \
+  INS(0x03, "NOP", 1, 1,  0, nop) \
+  INS(0x04, "TSB", 2, 5,  0, tsb_zpg) \
+  INS(0x07, "RMB", 2, 5,  0, rmb0) \
+  INS(0x0b, "NOP", 1, 1,  0, nop) \
+  INS(0x0c, "TSB", 3, 6,  0, tsb_abs) \
+  INS(0x0f, "BBR", 3, 5,  0, bbr0) \
+  INS(0x12, "ORA", 2, 5,  0, ora_ind) \
+  INS(0x13, "NOP", 1, 1,  0, nop) \
+  INS(0x14, "TRB", 2, 5,  0, trb_zpg) \
+  INS(0x17, "RMB", 2, 5,  0, rmb1) \
+  INS(0x1a, "INC", 1, 2,  0, inc_acc) \
+  INS(0x1b, "NOP", 1, 1,  0, nop) \
+  INS(0x1c, "TRB", 3, 6,  0, trb_abs) \
+  INS(0x1f, "BBR", 3, 5,  0, bbr1) \
+  INS(0x22, "NOP", 2, 2,  0, nop_imm) \
+  INS(0x23, "NOP", 1, 1,  0, nop) \
+  INS(0x27, "RMB", 2, 5,  0, rmb2) \
+  INS(0x2b, "NOP", 1, 1,  0, nop) \
+  INS(0x2f, "BBR", 3, 5,  0, bbr2) \
+  INS(0x32, "AND", 2, 5,  0, and_ind) \
+  INS(0x33, "NOP", 1, 1,  0, nop) \
+  INS(0x34, "BIT", 2, 4,  0, bit_zpgx) \
+  INS(0x37, "RMB", 2, 5,  0, rmb3) \
+  INS(0x3a, "DEC", 1, 2,  0, dec_acc) \
+  INS(0x3b, "NOP", 1, 1,  0, nop) \
+  INS(0x3c, "BIT", 3, 4,  0, bit_absx) \
+  INS(0x3f, "BBR", 3, 5,  0, bbr3) \
+  INS(0x42, "NOP", 2, 2,  0, nop_imm) \
+  INS(0x43, "NOP", 1, 1,  0, nop) \
+  INS(0x44, "NOP", 2, 3,  0, nop_imm) \
+  INS(0x47, "RMB", 2, 5,  0, rmb4) \
+  INS(0x4b, "NOP", 1, 1,  0, nop) \
+  INS(0x4f, "BBR", 3, 5,  0, bbr4) \
+  INS(0x52, "EOR", 2, 5,  0, eor_ind) \
+  INS(0x53, "NOP", 1, 1,  0, nop) \
+  INS(0x54, "NOP", 2, 4,  0, nop_imm) \
+  INS(0x57, "RMB", 2, 5,  0, rmb5) \
+  INS(0x5a, "PHY", 1, 3,  0, phy) \
+  INS(0x5b, "NOP", 1, 1,  0, nop) \
+  INS(0x5c, "NOP", 3, 8,  0, nop_abs) \
+  INS(0x5f, "BBR", 3, 5,  0, bbr5) \
+  INS(0x61, "ADC", 2, 6,  0, adc_indx_65C02) \
+  INS(0x62, "NOP", 2, 2,  0, nop_imm) \
+  INS(0x63, "NOP", 1, 1,  0, nop) \
+  INS(0x64, "STZ", 2, 3,  0, stz_zpg) \
+  INS(0x65, "ADC", 2, 3,  0, adc_zpg_65C02) \
+  INS(0x67, "RMB", 2, 5,  0, rmb6) \
+  INS(0x69, "ADC", 2, 2,  0, adc_imm_65C02) \
+  INS(0x6b, "NOP", 1, 1,  0, nop) \
+  INS(0x6c, "JMP", 3, 6,  0, jmp_ind_65C02) \
+  INS(0x6d, "ADC", 3, 4,  0, adc_abs_65C02) \
+  INS(0x6f, "BBR", 3, 5,  0, bbr6) \
+  INS(0x71, "ADC", 2, 5,  0, adc_indy_65C02) \
+  INS(0x72, "ADC", 2, 5,  0, adc_ind) \
+  INS(0x73, "NOP", 1, 1,  0, nop) \
+  INS(0x74, "STZ", 2, 4,  0, stz_zpgx) \
+  INS(0x75, "ADC", 2, 4,  0, adc_zpgx_65C02) \
+  INS(0x77, "RMB", 2, 5,  0, rmb7) \
+  INS(0x79, "ADC", 3, 4,  0, adc_absy_65C02) \
+  INS(0x7a, "PLY", 1, 4,  0, ply) \
+  INS(0x7b, "NOP", 1, 1,  0, nop) \
+  INS(0x7c, "JMP", 3, 6,  0, jmp_absx) \
+  INS(0x7d, "ADC", 3, 4,  0, adc_absx_65C02) \
+  INS(0x7f, "BBR", 3, 5,  0, bbr7) \
+  INS(0x80, "BRA", 2, 3,  0, bra) \
+  INS(0x82, "NOP", 2, 2,  0, nop_imm) \
+  INS(0x83, "NOP", 1, 1,  0, nop) \
+  INS(0x87, "SMB", 2, 5,  0, smb0) \
+  INS(0x89, "BIT", 2, 2,  0, bit_imm) \
+  INS(0x8b, "NOP", 1, 1,  0, nop) \
+  INS(0x8f, "BBS", 3, 5,  0, bbs0) \
+  INS(0x92, "STA", 2, 5,  0, sta_ind) \
+  INS(0x93, "NOP", 1, 1,  0, nop) \
+  INS(0x97, "SMB", 2, 5,  0, smb1) \
+  INS(0x9b, "NOP", 1, 1,  0, nop) \
+  INS(0x9c, "STZ", 3, 4,  0, stz_abs) \
+  INS(0x9e, "STZ", 3, 5,  0, stz_absx) \
+  INS(0x9f, "BBS", 3, 5,  0, bbs1) \
+  INS(0xa3, "NOP", 1, 1,  0, nop) \
+  INS(0xa7, "SMB", 2, 5,  0, smb2) \
+  INS(0xab, "NOP", 1, 1,  0, nop) \
+  INS(0xaf, "BBS", 3, 5,  0, bbs2) \
+  INS(0xb2, "LDA", 2, 5,  0, lda_ind) \
+  INS(0xb3, "NOP", 1, 1,  0, nop) \
+  INS(0xb7, "SMB", 2, 5,  0, smb3) \
+  INS(0xbb, "NOP", 1, 1,  0, nop) \
+  INS(0xbf, "BBS", 3, 5,  0, bbs3) \
+  INS(0xc2, "NOP", 2, 2,  0, nop_imm) \
+  INS(0xc3, "NOP", 1, 1,  0, nop) \
+  INS(0xc7, "SMB", 2, 5,  0, smb4) \
+  INS(0xcb, "NOP", 1, 1,  0, nop) \
+  INS(0xcf, "BBS", 3, 5,  0, bbs4) \
+  INS(0xd2, "CMP", 2, 5,  0, cmp_ind) \
+  INS(0xd3, "NOP", 1, 1,  0, nop) \
+  INS(0xd4, "NOP", 2, 4,  0, nop_imm) \
+  INS(0xd7, "SMB", 2, 5,  0, smb5) \
+  INS(0xda, "PHX", 1, 3,  0, phx) \
+  INS(0xdb, "NOP", 1, 1,  0, nop) \
+  INS(0xdc, "NOP", 3, 4,  0, nop_abs) \
+  INS(0xdf, "BBS", 3, 5,  0, bbs5) \
+  INS(0xe1, "SBC", 2, 6,  0, sbc_indx_65C02) \
+  INS(0xe2, "NOP", 2, 2,  0, nop_imm) \
+  INS(0xe3, "NOP", 1, 1,  0, nop) \
+  INS(0xe5, "SBC", 2, 3,  0, sbc_zpg_65C02) \
+  INS(0xe7, "SMB", 2, 5,  0, smb6) \
+  INS(0xe9, "SBC", 2, 2,  0, sbc_imm_65C02) \
+  INS(0xeb, "NOP", 1, 1,  0, nop) \
+  INS(0xed, "SBC", 3, 4,  0, sbc_abs_65C02) \
+  INS(0xef, "BBS", 3, 5,  0, bbs6) \
+  INS(0xf1, "SBC", 2, 5,  0, sbc_indy_65C02) \
+  INS(0xf2, "SBC", 2, 5,  0, sbc_ind) \
+  INS(0xf3, "NOP", 1, 1,  0, nop) \
+  INS(0xf4, "NOP", 2, 4,  0, nop_imm) \
+  INS(0xf5, "SBC", 2, 4,  0, sbc_zpgx_65C02) \
+  INS(0xf7, "SMB", 2, 5,  0, smb7) \
+  INS(0xf9, "SBC", 3, 4,  0, sbc_absy_65C02) \
+  INS(0xfa, "PLX", 1, 4,  0, plx) \
+  INS(0xfb, "NOP", 1, 1,  0, nop) \
+  INS(0xfc, "NOP", 3, 4,  0, nop_abs) \
+  INS(0xfd, "SBC", 3, 4,  0, sbc_absx_65C02) \
+  INS(0xff, "BBS", 3, 5,  0, bbs7)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+
+const struct cpu_instruction_t instructions_65C02[256] = {
+  EWM_6502_INSTRUCTIONS(EWM_INSTRUCTION_ENTRY)
+  EWM_65C02_INSTRUCTIONS(EWM_INSTRUCTION_ENTRY)
 };
+
+#pragma GCC diagnostic pop
+
+// Handlers are stored in the opcode tables relative to this one
+
+void ins_handler_base(struct cpu_t *cpu) {
+}
+
+int ins_init_opcodes(struct cpu_opcode_t *opcodes, const struct cpu_instruction_t *instructions) {
+  for (int i = 0; i < 256; i++) {
+    intptr_t distance = (intptr_t) instructions[i].handler - (intptr_t) ins_handler_base;
+    if (distance < INT32_MIN || distance > INT32_MAX) {
+      return -1;
+    }
+    opcodes[i].handler = distance;
+    opcodes[i].bytes = instructions[i].bytes;
+    opcodes[i].cycles = instructions[i].cycles;
+  }
+  return 0;
+}
+
+/* Switch based execution engine */
+
+// Instead of calling the handlers through the pointers in the dispatch
+// tables, the following generate a switch over all opcodes from the
+// instruction lists above. This lets the compiler inline the handlers
+// into a single loop, which avoids the indirect call per instruction.
+
+#define EWM_INSTRUCTION_CALL_1(handler) handler(cpu)
+#define EWM_INSTRUCTION_CALL_2(handler) handler(cpu, mem_get_byte(cpu, pc + 1))
+#define EWM_INSTRUCTION_CALL_3(handler) handler(cpu, mem_get_word(cpu, pc + 1))
+
+#define EWM_INSTRUCTION_CASE(opcode, name, bytes, cycles, stack, handler) \
+  case opcode: \
+    cpu->state.pc = pc + bytes; \
+    EWM_INSTRUCTION_CALL_##bytes(handler); \
+    cpu->counter += cycles; \
+    return;
+
+static inline void ins_execute_6502(struct cpu_t *cpu, uint8_t opcode, uint16_t pc) {
+  switch (opcode) {
+    EWM_6502_INSTRUCTIONS(EWM_INSTRUCTION_CASE)
+  }
+}
+
+static inline void ins_execute_65C02(struct cpu_t *cpu, uint8_t opcode, uint16_t pc) {
+  switch (opcode) {
+    EWM_65C02_INSTRUCTIONS(EWM_INSTRUCTION_CASE)
+    default:
+      ins_execute_6502(cpu, opcode, pc);
+  }
+}
+
+// The cycle counter and the deadline both live in the cpu because
+// devices read the counter and can end the slice early by moving the
+// deadline. Handlers add the cycles that depend on operands, page
+// crossings and taken branches, to the counter themselves. The
+// breakpoint is checked after an instruction so that running again
+// from a breakpoint makes progress.
+
+void ins_run_6502(struct cpu_t *cpu) {
+  while (cpu->counter < cpu->deadline) {
+    uint16_t pc = cpu->state.pc;
+    ins_execute_6502(cpu, mem_get_byte(cpu, pc), pc);
+    if (cpu->state.pc == cpu->breakpoint) {
+      break;
+    }
+  }
+}
+
+void ins_run_65C02(struct cpu_t *cpu) {
+  while (cpu->counter < cpu->deadline) {
+    uint16_t pc = cpu->state.pc;
+    ins_execute_65C02(cpu, mem_get_byte(cpu, pc), pc);
+    if (cpu->state.pc == cpu->breakpoint) {
+      break;
+    }
+  }
+}
+
+/* Block engine */
+
+// The same switch, but with the operand taken from the decoded block
+// instead of from memory.
+
+#define EWM_INSTRUCTION_DECODED_CALL_1(handler) handler(cpu)
+#define EWM_INSTRUCTION_DECODED_CALL_2(handler) handler(cpu, (uint8_t) oper)
+#define EWM_INSTRUCTION_DECODED_CALL_3(handler) handler(cpu, oper)
+
+#define EWM_INSTRUCTION_DECODED_CASE(opcode, name, bytes, cycles, stack, handler) \
+  case opcode: \
+    cpu->state.pc = pc + bytes; \
+    EWM_INSTRUCTION_DECODED_CALL_##bytes(handler); \
+    cpu->counter += cycles; \
+    return;
+
+static inline void ins_execute_decoded_6502(struct cpu_t *cpu, uint8_t opcode, uint16_t oper, uint16_t pc) {
+  switch (opcode) {
+    EWM_6502_INSTRUCTIONS(EWM_INSTRUCTION_DECODED_CASE)
+  }
+}
+
+static inline void ins_execute_decoded_65C02(struct cpu_t *cpu, uint8_t opcode, uint16_t oper, uint16_t pc) {
+  switch (opcode) {
+    EWM_65C02_INSTRUCTIONS(EWM_INSTRUCTION_DECODED_CASE)
+    default:
+      ins_execute_decoded_6502(cpu, opcode, oper, pc);
+  }
+}
+
+// A block is left when the pc does not end up at the next instruction,
+// when the page it came from changed, at the deadline, or at the
+// breakpoint. Code on pages that cannot be cached runs on the
+// switch engine until it leaves the page.
+
+#define EWM_INSTRUCTION_RUN_BLOCKS(model) \
+  while (cpu->counter < cpu->deadline) { \
+    uint16_t pc = cpu->state.pc; \
+    struct ewm_blk_t *blk = ewm_blk_lookup(cpu, pc); \
+    if (blk == NULL) { \
+      do { \
+        pc = cpu->state.pc; \
+        ins_execute_##model(cpu, mem_get_byte(cpu, pc), pc); \
+        if (cpu->state.pc == cpu->breakpoint) { \
+          return; \
+        } \
+      } while ((cpu->state.pc >> 8) == (pc >> 8) && cpu->counter < cpu->deadline); \
+      continue; \
+    } \
+    const uint32_t *version = &cpu->blocks->versions[pc >> 8]; \
+    for (int n = 0; n < blk->count; n++) { \
+      struct ewm_blk_ins_t *ins = &blk->ins[n]; \
+      ins_execute_decoded_##model(cpu, ins->opcode, ins->oper, pc); \
+      pc += ins->bytes; \
+      if (cpu->state.pc == cpu->breakpoint) { \
+        return; \
+      } \
+      if (cpu->state.pc != pc || cpu->counter >= cpu->deadline || *version != blk->version) { \
+        break; \
+      } \
+    } \
+  }
+
+void ins_run_blocks_6502(struct cpu_t *cpu) {
+  EWM_INSTRUCTION_RUN_BLOCKS(6502)
+}
+
+void ins_run_blocks_65C02(struct cpu_t *cpu) {
+  EWM_INSTRUCTION_RUN_BLOCKS(65C02)
+}
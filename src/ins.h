@@ -25,6 +25,8 @@
 
 #include <stdint.h>
 
+struct cpu_t;
+
 struct cpu_instruction_t {
    char *name;
    uint8_t opcode;
@@ -32,12 +34,38 @@ struct cpu_instruction_t {
    uint8_t cycles;
    int8_t stack; // How much stack does this instruction need. Negative means pull, positive push
    void *handler;
+};
+
+// Complete tables for each model, built at compile time.
+extern const struct cpu_instruction_t instructions[256];
+extern const struct cpu_instruction_t instructions_65C02[256];
 
-   int lua_before_handler;
-   int lua_after_handler;
+// All the step engine needs to run an opcode, in 8 bytes, so that the
+// whole table takes 32 cache lines. Handlers are kept as their distance
+// from ins_handler_base(), which fits in 32 bits because they all live
+// in ins.c.
+
+struct cpu_opcode_t {
+   int32_t handler;
+   uint8_t bytes;
+   uint8_t cycles;
 };
 
-extern struct cpu_instruction_t instructions[256];
-extern struct cpu_instruction_t instructions_65C02[256];
+void ins_handler_base(struct cpu_t *cpu);
+
+#define ins_opcode_handler(o) ((void*) ((uintptr_t) ins_handler_base + (intptr_t) (o)->handler))
+
+// Fills the opcode table from the instruction table. Returns -1 if a
+// handler is too far away.
+int ins_init_opcodes(struct cpu_opcode_t *opcodes, const struct cpu_instruction_t *instructions);
+
+// Switch based engines. Run instructions until the counter reaches
+// the deadline or the pc reaches the breakpoint.
+void ins_run_6502(struct cpu_t *cpu);
+void ins_run_65C02(struct cpu_t *cpu);
+
+// The block engine, which runs decoded blocks where it can.
+void ins_run_blocks_6502(struct cpu_t *cpu);
+void ins_run_blocks_65C02(struct cpu_t *cpu);
 
 #endif
@@ -0,0 +1,215 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "ldr.h"
+
+// Applesoft zero page pointers
+#define EWM_LDR_TXTTAB (0x67) // Start of the program
+#define EWM_LDR_VARTAB (0x69) // Start of simple variables
+#define EWM_LDR_ARYTAB (0x6b) // Start of arrays
+#define EWM_LDR_STREND (0x6d) // End of arrays
+#define EWM_LDR_FRETOP (0x6f) // Bottom of the strings
+#define EWM_LDR_MEMSIZ (0x73) // Top of memory
+#define EWM_LDR_PRGEND (0xaf) // End of the program
+
+static uint16_t ewm_ldr_get_word(struct cpu_t *cpu, uint16_t addr) {
+   return mem_get_byte(cpu, addr) | (mem_get_byte(cpu, addr + 1) << 8);
+}
+
+static void ewm_ldr_set_word(struct cpu_t *cpu, uint16_t addr, uint16_t v) {
+   mem_set_byte(cpu, addr, v & 0xff);
+   mem_set_byte(cpu, addr + 1, v >> 8);
+}
+
+int ewm_ldr_add_option(struct ewm_ldr_option_t **options, char *s) {
+   struct ewm_ldr_option_t option = { .next = NULL };
+
+   if (strncmp(s, "bas:", 4) == 0) {
+      option.type = EWM_LDR_TYPE_APPLESOFT;
+      option.path = s + 4;
+   } else if (strncmp(s, "bin:", 4) == 0) {
+      char *address = s + 4;
+      if (*address == '$') {
+         address++;
+      }
+      char *end = NULL;
+      unsigned long v = strtoul(address, &end, 16);
+      if (end == address || *end != ':' || v > 0xffff) {
+         return -1;
+      }
+      option.type = EWM_LDR_TYPE_BINARY;
+      option.address = v;
+      option.path = end + 1;
+   } else {
+      return -1;
+   }
+
+   if (*option.path == 0x00) {
+      return -1;
+   }
+
+   struct ewm_ldr_option_t *o = malloc(sizeof(struct ewm_ldr_option_t));
+   if (o == NULL) {
+      return -1;
+   }
+   *o = option;
+
+   // Programs are loaded in the order they were given
+   while (*options != NULL) {
+      options = &(*options)->next;
+   }
+   *options = o;
+
+   return 0;
+}
+
+void ewm_ldr_free_options(struct ewm_ldr_option_t *options) {
+   while (options != NULL) {
+      struct ewm_ldr_option_t *next = options->next;
+      free(options);
+      options = next;
+   }
+}
+
+int ewm_ldr_load_binary(struct cpu_t *cpu, uint16_t address, const uint8_t *data, size_t length) {
+   if (length > (size_t) 0x10000 - address) {
+      return -1;
+   }
+   for (size_t i = 0; i < length; i++) {
+      mem_set_byte(cpu, address + i, data[i]);
+   }
+   return 0;
+}
+
+int ewm_ldr_load_applesoft(struct cpu_t *cpu, const uint8_t *data, size_t length) {
+   uint16_t start = ewm_ldr_get_word(cpu, EWM_LDR_TXTTAB);
+   uint16_t top = ewm_ldr_get_word(cpu, EWM_LDR_MEMSIZ);
+
+   // Find the end of the program. The links in the file are for
+   // wherever it was saved from, so only the lines themselves count.
+   size_t end = 0;
+   while (end < length) {
+      if (end + 1 < length && data[end] == 0x00 && data[end + 1] == 0x00) {
+         break;
+      }
+      const uint8_t *eol = end + 4 < length ? memchr(data + end + 4, 0x00, length - end - 4) : NULL;
+      if (eol == NULL) {
+         return -1;
+      }
+      end = (eol - data) + 1;
+   }
+
+   // The closing link is added if the file does not have one
+   if (start < 0x0100 || start + end + 2 > top) {
+      return -1;
+   }
+
+   size_t line = 0;
+   while (line < end) {
+      size_t next = ((const uint8_t*) memchr(data + line + 4, 0x00, end - line - 4) - data) + 1;
+      ewm_ldr_set_word(cpu, start + line, start + next);
+      ewm_ldr_load_binary(cpu, start + line + 2, data + line + 2, next - line - 2);
+      line = next;
+   }
+   ewm_ldr_set_word(cpu, start + end, 0x0000);
+
+   // Like a CLEAR after the program was typed in
+   uint16_t vartab = start + end + 2;
+   ewm_ldr_set_word(cpu, EWM_LDR_VARTAB, vartab);
+   ewm_ldr_set_word(cpu, EWM_LDR_ARYTAB, vartab);
+   ewm_ldr_set_word(cpu, EWM_LDR_STREND, vartab);
+   ewm_ldr_set_word(cpu, EWM_LDR_FRETOP, top);
+   ewm_ldr_set_word(cpu, EWM_LDR_PRGEND, vartab);
+
+   return 0;
+}
+
+int ewm_ldr_load_file(struct cpu_t *cpu, struct ewm_ldr_option_t *option) {
+   int fd = open(option->path, O_RDONLY);
+   if (fd == -1) {
+      fprintf(stderr, "[LDR] Cannot open %s\n", option->path);
+      return -1;
+   }
+
+   struct stat file_info;
+   if (fstat(fd, &file_info) == -1 || file_info.st_size > 0x10000) {
+      fprintf(stderr, "[LDR] Cannot load %s\n", option->path);
+      close(fd);
+      return -1;
+   }
+
+   size_t length = file_info.st_size;
+   uint8_t *data = malloc(length + 1);
+   if (data == NULL || read(fd, data, length) != (ssize_t) length) {
+      fprintf(stderr, "[LDR] Cannot read %s\n", option->path);
+      close(fd);
+      free(data);
+      return -1;
+   }
+   close(fd);
+
+   int result = 0;
+
+   if (option->type == EWM_LDR_TYPE_APPLESOFT) {
+      if (ewm_ldr_load_applesoft(cpu, data, length) != 0) {
+         fprintf(stderr, "[LDR] %s is not an Applesoft program that fits in memory\n", option->path);
+         result = -1;
+      }
+   } else {
+      if (ewm_ldr_load_binary(cpu, option->address, data, length) != 0) {
+         fprintf(stderr, "[LDR] %s does not fit at $%.4X\n", option->path, option->address);
+         result = -1;
+      }
+   }
+
+   free(data);
+   return result;
+}
+
+int ewm_ldr_load(struct cpu_t *cpu, struct ewm_ldr_option_t *options, bool run) {
+   struct ewm_ldr_option_t *last = NULL;
+   for (struct ewm_ldr_option_t *o = options; o != NULL; o = o->next) {
+      if (ewm_ldr_load_file(cpu, o) != 0) {
+         return -1;
+      }
+      last = o;
+   }
+
+   if (run && last != NULL) {
+      if (last->type == EWM_LDR_TYPE_APPLESOFT) {
+         cpu->state.pc = EWM_LDR_APPLESOFT_RUN;
+      } else {
+         cpu->state.pc = last->address;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,66 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_LDR_H
+#define EWM_LDR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Loads programs straight into the memory of a running machine. Bytes
+// go through mem_set_byte(), so they end up wherever the cpu would
+// write them and decoded blocks are dropped like for any other write.
+//
+// An Applesoft program is the tokenized program as it is in memory. It
+// is put at TXTTAB, its lines are linked again for that address and
+// the variable and string pointers are set up as after a CLEAR. That
+// only works once Applesoft has been started.
+
+#define EWM_LDR_TYPE_BINARY    (0)
+#define EWM_LDR_TYPE_APPLESOFT (1)
+
+#define EWM_LDR_APPLESOFT_COLD (0xe000) // Starts Applesoft
+#define EWM_LDR_APPLESOFT_RUN  (0xd566) // Runs the program, like RUN does
+
+struct cpu_t;
+
+struct ewm_ldr_option_t {
+   int type;
+   uint16_t address; // Only for binaries
+   char *path;
+   struct ewm_ldr_option_t *next;
+};
+
+// Parses bin:<address>:<path> or bas:<path>, with the address in hex,
+// and appends it to the list. Returns -1 if it cannot be parsed.
+int ewm_ldr_add_option(struct ewm_ldr_option_t **options, char *s);
+void ewm_ldr_free_options(struct ewm_ldr_option_t *options);
+
+int ewm_ldr_load_binary(struct cpu_t *cpu, uint16_t address, const uint8_t *data, size_t length);
+int ewm_ldr_load_applesoft(struct cpu_t *cpu, const uint8_t *data, size_t length);
+int ewm_ldr_load_file(struct cpu_t *cpu, struct ewm_ldr_option_t *option);
+
+// Loads all programs and, if run is set, starts the last one.
+int ewm_ldr_load(struct cpu_t *cpu, struct ewm_ldr_option_t *options, bool run);
+
+#endif // EWM_LDR_H
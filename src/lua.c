@@ -36,6 +36,9 @@ static int ewm_lua_init(struct ewm_lua_t *lua) {
    memset(lua, 0x00, sizeof(struct ewm_lua_t));
    lua->state = luaL_newstate();
    luaL_openlibs(lua->state);
+   lua->cpu_ref = LUA_NOREF;
+   lua->two_ref = LUA_NOREF;
+   lua->dsk_ref = LUA_NOREF;
    return 0;
 }
 
@@ -48,6 +51,11 @@ struct ewm_lua_t *ewm_lua_create() {
    return lua;
 }
 
+void ewm_lua_destroy(struct ewm_lua_t *lua) {
+   lua_close(lua->state);
+   free(lua);
+}
+
 int ewm_lua_load_script(struct ewm_lua_t *lua, char *script_path) {
    if (luaL_dofile(lua->state, script_path) != 0) {
       printf("ewm: script error: %s\n", lua_tostring(lua->state, -1));
@@ -56,25 +64,39 @@ int ewm_lua_load_script(struct ewm_lua_t *lua, char *script_path) {
    return 0;
 }
 
-void ewm_lua_push_cpu(struct ewm_lua_t *lua, struct cpu_t *cpu) {
-   void *cpu_data = lua_newuserdata(lua->state, sizeof(struct cpu_t*));
-   *((struct cpu_t**) cpu_data) = cpu;
-   luaL_getmetatable(lua->state, "cpu_meta_table");
+// Every component has a single userdata per state. It is created the
+// first time it is pushed and then kept in the registry, so hooks that
+// run for every instruction or key press do not allocate. Pushing a
+// different component of the same kind replaces the cached userdata.
+
+static void ewm_lua_push_component(struct ewm_lua_t *lua, int *ref, void *component, char *meta_table) {
+   if (*ref != LUA_NOREF) {
+      lua_rawgeti(lua->state, LUA_REGISTRYINDEX, *ref);
+      if (*((void**) lua_touserdata(lua->state, -1)) == component) {
+         return;
+      }
+      lua_pop(lua->state, 1);
+      luaL_unref(lua->state, LUA_REGISTRYINDEX, *ref);
+   }
+
+   void *data = lua_newuserdata(lua->state, sizeof(void*));
+   *((void**) data) = component;
+   luaL_getmetatable(lua->state, meta_table);
    lua_setmetatable(lua->state, -2);
+   lua_pushvalue(lua->state, -1);
+   *ref = luaL_ref(lua->state, LUA_REGISTRYINDEX);
+}
+
+void ewm_lua_push_cpu(struct ewm_lua_t *lua, struct cpu_t *cpu) {
+   ewm_lua_push_component(lua, &lua->cpu_ref, cpu, "cpu_meta_table");
 }
 
 void ewm_lua_push_two(struct ewm_lua_t *lua, struct ewm_two_t *two) {
-   void *two_data = lua_newuserdata(lua->state, sizeof(struct ewm_two_t*));
-   *((struct ewm_two_t**) two_data) = two;
-   luaL_getmetatable(lua->state, "two_meta_table");
-   lua_setmetatable(lua->state, -2);
+   ewm_lua_push_component(lua, &lua->two_ref, two, "two_meta_table");
 }
 
 void ewm_lua_push_dsk(struct ewm_lua_t *lua, struct ewm_dsk_t *dsk) {
-   void *dsk_data = lua_newuserdata(lua->state, sizeof(struct ewm_dsk_t*));
-   *((struct ewm_dsk_t**) dsk_data) = dsk;
-   luaL_getmetatable(lua->state, "dsk_meta_table");
-   lua_setmetatable(lua->state, -2);
+   ewm_lua_push_component(lua, &lua->dsk_ref, dsk, "dsk_meta_table");
 }
 
 void ewm_lua_register_component(struct ewm_lua_t *lua, char *name, luaL_Reg *functions) {
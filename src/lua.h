@@ -33,9 +33,13 @@ struct ewm_dsk_t;
 
 struct ewm_lua_t {
    lua_State *state;
+   int cpu_ref; // Registry refs of the cached component userdata
+   int two_ref;
+   int dsk_ref;
 };
 
 struct ewm_lua_t *ewm_lua_create();
+void ewm_lua_destroy(struct ewm_lua_t *lua);
 int ewm_lua_load_script(struct ewm_lua_t *lua, char *script_path);
 
 void ewm_lua_push_cpu(struct ewm_lua_t *lua, struct cpu_t *cpu);
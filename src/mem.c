@@ -27,20 +27,18 @@
 
 #include "cpu.h"
 #include "mem.h"
+#include "blk.h"
 
-// The following two are our memory primitives that properly set go
-// through the handler functions for all registered memory. They will
-// take more time but do the right thing.
-
-uint8_t mem_get_byte(struct cpu_t *cpu, uint16_t addr) {
-   if (addr < cpu->ram_size) {
-      return cpu->ram[addr];
-   }
+// Pages that are shared by multiple regions, like the $C0xx soft
+// switches, cannot be resolved by the page table. For those we
+// still walk the list of memory regions.
 
+static uint8_t mem_get_byte_slow(struct cpu_t *cpu, uint16_t addr) {
    struct mem_t *mem = cpu->mem;
    while (mem != NULL) {
       if (mem->enabled && addr >= mem->start && addr <= mem->end) {
          if (mem->read_handler != NULL && mem->flags & MEM_FLAGS_READ) {
+            mem->reads++;
             return ((mem_read_handler_t) mem->read_handler)((struct cpu_t*) cpu, mem, addr);
          }
       }
@@ -50,18 +48,12 @@ uint8_t mem_get_byte(struct cpu_t *cpu, uint16_t addr) {
    return 0;
 }
 
-extern struct ewm_two_t *two;
-
-void mem_set_byte(struct cpu_t *cpu, uint16_t addr, uint8_t v) {
-   if (addr < cpu->ram_size) {
-      cpu->ram[addr] = v;
-      return;
-   }
-
+static void mem_set_byte_slow(struct cpu_t *cpu, uint16_t addr, uint8_t v) {
    struct mem_t *mem = cpu->mem;
    while (mem != NULL) {
       if (mem->enabled && addr >= mem->start && addr <= mem->end) {
          if (mem->write_handler && mem->flags & MEM_FLAGS_WRITE) {
+            mem->writes++;
             ((mem_write_handler_t) mem->write_handler)((struct cpu_t*) cpu, mem, addr, v);
          }
          return;
@@ -70,17 +62,95 @@ void mem_set_byte(struct cpu_t *cpu, uint16_t addr, uint8_t v) {
    }
 }
 
+// The following two are our memory primitives that properly go
+// through the handler functions for all registered memory. They
+// look up the page in the page table, which is kept up to date by
+// cpu_add_mem and cpu_remap_mem.
+
+static uint8_t mem_get_byte_page(struct cpu_t *cpu, struct cpu_page_t *page, uint16_t addr) {
+   if (page->mem != NULL) {
+      page->mem->reads++;
+      return page->mem->read_handler(cpu, page->mem, addr);
+   }
+   if (page->mixed) {
+      return mem_get_byte_slow(cpu, addr);
+   }
+   return 0;
+}
+
+static void mem_set_byte_page(struct cpu_t *cpu, struct cpu_page_t *page, uint16_t addr, uint8_t v) {
+   if (page->mem != NULL) {
+      page->mem->writes++;
+      page->mem->write_handler(cpu, page->mem, addr, v);
+      if (page->dirty != NULL) {
+         *page->dirty = 1;
+      }
+      return;
+   }
+   if (page->mixed) {
+      mem_set_byte_slow(cpu, addr, v);
+      return;
+   }
+   if (page->code) {
+      ewm_blk_write(cpu, addr, v);
+   }
+}
+
+// Watched pages never have data, so they cost nothing until then
+
+static uint8_t mem_get_byte_watched(struct cpu_t *cpu, struct cpu_page_t *page, uint16_t addr) {
+   uint8_t v = mem_get_byte_page(cpu, page, addr);
+   cpu_watched(cpu, EWM_CPU_WATCH_READ, addr, v);
+   return v;
+}
+
+static void mem_set_byte_watched(struct cpu_t *cpu, struct cpu_page_t *page, uint16_t addr, uint8_t v) {
+   mem_set_byte_page(cpu, page, addr, v);
+   cpu_watched(cpu, EWM_CPU_WATCH_WRITE, addr, v);
+}
+
+uint8_t mem_get_byte(struct cpu_t *cpu, uint16_t addr) {
+   struct cpu_page_t *page = &cpu->read_pages[addr >> 8];
+   if (page->data != NULL) {
+      return page->data[addr & 0xff];
+   }
+   if (page->watched) {
+      return mem_get_byte_watched(cpu, page, addr);
+   }
+   return mem_get_byte_page(cpu, page, addr);
+}
+
+void mem_set_byte(struct cpu_t *cpu, uint16_t addr, uint8_t v) {
+   struct cpu_page_t *page = &cpu->write_pages[addr >> 8];
+   if (page->data != NULL) {
+      page->data[addr & 0xff] = v;
+      *page->dirty = 1;
+      return;
+   }
+   if (page->watched) {
+      mem_set_byte_watched(cpu, page, addr, v);
+      return;
+   }
+   mem_set_byte_page(cpu, page, addr, v);
+}
+
 // Getters
 
 uint8_t mem_get_byte_abs(struct cpu_t *cpu, uint16_t addr) {
   return mem_get_byte(cpu, addr);
 }
 
+// Indexed reads take a cycle more when the index crosses a page, which
+// is the carry out of adding it to the low byte. Stores and read-modify-
+// write instructions always take that cycle, so they do not use these.
+
 uint8_t mem_get_byte_absx(struct cpu_t *cpu, uint16_t addr) {
+   cpu->counter += ((addr & 0x00ff) + cpu->state.x) >> 8;
    return mem_get_byte(cpu, addr + cpu->state.x);
 }
 
 uint8_t mem_get_byte_absy(struct cpu_t *cpu, uint16_t addr) {
+  cpu->counter += ((addr & 0x00ff) + cpu->state.y) >> 8;
   return mem_get_byte(cpu, addr + cpu->state.y);
 }
 
@@ -101,6 +171,7 @@ uint8_t mem_get_byte_indx(struct cpu_t *cpu, uint8_t addr) {
 }
 
 uint8_t mem_get_byte_indy(struct cpu_t *cpu, uint8_t addr) {
+   cpu->counter += ((uint16_t) cpu->ram[addr] + cpu->state.y) >> 8;
    return mem_get_byte(cpu, (((uint16_t) cpu->ram[addr+1] << 8) | (uint16_t) cpu->ram[addr]) + cpu->state.y);
 }
 
@@ -174,11 +245,11 @@ void mem_mod_byte_abs(struct cpu_t *cpu, uint16_t addr, mem_mod_t op) {
 }
 
 void mem_mod_byte_absx(struct cpu_t *cpu, uint16_t addr, mem_mod_t op) {
-  mem_set_byte_absx(cpu, addr, op(cpu, mem_get_byte_absx(cpu, addr)));
+  mem_set_byte_absx(cpu, addr, op(cpu, mem_get_byte(cpu, addr + cpu->state.x)));
 }
 
 void mem_mod_byte_absy(struct cpu_t *cpu, uint16_t addr, mem_mod_t op) {
-  mem_set_byte_absy(cpu, addr, op(cpu, mem_get_byte_absy(cpu, addr)));
+  mem_set_byte_absy(cpu, addr, op(cpu, mem_get_byte(cpu, addr + cpu->state.y)));
 }
 
 void mem_mod_byte_indx(struct cpu_t *cpu, uint8_t addr, mem_mod_t op) {
@@ -186,7 +257,8 @@ void mem_mod_byte_indx(struct cpu_t *cpu, uint8_t addr, mem_mod_t op) {
 }
 
 void mem_mod_byte_indy(struct cpu_t *cpu, uint8_t addr, mem_mod_t op) {
-  mem_set_byte_indy(cpu, addr, op(cpu, mem_get_byte_indy(cpu, addr)));
+  uint16_t a = (((uint16_t) cpu->ram[addr+1] << 8) | (uint16_t) cpu->ram[addr]) + cpu->state.y;
+  mem_set_byte(cpu, a, op(cpu, mem_get_byte(cpu, a)));
 }
 
 // For parsing --memory options
@@ -21,58 +21,206 @@
 // SOFTWARE.
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <SDL2/SDL.h>
 
 #include "sdl.h"
+#include "bat.h"
 #include "cpu.h"
+#include "ldr.h"
 #include "mem.h"
+#include "pac.h"
 #include "pia.h"
+#include "snp.h"
+#include "trc.h"
 #include "tty.h"
 #include "one.h"
 
+// Pipe mode
+
+static void ewm_one_pipe_write(struct ewm_one_pipe_t *pipe, uint8_t v) {
+   v &= 0x7f;
+   if (v == '\r') {
+      fputc('\n', pipe->output);
+   } else if (isprint(v)) {
+      fputc(v, pipe->output);
+   }
+}
+
+// Refills the buffer once it is empty, waiting at most timeout ms for
+// input. Returns false if there is nothing to read.
+
+static bool ewm_one_pipe_fill(struct ewm_one_pipe_t *pipe, int timeout) {
+   if (pipe->head != pipe->tail) {
+      return true;
+   }
+   if (pipe->eof) {
+      return false;
+   }
+
+   struct pollfd pfd = { .fd = pipe->fd, .events = POLLIN };
+   if (poll(&pfd, 1, timeout) <= 0) {
+      return false;
+   }
+
+   ssize_t n = read(pipe->fd, pipe->buffer, sizeof(pipe->buffer));
+   if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      return false;
+   }
+   if (n <= 0) {
+      pipe->eof = true;
+      return false;
+   }
+
+   pipe->head = 0;
+   pipe->tail = n;
+   return true;
+}
+
+// Keys go in the same way as typed ones, with newlines as returns
+
+static void ewm_one_pipe_poll(struct ewm_pia_t *pia, void *obj) {
+   struct ewm_one_t *one = (struct ewm_one_t*) obj;
+   struct ewm_one_pipe_t *pipe = one->pipe;
+
+   while (ewm_one_pipe_fill(pipe, 0)) {
+      uint8_t c = pipe->buffer[pipe->head++];
+      if (c == '\r') {
+         continue;
+      }
+      if (c == '\n') {
+         c = 0x0d;
+      }
+      ewm_pia_set_ina(pia, toupper(c) | 0x80);
+      ewm_pia_set_irqa1(pia);
+      pipe->waiting = false;
+      return;
+   }
+
+   // Show the prompt before waiting for more input
+   if (!pipe->waiting) {
+      fflush(pipe->output);
+   }
+   pipe->waiting = true;
+}
+
 static void ewm_one_pia_callback(struct ewm_pia_t *pia, void *obj, uint8_t ddr, uint8_t v) {
    struct ewm_one_t *one = (struct ewm_one_t*) obj;
+   if (one->pipe != NULL) {
+      ewm_one_pipe_write(one->pipe, v);
+      return;
+   }
    if (one->model == EWM_ONE_MODEL_APPLE1) {
       v &= 0x7f;
    }
    ewm_tty_write(one->tty, v);
 }
 
-static int ewm_one_init(struct ewm_one_t *one, int model, SDL_Renderer *renderer) {
+static int ewm_one_init(struct ewm_one_t *one, int model, SDL_Renderer *renderer, struct ewm_one_pipe_t *pipe) {
    memset(one, 0, sizeof(struct ewm_one_t));
    one->model = model;
+   one->pipe = pipe;
    switch (model) {
       case EWM_ONE_MODEL_APPLE1: {
          one->cpu = cpu_create(EWM_CPU_MODEL_6502);
          cpu_add_ram(one->cpu, 0x0000, 8 * 1024 - 1);
          cpu_add_rom_file(one->cpu, 0xff00, "rom/apple1.rom");
-         SDL_Color green = {0,255,0,255};
-         one->tty = ewm_tty_create(renderer, green);
-         one->pia = ewm_pia_create(one->cpu);
-         one->pia->callback = ewm_one_pia_callback;
-         one->pia->callback_obj = one;
          break;
       }
       case EWM_ONE_MODEL_REPLICA1: {
          one->cpu = cpu_create(EWM_CPU_MODEL_65C02);
          cpu_add_ram(one->cpu, 0x0000, 32 * 1024 - 1);
          cpu_add_rom_file(one->cpu, 0xe000, "rom/krusader.rom");
-         SDL_Color green = {0,255,0,255};
-         one->tty = ewm_tty_create(renderer, green);
-         one->pia = ewm_pia_create(one->cpu);
-         one->pia->callback = ewm_one_pia_callback;
-         one->pia->callback_obj = one;
          break;
       }
    }
+   if (pipe == NULL) {
+      SDL_Color green = {0,255,0,255};
+      one->tty = ewm_tty_create(renderer, green);
+   }
+   one->pia = ewm_pia_create(one->cpu);
+   one->pia->callback = ewm_one_pia_callback;
+   one->pia->callback_obj = one;
+   if (pipe != NULL) {
+      one->pia->poll = ewm_one_pipe_poll;
+   }
    return 0;
 }
 
 void ewm_one_destroy(struct ewm_one_t *one) {
-   // TODO
+   if (one->trace != NULL) {
+      ewm_trace_destroy(one->trace);
+   }
+   ewm_pia_destroy(one->pia);
+   if (one->tty != NULL) {
+      ewm_tty_destroy(one->tty);
+   }
+   if (one->pipe != NULL) {
+      fflush(one->pipe->output);
+      free(one->pipe);
+   }
+   cpu_destroy(one->cpu);
+   free(one->cpu);
+   free(one);
+}
+
+int ewm_one_save_snapshot(struct ewm_one_t *one, char *path) {
+   struct ewm_snapshot_t *snapshot = ewm_snapshot_create("ONE ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+
+   ewm_snapshot_begin(snapshot, "ONE ");
+   ewm_snapshot_put_u8(snapshot, one->model);
+   ewm_snapshot_end(snapshot);
+
+   int result = cpu_save_snapshot(one->cpu, snapshot);
+   if (result == 0) {
+      result = ewm_pia_save_snapshot(one->pia, snapshot);
+   }
+   if (result == 0 && one->tty != NULL) {
+      result = ewm_tty_save_snapshot(one->tty, snapshot);
+   }
+   if (result == 0) {
+      result = ewm_snapshot_save(snapshot, path);
+   }
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
+}
+
+int ewm_one_load_snapshot(struct ewm_one_t *one, char *path) {
+   struct ewm_snapshot_t *snapshot = ewm_snapshot_load(path, "ONE ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+
+   int result = 0;
+
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "ONE ", &chunk) != 0 || ewm_snapshot_get_u8(&chunk) != one->model) {
+      fprintf(stderr, "[ONE] Snapshot is for a different model\n");
+      result = -1;
+   }
+
+   if (result == 0) {
+      result = cpu_load_snapshot(one->cpu, snapshot);
+   }
+   if (result == 0) {
+      result = ewm_pia_load_snapshot(one->pia, snapshot);
+   }
+   if (result == 0 && one->tty != NULL) {
+      result = ewm_tty_load_snapshot(one->tty, snapshot);
+   }
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
 }
 
 static void ewm_one_keydown(struct ewm_one_t *one, uint8_t key) {
@@ -147,32 +295,192 @@ static bool ewm_one_poll_event(struct ewm_one_t *one, SDL_Window *window) {
    return true;
 }
 
+// Pending programs are loaded between slices, once the display side
+// of the PIA has been set up by the monitor.
+
+int ewm_one_load_programs(struct ewm_one_t *one, struct ewm_ldr_option_t *loads, bool run) {
+   for (struct ewm_ldr_option_t *o = loads; o != NULL; o = o->next) {
+      if (o->type != EWM_LDR_TYPE_BINARY) {
+         fprintf(stderr, "[ONE] Cannot load %s, only binaries can be loaded\n", o->path);
+         return -1;
+      }
+   }
+   one->loads = loads;
+   one->loads_run = run;
+   return 0;
+}
+
 static bool ewm_one_step_cpu(struct ewm_one_t *one, int cycles) {
+   if (one->loads != NULL && (one->pia->ctlb & 0b00000100)) {
+      struct ewm_ldr_option_t *loads = one->loads;
+      one->loads = NULL;
+      if (ewm_ldr_load(one->cpu, loads, one->loads_run) != 0) {
+         return false;
+      }
+   }
+
+   int ret = cpu_run(one->cpu, cycles);
+   if (ret < 0) {
+      // These only happen in strict mode
+      switch (ret) {
+         case EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION:
+            fprintf(stderr, "CPU: Exited because of unimplemented instructions 0x%.2x at 0x%.4x\n",
+                    mem_get_byte(one->cpu, one->cpu->state.pc), one->cpu->state.pc);
+            break;
+         case EWM_CPU_ERR_STACK_OVERFLOW:
+            fprintf(stderr, "CPU: Exited because of stack overflow at 0x%.4x\n", one->cpu->state.pc);
+            break;
+         case EWM_CPU_ERR_STACK_UNDERFLOW:
+            fprintf(stderr, "CPU: Exited because of stack underflow at 0x%.4x\n", one->cpu->state.pc);
+            break;
+      }
+      return false;
+   }
+   return true;
+}
+
+// In pipe mode the cpu runs flat out while there is input. When it
+// waits for a key it waits for input for up to a frame, and after the
+// last key it stops.
+
+static int ewm_one_run_pipe(struct ewm_one_t *one) {
+   struct ewm_one_pipe_t *pipe = one->pipe;
    while (true) {
-      int ret = cpu_step(one->cpu);
-      if (ret < 0) {
-         // These only happen in strict mode
-         switch (ret) {
-            case EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION:
-               fprintf(stderr, "CPU: Exited because of unimplemented instructions 0x%.2x at 0x%.4x\n",
-                       mem_get_byte(one->cpu, one->cpu->state.pc), one->cpu->state.pc);
-               break;
-            case EWM_CPU_ERR_STACK_OVERFLOW:
-               fprintf(stderr, "CPU: Exited because of stack overflow at 0x%.4x\n", one->cpu->state.pc);
-               break;
-            case EWM_CPU_ERR_STACK_UNDERFLOW:
-               fprintf(stderr, "CPU: Exited because of stack underflow at 0x%.4x\n", one->cpu->state.pc);
-               break;
+      if (!ewm_one_step_cpu(one, EWM_ONE_CPS / EWM_ONE_FPS)) {
+         return -1;
+      }
+      if (pipe->waiting) {
+         if (pipe->eof) {
+            break;
          }
-         return false;
+         ewm_one_pipe_fill(pipe, 1000 / EWM_ONE_FPS);
       }
+   }
+   fflush(pipe->output);
+   return 0;
+}
+
+// The cpu runs in bursts of a frame, sleeping in between
+
+static void ewm_one_run_window(struct ewm_one_t *one, SDL_Window *window) {
+   SDL_StartTextInput();
 
-      cycles -= ret;
-      if (cycles <= 0) {
+   struct ewm_pacer_t pacer;
+   ewm_pacer_init(&pacer, EWM_ONE_FPS, EWM_ONE_CPS);
+   uint32_t phase = 1;
+
+   while (true) {
+      if (!ewm_one_poll_event(one, window)) { // TODO Move window into one
          break;
       }
+
+      if (ewm_pacer_due(&pacer)) {
+         if (!ewm_one_step_cpu(one, ewm_pacer_frame(&pacer, one->cpu->counter))) {
+            break;
+         }
+
+         if (one->tty->screen_dirty || (phase == 0) || ((phase % (EWM_ONE_FPS / 4)) == 0)) {
+            SDL_SetRenderDrawColor(one->tty->renderer, 0, 0, 0, 255);
+            SDL_RenderClear(one->tty->renderer);
+
+            ewm_tty_refresh(one->tty, phase, EWM_ONE_FPS);
+            one->tty->screen_dirty = false;
+
+            SDL_RenderCopy(one->tty->renderer, one->tty->texture, NULL, NULL);
+
+            SDL_RenderPresent(one->tty->renderer);
+         }
+
+         phase += 1;
+         if (phase == EWM_ONE_FPS) {
+            phase = 0;
+         }
+      } else {
+         ewm_pacer_wait(&pacer, 1000 / EWM_ONE_FPS);
+      }
+   }
+}
+
+// Run a job of the batch runner. The machine runs without a window at
+// max speed and the dump is either the screen or a range of memory.
+
+static void ewm_one_dump_text(struct ewm_one_t *one, FILE *fp) {
+   for (int row = 0; row < EWM_ONE_TTY_ROWS; row++) {
+      for (int column = 0; column < EWM_ONE_TTY_COLUMNS; column++) {
+         uint8_t c = one->tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column] & 0x7f;
+         fputc(isprint(c) ? c : ' ', fp);
+      }
+      fputc('\n', fp);
    }
-   return true;
+}
+
+static void ewm_one_dump_memory(struct ewm_one_t *one, FILE *fp, uint16_t start, uint16_t end) {
+   for (uint32_t addr = start & 0xfff0; addr <= end; addr += 16) {
+      fprintf(fp, "%.4X:", addr);
+      for (uint32_t i = addr; i < addr + 16 && i <= end; i++) {
+         if (i < start) {
+            fprintf(fp, "   ");
+         } else {
+            fprintf(fp, " %.2X", mem_get_byte(one->cpu, i));
+         }
+      }
+      fputc('\n', fp);
+   }
+}
+
+int ewm_one_run_job(struct ewm_batch_job_t *job, FILE *out) {
+   unsigned int start = 0, end = 0;
+   if (job->dump != NULL && strcmp(job->dump, "text") != 0) {
+      if (sscanf(job->dump, "memory:%x:%x", &start, &end) != 2 || start > end || end > 0xffff) {
+         fprintf(stderr, "[ONE] Unknown dump %s\n", job->dump);
+         return -1;
+      }
+   }
+
+   struct ewm_one_t *one = ewm_one_create(job->model, NULL);
+   if (one == NULL) {
+      return -1;
+   }
+
+   int result = 0;
+   if (job->memory != NULL) {
+      result = cpu_add_memory_from_options(one->cpu, job->memory);
+   }
+
+   cpu_strict(one->cpu, job->strict);
+
+   if (result == 0) {
+      cpu_reset(one->cpu);
+      if (job->snapshot != NULL && ewm_one_load_snapshot(one, job->snapshot) != 0) {
+         fprintf(stderr, "[ONE] Cannot load snapshot from %s\n", job->snapshot);
+         result = -1;
+      }
+   }
+
+   if (result == 0) {
+      result = ewm_one_load_programs(one, job->loads, job->run);
+   }
+
+   if (result == 0) {
+      uint64_t limit = one->cpu->counter + job->seconds * EWM_ONE_CPS;
+      while (one->cpu->counter < limit) {
+         if (!ewm_one_step_cpu(one, EWM_ONE_CPS / EWM_ONE_FPS)) {
+            result = -1;
+            break;
+         }
+      }
+      if (job->dump != NULL) {
+         if (strcmp(job->dump, "text") == 0) {
+            ewm_one_dump_text(one, out);
+         } else {
+            ewm_one_dump_memory(one, out, start, end);
+         }
+      }
+   }
+
+   ewm_one_destroy(one);
+
+   return result;
 }
 
 #define EWM_ONE_OPT_HELP   (0)
@@ -180,6 +488,12 @@ static bool ewm_one_step_cpu(struct ewm_one_t *one, int cycles) {
 #define EWM_ONE_OPT_MEMORY (2)
 #define EWM_ONE_OPT_TRACE  (3)
 #define EWM_ONE_OPT_STRICT (4)
+#define EWM_ONE_OPT_LOAD_SNAPSHOT (5)
+#define EWM_ONE_OPT_SAVE_SNAPSHOT (6)
+#define EWM_ONE_OPT_PROFILE (7)
+#define EWM_ONE_OPT_PIPE   (8)
+#define EWM_ONE_OPT_LOAD   (9)
+#define EWM_ONE_OPT_RUN    (10)
 
 static struct option one_options[] = {
    { "help",   no_argument,       NULL, EWM_ONE_OPT_HELP   },
@@ -187,6 +501,12 @@ static struct option one_options[] = {
    { "memory", required_argument, NULL, EWM_ONE_OPT_MEMORY },
    { "trace",  optional_argument, NULL, EWM_ONE_OPT_TRACE  },
    { "strict", no_argument,       NULL, EWM_ONE_OPT_STRICT },
+   { "load-snapshot", required_argument, NULL, EWM_ONE_OPT_LOAD_SNAPSHOT },
+   { "save-snapshot", required_argument, NULL, EWM_ONE_OPT_SAVE_SNAPSHOT },
+   { "profile", no_argument,      NULL, EWM_ONE_OPT_PROFILE },
+   { "pipe",   optional_argument, NULL, EWM_ONE_OPT_PIPE   },
+   { "load",   required_argument, NULL, EWM_ONE_OPT_LOAD   },
+   { "run",    no_argument,       NULL, EWM_ONE_OPT_RUN    },
    { NULL,     0,                 NULL, 0 }
 };
 
@@ -194,8 +514,14 @@ static void usage() {
    fprintf(stderr, "Usage: ewm one [options]\n");
    fprintf(stderr, "  --model <model>   model to emulate (default: apple1)\n");
    fprintf(stderr, "  --memory <region> add memory region (ram|rom:address:path)\n");
-   fprintf(stderr, "  --trace <file>    trace cpu to file\n");
+   fprintf(stderr, "  --trace=<file>    trace cpu to file (default: ewm.trace), see ewm trace-dump\n");
    fprintf(stderr, "  --strict          run emulator in strict mode\n");
+   fprintf(stderr, "  --load-snapshot <path> continue from a snapshot\n");
+   fprintf(stderr, "  --save-snapshot <path> save a snapshot at exit\n");
+   fprintf(stderr, "  --profile         print where the cpu spent its cycles at exit\n");
+   fprintf(stderr, "  --pipe=<file>     type keys from file (default: stdin) and print to stdout, without a window\n");
+   fprintf(stderr, "  --load <program>  load bin:address:path into memory\n");
+   fprintf(stderr, "  --run             run the last program that was loaded\n");
    fprintf(stderr, "\n");
    fprintf(stderr, "Supported models:\n");
    fprintf(stderr, "  apple1    Classic Apple 1, 6502, 8KB RAM, Woz Monitor\n");
@@ -208,6 +534,13 @@ int ewm_one_main(int argc, char **argv) {
    struct ewm_memory_option_t *extra_memory = NULL;
    char *trace_path = NULL;
    bool strict = false;
+   char *load_snapshot_path = NULL;
+   char *save_snapshot_path = NULL;
+   bool profile = false;
+   bool pipe = false;
+   char *pipe_path = NULL;
+   struct ewm_ldr_option_t *loads = NULL;
+   bool run_loaded = false;
 
    int ch;
    while ((ch = getopt_long_only(argc, argv, "", one_options, NULL)) != -1) {
@@ -237,13 +570,41 @@ int ewm_one_main(int argc, char **argv) {
             break;
          }
          case EWM_ONE_OPT_TRACE: {
-            trace_path = optarg ? optarg : "/dev/stderr";
+            trace_path = optarg ? optarg : EWM_TRACE_DEFAULT_PATH;
             break;
          }
          case EWM_ONE_OPT_STRICT: {
             strict = true;
             break;
          }
+         case EWM_ONE_OPT_LOAD_SNAPSHOT: {
+            load_snapshot_path = optarg;
+            break;
+         }
+         case EWM_ONE_OPT_SAVE_SNAPSHOT: {
+            save_snapshot_path = optarg;
+            break;
+         }
+         case EWM_ONE_OPT_PROFILE: {
+            profile = true;
+            break;
+         }
+         case EWM_ONE_OPT_PIPE: {
+            pipe = true;
+            pipe_path = optarg;
+            break;
+         }
+         case EWM_ONE_OPT_LOAD: {
+            if (ewm_ldr_add_option(&loads, optarg) != 0) {
+               usage();
+               exit(1);
+            }
+            break;
+         }
+         case EWM_ONE_OPT_RUN: {
+            run_loaded = true;
+            break;
+         }
          default: {
             usage();
             exit(1);
@@ -251,36 +612,50 @@ int ewm_one_main(int argc, char **argv) {
       }
    }
 
-   // Setup SDL
+   // Setup SDL, unless in pipe mode
 
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
-      fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
-      return 1;
-   }
+   SDL_Window *window = NULL;
+   SDL_Renderer *renderer = NULL;
+   struct ewm_one_t *one = NULL;
 
-   SDL_Window *window = SDL_CreateWindow("EWM v0.1 - Apple 1", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-         280*3, 192*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      return 1;
-   }
+   if (pipe) {
+      int fd = STDIN_FILENO;
+      if (pipe_path != NULL && (fd = open(pipe_path, O_RDONLY)) == -1) {
+         fprintf(stderr, "[ONE] Cannot open %s\n", pipe_path);
+         return 1;
+      }
+      one = ewm_one_create_pipe(model, fd, stdout);
+   } else {
+      if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0) {
+         fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      return 1;
-   }
+      window = SDL_CreateWindow("EWM v0.1 - Apple 1", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            280*3, 192*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         return 1;
+      }
 
-   if (ewm_sdl_check_renderer(renderer) != 0) {
-      fprintf(stderr, "ewm: boo: unsupported renderer\n");
-      return 1;
-   }
+      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+      if (renderer == NULL) {
+         fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+         return 1;
+      }
+
+      if (ewm_sdl_check_renderer(renderer) != 0) {
+         fprintf(stderr, "ewm: boo: unsupported renderer\n");
+         return 1;
+      }
 
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
+      SDL_RenderSetLogicalSize(renderer, 280, 192);
+
+      one = ewm_one_create(model, renderer);
+   }
 
    // Create the machine
 
-   struct ewm_one_t *one = ewm_one_create(model, renderer);
    if (one == NULL) {
       fprintf(stderr, "Failed to create ewm_one_t\n");
       return 1;
@@ -295,66 +670,83 @@ int ewm_one_main(int argc, char **argv) {
    }
 
    cpu_strict(one->cpu, strict);
-   cpu_trace(one->cpu, trace_path);
-
-   cpu_reset(one->cpu);
-
-   // Main loop
-
-   SDL_StartTextInput();
-
-   uint32_t ticks = SDL_GetTicks();
-   uint32_t phase = 1;
-
-   while (true) {
-      if (!ewm_one_poll_event(one, window)) { // TODO Move window into one
-         break;
+   if (trace_path != NULL) {
+      one->trace = ewm_trace_create(trace_path, one->cpu->model);
+      if (one->trace == NULL) {
+         fprintf(stderr, "[ONE] Cannot trace to %s\n", trace_path);
+         exit(1);
       }
+      cpu_trace(one->cpu, one->trace);
+   }
 
-      // This is very basic throttling that does bursts of CPU cycles.
+   if (profile && cpu_profile(one->cpu, true) != 0) {
+      fprintf(stderr, "[ONE] Cannot start the profiler\n");
+      exit(1);
+   }
 
-      if ((SDL_GetTicks() - ticks) >= (1000 / EWM_ONE_FPS)) {
-         if (!ewm_one_step_cpu(one, EWM_ONE_CPS / EWM_ONE_FPS)) {
-            break;
-         }
+   cpu_reset(one->cpu);
 
-         if (one->tty->screen_dirty || (phase == 0) || ((phase % (EWM_ONE_FPS / 4)) == 0)) {
-            SDL_SetRenderDrawColor(one->tty->renderer, 0, 0, 0, 255);
-            SDL_RenderClear(one->tty->renderer);
+   if (load_snapshot_path != NULL) {
+      if (ewm_one_load_snapshot(one, load_snapshot_path) != 0) {
+         fprintf(stderr, "[ONE] Cannot load snapshot from %s\n", load_snapshot_path);
+         exit(1);
+      }
+   }
 
-            ewm_tty_refresh(one->tty, phase, EWM_ONE_FPS);
-            one->tty->screen_dirty = false;
+   if (ewm_one_load_programs(one, loads, run_loaded) != 0) {
+      exit(1);
+   }
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(one->tty->renderer, one->tty->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(one->tty->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
+   // Main loop
 
-            SDL_RenderPresent(one->tty->renderer);
-         }
+   int result = 0;
+   if (one->pipe != NULL) {
+      result = ewm_one_run_pipe(one);
+   } else {
+      ewm_one_run_window(one, window);
+   }
 
-         ticks = SDL_GetTicks();
+   cpu_profile_report(one->cpu, stderr, EWM_CPU_PROFILE_TOP);
 
-         phase += 1;
-         if (phase == EWM_ONE_FPS) {
-            phase = 0;
-         }
+   if (save_snapshot_path != NULL) {
+      if (ewm_one_save_snapshot(one, save_snapshot_path) != 0) {
+         fprintf(stderr, "[ONE] Cannot save snapshot to %s\n", save_snapshot_path);
       }
    }
 
+   ewm_ldr_free_options(loads);
+
    // Destroy SDL
 
-   SDL_DestroyWindow(window);
-   SDL_DestroyRenderer(renderer);
-   SDL_Quit();
+   if (window != NULL) {
+      SDL_DestroyWindow(window);
+      SDL_DestroyRenderer(renderer);
+      SDL_Quit();
+   }
 
-   return 0;
+   return (result == 0) ? 0 : 1;
 }
 
 struct ewm_one_t *ewm_one_create(int model, SDL_Renderer *renderer) {
    struct ewm_one_t *one = (struct ewm_one_t*) malloc(sizeof(struct ewm_one_t));
-   if (ewm_one_init(one, model, renderer) != 0) {
+   if (ewm_one_init(one, model, renderer, NULL) != 0) {
+      free(one);
+      one = NULL;
+   }
+   return one;
+}
+
+struct ewm_one_t *ewm_one_create_pipe(int model, int fd, FILE *output) {
+   struct ewm_one_pipe_t *pipe = calloc(1, sizeof(struct ewm_one_pipe_t));
+   if (pipe == NULL) {
+      return NULL;
+   }
+   pipe->fd = fd;
+   pipe->output = output;
+
+   struct ewm_one_t *one = (struct ewm_one_t*) malloc(sizeof(struct ewm_one_t));
+   if (ewm_one_init(one, model, NULL, pipe) != 0) {
+      free(pipe);
       free(one);
       one = NULL;
    }
@@ -23,6 +23,11 @@
 #ifndef EWM_ONE_H
 #define EWM_ONE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #include <SDL2/SDL.h>
 
 #define EWM_ONE_MODEL_APPLE1   (0)
@@ -35,17 +40,53 @@
 struct cpu_t;
 struct ewm_tty_t;
 struct ewm_pia_t;
+struct ewm_trace_t;
+struct ewm_batch_job_t;
+struct ewm_ldr_option_t;
+
+// In pipe mode keys are read from fd and the display goes to output,
+// without SDL or a terminal. Reads only happen when the machine looks
+// for a key, and never block.
+
+#define EWM_ONE_PIPE_BUFFER_SIZE (4096)
+
+struct ewm_one_pipe_t {
+   int fd;
+   FILE *output;
+   bool eof;
+   bool waiting; // Set when the machine looked for a key that was not there yet
+   size_t head, tail;
+   uint8_t buffer[EWM_ONE_PIPE_BUFFER_SIZE];
+};
 
 struct ewm_one_t {
    int model;
    struct cpu_t *cpu;
-   struct ewm_tty_t *tty;
+   struct ewm_tty_t *tty;     // NULL in pipe mode
    struct ewm_pia_t *pia;
+   struct ewm_trace_t *trace; // NULL unless tracing
+   struct ewm_one_pipe_t *pipe; // NULL unless in pipe mode
+
+   // Programs to load once the monitor is up. They are not owned by
+   // the machine.
+   struct ewm_ldr_option_t *loads;
+   bool loads_run;
 };
 
 struct ewm_one_t *ewm_one_create(int type, SDL_Renderer *renderer);
+struct ewm_one_t *ewm_one_create_pipe(int type, int fd, FILE *output);
 void ewm_one_destroy(struct ewm_one_t *one);
 
+// Loads the programs after the monitor has set up the PIA, so that
+// they can print as soon as they run. Only binaries can be loaded.
+int ewm_one_load_programs(struct ewm_one_t *one, struct ewm_ldr_option_t *loads, bool run);
+
+int ewm_one_save_snapshot(struct ewm_one_t *one, char *path);
+int ewm_one_load_snapshot(struct ewm_one_t *one, char *path);
+
+// Runs a job of the batch runner and writes its dump to out.
+int ewm_one_run_job(struct ewm_batch_job_t *job, FILE *out);
+
 int ewm_one_main(int argc, char **argv);
 
 #endif // EWM_ONE_H
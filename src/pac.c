@@ -0,0 +1,82 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <SDL2/SDL.h>
+
+#include "pac.h"
+
+void ewm_pacer_init(struct ewm_pacer_t *pacer, uint32_t fps, uint64_t hz) {
+   uint64_t now = SDL_GetPerformanceCounter();
+   pacer->frequency = SDL_GetPerformanceFrequency();
+   pacer->period = pacer->frequency / fps;
+   pacer->deadline = now;
+   pacer->hz = hz;
+   pacer->cycles = hz / fps;
+   pacer->base_time = now;
+   pacer->base_counter = 0;
+   pacer->window_time = now;
+   pacer->window_counter = 0;
+   pacer->mhz = hz / 1000000.0;
+}
+
+bool ewm_pacer_due(struct ewm_pacer_t *pacer) {
+   return SDL_GetPerformanceCounter() >= pacer->deadline;
+}
+
+// SDL_Delay() only does milliseconds. Rounding up means we wake up a
+// little late rather than early, which the fixed deadlines absorb.
+
+void ewm_pacer_wait(struct ewm_pacer_t *pacer, uint32_t ms) {
+   uint64_t now = SDL_GetPerformanceCounter();
+   if (now < pacer->deadline) {
+      uint64_t wait = ((pacer->deadline - now) * 1000 + pacer->frequency - 1) / pacer->frequency;
+      SDL_Delay((wait < ms) ? (uint32_t) wait : ms);
+   }
+}
+
+uint64_t ewm_pacer_frame(struct ewm_pacer_t *pacer, uint64_t counter) {
+   uint64_t now = SDL_GetPerformanceCounter();
+
+   pacer->deadline += pacer->period;
+   if (pacer->deadline + pacer->period < now) {
+      pacer->deadline = now + pacer->period;
+   }
+
+   uint64_t elapsed = now - pacer->base_time;
+   uint64_t expected = pacer->base_counter + (elapsed / pacer->frequency) * pacer->hz + ((elapsed % pacer->frequency) * pacer->hz) / pacer->frequency;
+   if (counter < pacer->base_counter || counter >= expected + pacer->cycles || expected > counter + 2 * pacer->cycles) {
+      pacer->base_time = now;
+      pacer->base_counter = counter;
+      return pacer->cycles;
+   }
+   return (expected + pacer->cycles) - counter;
+}
+
+void ewm_pacer_measure(struct ewm_pacer_t *pacer, uint64_t counter) {
+   uint64_t now = SDL_GetPerformanceCounter();
+   if (now - pacer->window_time >= pacer->frequency) {
+      double seconds = (double) (now - pacer->window_time) / pacer->frequency;
+      pacer->mhz = (counter >= pacer->window_counter) ? (counter - pacer->window_counter) / seconds / 1000000.0 : 0.0;
+      pacer->window_time = now;
+      pacer->window_counter = counter;
+   }
+}
@@ -0,0 +1,66 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_PAC_H
+#define EWM_PAC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frame pacing on the performance counter. Frames are due at fixed
+// deadlines, so oversleeping one frame does not delay the ones after
+// it, and in between the caller sleeps instead of polling.
+//
+// The pacer also keeps track of how many cycles should have run by
+// now. Each frame runs the difference with what actually ran, so the
+// emulated speed stays at hz, even when frames start late or run
+// over. How fast the cpu actually went is measured in mhz.
+
+struct ewm_pacer_t {
+   uint64_t frequency; // Performance counter ticks per second
+   uint64_t period;    // Ticks per frame
+   uint64_t deadline;  // Start of the next frame
+   uint64_t hz;
+   uint64_t cycles;    // Nominal cycles per frame
+
+   uint64_t base_time, base_counter; // Where the cycles are counted from
+
+   uint64_t window_time, window_counter; // Start of the measurement
+   double mhz;
+};
+
+void ewm_pacer_init(struct ewm_pacer_t *pacer, uint32_t fps, uint64_t hz);
+bool ewm_pacer_due(struct ewm_pacer_t *pacer);
+
+// Sleeps until the next frame is due, or for at most ms milliseconds
+void ewm_pacer_wait(struct ewm_pacer_t *pacer, uint32_t ms);
+
+// Starts the frame that is due. Returns the number of cycles it should
+// run to catch up with the clock, given the current cycle counter. If
+// the cpu fell far behind, because it was paused or the counter jumped,
+// it starts counting again from here instead of catching up.
+uint64_t ewm_pacer_frame(struct ewm_pacer_t *pacer, uint64_t counter);
+
+// Updates mhz about once a second
+void ewm_pacer_measure(struct ewm_pacer_t *pacer, uint64_t counter);
+
+#endif // EWM_PAC_H
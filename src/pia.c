@@ -27,6 +27,7 @@
 #include <string.h>
 
 #include "cpu.h"
+#include "snp.h"
 #include "pia.h"
 
 // This implements a 6820 Peripheral I/O Adapter. On the Apple I this
@@ -46,6 +47,13 @@ static uint8_t pia_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
          }
          break;
       case EWM_A1_PIA6820_KBD_CTL:
+         if (!(pia->ctla & 0b10000000) && pia->poll != NULL) {
+            pia->poll(pia, pia->callback_obj);
+         }
+         // The Woz monitor waits for a key in a tight loop on this
+         if (!(pia->ctla & 0b10000000)) {
+            cpu_skip_poll_loop(cpu, addr);
+         }
          return pia->ctla;
          break;
       case EWM_A1_PIA6820_DSP_DDR:
@@ -140,3 +148,34 @@ void ewm_pia_set_inb(struct ewm_pia_t *pia, uint8_t v) {
 void ewm_pia_set_irqa1(struct ewm_pia_t *pia) {
    pia->ctla |= 0b10000000; // Set IRQA1
 }
+
+int ewm_pia_save_snapshot(struct ewm_pia_t *pia, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "PIA ");
+   ewm_snapshot_put_u8(snapshot, pia->ina);
+   ewm_snapshot_put_u8(snapshot, pia->outa);
+   ewm_snapshot_put_u8(snapshot, pia->ddra);
+   ewm_snapshot_put_u8(snapshot, pia->ctla);
+   ewm_snapshot_put_u8(snapshot, pia->inb);
+   ewm_snapshot_put_u8(snapshot, pia->outb);
+   ewm_snapshot_put_u8(snapshot, pia->ddrb);
+   ewm_snapshot_put_u8(snapshot, pia->ctlb);
+   ewm_snapshot_end(snapshot);
+   return snapshot->error ? -1 : 0;
+}
+
+int ewm_pia_load_snapshot(struct ewm_pia_t *pia, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "PIA ", &chunk) != 0) {
+      fprintf(stderr, "[PIA] Snapshot has no pia state\n");
+      return -1;
+   }
+   pia->ina = ewm_snapshot_get_u8(&chunk);
+   pia->outa = ewm_snapshot_get_u8(&chunk);
+   pia->ddra = ewm_snapshot_get_u8(&chunk);
+   pia->ctla = ewm_snapshot_get_u8(&chunk);
+   pia->inb = ewm_snapshot_get_u8(&chunk);
+   pia->outb = ewm_snapshot_get_u8(&chunk);
+   pia->ddrb = ewm_snapshot_get_u8(&chunk);
+   pia->ctlb = ewm_snapshot_get_u8(&chunk);
+   return chunk.error ? -1 : 0;
+}
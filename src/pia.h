@@ -40,9 +40,14 @@
 #define EWM_A1_PIA6820_DSP_CTL (EWM_A1_PIA6820_ADDR + EWM_PIA6820_CTLB)
 
 struct ewm_pia_t;
+struct ewm_snapshot_t;
 
 typedef void (*ewm_pia_callback_t)(struct ewm_pia_t *pia, void *obj, uint8_t ddr, uint8_t v);
 
+// Called with the callback obj when the cpu looks for a key while
+// there is none, so that input can be fed in as fast as it is read.
+typedef void (*ewm_pia_poll_t)(struct ewm_pia_t *pia, void *obj);
+
 struct ewm_pia_t {
    uint8_t ina;
    uint8_t outa;
@@ -53,6 +58,7 @@ struct ewm_pia_t {
    uint8_t ddrb;
    uint8_t ctlb;
    ewm_pia_callback_t callback;
+   ewm_pia_poll_t poll; // NULL unless input is fed from a pipe
    void *callback_obj;
 };
 
@@ -67,4 +73,7 @@ void ewm_pia_set_inb(struct ewm_pia_t *pia, uint8_t v);
 
 void ewm_pia_set_irqa1(struct ewm_pia_t *pia);
 
+int ewm_pia_save_snapshot(struct ewm_pia_t *pia, struct ewm_snapshot_t *snapshot);
+int ewm_pia_load_snapshot(struct ewm_pia_t *pia, struct ewm_snapshot_t *snapshot);
+
 #endif
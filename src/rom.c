@@ -0,0 +1,158 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rom.h"
+
+// Images are looked up by device and inode, so that different paths to
+// the same file share an image. The list is short and only touched when
+// machines are created or destroyed, a spinlock is good enough.
+
+static struct ewm_rom_t *ewm_roms = NULL;
+static atomic_flag ewm_roms_lock = ATOMIC_FLAG_INIT;
+
+static void ewm_rom_lock() {
+   while (atomic_flag_test_and_set_explicit(&ewm_roms_lock, memory_order_acquire)) {
+      // Spin
+   }
+}
+
+static void ewm_rom_unlock() {
+   atomic_flag_clear_explicit(&ewm_roms_lock, memory_order_release);
+}
+
+static struct ewm_rom_t *ewm_rom_map(int fd, struct stat *file_info) {
+   if (file_info->st_size == 0) {
+      return NULL;
+   }
+
+   void *data = mmap(NULL, file_info->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (data == MAP_FAILED) {
+      return NULL;
+   }
+
+   struct ewm_rom_t *rom = calloc(1, sizeof(struct ewm_rom_t));
+   if (rom == NULL) {
+      munmap(data, file_info->st_size);
+      return NULL;
+   }
+
+   rom->dev = file_info->st_dev;
+   rom->ino = file_info->st_ino;
+   rom->data = data;
+   rom->size = file_info->st_size;
+
+   return rom;
+}
+
+static void ewm_rom_free(struct ewm_rom_t *rom) {
+   munmap((void*) rom->data, rom->size);
+   free(rom->decoded);
+   free(rom);
+}
+
+struct ewm_rom_t *ewm_rom_acquire(char *path) {
+   int fd = open(path, O_RDONLY);
+   if (fd == -1) {
+      return NULL;
+   }
+
+   struct stat file_info;
+   if (fstat(fd, &file_info) == -1) {
+      close(fd);
+      return NULL;
+   }
+
+   ewm_rom_lock();
+
+   struct ewm_rom_t *rom = ewm_roms;
+   while (rom != NULL && (rom->dev != file_info.st_dev || rom->ino != file_info.st_ino)) {
+      rom = rom->next;
+   }
+
+   if (rom == NULL) {
+      rom = ewm_rom_map(fd, &file_info);
+      if (rom != NULL) {
+         rom->next = ewm_roms;
+         ewm_roms = rom;
+      }
+   }
+
+   if (rom != NULL) {
+      rom->refs++;
+   }
+
+   ewm_rom_unlock();
+
+   close(fd);
+
+   return rom;
+}
+
+void ewm_rom_release(struct ewm_rom_t *rom) {
+   ewm_rom_lock();
+   rom->refs--;
+   ewm_rom_unlock();
+}
+
+const void *ewm_rom_decoded(struct ewm_rom_t *rom, size_t size, ewm_rom_decoder_t decoder) {
+   ewm_rom_lock();
+
+   if (rom->decoded == NULL) {
+      rom->decoded = calloc(1, size);
+      if (rom->decoded != NULL) {
+         rom->decoded_size = size;
+         decoder(rom->data, rom->size, rom->decoded);
+      }
+   }
+
+   void *decoded = (rom->decoded_size == size) ? rom->decoded : NULL;
+
+   ewm_rom_unlock();
+
+   return decoded;
+}
+
+void ewm_rom_purge(void) {
+   ewm_rom_lock();
+
+   struct ewm_rom_t **p = &ewm_roms;
+   while (*p != NULL) {
+      struct ewm_rom_t *rom = *p;
+      if (rom->refs == 0) {
+         *p = rom->next;
+         ewm_rom_free(rom);
+      } else {
+         p = &rom->next;
+      }
+   }
+
+   ewm_rom_unlock();
+}
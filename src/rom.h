@@ -0,0 +1,59 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_ROM_H
+#define EWM_ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A process wide cache of ROM images. Each image is mapped read-only
+// once and shared by every machine that uses it. Data decoded from an
+// image, like the glyphs of a character ROM, is kept with it so that it
+// is also only decoded once.
+
+typedef void (*ewm_rom_decoder_t)(const uint8_t *data, size_t size, void *decoded);
+
+struct ewm_rom_t {
+   dev_t dev;
+   ino_t ino;
+   const uint8_t *data;
+   size_t size;
+   int refs;
+   void *decoded;
+   size_t decoded_size;
+   struct ewm_rom_t *next;
+};
+
+struct ewm_rom_t *ewm_rom_acquire(char *path);
+void ewm_rom_release(struct ewm_rom_t *rom);
+
+// Returns the data decoded from the image, calling the decoder to fill
+// it in the first time. Every user of an image must decode it the same.
+const void *ewm_rom_decoded(struct ewm_rom_t *rom, size_t size, ewm_rom_decoder_t decoder);
+
+// Unmaps images that are no longer in use. Until then they are kept
+// around, so that machines created one after the other share them too.
+void ewm_rom_purge(void);
+
+#endif // EWM_ROM_H
@@ -0,0 +1,350 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "snp.h"
+#include "rwd.h"
+
+#define EWM_REWIND_PAGE_SIZE (256)
+
+// The encoding of a page takes at most one extra byte for every run of
+// 128 bytes.
+
+#define EWM_REWIND_RUN_MAX (128)
+#define EWM_REWIND_PAGE_MAX (2 + EWM_REWIND_PAGE_SIZE + EWM_REWIND_PAGE_SIZE / EWM_REWIND_RUN_MAX)
+
+// Frames hold the snapshot of the machine, so they are never smaller
+// than this. It is only used to size the list of frames.
+
+#define EWM_REWIND_FRAME_MIN (128)
+
+static int ewm_rewind_pages(struct mem_t *mem) {
+   return ((mem->end - mem->start) >> 8) + 1;
+}
+
+static size_t ewm_rewind_page_size(struct mem_t *mem, int page) {
+   size_t length = mem->end - mem->start + 1;
+   size_t offset = page * EWM_REWIND_PAGE_SIZE;
+   return (length - offset < EWM_REWIND_PAGE_SIZE) ? length - offset : EWM_REWIND_PAGE_SIZE;
+}
+
+// Pushes go straight to the stack page without the page table, so the
+// first two pages of the main RAM are always considered written.
+
+static void ewm_rewind_mark_stack(struct ewm_rewind_t *rewind) {
+   for (struct mem_t *mem = rewind->cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->dirty != NULL && mem->obj == rewind->cpu->ram) {
+         mem->dirty[0] = 1;
+         if (ewm_rewind_pages(mem) > 1) {
+            mem->dirty[1] = 1;
+         }
+      }
+   }
+}
+
+// Runs of unchanged bytes are a single byte with the high bit set,
+// other runs are a byte with their length followed by the XOR of the
+// old and the new bytes.
+
+static size_t ewm_rewind_encode(uint8_t *dst, uint8_t *old, uint8_t *new, size_t size) {
+   size_t length = 0, i = 0;
+   while (i < size) {
+      size_t run = 0;
+      if (old[i] == new[i]) {
+         while (i + run < size && run < EWM_REWIND_RUN_MAX && old[i + run] == new[i + run]) {
+            run++;
+         }
+         dst[length++] = 0x80 | (run - 1);
+      } else {
+         while (i + run < size && run < EWM_REWIND_RUN_MAX && old[i + run] != new[i + run]) {
+            run++;
+         }
+         dst[length++] = run - 1;
+         for (size_t j = i; j < i + run; j++) {
+            dst[length++] = old[j] ^ new[j];
+         }
+      }
+      i += run;
+   }
+   return length;
+}
+
+static size_t ewm_rewind_apply(uint8_t *src, uint8_t *reference, uint8_t *data, size_t size) {
+   size_t length = 0, i = 0;
+   while (i < size) {
+      uint8_t token = src[length++];
+      size_t run = (token & 0x7f) + 1;
+      if ((token & 0x80) == 0) {
+         for (size_t j = i; j < i + run; j++) {
+            reference[j] ^= src[length];
+            data[j] ^= src[length];
+            length++;
+         }
+      }
+      i += run;
+   }
+   return length;
+}
+
+static void ewm_rewind_store(uint8_t *p, uint32_t v, int length) {
+   for (int i = 0; i < length; i++) {
+      p[i] = (uint8_t) (v >> (i * 8));
+   }
+}
+
+static uint32_t ewm_rewind_fetch(uint8_t *p, int length) {
+   uint32_t v = 0;
+   for (int i = 0; i < length; i++) {
+      v |= (uint32_t) p[i] << (i * 8);
+   }
+   return v;
+}
+
+struct ewm_rewind_t *ewm_rewind_create(struct cpu_t *cpu, size_t arena_size) {
+   struct ewm_rewind_t *rewind = calloc(1, sizeof(struct ewm_rewind_t));
+   if (rewind == NULL) {
+      return NULL;
+   }
+
+   rewind->cpu = cpu;
+
+   int pages = 0;
+   for (struct mem_t *mem = cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->dirty != NULL) {
+         pages += ewm_rewind_pages(mem);
+      }
+   }
+
+   rewind->reference_size = pages * EWM_REWIND_PAGE_SIZE;
+   rewind->reference = malloc(rewind->reference_size);
+   rewind->arena_size = arena_size;
+   rewind->arena = malloc(arena_size);
+   rewind->frames_capacity = arena_size / EWM_REWIND_FRAME_MIN;
+   rewind->frames = malloc(rewind->frames_capacity * sizeof(struct ewm_rewind_frame_t));
+   rewind->scratch_size = 2 + pages * EWM_REWIND_PAGE_MAX;
+   rewind->scratch = malloc(rewind->scratch_size);
+
+   if (rewind->reference == NULL || rewind->arena == NULL || rewind->frames == NULL || rewind->scratch == NULL) {
+      ewm_rewind_destroy(rewind);
+      return NULL;
+   }
+
+   ewm_rewind_reset(rewind);
+
+   return rewind;
+}
+
+void ewm_rewind_destroy(struct ewm_rewind_t *rewind) {
+   free(rewind->reference);
+   free(rewind->arena);
+   free(rewind->frames);
+   free(rewind->scratch);
+   free(rewind);
+}
+
+void ewm_rewind_reset(struct ewm_rewind_t *rewind) {
+   uint8_t *reference = rewind->reference;
+   for (struct mem_t *mem = rewind->cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->dirty != NULL) {
+         int pages = ewm_rewind_pages(mem);
+         memcpy(reference, mem->obj, mem->end - mem->start + 1);
+         memset(mem->dirty, 0, pages);
+         reference += pages * EWM_REWIND_PAGE_SIZE;
+      }
+   }
+
+   rewind->head = 0;
+   rewind->first = 0;
+   rewind->count = 0;
+}
+
+// Returns where length bytes can go in the arena, dropping the oldest
+// frames that are in the way. Frames are never split, if the frame
+// does not fit at the end of the arena we start over at the front, and
+// the frames that were left at the end are the oldest ones.
+
+static bool ewm_rewind_in_the_way(struct ewm_rewind_t *rewind, size_t offset, size_t length, bool wrapped) {
+   struct ewm_rewind_frame_t *frame = &rewind->frames[rewind->first];
+   if (rewind->count == rewind->frames_capacity || (wrapped && frame->offset >= rewind->head)) {
+      return true;
+   }
+   return frame->offset < offset + length && offset < frame->offset + frame->length;
+}
+
+static size_t ewm_rewind_reserve(struct ewm_rewind_t *rewind, size_t length) {
+   size_t offset = rewind->head;
+   bool wrapped = (offset + length > rewind->arena_size);
+   if (wrapped) {
+      offset = 0;
+   }
+
+   while (rewind->count != 0 && ewm_rewind_in_the_way(rewind, offset, length, wrapped)) {
+      rewind->first = (rewind->first + 1) % rewind->frames_capacity;
+      rewind->count--;
+   }
+
+   rewind->head = offset + length;
+   return offset;
+}
+
+int ewm_rewind_record(struct ewm_rewind_t *rewind, struct ewm_snapshot_t *state) {
+   ewm_rewind_mark_stack(rewind);
+
+   // Encode the pages that changed and bring the reference up to date
+
+   uint8_t *dst = rewind->scratch + 2;
+   int count = 0;
+
+   uint8_t *reference = rewind->reference;
+   int region = 0;
+   for (struct mem_t *mem = rewind->cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->dirty == NULL) {
+         continue;
+      }
+      int pages = ewm_rewind_pages(mem);
+      for (int page = 0; page < pages; page++) {
+         if (mem->dirty[page] == 0) {
+            continue;
+         }
+         mem->dirty[page] = 0;
+
+         uint8_t *old = reference + page * EWM_REWIND_PAGE_SIZE;
+         uint8_t *new = (uint8_t*) mem->obj + page * EWM_REWIND_PAGE_SIZE;
+         size_t size = ewm_rewind_page_size(mem, page);
+         if (memcmp(old, new, size) == 0) {
+            continue;
+         }
+
+         dst[0] = region;
+         dst[1] = page;
+         dst += 2 + ewm_rewind_encode(dst + 2, old, new, size);
+         memcpy(old, new, size);
+         count++;
+      }
+      reference += pages * EWM_REWIND_PAGE_SIZE;
+      region++;
+   }
+
+   ewm_rewind_store(rewind->scratch, count, 2);
+   size_t pages_length = dst - rewind->scratch;
+
+   // A frame is the length of the state, the state and then the pages
+
+   size_t state_length = ewm_snapshot_length(state);
+   size_t length = 4 + state_length + pages_length;
+   if (state->error || length > rewind->arena_size) {
+      // Without this frame the older ones cannot be reached anymore
+      rewind->count = 0;
+      return -1;
+   }
+
+   size_t offset = ewm_rewind_reserve(rewind, length);
+   uint8_t *frame = rewind->arena + offset;
+   ewm_rewind_store(frame, state_length, 4);
+   ewm_snapshot_copy(state, frame + 4);
+   memcpy(frame + 4 + state_length, rewind->scratch, pages_length);
+
+   int last = (rewind->first + rewind->count) % rewind->frames_capacity;
+   rewind->frames[last].offset = offset;
+   rewind->frames[last].length = length;
+   rewind->count++;
+
+   return 0;
+}
+
+// Undo the changes of a frame, which brings RAM and the reference back
+// to what they were at the frame before it.
+
+static void ewm_rewind_undo(struct ewm_rewind_t *rewind, uint8_t *frame) {
+   uint8_t *src = frame + 4 + ewm_rewind_fetch(frame, 4);
+   int count = ewm_rewind_fetch(src, 2);
+   src += 2;
+
+   for (int i = 0; i < count; i++) {
+      int region = src[0], page = src[1];
+      src += 2;
+
+      uint8_t *reference = rewind->reference;
+      for (struct mem_t *mem = rewind->cpu->mem; mem != NULL; mem = mem->next) {
+         if (mem->dirty == NULL) {
+            continue;
+         }
+         if (region-- == 0) {
+            uint8_t *data = (uint8_t*) mem->obj + page * EWM_REWIND_PAGE_SIZE;
+            reference += page * EWM_REWIND_PAGE_SIZE;
+            src += ewm_rewind_apply(src, reference, data, ewm_rewind_page_size(mem, page));
+            break;
+         }
+         reference += ewm_rewind_pages(mem) * EWM_REWIND_PAGE_SIZE;
+      }
+   }
+}
+
+struct ewm_snapshot_t *ewm_rewind_back(struct ewm_rewind_t *rewind, int frames, char *machine) {
+   if (rewind->count == 0) {
+      return NULL;
+   }
+
+   // First throw away what was written since the last frame
+
+   ewm_rewind_mark_stack(rewind);
+
+   uint8_t *reference = rewind->reference;
+   for (struct mem_t *mem = rewind->cpu->mem; mem != NULL; mem = mem->next) {
+      if (mem->dirty == NULL) {
+         continue;
+      }
+      int pages = ewm_rewind_pages(mem);
+      for (int page = 0; page < pages; page++) {
+         if (mem->dirty[page] != 0) {
+            mem->dirty[page] = 0;
+            memcpy((uint8_t*) mem->obj + page * EWM_REWIND_PAGE_SIZE, reference + page * EWM_REWIND_PAGE_SIZE, ewm_rewind_page_size(mem, page));
+         }
+      }
+      reference += pages * EWM_REWIND_PAGE_SIZE;
+   }
+
+   // Then undo frames, the oldest frame stays as there is nothing to
+   // undo it to.
+
+   while (frames > 0 && rewind->count > 1) {
+      int last = (rewind->first + rewind->count - 1) % rewind->frames_capacity;
+      ewm_rewind_undo(rewind, rewind->arena + rewind->frames[last].offset);
+      rewind->head = rewind->frames[last].offset;
+      rewind->count--;
+      frames--;
+   }
+
+   int last = (rewind->first + rewind->count - 1) % rewind->frames_capacity;
+   uint8_t *frame = rewind->arena + rewind->frames[last].offset;
+   rewind->head = rewind->frames[last].offset + rewind->frames[last].length;
+
+   struct ewm_snapshot_t *state = ewm_snapshot_open(frame + 4, ewm_rewind_fetch(frame, 4), machine);
+   if (state != NULL) {
+      state->without_memory = true;
+   }
+   return state;
+}
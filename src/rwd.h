@@ -0,0 +1,78 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_RWD_H
+#define EWM_RWD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewinding keeps the recent history of a machine in an arena of fixed
+// size. Every frame is recorded as the pages of RAM that were written
+// since the previous frame, plus a snapshot of everything else without
+// the contents of RAM. Pages are stored as the run length encoded XOR
+// of their old and new contents, which is small for pages that barely
+// changed and can be applied in either direction. When the arena is
+// full the oldest frames are dropped.
+
+struct cpu_t;
+struct ewm_snapshot_t;
+
+struct ewm_rewind_frame_t {
+   size_t offset;
+   size_t length;
+};
+
+struct ewm_rewind_t {
+   struct cpu_t *cpu;
+   uint8_t *reference; // RAM as it was at the last recorded frame
+   size_t reference_size;
+   uint8_t *arena;
+   size_t arena_size;
+   size_t head;
+   struct ewm_rewind_frame_t *frames;
+   int frames_capacity;
+   int first;
+   int count;
+   uint8_t *scratch; // A frame is encoded here before it goes into the arena
+   size_t scratch_size;
+};
+
+struct ewm_rewind_t *ewm_rewind_create(struct cpu_t *cpu, size_t arena_size);
+void ewm_rewind_destroy(struct ewm_rewind_t *rewind);
+
+// Forget all frames and start over from the current contents of RAM.
+// Must be called when RAM changes behind the back of the page table,
+// for example after loading a snapshot.
+void ewm_rewind_reset(struct ewm_rewind_t *rewind);
+
+// Record a frame with state, a snapshot without memory, of the rest
+// of the machine. State can be destroyed after this returns.
+int ewm_rewind_record(struct ewm_rewind_t *rewind, struct ewm_snapshot_t *state);
+
+// Go back the given number of frames, or as far as possible. RAM is
+// restored in place. Returns the state that was recorded with that
+// frame, which the caller loads and destroys, or NULL if there are no
+// frames at all.
+struct ewm_snapshot_t *ewm_rewind_back(struct ewm_rewind_t *rewind, int frames, char *machine);
+
+#endif // EWM_RWD_H
@@ -21,6 +21,7 @@
 // SOFTWARE.
 
 #include <stdint.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include <SDL2/SDL.h>
@@ -34,42 +35,59 @@
 
 // Text rendering
 
-static int txt_line_offsets[24] = {
+static const int txt_line_offsets[24] = {
    0x000, 0x080, 0x100, 0x180, 0x200, 0x280, 0x300, 0x380, 0x028, 0x0a8, 0x128, 0x1a8,
    0x228, 0x2a8, 0x328, 0x3a8, 0x050, 0x0d0, 0x150, 0x1d0, 0x250, 0x2d0, 0x350, 0x3d0
 };
 
 static inline void scr_render_character(struct scr_t *scr, int row, int column, bool flash) {
-   uint16_t base = (scr->two->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
-   uint8_t c = scr->two->cpu->ram[((txt_line_offsets[row] + base) + column)];
-
-   uint32_t *src = scr->chr->bitmaps[c];
-   if (src != NULL) {
-      uint32_t *dst = scr->pixels + ((40 * 7 * 8) * row) + (7 * column);
-      for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            if (c >= 0x40 && c < 0x80 && flash) {
-               *dst++ = 0;
-            } else {
-               *dst++ = *src++;
-            }
+   uint16_t base = (scr->frame->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
+   uint8_t c = scr->frame->ram[((txt_line_offsets[row] + base) + column)];
+
+   uint32_t *src = ewm_chr_glyph(scr->chr, (flash && c >= 0x40 && c < 0x80) ? EWM_CHR_GLYPH_BLANK : c);
+   uint32_t *dst = scr->pixels + ((40 * 7 * 8) * row) + (7 * column);
+   for (int y = 0; y < 8; y++) {
+      memcpy(dst, src, 7 * sizeof(uint32_t));
+      src += 7;
+      dst += 280;
+   }
+}
+
+static inline void scr_render_txt_rows(struct scr_t *scr, bool flash, uint32_t rows, int first, int last) {
+   for (int row = first; row < last; row++) {
+      if (rows & (1 << row)) {
+         for (int column = 0; column < 40; column++) {
+            scr_render_character(scr, row, column, flash);
          }
-         dst += 280 - 7;
       }
    }
 }
 
-static inline void scr_render_txt_screen(struct scr_t *scr, bool flash) {
+static inline void scr_render_txt_screen(struct scr_t *scr, bool flash, uint32_t rows) {
+   scr_render_txt_rows(scr, flash, rows, 0, 24);
+}
+
+// Returns the rows that contain flashing characters, which need to
+// be redrawn when the flash state changes.
+
+static uint32_t scr_flashing_rows(struct scr_t *scr) {
+   uint16_t base = (scr->frame->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
+   uint32_t rows = 0;
    for (int row = 0; row < 24; row++) {
+      uint8_t *line = &scr->frame->ram[txt_line_offsets[row] + base];
       for (int column = 0; column < 40; column++) {
-         scr_render_character(scr, row, column, flash);
+         if (line[column] >= 0x40 && line[column] < 0x80) {
+            rows |= (1 << row);
+            break;
+         }
       }
    }
+   return rows;
 }
 
 // Lores Rendering
 
-static SDL_Color lores_colors[16] = {
+static const SDL_Color lores_colors[16] = {
    { 0,   0,   0,   255 }, // 0 Black
    { 255, 0,   255, 255 }, // 1 Magenta
    { 0,   0,   204, 255 }, // 2 Dark Blue
@@ -89,8 +107,8 @@ static SDL_Color lores_colors[16] = {
 };
 
 static inline void scr_render_lores_block(struct scr_t *scr, int row, int column) {
-   uint16_t base = (scr->two->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
-   uint8_t c = scr->two->cpu->ram[((txt_line_offsets[row] + base) + column)];
+   uint16_t base = (scr->frame->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
+   uint8_t c = scr->frame->ram[((txt_line_offsets[row] + base) + column)];
 
    uint32_t *src = scr->lgr_bitmaps[c];
    uint32_t *dst = scr->pixels + ((40 * 7 * 8) * row) + (7 * column);
@@ -103,49 +121,47 @@ static inline void scr_render_lores_block(struct scr_t *scr, int row, int column
    }
 }
 
-static inline void scr_render_lgr_screen(struct scr_t *scr, bool flash) {
-   bool mixed = (scr->two->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED);
+static inline void scr_render_lgr_screen(struct scr_t *scr, bool flash, uint32_t rows) {
+   bool mixed = (scr->frame->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED);
 
    // Render graphics
-   int rows = mixed ? 20 : 24;
-   for (int row = 0; row < rows; row++) {
-      for (int column = 0; column < 40; column++) {
-         scr_render_lores_block(scr, row, column);
+   int last = mixed ? 20 : 24;
+   for (int row = 0; row < last; row++) {
+      if (rows & (1 << row)) {
+         for (int column = 0; column < 40; column++) {
+            scr_render_lores_block(scr, row, column);
+         }
       }
    }
 
    // Render bottom 4 lines
    if (mixed) {
-      for (int row = 20; row < 24; row++) {
-         for (int column = 0; column < 40; column++) {
-            scr_render_character(scr, row, column, flash);
-         }
-      }
+      scr_render_txt_rows(scr, flash, rows, 20, 24);
    }
 }
 
 // Hires rendering
 
-static SDL_Color hgr_colors1[16] = {
+static const SDL_Color hgr_colors1[16] = {
    { 0,   0,   0,   255 }, // 00 Black
    { 0, 249, 0,   255 }, // 01 Green
    { 255, 64, 255, 255 }, // 10 Purple
    { 255, 255, 255, 255 }  // 11 White
 };
 
-static SDL_Color hgr_colors2[16] = {
+static const SDL_Color hgr_colors2[16] = {
    { 0,   0,   0,   255 }, // 00 Black
    { 255, 147, 0,   255 }, // 01 Red
    { 0, 150, 255, 255 }, // 10 Blue
    { 255, 255, 255, 255 }  // 11 White
 };
 
-static uint16_t hgr_page_offsets[2] = {
+static const uint16_t hgr_page_offsets[2] = {
    0x2000, // $0000 in our buffer, $2000 in emulator
    0x4000  // $2000 in our buffer, $4000 in emulator
 };
 
-static uint16_t hgr_line_offsets[192] = {
+static const uint16_t hgr_line_offsets[192] = {
    0x0000, 0x0400, 0x0800, 0x0c00, 0x1000, 0x1400, 0x1800, 0x1c00,
    0x0080, 0x0480, 0x0880, 0x0c80, 0x1080, 0x1480, 0x1880, 0x1c80,
    0x0100, 0x0500, 0x0900, 0x0d00, 0x1100, 0x1500, 0x1900, 0x1d00,
@@ -172,18 +188,30 @@ static uint16_t hgr_line_offsets[192] = {
    0x03d0, 0x07d0, 0x0bd0, 0x0fd0, 0x13d0, 0x17d0, 0x1bd0, 0x1fd0
 };
 
+// Hires lines are rendered with lookup tables that are built when the
+// screen is created. In monochrome every byte maps to 7 pixels. In
+// color the screen is rendered in pairs of bytes: the first 6 pixels
+// only depend on the first byte, the next 8 pixels depend on the
+// second byte and on bit 6 of the first byte.
+
 inline static void scr_render_hgr_line_green(struct scr_t *scr, int line, uint16_t line_base) {
-   uint8_t *src = &scr->two->cpu->ram[line_base];
+   uint8_t *src = &scr->frame->ram[line_base];
    uint32_t *dst = scr->pixels + (40 * 7 * line);
    for (int i = 0; i < 40; i++) {
-      uint8_t c = *src++;
-      for (int j = 0; j < 7; j++) {
-	 if (c & (1 << j)) {
-	    *dst++ = scr->green;
-         } else {
-            *dst++ = 0;
-         }
-      }
+      memcpy(dst, scr->hgr_mono[*src++], 7 * sizeof(uint32_t));
+      dst += 7;
+   }
+}
+
+inline static void scr_render_hgr_line_color(struct scr_t *scr, int line, uint16_t line_base) {
+   uint8_t *src = &scr->frame->ram[line_base];
+   uint32_t *dst = scr->pixels + (40 * 7 * line);
+   for (int i = 0; i < 20; i++) {
+      uint8_t b1 = *src++;
+      uint8_t b2 = *src++;
+      memcpy(dst, scr->hgr_color_even[b1], 6 * sizeof(uint32_t));
+      memcpy(dst + 6, scr->hgr_color_odd[((b1 & 0b01000000) << 2) | b2], 8 * sizeof(uint32_t));
+      dst += 14;
    }
 }
 
@@ -196,59 +224,41 @@ inline static int swap(int n) {
    return n;
 }
 
-inline static void scr_render_hgr_line_color(struct scr_t *scr, int line, uint16_t line_base) {
-
-   uint8_t *src = &scr->two->cpu->ram[line_base];
-   uint32_t *dst = scr->pixels + (40 * 7 * line);
-
-   for (int i = 0; i < 20; i++) {
-      uint8_t b1 = *src++;
-      uint8_t b2 = *src++;
-
-      if (b1 & 0b10000000) {
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00000011) >> 0)];
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00000011) >> 0)];
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00001100) >> 2)];
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00001100) >> 2)];
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00110000) >> 4)];
-         *dst++ = scr->hgr_colors2[swap((b1 & 0b00110000) >> 4)];
-      } else {
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00000011) >> 0)];
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00000011) >> 0)];
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00001100) >> 2)];
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00001100) >> 2)];
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00110000) >> 4)];
-         *dst++ = scr->hgr_colors1[swap((b1 & 0b00110000) >> 4)];
+static void scr_init_hgr_tables(struct scr_t *scr) {
+   for (int b = 0; b < 256; b++) {
+      for (int j = 0; j < 7; j++) {
+         scr->hgr_mono[b][j] = (b & (1 << j)) ? scr->green : 0;
       }
+   }
 
-      if (b2 & 0b10000000) {
-         *dst++ = scr->hgr_colors2[(((b1 & 0b01000000) >> 5) | (b2 & 0b00000001))];
-         *dst++ = scr->hgr_colors2[(((b1 & 0b01000000) >> 5) | (b2 & 0b00000001))];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b00000110) >> 1)];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b00000110) >> 1)];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b00011000) >> 3)];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b00011000) >> 3)];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b01100000) >> 5)];
-         *dst++ = scr->hgr_colors2[swap( (b2 & 0b01100000) >> 5)];
-      } else {
-         *dst++ = scr->hgr_colors1[(((b1 & 0b01000000) >> 5) | (b2 & 0b00000001))];
-         *dst++ = scr->hgr_colors1[(((b1 & 0b01000000) >> 5) | (b2 & 0b00000001))];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b00000110) >> 1)];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b00000110) >> 1)];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b00011000) >> 3)];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b00011000) >> 3)];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b01100000) >> 5)];
-         *dst++ = scr->hgr_colors1[swap( (b2 & 0b01100000) >> 5)];
+   for (int b1 = 0; b1 < 256; b1++) {
+      uint32_t *colors = (b1 & 0b10000000) ? scr->hgr_colors2 : scr->hgr_colors1;
+      for (int j = 0; j < 3; j++) {
+         scr->hgr_color_even[b1][j*2+0] = colors[swap((b1 >> (j*2)) & 0b11)];
+         scr->hgr_color_even[b1][j*2+1] = colors[swap((b1 >> (j*2)) & 0b11)];
       }
    }
 
+   for (int k = 0; k < 512; k++) {
+      int b1_bit6 = (k >> 8) & 1, b2 = k & 0xff;
+      uint32_t *colors = (b2 & 0b10000000) ? scr->hgr_colors2 : scr->hgr_colors1;
+      scr->hgr_color_odd[k][0] = colors[(b1_bit6 << 1) | (b2 & 0b00000001)];
+      scr->hgr_color_odd[k][1] = colors[(b1_bit6 << 1) | (b2 & 0b00000001)];
+      for (int j = 0; j < 3; j++) {
+         scr->hgr_color_odd[k][2+j*2+0] = colors[swap((b2 >> (1+j*2)) & 0b11)];
+         scr->hgr_color_odd[k][2+j*2+1] = colors[swap((b2 >> (1+j*2)) & 0b11)];
+      }
+   }
 }
 
-inline static void scr_render_hgr_screen(struct scr_t *scr, bool flash) {
+inline static void scr_render_hgr_screen(struct scr_t *scr, bool flash, uint32_t rows, uint32_t txt_rows) {
    // Render graphics
-   int lines = (scr->two->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED) ? 160  : 192;
-   uint16_t hgr_base = hgr_page_offsets[scr->two->screen_page];
+   int lines = (scr->frame->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED) ? 160  : 192;
+   uint16_t hgr_base = hgr_page_offsets[scr->frame->screen_page];
    for (int line = 0; line < lines; line++) {
+      if ((rows & (1 << (line / 8))) == 0) {
+         continue;
+      }
       uint16_t line_base = hgr_base + hgr_line_offsets[line];
       if (scr->color_scheme == EWM_SCR_COLOR_SCHEME_COLOR) {
          scr_render_hgr_line_color(scr, line, line_base);
@@ -258,12 +268,8 @@ inline static void scr_render_hgr_screen(struct scr_t *scr, bool flash) {
    }
 
    // Render bottom 4 lines of text
-   if (scr->two->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED) {
-      for (int row = 20; row < 24; row++) {
-         for (int column = 0; column < 40; column++) {
-            scr_render_character(scr, row, column, flash);
-         }
-      }
+   if (scr->frame->screen_graphics_style == EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED) {
+      scr_render_txt_rows(scr, flash, txt_rows, 20, 24);
    }
 }
 
@@ -283,6 +289,15 @@ static int ewm_scr_init(struct scr_t *scr, struct ewm_two_t *two, SDL_Renderer *
    scr->surface = SDL_CreateRGBSurfaceWithFormatFrom(scr->pixels, EWM_SCR_WIDTH, EWM_SCR_HEIGHT,
       32, 4 * EWM_SCR_WIDTH, ewm_sdl_pixel_format(renderer));
 
+   if (renderer != NULL) {
+      scr->texture = SDL_CreateTexture(renderer, ewm_sdl_pixel_format(renderer), SDL_TEXTUREACCESS_STREAMING,
+         EWM_SCR_WIDTH, EWM_SCR_HEIGHT);
+      if (scr->texture == NULL) {
+         fprintf(stderr, "[SCR] Failed to create texture: %s\n", SDL_GetError());
+         return -1;
+      }
+   }
+
    for (int c = 0; c <= 255; c++) {
       scr->lgr_bitmaps[c] = malloc(4 * 7 * 8);
 
@@ -314,6 +329,8 @@ static int ewm_scr_init(struct scr_t *scr, struct ewm_two_t *two, SDL_Renderer *
       scr->hgr_colors2[i] = SDL_MapRGBA(scr->surface->format, c.r, c.g, c.b, c.a);
    }
 
+   scr_init_hgr_tables(scr);
+
    return 0;
 }
 
@@ -327,33 +344,117 @@ struct scr_t *ewm_scr_create(struct ewm_two_t *two, SDL_Renderer *renderer) {
 }
 
 void ewm_scr_destroy(struct scr_t *scr) {
-   // TODO
+   if (scr->texture != NULL) {
+      SDL_DestroyTexture(scr->texture);
+   }
+   SDL_FreeSurface(scr->surface);
+   free(scr->pixels);
+   for (int c = 0; c <= 255; c++) {
+      free(scr->lgr_bitmaps[c]);
+   }
+   ewm_chr_destroy(scr->chr);
+   free(scr);
 }
 
-void ewm_scr_update(struct scr_t *scr, int phase, int fps) {
-   SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
-   SDL_RenderClear(scr->renderer);
+// Upload the band of character rows that was redrawn to the texture,
+// instead of creating a new texture from the whole surface.
+
+static void scr_update_texture(struct scr_t *scr, uint32_t rows) {
+   int first = __builtin_ctz(rows), last = 31 - __builtin_clz(rows);
+   SDL_Rect rect = { .x = 0, .y = first * 8, .w = EWM_SCR_WIDTH, .h = (last - first + 1) * 8 };
+   SDL_UpdateTexture(scr->texture, &rect, scr->pixels + (rect.y * EWM_SCR_WIDTH), 4 * EWM_SCR_WIDTH);
+}
+
+// Renders a frame. Only rows that are flagged in the frame are redrawn,
+// unless the frame or the screen itself asks for a full redraw.
+// Returns true if anything was redrawn.
+
+bool ewm_scr_render(struct scr_t *scr, struct scr_frame_t *frame, int phase, int fps) {
+   scr->frame = frame;
 
-   int flash = ((phase / (fps/4)) % 2);
+   bool flash = (fps >= 4) ? ((phase / (fps/4)) % 2) : false;
 
-   switch (scr->two->screen_mode) {
+   uint32_t txt_rows, hgr_rows;
+   if (frame->full || scr->dirty) {
+      txt_rows = hgr_rows = EWM_SCR_ALL_ROWS;
+      scr->dirty = false;
+   } else {
+      txt_rows = frame->txt_rows[frame->screen_page];
+      hgr_rows = frame->hgr_rows[frame->screen_page];
+   }
+
+   if (flash != scr->flash) {
+      txt_rows |= scr_flashing_rows(scr);
+      scr->flash = flash;
+   }
+
+   if (scr->renderer != NULL) {
+      SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
+      SDL_RenderClear(scr->renderer);
+   }
+
+   uint32_t rows = 0;
+
+   switch (frame->screen_mode) {
       case EWM_A2P_SCREEN_MODE_TEXT:
-         scr_render_txt_screen(scr, flash);
+         scr_render_txt_screen(scr, flash, txt_rows);
+         rows = txt_rows;
          break;
       case EWM_A2P_SCREEN_MODE_GRAPHICS:
-         switch (scr->two->screen_graphics_mode) {
+         switch (frame->screen_graphics_mode) {
             case EWM_A2P_SCREEN_GRAPHICS_MODE_LGR:
-               scr_render_lgr_screen(scr, flash);
+               scr_render_lgr_screen(scr, flash, txt_rows);
+               rows = txt_rows;
                break;
             case EWM_A2P_SCREEN_GRAPHICS_MODE_HGR:
-               scr_render_hgr_screen(scr, flash);
+               scr_render_hgr_screen(scr, flash, hgr_rows, txt_rows);
+               rows = hgr_rows | (txt_rows & EWM_SCR_MIXED_ROWS);
                break;
          }
          break;
    }
+
+   scr->frame = NULL;
+
+   rows &= EWM_SCR_ALL_ROWS;
+   if (rows != 0 && scr->texture != NULL) {
+      scr_update_texture(scr, rows);
+   }
+
+   return rows != 0;
+}
+
+// Describes the current state of the machine as a frame and consumes
+// its dirty rows. The frame points straight into the machine's RAM.
+
+void ewm_scr_take_frame(struct scr_t *scr, struct scr_frame_t *frame) {
+   struct ewm_two_t *two = scr->two;
+
+   frame->ram = two->cpu->ram;
+   frame->screen_mode = two->screen_mode;
+   frame->screen_graphics_mode = two->screen_graphics_mode;
+   frame->screen_graphics_style = two->screen_graphics_style;
+   frame->screen_page = two->screen_page;
+   frame->full = two->screen_dirty;
+
+   for (int page = 0; page < 2; page++) {
+      frame->txt_rows[page] = two->screen_txt_dirty[page];
+      frame->hgr_rows[page] = two->screen_hgr_dirty[page];
+      two->screen_txt_dirty[page] = 0;
+      two->screen_hgr_dirty[page] = 0;
+   }
+
+   two->screen_dirty = false;
+}
+
+bool ewm_scr_update(struct scr_t *scr, int phase, int fps) {
+   struct scr_frame_t frame;
+   ewm_scr_take_frame(scr, &frame);
+   return ewm_scr_render(scr, &frame, phase, fps);
 }
 
 void ewm_scr_set_color_scheme(struct scr_t *scr, int color_scheme) {
    scr->color_scheme = color_scheme;
+   scr->dirty = true;
    ewm_chr_set_color(scr->chr, color_scheme == EWM_SCR_COLOR_SCHEME_MONOCHROME ? scr->green : scr->white);
 }
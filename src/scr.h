@@ -23,6 +23,8 @@
 #ifndef EWM_SCR_H
 #define EWM_SCR_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <SDL2/SDL.h>
 
 #define EWM_SCR_COLOR_SCHEME_MONOCHROME (0)
@@ -32,9 +34,27 @@
 #define EWM_SCR_WIDTH (280)
 #define EWM_SCR_HEIGHT (192)
 
+#define EWM_SCR_ALL_ROWS   (0x00ffffff)
+#define EWM_SCR_MIXED_ROWS (0x00f00000)
+
 struct ewm_two_t;
 struct ewm_chr_t;
 
+// A frame is what the screen renders: the video memory and the soft
+// switch state of the machine, plus the character rows, per page,
+// that changed since the previous frame.
+
+struct scr_frame_t {
+   uint8_t *ram;
+   int screen_mode;
+   int screen_graphics_mode;
+   int screen_graphics_style;
+   int screen_page;
+   bool full;
+   uint32_t txt_rows[2];
+   uint32_t hgr_rows[2];
+};
+
 // The 'scr' object represents the screen. It renders the contents of
 // the machine. It has pluggable renders.
 
@@ -43,20 +63,30 @@ struct scr_t {
    SDL_Renderer *renderer;
    struct ewm_chr_t *chr;
    int color_scheme;
+   bool flash;
+   bool dirty;
+   struct scr_frame_t *frame; // The frame being rendered
 
    uint32_t *pixels;
    SDL_Surface *surface;
+   SDL_Texture *texture; // Streaming texture, updated with the rows that changed
 
    uint32_t *lgr_bitmaps[256];
    uint32_t green;
    uint32_t white;
    uint32_t hgr_colors1[4];
    uint32_t hgr_colors2[4];
+
+   uint32_t hgr_mono[256][7];
+   uint32_t hgr_color_even[256][6];
+   uint32_t hgr_color_odd[512][8];
 };
 
 struct scr_t *ewm_scr_create(struct ewm_two_t *two, SDL_Renderer *renderer);
 void ewm_scr_destroy(struct scr_t *scr);
-void ewm_scr_update(struct scr_t *scr, int phase, int fps);
+bool ewm_scr_update(struct scr_t *scr, int phase, int fps);
+bool ewm_scr_render(struct scr_t *scr, struct scr_frame_t *frame, int phase, int fps);
+void ewm_scr_take_frame(struct scr_t *scr, struct scr_frame_t *frame);
 void ewm_scr_set_color_scheme(struct scr_t *scr, int color_scheme);
 
 #endif
@@ -20,6 +20,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -43,6 +44,14 @@ void txt_full_refresh_setup(struct scr_t *scr) {
 }
 
 void txt_full_refresh_test(struct scr_t *scr) {
+   scr->two->screen_dirty = true;
+   ewm_scr_update(scr, 0, 0);
+}
+
+// Nothing changes between refreshes, so this should cost close to
+// nothing because only dirty rows are redrawn.
+
+void txt_static_refresh_test(struct scr_t *scr) {
    ewm_scr_update(scr, 0, 0);
 }
 
@@ -59,6 +68,7 @@ void lgr_full_refresh_setup(struct scr_t *scr) {
 }
 
 void lgr_full_refresh_test(struct scr_t *scr) {
+   scr->two->screen_dirty = true;
    ewm_scr_update(scr, 0, 0);
 }
 
@@ -74,12 +84,38 @@ void hgr_full_refresh_setup(struct scr_t *scr) {
 }
 
 void hgr_full_refresh_test(struct scr_t *scr) {
+   scr->two->screen_dirty = true;
    ewm_scr_update(scr, 0, 0);
 }
 
-void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t test_run) {
-   test_setup(scr);
+void hgr_color_full_refresh_setup(struct scr_t *scr) {
+   hgr_full_refresh_setup(scr);
+   ewm_scr_set_color_scheme(scr, EWM_SCR_COLOR_SCHEME_COLOR);
+}
+
+// Measures just the hires renderer, without uploading or presenting
+// anything, so that we can track the cost of rendering scanlines.
+
+void hgr_throughput(struct scr_t *scr, char *name, int color_scheme) {
+   hgr_full_refresh_setup(scr);
+   ewm_scr_set_color_scheme(scr, color_scheme);
+
+   Uint64 start = SDL_GetPerformanceCounter();
+   for (int i = 0; i < 1000; i++) {
+      scr->two->screen_dirty = true;
+      ewm_scr_update(scr, 0, 0);
+   }
+   Uint64 now = SDL_GetPerformanceCounter();
+   double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
+
+   printf("%-20s %.1f lines/ms\n", name, (1000.0 * EWM_SCR_HEIGHT) / total);
+}
 
+// Runs the test twice. First the way we used to do it, by creating a
+// texture from the surface for every frame, and then by using the
+// streaming texture that ewm_scr_update() keeps up to date.
+
+static double run(struct scr_t *scr, test_run_t test_run, bool streaming) {
    Uint64 start = SDL_GetPerformanceCounter();
    for (int i = 0; i < 1000; i++) {
       SDL_SetRenderDrawColor(scr->renderer, 0, 0, 0, 255);
@@ -87,19 +123,28 @@ void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t tes
 
       test_run(scr);
 
-      SDL_Texture *texture = SDL_CreateTextureFromSurface(scr->renderer, scr->surface);
-      if (texture != NULL) {
-         SDL_RenderCopy(scr->renderer, texture, NULL, NULL);
-         SDL_DestroyTexture(texture);
+      if (streaming) {
+         SDL_RenderCopy(scr->renderer, scr->texture, NULL, NULL);
+      } else {
+         SDL_Texture *texture = SDL_CreateTextureFromSurface(scr->renderer, scr->surface);
+         if (texture != NULL) {
+            SDL_RenderCopy(scr->renderer, texture, NULL, NULL);
+            SDL_DestroyTexture(texture);
+         }
       }
 
       SDL_RenderPresent(scr->renderer);
    }
    Uint64 now = SDL_GetPerformanceCounter();
    double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
-   double per_screen = total / 1000.0;
+   return total / 1000.0;
+}
 
-   printf("%-20s %.3f/refresh\n", name, per_screen);
+void test(struct scr_t *scr, char *name, test_setup_t test_setup, test_run_t test_run) {
+   test_setup(scr);
+   double surface = run(scr, test_run, false);
+   double streaming = run(scr, test_run, true);
+   printf("%-20s %.3f/refresh (surface) %.3f/refresh (streaming)\n", name, surface, streaming);
 }
 
 int main() {
@@ -131,8 +176,13 @@ int main() {
    cpu_reset(two->cpu);
 
    test(two->scr, "txt_full_refresh", txt_full_refresh_setup, txt_full_refresh_test);
+   test(two->scr, "txt_static_refresh", txt_full_refresh_setup, txt_static_refresh_test);
    test(two->scr, "lgr_full_refresh", lgr_full_refresh_setup, lgr_full_refresh_test);
    test(two->scr, "hgr_full_refresh", hgr_full_refresh_setup, hgr_full_refresh_test);
+   test(two->scr, "hgr_color_refresh", hgr_color_full_refresh_setup, hgr_full_refresh_test);
+
+   hgr_throughput(two->scr, "hgr_mono_throughput", EWM_SCR_COLOR_SCHEME_MONOCHROME);
+   hgr_throughput(two->scr, "hgr_color_throughput", EWM_SCR_COLOR_SCHEME_COLOR);
 
    // Destroy DSL things
 
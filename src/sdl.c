@@ -24,6 +24,12 @@
 #include <SDL2/SDL.h>
 
 int ewm_sdl_pixel_format(SDL_Renderer *renderer) {
+   // Without a renderer, like when running headless, we only draw
+   // into surfaces, so any of the formats below is fine.
+   if (renderer == NULL) {
+      return SDL_PIXELFORMAT_ARGB8888;
+   }
+
    SDL_RendererInfo info;
    if (SDL_GetRendererInfo(renderer, &info) != 0) {
       return -1;
@@ -0,0 +1,369 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "snp.h"
+
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+#define EWM_SNAPSHOT_HEADER_SIZE (12)
+#define EWM_SNAPSHOT_CHUNK_HEADER_SIZE (8)
+
+// Small values are put in blocks of scratch memory that stay where they
+// are until the snapshot is destroyed, since the iovecs point into them.
+
+#define EWM_SNAPSHOT_BLOCK_SIZE (4096)
+
+struct ewm_snapshot_block_t {
+   struct ewm_snapshot_block_t *next;
+   size_t used;
+   uint8_t data[EWM_SNAPSHOT_BLOCK_SIZE];
+};
+
+static bool ewm_snapshot_add_iov(struct ewm_snapshot_t *snapshot, void *base, size_t length) {
+   if (snapshot->iov_count == snapshot->iov_capacity) {
+      int capacity = (snapshot->iov_capacity == 0) ? 64 : snapshot->iov_capacity * 2;
+      struct iovec *iov = realloc(snapshot->iov, capacity * sizeof(struct iovec));
+      if (iov == NULL) {
+         snapshot->error = true;
+         return false;
+      }
+      snapshot->iov = iov;
+      snapshot->iov_capacity = capacity;
+   }
+   snapshot->iov[snapshot->iov_count].iov_base = base;
+   snapshot->iov[snapshot->iov_count].iov_len = length;
+   snapshot->iov_count++;
+   return true;
+}
+
+// Returns length bytes of scratch memory that will be written at the
+// current position. Consecutive puts share a single iovec.
+static uint8_t *ewm_snapshot_scratch(struct ewm_snapshot_t *snapshot, size_t length) {
+   struct ewm_snapshot_block_t *block = snapshot->blocks;
+   if (block == NULL || block->used + length > EWM_SNAPSHOT_BLOCK_SIZE) {
+      block = malloc(sizeof(struct ewm_snapshot_block_t));
+      if (block == NULL) {
+         snapshot->error = true;
+         return NULL;
+      }
+      block->next = snapshot->blocks;
+      block->used = 0;
+      snapshot->blocks = block;
+   }
+
+   uint8_t *p = block->data + block->used;
+   block->used += length;
+
+   struct iovec *last = (snapshot->iov_count != 0) ? &snapshot->iov[snapshot->iov_count - 1] : NULL;
+   if (last != NULL && (uint8_t*) last->iov_base + last->iov_len == p) {
+      last->iov_len += length;
+   } else if (!ewm_snapshot_add_iov(snapshot, p, length)) {
+      return NULL;
+   }
+
+   snapshot->chunk_length += length;
+   return p;
+}
+
+static void ewm_snapshot_store(uint8_t *p, uint64_t v, int length) {
+   for (int i = 0; i < length; i++) {
+      p[i] = (uint8_t) (v >> (i * 8));
+   }
+}
+
+static uint64_t ewm_snapshot_fetch(uint8_t *p, int length) {
+   uint64_t v = 0;
+   for (int i = 0; i < length; i++) {
+      v |= (uint64_t) p[i] << (i * 8);
+   }
+   return v;
+}
+
+struct ewm_snapshot_t *ewm_snapshot_create(char *machine) {
+   struct ewm_snapshot_t *snapshot = calloc(1, sizeof(struct ewm_snapshot_t));
+   if (snapshot == NULL) {
+      return NULL;
+   }
+   memcpy(snapshot->machine, machine, 4);
+
+   uint8_t *header = ewm_snapshot_scratch(snapshot, EWM_SNAPSHOT_HEADER_SIZE);
+   if (header == NULL) {
+      ewm_snapshot_destroy(snapshot);
+      return NULL;
+   }
+   memcpy(header, EWM_SNAPSHOT_MAGIC, 4);
+   ewm_snapshot_store(header + 4, EWM_SNAPSHOT_VERSION, 4);
+   memcpy(header + 8, machine, 4);
+
+   return snapshot;
+}
+
+void ewm_snapshot_destroy(struct ewm_snapshot_t *snapshot) {
+   while (snapshot->blocks != NULL) {
+      struct ewm_snapshot_block_t *next = snapshot->blocks->next;
+      free(snapshot->blocks);
+      snapshot->blocks = next;
+   }
+   free(snapshot->iov);
+   free(snapshot->data);
+   free(snapshot);
+}
+
+void ewm_snapshot_begin(struct ewm_snapshot_t *snapshot, char *id) {
+   snapshot->chunk_header = ewm_snapshot_scratch(snapshot, EWM_SNAPSHOT_CHUNK_HEADER_SIZE);
+   if (snapshot->chunk_header != NULL) {
+      memcpy(snapshot->chunk_header, id, 4);
+   }
+   snapshot->chunk_length = 0;
+}
+
+void ewm_snapshot_end(struct ewm_snapshot_t *snapshot) {
+   if (snapshot->chunk_header != NULL) {
+      ewm_snapshot_store(snapshot->chunk_header + 4, snapshot->chunk_length, 4);
+      snapshot->chunk_header = NULL;
+   }
+}
+
+void ewm_snapshot_put_u8(struct ewm_snapshot_t *snapshot, uint8_t v) {
+   uint8_t *p = ewm_snapshot_scratch(snapshot, 1);
+   if (p != NULL) {
+      *p = v;
+   }
+}
+
+void ewm_snapshot_put_u16(struct ewm_snapshot_t *snapshot, uint16_t v) {
+   uint8_t *p = ewm_snapshot_scratch(snapshot, 2);
+   if (p != NULL) {
+      ewm_snapshot_store(p, v, 2);
+   }
+}
+
+void ewm_snapshot_put_u32(struct ewm_snapshot_t *snapshot, uint32_t v) {
+   uint8_t *p = ewm_snapshot_scratch(snapshot, 4);
+   if (p != NULL) {
+      ewm_snapshot_store(p, v, 4);
+   }
+}
+
+void ewm_snapshot_put_u64(struct ewm_snapshot_t *snapshot, uint64_t v) {
+   uint8_t *p = ewm_snapshot_scratch(snapshot, 8);
+   if (p != NULL) {
+      ewm_snapshot_store(p, v, 8);
+   }
+}
+
+void ewm_snapshot_put_data(struct ewm_snapshot_t *snapshot, void *data, size_t length) {
+   if (length != 0 && ewm_snapshot_add_iov(snapshot, data, length)) {
+      snapshot->chunk_length += length;
+   }
+}
+
+int ewm_snapshot_save(struct ewm_snapshot_t *snapshot, char *path) {
+   if (snapshot->error) {
+      return -1;
+   }
+
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1) {
+      return -1;
+   }
+
+   // writev() takes at most IOV_MAX pieces and may write less than asked
+   struct iovec *iov = snapshot->iov;
+   int count = snapshot->iov_count;
+   while (count != 0) {
+      ssize_t written = writev(fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+      if (written == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         close(fd);
+         return -1;
+      }
+      while (count != 0 && (size_t) written >= iov->iov_len) {
+         written -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (written != 0) {
+         iov->iov_base = (uint8_t*) iov->iov_base + written;
+         iov->iov_len -= written;
+      }
+   }
+
+   return close(fd);
+}
+
+size_t ewm_snapshot_length(struct ewm_snapshot_t *snapshot) {
+   size_t length = 0;
+   for (int i = 0; i < snapshot->iov_count; i++) {
+      length += snapshot->iov[i].iov_len;
+   }
+   return length;
+}
+
+void ewm_snapshot_copy(struct ewm_snapshot_t *snapshot, uint8_t *buffer) {
+   for (int i = 0; i < snapshot->iov_count; i++) {
+      memcpy(buffer, snapshot->iov[i].iov_base, snapshot->iov[i].iov_len);
+      buffer += snapshot->iov[i].iov_len;
+   }
+}
+
+// Takes ownership of data, which is freed if it is not a snapshot of
+// the machine.
+
+static struct ewm_snapshot_t *ewm_snapshot_parse(uint8_t *data, size_t length, char *name, char *machine) {
+   if (length < EWM_SNAPSHOT_HEADER_SIZE || memcmp(data, EWM_SNAPSHOT_MAGIC, 4) != 0) {
+      fprintf(stderr, "[SNP] %s is not a snapshot\n", name);
+      free(data);
+      return NULL;
+   }
+
+   if (ewm_snapshot_fetch(data + 4, 4) != EWM_SNAPSHOT_VERSION) {
+      fprintf(stderr, "[SNP] %s has unsupported version %u\n", name, (uint32_t) ewm_snapshot_fetch(data + 4, 4));
+      free(data);
+      return NULL;
+   }
+
+   if (memcmp(data + 8, machine, 4) != 0) {
+      fprintf(stderr, "[SNP] %s is a snapshot of another machine\n", name);
+      free(data);
+      return NULL;
+   }
+
+   struct ewm_snapshot_t *snapshot = calloc(1, sizeof(struct ewm_snapshot_t));
+   if (snapshot == NULL) {
+      free(data);
+      return NULL;
+   }
+
+   memcpy(snapshot->machine, machine, 4);
+   snapshot->data = data;
+   snapshot->length = length;
+
+   return snapshot;
+}
+
+struct ewm_snapshot_t *ewm_snapshot_load(char *path, char *machine) {
+   int fd = open(path, O_RDONLY);
+   if (fd == -1) {
+      return NULL;
+   }
+
+   struct stat file_info;
+   if (fstat(fd, &file_info) == -1 || file_info.st_size < EWM_SNAPSHOT_HEADER_SIZE) {
+      close(fd);
+      return NULL;
+   }
+
+   size_t length = file_info.st_size;
+   uint8_t *data = malloc(length);
+   if (data == NULL || read(fd, data, length) != (ssize_t) length) {
+      close(fd);
+      free(data);
+      return NULL;
+   }
+   close(fd);
+
+   return ewm_snapshot_parse(data, length, path, machine);
+}
+
+struct ewm_snapshot_t *ewm_snapshot_open(uint8_t *data, size_t length, char *machine) {
+   uint8_t *copy = malloc(length);
+   if (copy == NULL) {
+      return NULL;
+   }
+   memcpy(copy, data, length);
+   return ewm_snapshot_parse(copy, length, "data", machine);
+}
+
+int ewm_snapshot_chunk(struct ewm_snapshot_t *snapshot, char *id, struct ewm_snapshot_chunk_t *chunk) {
+   size_t position = EWM_SNAPSHOT_HEADER_SIZE;
+   while (position + EWM_SNAPSHOT_CHUNK_HEADER_SIZE <= snapshot->length) {
+      uint8_t *header = snapshot->data + position;
+      size_t length = ewm_snapshot_fetch(header + 4, 4);
+      position += EWM_SNAPSHOT_CHUNK_HEADER_SIZE;
+      if (length > snapshot->length - position) {
+         break;
+      }
+      if (memcmp(header, id, 4) == 0) {
+         chunk->data = snapshot->data + position;
+         chunk->length = length;
+         chunk->position = 0;
+         chunk->error = false;
+         return 0;
+      }
+      position += length;
+   }
+   return -1;
+}
+
+static uint8_t *ewm_snapshot_get(struct ewm_snapshot_chunk_t *chunk, size_t length) {
+   if (chunk->error || length > chunk->length - chunk->position) {
+      chunk->error = true;
+      return NULL;
+   }
+   uint8_t *p = chunk->data + chunk->position;
+   chunk->position += length;
+   return p;
+}
+
+uint8_t ewm_snapshot_get_u8(struct ewm_snapshot_chunk_t *chunk) {
+   uint8_t *p = ewm_snapshot_get(chunk, 1);
+   return (p != NULL) ? *p : 0;
+}
+
+uint16_t ewm_snapshot_get_u16(struct ewm_snapshot_chunk_t *chunk) {
+   uint8_t *p = ewm_snapshot_get(chunk, 2);
+   return (p != NULL) ? (uint16_t) ewm_snapshot_fetch(p, 2) : 0;
+}
+
+uint32_t ewm_snapshot_get_u32(struct ewm_snapshot_chunk_t *chunk) {
+   uint8_t *p = ewm_snapshot_get(chunk, 4);
+   return (p != NULL) ? (uint32_t) ewm_snapshot_fetch(p, 4) : 0;
+}
+
+uint64_t ewm_snapshot_get_u64(struct ewm_snapshot_chunk_t *chunk) {
+   uint8_t *p = ewm_snapshot_get(chunk, 8);
+   return (p != NULL) ? ewm_snapshot_fetch(p, 8) : 0;
+}
+
+void ewm_snapshot_get_data(struct ewm_snapshot_chunk_t *chunk, void *data, size_t length) {
+   uint8_t *p = ewm_snapshot_get(chunk, length);
+   if (p != NULL) {
+      memcpy(data, p, length);
+   } else {
+      memset(data, 0, length);
+   }
+}
@@ -0,0 +1,108 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_SNP_H
+#define EWM_SNP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Snapshots of the complete state of a machine. A snapshot file starts
+// with a header with the format version and the machine it was taken
+// of, followed by chunks. Every chunk starts with a four character id
+// and its length, so that chunks that are not understood are skipped.
+// All values are stored little endian.
+//
+// While writing, a snapshot is a list of pieces that are written out
+// with writev(). Data added with ewm_snapshot_put_data() is referenced
+// and not copied, which means that memory has to stay untouched until
+// the snapshot is saved.
+
+#define EWM_SNAPSHOT_MAGIC   "EWMS"
+#define EWM_SNAPSHOT_VERSION (1)
+
+struct ewm_snapshot_block_t;
+
+struct ewm_snapshot_t {
+   char machine[4];
+   bool error;
+
+   // Rewind frames track RAM themselves. Set this on both sides to
+   // leave the contents of RAM out of the snapshot.
+   bool without_memory;
+
+   // Writing
+   struct iovec *iov;
+   int iov_count;
+   int iov_capacity;
+   struct ewm_snapshot_block_t *blocks;
+   uint8_t *chunk_header;
+   size_t chunk_length;
+
+   // Reading
+   uint8_t *data;
+   size_t length;
+};
+
+struct ewm_snapshot_chunk_t {
+   uint8_t *data;
+   size_t length;
+   size_t position;
+   bool error; // Set when reading past the end of the chunk
+};
+
+struct ewm_snapshot_t *ewm_snapshot_create(char *machine);
+void ewm_snapshot_destroy(struct ewm_snapshot_t *snapshot);
+
+void ewm_snapshot_begin(struct ewm_snapshot_t *snapshot, char *id);
+void ewm_snapshot_end(struct ewm_snapshot_t *snapshot);
+
+void ewm_snapshot_put_u8(struct ewm_snapshot_t *snapshot, uint8_t v);
+void ewm_snapshot_put_u16(struct ewm_snapshot_t *snapshot, uint16_t v);
+void ewm_snapshot_put_u32(struct ewm_snapshot_t *snapshot, uint32_t v);
+void ewm_snapshot_put_u64(struct ewm_snapshot_t *snapshot, uint64_t v);
+void ewm_snapshot_put_data(struct ewm_snapshot_t *snapshot, void *data, size_t length);
+
+int ewm_snapshot_save(struct ewm_snapshot_t *snapshot, char *path);
+
+// The same without a file. Copy writes ewm_snapshot_length() bytes.
+size_t ewm_snapshot_length(struct ewm_snapshot_t *snapshot);
+void ewm_snapshot_copy(struct ewm_snapshot_t *snapshot, uint8_t *buffer);
+
+// Returns NULL if the file cannot be read, or if it is not a snapshot
+// of the given machine in the current format version.
+struct ewm_snapshot_t *ewm_snapshot_load(char *path, char *machine);
+
+// Like ewm_snapshot_load, but from a copy of the data in memory.
+struct ewm_snapshot_t *ewm_snapshot_open(uint8_t *data, size_t length, char *machine);
+
+int ewm_snapshot_chunk(struct ewm_snapshot_t *snapshot, char *id, struct ewm_snapshot_chunk_t *chunk);
+
+uint8_t ewm_snapshot_get_u8(struct ewm_snapshot_chunk_t *chunk);
+uint16_t ewm_snapshot_get_u16(struct ewm_snapshot_chunk_t *chunk);
+uint32_t ewm_snapshot_get_u32(struct ewm_snapshot_chunk_t *chunk);
+uint64_t ewm_snapshot_get_u64(struct ewm_snapshot_chunk_t *chunk);
+void ewm_snapshot_get_data(struct ewm_snapshot_chunk_t *chunk, void *data, size_t length);
+
+#endif // EWM_SNP_H
@@ -0,0 +1,184 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thr.h"
+#include "spk.h"
+
+#define EWM_SPK_VOLUME (0.25f)
+#define EWM_SPK_CUTOFF (0.45) // In cycles per sample, just under Nyquist
+#define EWM_SPK_DC_POLE (0.995f)
+
+// Each row of the kernel is a windowed sinc impulse that is delayed by
+// half the taps plus a fraction of a sample, and sums to one. Adding a
+// row to the deltas and integrating them gives a band-limited step.
+
+static void ewm_spk_init_kernel(struct ewm_spk_t *spk) {
+   for (int p = 0; p < EWM_SPK_PHASES; p++) {
+      double f = (double) p / EWM_SPK_PHASES, sum = 0.0;
+      for (int k = 0; k < EWM_SPK_TAPS; k++) {
+         double x = k + 1 - f - EWM_SPK_TAPS / 2;
+         double u = (k + 1 - f) / EWM_SPK_TAPS;
+         double sinc = (x == 0.0) ? 1.0 : sin(M_PI * 2 * EWM_SPK_CUTOFF * x) / (M_PI * 2 * EWM_SPK_CUTOFF * x);
+         double window = 0.42 - 0.5 * cos(2 * M_PI * u) + 0.08 * cos(4 * M_PI * u);
+         spk->kernel[p][k] = sinc * window;
+         sum += spk->kernel[p][k];
+      }
+      for (int k = 0; k < EWM_SPK_TAPS; k++) {
+         spk->kernel[p][k] /= sum;
+      }
+   }
+}
+
+static void ewm_spk_step(struct ewm_spk_t *spk, double fraction) {
+   int phase = (int) (fraction * EWM_SPK_PHASES);
+   if (phase >= EWM_SPK_PHASES) {
+      phase = EWM_SPK_PHASES - 1;
+   }
+   float delta = (spk->level > 0.0f) ? -2 * EWM_SPK_VOLUME : 2 * EWM_SPK_VOLUME;
+   spk->level += delta;
+   for (int k = 0; k < EWM_SPK_TAPS; k++) {
+      spk->deltas[(spk->sample + k) & (EWM_SPK_RING - 1)] += delta * spk->kernel[phase][k];
+   }
+}
+
+// Runs on the audio thread. Only advances the audio clock up to where
+// the cpu has been. If the cpu got too far ahead, for example because
+// it is not paced by the audio, skip ahead and drop what we missed.
+
+static void ewm_spk_callback(void *userdata, Uint8 *stream, int len) {
+   struct ewm_spk_t *spk = (struct ewm_spk_t*) userdata;
+   float *out = (float*) stream;
+   int samples = len / sizeof(float);
+
+   uint64_t now = atomic_load_explicit(&spk->now, memory_order_acquire);
+   if (now > spk->time + 2 * spk->latency) {
+      spk->time = now - spk->latency;
+   }
+
+   for (int i = 0; i < samples; i++) {
+      double end = spk->time + spk->cycles_per_sample;
+      if (end <= now) {
+         while (spk->pending || ewm_spsc_pop(spk->toggles, &spk->toggle)) {
+            spk->pending = true;
+            if (spk->toggle >= end) {
+               break;
+            }
+            if (spk->toggle >= spk->time) {
+               ewm_spk_step(spk, (spk->toggle - spk->time) / spk->cycles_per_sample);
+            }
+            spk->pending = false;
+         }
+         spk->time = end;
+      }
+
+      float in = (spk->sum += spk->deltas[spk->sample & (EWM_SPK_RING - 1)]);
+      spk->deltas[spk->sample & (EWM_SPK_RING - 1)] = 0.0f;
+      spk->sample++;
+
+      spk->last_out = in - spk->last_in + EWM_SPK_DC_POLE * spk->last_out;
+      spk->last_in = in;
+      out[i] = spk->last_out;
+   }
+
+   atomic_store_explicit(&spk->clock, (uint64_t) spk->time, memory_order_release);
+}
+
+struct ewm_spk_t *ewm_spk_create(uint64_t cycles_per_second, uint64_t latency) {
+   struct ewm_spk_t *spk = calloc(1, sizeof(struct ewm_spk_t));
+   if (spk == NULL) {
+      return NULL;
+   }
+
+   spk->latency = latency;
+   atomic_init(&spk->now, 0);
+   atomic_init(&spk->clock, 0);
+   ewm_spk_init_kernel(spk);
+
+   spk->toggles = ewm_spsc_create(EWM_SPK_QUEUE_SIZE, sizeof(uint64_t));
+   if (spk->toggles == NULL) {
+      ewm_spk_destroy(spk);
+      return NULL;
+   }
+
+   SDL_AudioSpec want = {
+      .freq = EWM_SPK_FREQUENCY,
+      .format = AUDIO_F32SYS,
+      .channels = 1,
+      .samples = EWM_SPK_SAMPLES,
+      .callback = ewm_spk_callback,
+      .userdata = spk
+   }, have;
+
+   spk->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+   if (spk->device == 0) {
+      fprintf(stderr, "[SPK] Could not open audio device: %s\n", SDL_GetError());
+      ewm_spk_destroy(spk);
+      return NULL;
+   }
+
+   spk->cycles_per_sample = (double) cycles_per_second / have.freq;
+   SDL_PauseAudioDevice(spk->device, 0);
+
+   return spk;
+}
+
+void ewm_spk_destroy(struct ewm_spk_t *spk) {
+   if (spk->device != 0) {
+      SDL_CloseAudioDevice(spk->device);
+   }
+   if (spk->toggles != NULL) {
+      ewm_spsc_destroy(spk->toggles);
+   }
+   free(spk);
+}
+
+void ewm_spk_toggle(struct ewm_spk_t *spk, uint64_t counter) {
+   ewm_spsc_push(spk->toggles, &counter);
+}
+
+void ewm_spk_sync(struct ewm_spk_t *spk, uint64_t counter) {
+   atomic_store_explicit(&spk->now, counter, memory_order_release);
+}
+
+bool ewm_spk_wants_cycles(struct ewm_spk_t *spk, uint64_t counter) {
+   return counter < atomic_load_explicit(&spk->clock, memory_order_acquire) + spk->latency;
+}
+
+// With the audio device locked the callback is not running, so we can
+// safely empty the queue from this side.
+
+void ewm_spk_reset(struct ewm_spk_t *spk, uint64_t counter) {
+   SDL_LockAudioDevice(spk->device);
+   uint64_t toggle;
+   while (ewm_spsc_pop(spk->toggles, &toggle)) {
+   }
+   spk->pending = false;
+   spk->time = counter;
+   atomic_store(&spk->now, counter);
+   atomic_store(&spk->clock, counter);
+   SDL_UnlockAudioDevice(spk->device);
+}
@@ -0,0 +1,87 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_SPK_H
+#define EWM_SPK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+// The speaker. The cpu pushes the cycle counter of every $C030 toggle
+// into a queue, which the audio callback turns into samples. Toggles
+// become band-limited steps, which keeps the square waves from
+// aliasing, and a DC blocker lets the speaker go quiet while it is not
+// being toggled.
+//
+// The audio clock counts cycles too. It never gets ahead of the last
+// cycle counter the cpu reported through ewm_spk_sync(), so a paused
+// or slow cpu only results in silence. The cpu can use
+// ewm_spk_wants_cycles() to run exactly as fast as the audio plays.
+
+#define EWM_SPK_QUEUE_SIZE (16384) // Toggles
+#define EWM_SPK_FREQUENCY  (48000)
+#define EWM_SPK_SAMPLES    (512)
+#define EWM_SPK_PHASES     (32)
+#define EWM_SPK_TAPS       (16)
+#define EWM_SPK_RING       (32) // Power of two, at least EWM_SPK_TAPS
+
+struct ewm_spsc_t;
+
+struct ewm_spk_t {
+   SDL_AudioDeviceID device;
+   struct ewm_spsc_t *toggles;
+   double cycles_per_sample;
+   uint64_t latency; // Cycles that the cpu runs ahead of the audio
+
+   _Atomic uint64_t now;   // Written by the cpu
+   _Atomic uint64_t clock; // Written by the audio callback
+
+   // Owned by the audio callback
+   double time;
+   bool pending;
+   uint64_t toggle;
+   float level;
+   float sum, last_in, last_out;
+   float deltas[EWM_SPK_RING];
+   uint32_t sample;
+
+   float kernel[EWM_SPK_PHASES][EWM_SPK_TAPS];
+};
+
+struct ewm_spk_t *ewm_spk_create(uint64_t cycles_per_second, uint64_t latency);
+void ewm_spk_destroy(struct ewm_spk_t *spk);
+
+// Called from the cpu thread. Toggles that do not fit in the queue are
+// dropped.
+void ewm_spk_toggle(struct ewm_spk_t *spk, uint64_t counter);
+
+void ewm_spk_sync(struct ewm_spk_t *spk, uint64_t counter);
+bool ewm_spk_wants_cycles(struct ewm_spk_t *spk, uint64_t counter);
+
+// Drops everything that was queued and continues at counter, for when
+// the cycle counter has jumped, like after loading a snapshot.
+void ewm_spk_reset(struct ewm_spk_t *spk, uint64_t counter);
+
+#endif // EWM_SPK_H
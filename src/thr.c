@@ -0,0 +1,240 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "thr.h"
+
+// SPSC queue. Head and tail only ever increase, the slot is the index
+// modulo the capacity. The release store of tail makes the element
+// visible to the consumer, the release store of head gives the slot
+// back to the producer.
+
+struct ewm_spsc_t *ewm_spsc_create(size_t capacity, size_t element_size) {
+   if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+      return NULL;
+   }
+
+   struct ewm_spsc_t *queue = malloc(sizeof(struct ewm_spsc_t));
+   if (queue == NULL) {
+      return NULL;
+   }
+
+   atomic_init(&queue->head, 0);
+   atomic_init(&queue->tail, 0);
+   queue->capacity = capacity;
+   queue->element_size = element_size;
+   queue->data = calloc(capacity, element_size);
+   if (queue->data == NULL) {
+      free(queue);
+      return NULL;
+   }
+
+   return queue;
+}
+
+void ewm_spsc_destroy(struct ewm_spsc_t *queue) {
+   free(queue->data);
+   free(queue);
+}
+
+bool ewm_spsc_push(struct ewm_spsc_t *queue, const void *element) {
+   size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+   size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+   if (tail - head == queue->capacity) {
+      return false;
+   }
+   memcpy(queue->data + (tail & (queue->capacity - 1)) * queue->element_size, element, queue->element_size);
+   atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+   return true;
+}
+
+bool ewm_spsc_pop(struct ewm_spsc_t *queue, void *element) {
+   size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+   if (head == tail) {
+      return false;
+   }
+   memcpy(element, queue->data + (head & (queue->capacity - 1)) * queue->element_size, queue->element_size);
+   atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+   return true;
+}
+
+// Triple buffer. Publishing swaps the back buffer with the middle one
+// and marks it fresh. Acquiring swaps the front buffer with the middle
+// one, but only if something new was published.
+
+struct ewm_triple_t *ewm_triple_create(size_t size) {
+   struct ewm_triple_t *triple = malloc(sizeof(struct ewm_triple_t));
+   if (triple == NULL) {
+      return NULL;
+   }
+
+   for (int i = 0; i < 3; i++) {
+      triple->buffers[i] = calloc(1, size);
+      if (triple->buffers[i] == NULL) {
+         for (int j = 0; j < i; j++) {
+            free(triple->buffers[j]);
+         }
+         free(triple);
+         return NULL;
+      }
+   }
+
+   triple->back = 0;
+   triple->front = 1;
+   atomic_init(&triple->middle, 2);
+
+   return triple;
+}
+
+void ewm_triple_destroy(struct ewm_triple_t *triple) {
+   for (int i = 0; i < 3; i++) {
+      free(triple->buffers[i]);
+   }
+   free(triple);
+}
+
+void *ewm_triple_back(struct ewm_triple_t *triple) {
+   return triple->buffers[triple->back];
+}
+
+void ewm_triple_publish(struct ewm_triple_t *triple) {
+   int middle = atomic_exchange_explicit(&triple->middle, triple->back | EWM_TRIPLE_FRESH, memory_order_acq_rel);
+   triple->back = middle & ~EWM_TRIPLE_FRESH;
+}
+
+void *ewm_triple_acquire(struct ewm_triple_t *triple, bool *fresh) {
+   *fresh = (atomic_load_explicit(&triple->middle, memory_order_relaxed) & EWM_TRIPLE_FRESH) != 0;
+   if (*fresh) {
+      int middle = atomic_exchange_explicit(&triple->middle, triple->front, memory_order_acq_rel);
+      triple->front = middle & ~EWM_TRIPLE_FRESH;
+   }
+   return triple->buffers[triple->front];
+}
+
+// Each worker owns the range of jobs [bottom, top), packed into a single
+// word so that the owner taking from the bottom and thieves taking from
+// the top can both use a plain compare and swap.
+
+struct ewm_pool_worker_t {
+   _Alignas(64) _Atomic uint64_t range;
+   struct ewm_pool_t *pool;
+   int index;
+   pthread_t thread;
+   bool started;
+};
+
+struct ewm_pool_t {
+   ewm_pool_job_t fn;
+   void *ctx;
+   int threads;
+   struct ewm_pool_worker_t *workers;
+};
+
+#define EWM_POOL_RANGE(bottom, top) (((uint64_t) (top) << 32) | (uint32_t) (bottom))
+#define EWM_POOL_BOTTOM(range) ((int) ((range) & 0xffffffff))
+#define EWM_POOL_TOP(range) ((int) ((range) >> 32))
+
+static int ewm_pool_take(struct ewm_pool_worker_t *worker, bool steal) {
+   uint64_t range = atomic_load_explicit(&worker->range, memory_order_acquire);
+   while (EWM_POOL_BOTTOM(range) < EWM_POOL_TOP(range)) {
+      int bottom = EWM_POOL_BOTTOM(range), top = EWM_POOL_TOP(range);
+      uint64_t next = steal ? EWM_POOL_RANGE(bottom, top - 1) : EWM_POOL_RANGE(bottom + 1, top);
+      if (atomic_compare_exchange_weak_explicit(&worker->range, &range, next, memory_order_acq_rel, memory_order_acquire)) {
+         return steal ? top - 1 : bottom;
+      }
+   }
+   return -1;
+}
+
+static void *ewm_pool_worker(void *data) {
+   struct ewm_pool_worker_t *worker = data;
+   struct ewm_pool_t *pool = worker->pool;
+
+   for (;;) {
+      int job = ewm_pool_take(worker, false);
+      for (int i = 1; job == -1 && i < pool->threads; i++) {
+         job = ewm_pool_take(&pool->workers[(worker->index + i) % pool->threads], true);
+      }
+      if (job == -1) {
+         // Jobs are never added, so once every range is empty we are done
+         break;
+      }
+      pool->fn(pool->ctx, job);
+   }
+
+   return NULL;
+}
+
+int ewm_pool_run(int jobs, int threads, ewm_pool_job_t fn, void *ctx) {
+   if (threads <= 0) {
+      threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (threads > jobs) {
+      threads = jobs;
+   }
+   if (threads <= 0) {
+      return 0;
+   }
+
+   struct ewm_pool_t pool = { .fn = fn, .ctx = ctx, .threads = threads };
+   pool.workers = aligned_alloc(64, threads * sizeof(struct ewm_pool_worker_t));
+   if (pool.workers == NULL) {
+      return -1;
+   }
+
+   for (int i = 0; i < threads; i++) {
+      struct ewm_pool_worker_t *worker = &pool.workers[i];
+      atomic_init(&worker->range, EWM_POOL_RANGE((jobs * i) / threads, (jobs * (i + 1)) / threads));
+      worker->pool = &pool;
+      worker->index = i;
+      worker->started = false;
+   }
+
+   // The calling thread is the first worker
+   for (int i = 1; i < threads; i++) {
+      int error = pthread_create(&pool.workers[i].thread, NULL, ewm_pool_worker, &pool.workers[i]);
+      if (error != 0) {
+         fprintf(stderr, "[THR] Cannot create pool thread: %s\n", strerror(error));
+      } else {
+         pool.workers[i].started = true;
+      }
+   }
+
+   ewm_pool_worker(&pool.workers[0]);
+
+   for (int i = 1; i < threads; i++) {
+      if (pool.workers[i].started) {
+         pthread_join(pool.workers[i].thread, NULL);
+      }
+   }
+
+   free(pool.workers);
+
+   return 0;
+}
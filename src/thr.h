@@ -0,0 +1,77 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_THR_H
+#define EWM_THR_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free primitives for passing data between threads.
+
+// A single producer, single consumer queue of fixed size elements. The
+// capacity must be a power of two.
+
+struct ewm_spsc_t {
+   _Atomic size_t head; // Next element to pop, written by the consumer
+   _Atomic size_t tail; // Next element to push, written by the producer
+   size_t capacity;
+   size_t element_size;
+   uint8_t *data;
+};
+
+struct ewm_spsc_t *ewm_spsc_create(size_t capacity, size_t element_size);
+void ewm_spsc_destroy(struct ewm_spsc_t *queue);
+bool ewm_spsc_push(struct ewm_spsc_t *queue, const void *element);
+bool ewm_spsc_pop(struct ewm_spsc_t *queue, void *element);
+
+// A triple buffer. The producer fills the back buffer and publishes it.
+// The consumer always picks up the most recently published buffer, so
+// neither side ever waits for the other and frames may be dropped.
+
+#define EWM_TRIPLE_FRESH 0x04
+
+struct ewm_triple_t {
+   void *buffers[3];
+   int back;           // Owned by the producer
+   int front;          // Owned by the consumer
+   _Atomic int middle; // Index of the last published buffer, or'ed with EWM_TRIPLE_FRESH
+};
+
+struct ewm_triple_t *ewm_triple_create(size_t size);
+void ewm_triple_destroy(struct ewm_triple_t *triple);
+void *ewm_triple_back(struct ewm_triple_t *triple);
+void ewm_triple_publish(struct ewm_triple_t *triple);
+void *ewm_triple_acquire(struct ewm_triple_t *triple, bool *fresh);
+
+// A pool of threads that runs a fixed number of independent jobs. The
+// jobs are divided evenly over the threads up front. A thread that runs
+// out of jobs steals from the top of the range of another thread. The
+// threads argument can be 0 to use one thread per cpu.
+
+typedef void (*ewm_pool_job_t)(void *ctx, int job);
+
+int ewm_pool_run(int jobs, int threads, ewm_pool_job_t fn, void *ctx);
+
+#endif // EWM_THR_H
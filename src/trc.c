@@ -0,0 +1,237 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "cpu.h"
+#include "fmt.h"
+#include "ins.h"
+#include "mem.h"
+#include "trc.h"
+
+// The flusher writes whatever is in the ring and then goes back to
+// sleep for a bit. With a 4 MB ring and a cpu that produces about
+// five bytes per instruction, that is plenty of room.
+
+static size_t ewm_trace_flush(struct ewm_trace_t *trace) {
+   size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+
+   size_t length = tail - head;
+   if (length != 0) {
+      size_t offset = head & (EWM_TRACE_RING_SIZE - 1);
+      size_t first = (offset + length > EWM_TRACE_RING_SIZE) ? EWM_TRACE_RING_SIZE - offset : length;
+      fwrite(&trace->ring[offset], 1, first, trace->fp);
+      fwrite(&trace->ring[0], 1, length - first, trace->fp);
+      atomic_store_explicit(&trace->head, tail, memory_order_release);
+   }
+
+   return length;
+}
+
+static int ewm_trace_flusher(void *data) {
+   struct ewm_trace_t *trace = (struct ewm_trace_t*) data;
+   while (!atomic_load(&trace->quit)) {
+      if (ewm_trace_flush(trace) == 0) {
+         SDL_Delay(1);
+      }
+   }
+   return 0;
+}
+
+struct ewm_trace_t *ewm_trace_create(char *path, int model) {
+   struct ewm_trace_t *trace = calloc(1, sizeof(struct ewm_trace_t));
+   if (trace == NULL) {
+      return NULL;
+   }
+
+   trace->ring = malloc(EWM_TRACE_RING_SIZE);
+   if (trace->ring == NULL) {
+      free(trace);
+      return NULL;
+   }
+
+   trace->fp = fopen(path, "wb");
+   if (trace->fp == NULL) {
+      free(trace->ring);
+      free(trace);
+      return NULL;
+   }
+
+   uint8_t header[6] = { 'E', 'W', 'M', 'T', EWM_TRACE_VERSION, model };
+   fwrite(header, 1, sizeof(header), trace->fp);
+
+   atomic_init(&trace->head, 0);
+   atomic_init(&trace->tail, 0);
+   atomic_init(&trace->quit, false);
+
+   trace->thread = SDL_CreateThread(ewm_trace_flusher, "ewm_trace_flusher", trace);
+   if (trace->thread == NULL) {
+      fprintf(stderr, "[TRC] Cannot create flusher thread: %s\n", SDL_GetError());
+      fclose(trace->fp);
+      free(trace->ring);
+      free(trace);
+      return NULL;
+   }
+
+   return trace;
+}
+
+void ewm_trace_destroy(struct ewm_trace_t *trace) {
+   atomic_store(&trace->quit, true);
+   SDL_WaitThread(trace->thread, NULL);
+   ewm_trace_flush(trace);
+   fclose(trace->fp);
+   free(trace->ring);
+   free(trace);
+}
+
+// Dumping a trace. The records are replayed into a scratch cpu, with
+// just enough state for the formatters: the registers and the bytes of
+// the instruction at the pc.
+
+static int ewm_trace_read(FILE *fp, uint8_t *buffer, int length) {
+   return fread(buffer, 1, length, fp) == (size_t) length ? 0 : -1;
+}
+
+static int ewm_trace_dump(FILE *fp, FILE *out) {
+   uint8_t header[6];
+   if (ewm_trace_read(fp, header, sizeof(header)) != 0 || memcmp(header, "EWMT", 4) != 0) {
+      fprintf(stderr, "[TRC] Not a trace file\n");
+      return -1;
+   }
+
+   if (header[4] != EWM_TRACE_VERSION) {
+      fprintf(stderr, "[TRC] Unsupported trace version %d\n", header[4]);
+      return -1;
+   }
+
+   if (header[5] != EWM_CPU_MODEL_6502 && header[5] != EWM_CPU_MODEL_65C02) {
+      fprintf(stderr, "[TRC] Unsupported cpu model %d\n", header[5]);
+      return -1;
+   }
+
+   struct cpu_t *cpu = cpu_create(header[5]);
+   if (cpu == NULL) {
+      return -1;
+   }
+   cpu_add_ram(cpu, 0x0000, 0xffff);
+
+   uint16_t next_pc = 0;
+   uint8_t registers[5] = { 0, 0, 0, 0, 0 };
+
+   int result = 0;
+   int flags;
+   while ((flags = fgetc(fp)) != EOF) {
+      int opcode = fgetc(fp);
+      if (opcode == EOF) {
+         result = -1;
+         break;
+      }
+
+      const struct cpu_instruction_t *i = &cpu->instructions[opcode];
+      uint8_t bytes[3] = { opcode, 0, 0 };
+      int length = i->bytes ? i->bytes : 1;
+      if (ewm_trace_read(fp, &bytes[1], length - 1) != 0) {
+         result = -1;
+         break;
+      }
+
+      uint16_t pc = next_pc;
+      switch (flags & EWM_TRACE_PC_MASK) {
+         case EWM_TRACE_PC_RELATIVE: {
+            uint8_t delta;
+            if (ewm_trace_read(fp, &delta, 1) != 0) {
+               result = -1;
+            }
+            pc += (int8_t) delta;
+            break;
+         }
+         case EWM_TRACE_PC_ABSOLUTE: {
+            uint8_t address[2];
+            if (ewm_trace_read(fp, address, 2) != 0) {
+               result = -1;
+            }
+            pc = address[0] | (address[1] << 8);
+            break;
+         }
+      }
+      next_pc = pc + length;
+
+      for (int r = 0; r < 5; r++) {
+         if ((flags & (1 << r)) && ewm_trace_read(fp, &registers[r], 1) != 0) {
+            result = -1;
+         }
+      }
+
+      if (result != 0) {
+         break;
+      }
+
+      for (int n = 0; n < length; n++) {
+         mem_set_byte(cpu, pc + n, bytes[n]);
+      }
+
+      cpu->state.pc = pc;
+      cpu->state.a = registers[0];
+      cpu->state.x = registers[1];
+      cpu->state.y = registers[2];
+      cpu->state.sp = registers[3];
+      _cpu_set_status(cpu, registers[4]);
+
+      char instruction[256], state[256];
+      cpu_format_instruction(cpu, instruction);
+      cpu_format_state(cpu, state);
+      fprintf(out, "%.4X: %-16s %s\n", pc, instruction, state);
+   }
+
+   if (result != 0) {
+      fprintf(stderr, "[TRC] Trace is truncated\n");
+   }
+
+   cpu_destroy(cpu);
+   free(cpu);
+
+   return result;
+}
+
+int ewm_trace_dump_main(int argc, char **argv) {
+   if (argc != 2) {
+      fprintf(stderr, "Usage: ewm trace-dump <trace file>\n");
+      return 1;
+   }
+
+   FILE *fp = fopen(argv[1], "rb");
+   if (fp == NULL) {
+      fprintf(stderr, "[TRC] Cannot open %s\n", argv[1]);
+      return 1;
+   }
+
+   int result = ewm_trace_dump(fp, stdout);
+   fclose(fp);
+
+   return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2015 Stefan Arentz - http://github.com/st3fan/ewm
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef EWM_TRC_H
+#define EWM_TRC_H
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct SDL_Thread;
+
+// Binary cpu traces. The cpu appends a record for every instruction to
+// a ring buffer and a background thread writes the ring to the trace
+// file. Use 'ewm trace-dump' to turn a trace into readable text.
+//
+// A trace file starts with "EWMT", the version and the cpu model. Then
+// follows a record per instruction, describing the state right before
+// the instruction was executed:
+//
+//   flags     bits 0-4 set if A, X, Y, SP or P changed since the previous
+//             record, bits 5-6 say how the pc is stored
+//   opcode
+//   operands  as many as the instruction has, 0 to 2 bytes
+//   pc        nothing if it follows the previous instruction, one signed
+//             byte relative to that, or the full address
+//   registers the ones that changed, in the order of the flags
+
+#define EWM_TRACE_VERSION (1)
+
+#define EWM_TRACE_A  (1 << 0)
+#define EWM_TRACE_X  (1 << 1)
+#define EWM_TRACE_Y  (1 << 2)
+#define EWM_TRACE_SP (1 << 3)
+#define EWM_TRACE_P  (1 << 4)
+
+#define EWM_TRACE_PC_MASK     (3 << 5)
+#define EWM_TRACE_PC_NEXT     (0 << 5)
+#define EWM_TRACE_PC_RELATIVE (1 << 5)
+#define EWM_TRACE_PC_ABSOLUTE (2 << 5)
+
+#define EWM_TRACE_DEFAULT_PATH "ewm.trace"
+
+#define EWM_TRACE_RING_SIZE (4 * 1024 * 1024) // Must be a power of two
+#define EWM_TRACE_RECORD_MAX (11)
+
+struct ewm_trace_t {
+   // Written by the cpu
+   _Atomic size_t tail;
+   uint16_t next_pc;
+   uint8_t registers[5];
+
+   // Written by the flusher
+   _Alignas(64) _Atomic size_t head;
+
+   uint8_t *ring;
+   FILE *fp;
+   struct SDL_Thread *thread;
+   atomic_bool quit;
+};
+
+struct ewm_trace_t *ewm_trace_create(char *path, int model);
+void ewm_trace_destroy(struct ewm_trace_t *trace);
+
+int ewm_trace_dump_main(int argc, char **argv);
+
+// Called by the cpu before every instruction. Waits for the flusher if
+// the ring is full, traces do not drop records.
+
+static inline void ewm_trace_record(struct ewm_trace_t *trace, uint16_t pc, uint8_t *bytes, int length,
+                                    uint8_t a, uint8_t x, uint8_t y, uint8_t sp, uint8_t p) {
+   uint8_t record[EWM_TRACE_RECORD_MAX];
+   int n = 1;
+
+   for (int i = 0; i < length; i++) {
+      record[n++] = bytes[i];
+   }
+
+   uint8_t flags;
+   int16_t delta = (int16_t) (pc - trace->next_pc);
+   if (delta == 0) {
+      flags = EWM_TRACE_PC_NEXT;
+   } else if (delta >= -128 && delta <= 127) {
+      flags = EWM_TRACE_PC_RELATIVE;
+      record[n++] = (uint8_t) delta;
+   } else {
+      flags = EWM_TRACE_PC_ABSOLUTE;
+      record[n++] = pc & 0xff;
+      record[n++] = pc >> 8;
+   }
+   trace->next_pc = pc + length;
+
+   uint8_t registers[5] = { a, x, y, sp, p };
+   for (int i = 0; i < 5; i++) {
+      if (registers[i] != trace->registers[i]) {
+         flags |= (1 << i);
+         record[n++] = registers[i];
+         trace->registers[i] = registers[i];
+      }
+   }
+
+   record[0] = flags;
+
+   size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+   while (tail + n - atomic_load_explicit(&trace->head, memory_order_acquire) > EWM_TRACE_RING_SIZE) {
+      sched_yield();
+   }
+
+   for (int i = 0; i < n; i++) {
+      trace->ring[(tail + i) & (EWM_TRACE_RING_SIZE - 1)] = record[i];
+   }
+
+   atomic_store_explicit(&trace->tail, tail + n, memory_order_release);
+}
+
+#endif // EWM_TRC_H
@@ -20,8 +20,11 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <stdio.h>
+
 #include "chr.h"
 #include "sdl.h"
+#include "snp.h"
 #include "tty.h"
 
 struct ewm_tty_t *ewm_tty_create(SDL_Renderer *renderer, SDL_Color color) {
@@ -35,14 +38,30 @@ struct ewm_tty_t *ewm_tty_create(SDL_Renderer *renderer, SDL_Color color) {
       EWM_ONE_TTY_ROWS * ewm_chr_height(tty->chr), 32, 4 * EWM_ONE_TTY_COLUMNS * ewm_chr_width(tty->chr),
          ewm_sdl_pixel_format(renderer));
 
+   // The texture is updated by ewm_tty_refresh()
+   if (renderer != NULL) {
+      tty->texture = SDL_CreateTexture(renderer, ewm_sdl_pixel_format(renderer), SDL_TEXTUREACCESS_STREAMING,
+         EWM_ONE_TTY_COLUMNS * ewm_chr_width(tty->chr), EWM_ONE_TTY_ROWS * ewm_chr_height(tty->chr));
+      if (tty->texture != NULL) {
+         SDL_SetTextureBlendMode(tty->texture, SDL_BLENDMODE_BLEND);
+      }
+   }
+
    tty->screen_cursor_enabled = 1;
    tty->color = SDL_MapRGBA(tty->surface->format, color.r, color.g, color.b, color.a);
+   ewm_chr_set_color(tty->chr, tty->color);
    ewm_tty_reset(tty);
    return tty;
 }
 
 void ewm_tty_destroy(struct ewm_tty_t *tty) {
-   // TODO
+   if (tty->texture != NULL) {
+      SDL_DestroyTexture(tty->texture);
+   }
+   SDL_FreeSurface(tty->surface);
+   free(tty->pixels);
+   ewm_chr_destroy(tty->chr);
+   free(tty);
 }
 
 #if 0
@@ -61,32 +80,29 @@ static inline void ewm_tty_render_character(struct ewm_tty_t *tty, int row, int
 }
 #endif
 
-// Take one - get something on the screen. Very inefficient to do it char-by-char, but good baseline.
+// The glyphs in the character generator are already in our color, so
+// every row of a character is a straight copy.
 static inline void ewm_tty_render_character(struct ewm_tty_t *tty, int row, int column, uint8_t c) {
    c += 0x80; // TODO This should not be there really
-   uint32_t *src = tty->chr->bitmaps[c];
-   if (src != NULL) {
-      uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
-      for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            *dst++ = *src++ ? tty->color : 0; // TODO Can be optimized by moving color into chr
-         }
-         dst += (40 * 7) - 7;
-      }
-   } else {
-      uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
-      for (int y = 0; y < 8; y++) {
-         for (int x = 0; x < 7; x++) {
-            *dst++ = 0;
-         }
-         dst += (40 * 7) - 7;
-      }
+   uint32_t *src = ewm_chr_glyph(tty->chr, c);
+   uint32_t *dst = tty->pixels + ((40 * 7 * 8) * row) + (7 * column);
+   for (int y = 0; y < 8; y++) {
+      memcpy(dst, src, 7 * sizeof(uint32_t));
+      src += 7;
+      dst += (40 * 7);
    }
 }
 
+#define EWM_TTY_ROW_PIXELS (40 * 7 * 8)
+#define EWM_TTY_ALL_ROWS ((1 << EWM_ONE_TTY_ROWS) - 1)
+
 static void tty_scroll_up(struct ewm_tty_t *tty) {
    memmove(tty->screen_buffer, &tty->screen_buffer[EWM_ONE_TTY_COLUMNS], (EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS);
    memset(&tty->screen_buffer[(EWM_ONE_TTY_ROWS-1) * EWM_ONE_TTY_COLUMNS], 0, EWM_ONE_TTY_COLUMNS);
+   tty->rows_dirty = (tty->rows_dirty >> 1) | (1 << (EWM_ONE_TTY_ROWS-1));
+   if (tty->rows_scrolled < EWM_ONE_TTY_ROWS) {
+      tty->rows_scrolled++;
+   }
 }
 
 void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v) {
@@ -99,6 +115,7 @@ void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v) {
       }
    } else {
       tty->screen_buffer[(tty->screen_cursor_row * EWM_ONE_TTY_COLUMNS) + tty->screen_cursor_column] = v;
+      tty->rows_dirty |= 1 << tty->screen_cursor_row;
       tty->screen_cursor_column++;
       if (tty->screen_cursor_column == EWM_ONE_TTY_COLUMNS) {
          tty->screen_cursor_column = 0;
@@ -121,7 +138,7 @@ void ewm_tty_reset(struct ewm_tty_t *tty) {
 
    tty->screen_cursor_row = 0;
    tty->screen_cursor_column = 0;
-   tty->screen_dirty = true;
+   ewm_tty_invalidate(tty);
 }
 
 void ewm_tty_set_line(struct ewm_tty_t *tty, int v, char *line) {
@@ -129,16 +146,61 @@ void ewm_tty_set_line(struct ewm_tty_t *tty, int v, char *line) {
       char buf[41];
       snprintf(buf, 40, "%-40s", line);
       memcpy(tty->screen_buffer + (v * 40), buf, 40);
+      tty->rows_dirty |= 1 << v;
+      tty->screen_dirty = true;
    }
 }
 
+void ewm_tty_invalidate(struct ewm_tty_t *tty) {
+   tty->rows_dirty = EWM_TTY_ALL_ROWS;
+   tty->rows_scrolled = 0;
+   tty->cursor_drawn = false;
+   tty->screen_dirty = true;
+}
+
+static void ewm_tty_render_row(struct ewm_tty_t *tty, int row) {
+   for (int column = 0; column < EWM_ONE_TTY_COLUMNS; column++) {
+      ewm_tty_render_character(tty, row, column, tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column]);
+   }
+}
+
+// Brings the pixels up to date and then updates the rows of the texture
+// that changed, which for a blinking cursor is just the one row.
+
 void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps) {
-   for (int row = 0; row < 24; row++) {
-      for (int column = 0; column < 40; column++) {
-         ewm_tty_render_character(tty, row, column, tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column]);
+   int first = EWM_ONE_TTY_ROWS, last = -1;
+
+   if (tty->rows_scrolled != 0) {
+      if (tty->rows_scrolled < EWM_ONE_TTY_ROWS) {
+         memmove(tty->pixels, tty->pixels + (tty->rows_scrolled * EWM_TTY_ROW_PIXELS),
+            (EWM_ONE_TTY_ROWS - tty->rows_scrolled) * EWM_TTY_ROW_PIXELS * sizeof(uint32_t));
+         tty->cursor_drawn_row -= tty->rows_scrolled;
+      } else {
+         tty->rows_dirty = EWM_TTY_ALL_ROWS;
       }
+      tty->rows_scrolled = 0;
+      first = 0;
+      last = EWM_ONE_TTY_ROWS - 1;
    }
 
+   // Put back the character under the cursor, unless it scrolled away
+   if (tty->cursor_drawn && tty->cursor_drawn_row >= 0) {
+      int row = tty->cursor_drawn_row, column = tty->cursor_drawn_column;
+      ewm_tty_render_character(tty, row, column, tty->screen_buffer[(row * EWM_ONE_TTY_COLUMNS) + column]);
+      first = (row < first) ? row : first;
+      last = (row > last) ? row : last;
+   }
+   tty->cursor_drawn = false;
+
+   for (int row = 0; row < EWM_ONE_TTY_ROWS; row++) {
+      if (tty->rows_dirty & (1 << row)) {
+         ewm_tty_render_row(tty, row);
+         first = (row < first) ? row : first;
+         last = (row > last) ? row : last;
+      }
+   }
+   tty->rows_dirty = 0;
+
    if (fps != 0) {
       if ((phase % (fps / 4)) == 0) {
          tty->screen_cursor_blink = !tty->screen_cursor_blink;
@@ -146,10 +208,45 @@ void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps) {
    }
 
    if (tty->screen_cursor_enabled) {
+      int row = tty->screen_cursor_row, column = tty->screen_cursor_column;
       if (tty->screen_cursor_blink) {
-         ewm_tty_render_character(tty, tty->screen_cursor_row, tty->screen_cursor_column, EWM_ONE_TTY_CURSOR_ON);
+         ewm_tty_render_character(tty, row, column, EWM_ONE_TTY_CURSOR_ON);
       } else {
-         ewm_tty_render_character(tty, tty->screen_cursor_row, tty->screen_cursor_column, EWM_ONE_TTY_CURSOR_OFF);
+         ewm_tty_render_character(tty, row, column, EWM_ONE_TTY_CURSOR_OFF);
       }
+      tty->cursor_drawn = true;
+      tty->cursor_drawn_row = row;
+      tty->cursor_drawn_column = column;
+      first = (row < first) ? row : first;
+      last = (row > last) ? row : last;
+   }
+
+   if (tty->texture != NULL && last >= first) {
+      SDL_Rect rect = { .x = 0, .y = first * 8, .w = EWM_ONE_TTY_COLUMNS * 7, .h = (last - first + 1) * 8 };
+      SDL_UpdateTexture(tty->texture, &rect, tty->pixels + (first * EWM_TTY_ROW_PIXELS), tty->surface->pitch);
+   }
+}
+
+int ewm_tty_save_snapshot(struct ewm_tty_t *tty, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "TTY ");
+   ewm_snapshot_put_data(snapshot, tty->screen_buffer, sizeof(tty->screen_buffer));
+   ewm_snapshot_put_u8(snapshot, tty->screen_cursor_enabled);
+   ewm_snapshot_put_u8(snapshot, tty->screen_cursor_row);
+   ewm_snapshot_put_u8(snapshot, tty->screen_cursor_column);
+   ewm_snapshot_end(snapshot);
+   return snapshot->error ? -1 : 0;
+}
+
+int ewm_tty_load_snapshot(struct ewm_tty_t *tty, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "TTY ", &chunk) != 0) {
+      fprintf(stderr, "[TTY] Snapshot has no terminal state\n");
+      return -1;
    }
+   ewm_snapshot_get_data(&chunk, tty->screen_buffer, sizeof(tty->screen_buffer));
+   tty->screen_cursor_enabled = ewm_snapshot_get_u8(&chunk);
+   tty->screen_cursor_row = ewm_snapshot_get_u8(&chunk) % EWM_ONE_TTY_ROWS;
+   tty->screen_cursor_column = ewm_snapshot_get_u8(&chunk) % EWM_ONE_TTY_COLUMNS;
+   ewm_tty_invalidate(tty);
+   return chunk.error ? -1 : 0;
 }
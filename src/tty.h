@@ -34,6 +34,12 @@
 #define EWM_ONE_TTY_CURSOR_OFF ' '
 
 struct ewm_chr_t;
+struct ewm_snapshot_t;
+
+// The pixels are only rendered again for rows that changed since the
+// last refresh. Scrolling moves the pixels up instead, so that only
+// the new bottom row has to be rendered. Code that changes the screen
+// buffer directly has to call ewm_tty_invalidate().
 
 struct ewm_tty_t {
    SDL_Renderer *renderer;
@@ -41,6 +47,12 @@ struct ewm_tty_t {
    bool screen_dirty;
    uint8_t screen_buffer[EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS];
 
+   uint32_t rows_dirty; // A bit per row to render again
+   int rows_scrolled;   // Rows scrolled up since the last refresh
+   bool cursor_drawn;
+   int cursor_drawn_row;
+   int cursor_drawn_column;
+
    int screen_cursor_enabled;
    int screen_cursor_row;
    int screen_cursor_column;
@@ -48,6 +60,7 @@ struct ewm_tty_t {
 
    uint32_t *pixels;
    SDL_Surface *surface;
+   SDL_Texture *texture;
    uint32_t color;
 };
 
@@ -56,6 +69,10 @@ void ewm_tty_destroy(struct ewm_tty_t *tty);
 void ewm_tty_write(struct ewm_tty_t *tty, uint8_t v);
 void ewm_tty_reset(struct ewm_tty_t *tty);
 void ewm_tty_set_line(struct ewm_tty_t *tty, int v, char *line);
+void ewm_tty_invalidate(struct ewm_tty_t *tty);
 void ewm_tty_refresh(struct ewm_tty_t *tty, uint32_t phase, uint32_t fps);
 
+int ewm_tty_save_snapshot(struct ewm_tty_t *tty, struct ewm_snapshot_t *snapshot);
+int ewm_tty_load_snapshot(struct ewm_tty_t *tty, struct ewm_snapshot_t *snapshot);
+
 #endif // EWM_TTY_H
@@ -1,37 +1,66 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "one.h"
 #include "tty.h"
 
-void test(struct ewm_tty_t *tty) {
-   // TODO Setup
+static void present(struct ewm_tty_t *tty) {
+   SDL_SetRenderDrawColor(tty->renderer, 0, 0, 0, 255);
+   SDL_RenderClear(tty->renderer);
+
+   ewm_tty_refresh(tty, 1, EWM_ONE_FPS);
+
+   SDL_RenderCopy(tty->renderer, tty->texture, NULL, NULL);
+
+   SDL_RenderPresent(tty->renderer);
+}
 
+// Every refresh renders the whole screen
+void test(struct ewm_tty_t *tty) {
    for (int i = 0; i < (EWM_ONE_TTY_ROWS * EWM_ONE_TTY_COLUMNS); i++) {
       tty->screen_buffer[i] = 32 + (rand() % 64);
    }
 
    Uint64 start = SDL_GetPerformanceCounter();
    for (int i = 0; i < 1000; i++) {
-      SDL_SetRenderDrawColor(tty->renderer, 0, 0, 0, 255);
-      SDL_RenderClear(tty->renderer);
+      ewm_tty_invalidate(tty);
+      present(tty);
+   }
+   Uint64 now = SDL_GetPerformanceCounter();
+   double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
+   double per_screen = total / 1000.0;
 
-      ewm_tty_refresh(tty, 1, EWM_ONE_FPS);
+   printf("%-20s %.3f/refresh\n", "tty", per_screen);
+}
 
-      SDL_Texture *texture = SDL_CreateTextureFromSurface(tty->renderer, tty->surface);
-      if (texture != NULL) {
-         SDL_RenderCopy(tty->renderer, texture, NULL, NULL);
-         SDL_DestroyTexture(texture);
-      }
+// Every refresh prints a line, which scrolls the screen. The pixels
+// must still be the same as those of a full render afterwards.
+void test_scroll(struct ewm_tty_t *tty) {
+   size_t size = tty->surface->pitch * tty->surface->h;
+   uint32_t *pixels = malloc(size);
 
-      SDL_RenderPresent(tty->renderer);
+   Uint64 start = SDL_GetPerformanceCounter();
+   for (int i = 0; i < 1000; i++) {
+      for (int column = 0; column < 32; column++) {
+         ewm_tty_write(tty, 32 + (rand() % 64));
+      }
+      ewm_tty_write(tty, '\r');
+      present(tty);
    }
    Uint64 now = SDL_GetPerformanceCounter();
    double total = (double)((now - start)*1000) / SDL_GetPerformanceFrequency();
    double per_screen = total / 1000.0;
 
-   printf("%-20s %.3f/refresh\n", "tty", per_screen);
+   memcpy(pixels, tty->pixels, size);
+   ewm_tty_invalidate(tty);
+   present(tty);
+   bool same = memcmp(pixels, tty->pixels, size) == 0;
+   free(pixels);
+
+   printf("%-20s %.3f/refresh %s\n", "tty scroll", per_screen, same ? "ok" : "MISMATCH");
 }
 
 int main() {
@@ -58,6 +87,7 @@ int main() {
 
    struct ewm_one_t *one = ewm_one_create(EWM_ONE_MODEL_APPLE1, renderer);
    test(one->tty);
+   test_scroll(one->tty);
 
    SDL_DestroyWindow(window);
    SDL_DestroyRenderer(renderer);
@@ -30,13 +30,23 @@
 
 #include "cpu.h"
 #include "mem.h"
+#include "pac.h"
 #include "dsk.h"
+#include "ldr.h"
 #include "alc.h"
+#include "bat.h"
+#include "cap.h"
 #include "chr.h"
 #include "scr.h"
+#include "sdl.h"
 #if defined(EWM_LUA)
 #include "lua.h"
 #endif
+#include "rwd.h"
+#include "snp.h"
+#include "spk.h"
+#include "thr.h"
+#include "trc.h"
 #include "tty.h"
 #include "two.h"
 
@@ -76,197 +86,304 @@
 #define EWM_TWO_SS_PADL4 0xc067
 
 
-static uint8_t ewm_two_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
-   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
-   //printf("ewm_two_iom_read(%x)\n", addr);
-   switch (addr) {
-      case EWM_A2P_SS_KBD:
-         return two->key;
-      case EWM_A2P_SS_KBDSTRB:
-         two->key &= 0x7f;
-         return 0x00;
-
-      case EWM_A2P_SS_SCREEN_MODE_GRAPHICS:
-         two->screen_mode = EWM_A2P_SCREEN_MODE_GRAPHICS;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_SCREEN_MODE_TEXT:
-         two->screen_mode = EWM_A2P_SCREEN_MODE_TEXT;
-         two->screen_dirty = true;
-         break;
+// Triggering the paddles sets their value to $FF. Depending on the
+// position of the paddle, the value drops back to zero after up to
+// 2820 cycles, which we schedule as an event.
 
-      case EWM_A2P_SS_GRAPHICS_MODE_LGR:
-         two->screen_graphics_mode = EWM_A2P_SCREEN_GRAPHICS_MODE_LGR;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_GRAPHICS_MODE_HGR:
-         two->screen_graphics_mode = EWM_A2P_SCREEN_GRAPHICS_MODE_HGR;
-         two->screen_dirty = true;
-         break;
+#define EWM_TWO_PADDLE_CYCLES (2820)
 
-      case EWM_A2P_SS_GRAPHICS_STYLE_FULL:
-         two->screen_graphics_style = EWM_A2P_SCREEN_GRAPHICS_STYLE_FULL;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_GRAPHICS_STYLE_MIXED:
-         two->screen_graphics_style = EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED;
-         two->screen_dirty = true;
-         break;
-
-      case EWM_A2P_SS_SCREEN_PAGE1:
-         two->screen_page = EWM_A2P_SCREEN_PAGE1;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_SCREEN_PAGE2:
-         two->screen_page = EWM_A2P_SCREEN_PAGE2;
-         two->screen_dirty = true;
-         break;
+static void ewm_two_paddle_timeout(struct cpu_t *cpu, void *obj) {
+   *((uint8_t*) obj) = 0x00;
+}
 
-      case EWM_A2P_SS_TAPEOUT:
-         // Ignore this
-         break;
+static void ewm_two_trigger_paddle(struct ewm_two_t *two, uint8_t *value, int position) {
+   *value = 0xff;
+   cpu_schedule(two->cpu, position * (EWM_TWO_PADDLE_CYCLES / 255), ewm_two_paddle_timeout, value);
+}
 
-      case EWM_A2P_SS_SPKR:
-         // TODO Implement speaker support
-         break;
+// Changing the screen mode or page means everything on screen has to
+// be redrawn. Programs often hit these switches without changing
+// anything, so we only flag the screen dirty on an actual change.
 
-      case EWM_A2P_SS_PB0:
-         return two->buttons[0];
-      case EWM_A2P_SS_PB1:
-         return two->buttons[1];
-      case EWM_A2P_SS_PB2:
-         return two->buttons[2];
-      case EWM_A2P_SS_PB3:
-         return two->buttons[3];
+static void ewm_two_set_screen(struct ewm_two_t *two, int *field, int value) {
+   if (*field != value) {
+      *field = value;
+      two->screen_dirty = true;
+   }
+}
 
-      case EWM_A2P_SS_SETAN0:
-         break;
-      case EWM_A2P_SS_SETAN1:
-         break;
-      case EWM_A2P_SS_SETAN2:
-         break;
-      case EWM_A2P_SS_SETAN3:
-         break;
+// Writes to the text and hires pages go through this handler, which
+// keeps track of which of the 24 character rows changed. Reads are
+// still handled by the RAM region directly through the page table.
 
-      case EWM_A2P_SS_CLRAN0:
-         break;
-      case EWM_A2P_SS_CLRAN1:
-         break;
-      case EWM_A2P_SS_CLRAN2:
-         break;
-      case EWM_A2P_SS_CLRAN3:
-         break;
+static int ewm_two_screen_row(uint16_t offset) {
+   int column = offset & 0x7f;
+   if (column >= 0x78) {
+      return -1; // Screen holes are not displayed
+   }
+   return (column / 0x28) * 8 + ((offset >> 7) & 0x07);
+}
 
-      case EWM_TWO_SS_PTRIG: {
-         if (two->joystick != NULL) {
-            int x = 128 + (SDL_JoystickGetAxis(two->joystick, 0) / 256);
-            two->padl0_time = two->cpu->counter + (x * (2820 / 255)); // TODO Remove magic values
-            two->padl0_value = 0xff;
-            int y = 128 + (SDL_JoystickGetAxis(two->joystick, 1) / 256);
-            two->padl1_time = two->cpu->counter + (y * (2820 / 255)); // TODO Remove magic values
-            two->padl1_value = 0xff;
+static void ewm_two_vid_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   uint8_t *ram = (uint8_t*) two->ram->obj;
+   if (ram[addr] != b) {
+      ram[addr] = b;
+      if (addr < 0x2000) {
+         int row = ewm_two_screen_row(addr - 0x0400);
+         if (row != -1) {
+            two->screen_txt_dirty[(addr - 0x0400) >> 10] |= (1 << row);
          }
-         break;
-      }
-      case EWM_TWO_SS_PADL0: {
-         if (two->padl0_time != 0 && two->cpu->counter >= two->padl0_time) {
-            two->padl0_time = 0;
-            two->padl0_value = 0;
+      } else {
+         int row = ewm_two_screen_row(addr - 0x2000);
+         if (row != -1) {
+            two->screen_hgr_dirty[(addr - 0x2000) >> 13] |= (1 << row);
          }
-         return two->padl0_value;
-      }
-      case EWM_TWO_SS_PADL1: {
-         if (two->padl1_time != 0 && two->cpu->counter >= two->padl1_time) {
-            two->padl1_value = 0;
-         }
-         return two->padl1_value;
       }
+   }
+}
 
-      default:
-         printf("[A2P] Unexpected read at $%.4X pc is $%.4X\n", addr, cpu->state.pc);
-         break;
+// Page $C0 is dispatched through a table indexed by the low byte of
+// the address. Soft switches get a handler each and the slot I/O of
+// cards goes straight to the handlers of their regions, so nothing has
+// to walk the memory list. Accesses that nothing handles are logged
+// once per address.
+
+static uint8_t ewm_two_io_unexpected_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   if (!(two->io_logged[addr & 0xff] & 0x01)) {
+      two->io_logged[addr & 0xff] |= 0x01;
+      fprintf(stderr, "[A2P] Unexpected read at $%.4X pc is $%.4X\n", addr, cpu->state.pc);
    }
    return 0;
 }
 
-static void ewm_two_iom_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+static void ewm_two_io_unexpected_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
    struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
-   //printf("ewm_two_iom_write(%x)\n", addr);
-   switch (addr) {
-      case EWM_A2P_SS_KBD:
-         // Ignore - This is CLR80STORE on the IIe
-         break;
+   if (!(two->io_logged[addr & 0xff] & 0x02)) {
+      two->io_logged[addr & 0xff] |= 0x02;
+      fprintf(stderr, "[A2P] Unexpected write at $%.4X pc is $%.4X\n", addr, cpu->state.pc);
+   }
+}
 
-      case EWM_A2P_SS_KBDSTRB:
-         two->key &= 0x7f;
-         break;
+static uint8_t ewm_two_io_ignore_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   return 0;
+}
 
-      case EWM_A2P_SS_SCREEN_MODE_GRAPHICS:
-         two->screen_mode = EWM_A2P_SCREEN_MODE_GRAPHICS;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_SCREEN_MODE_TEXT:
-         two->screen_mode = EWM_A2P_SCREEN_MODE_TEXT;
-         two->screen_dirty = true;
-         break;
+static void ewm_two_io_ignore_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+}
 
-      case EWM_A2P_SS_GRAPHICS_MODE_LGR:
-         two->screen_graphics_mode = EWM_A2P_SCREEN_GRAPHICS_MODE_LGR;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_GRAPHICS_MODE_HGR:
-         two->screen_graphics_mode = EWM_A2P_SCREEN_GRAPHICS_MODE_HGR;
-         two->screen_dirty = true;
-         break;
+// Most of the time the machine waits for a key in the KEYIN loop of
+// the monitor, which also counts the random seed at $4E up. While no
+// key is pressed we skip the iterations that fit in the slice and do
+// the counting here. Other tight loops on the keyboard are handled by
+// cpu_skip_poll_loop().
+
+static const uint8_t ewm_two_keyin[] = {
+   0xe6, 0x4e,       // KEYIN  INC RNDL
+   0xd0, 0x02,       //        BNE KEYIN2
+   0xe6, 0x4f,       //        INC RNDH
+   0x2c, 0x00, 0xc0, // KEYIN2 BIT KBD
+   0x10, 0xf5        //        BPL KEYIN
+};
 
-      case EWM_A2P_SS_GRAPHICS_STYLE_FULL:
-         two->screen_graphics_style = EWM_A2P_SCREEN_GRAPHICS_STYLE_FULL;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_GRAPHICS_STYLE_MIXED:
-         two->screen_graphics_style = EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED;
-         two->screen_dirty = true;
-         break;
+#define EWM_TWO_KEYIN      (0xfd1b)
+#define EWM_TWO_KEYIN_READ (0xfd24) // The pc while reading KBD
 
-      case EWM_A2P_SS_SCREEN_PAGE1:
-         two->screen_page = EWM_A2P_SCREEN_PAGE1;
-         two->screen_dirty = true;
-         break;
-      case EWM_A2P_SS_SCREEN_PAGE2:
-         two->screen_page = EWM_A2P_SCREEN_PAGE2;
-         two->screen_dirty = true;
-         break;
+static bool ewm_two_keyin_mapped(struct cpu_t *cpu) {
+   for (size_t i = 0; i < sizeof(ewm_two_keyin); i++) {
+      if (mem_get_byte(cpu, EWM_TWO_KEYIN + i) != ewm_two_keyin[i]) {
+         return false;
+      }
+   }
+   return true;
+}
 
-      case EWM_A2P_SS_TAPEOUT:
-         // Ignore this
-         break;
+static bool ewm_two_skip_keyin(struct cpu_t *cpu) {
+   if (cpu->state.pc != EWM_TWO_KEYIN_READ || !ewm_two_keyin_mapped(cpu)) {
+      return false;
+   }
 
-      case EWM_A2P_SS_SPKR:
-         // TODO Implement speaker support
-         break;
+   uint64_t budget = cpu_idle_cycles(cpu, EWM_TWO_KEYIN, EWM_TWO_KEYIN + sizeof(ewm_two_keyin) - 1);
+   // Both branches are taken and stay on the page, except that the BNE
+   // falls through to the second INC when RNDL wraps
+   uint64_t inc = cpu_instruction_cycles(cpu, 0xe6);
+   uint64_t cycles = cpu_instruction_cycles(cpu, 0x10) + 1 + inc + cpu_instruction_cycles(cpu, 0xd0) + 1 + cpu_instruction_cycles(cpu, 0x2c);
+   uint16_t rnd = mem_get_word(cpu, 0x004e);
 
-      case EWM_A2P_SS_SETAN0:
-         break;
-      case EWM_A2P_SS_SETAN1:
-         break;
-      case EWM_A2P_SS_SETAN2:
-         break;
-      case EWM_A2P_SS_SETAN3:
+   uint64_t skipped = 0;
+   while (true) {
+      uint64_t iteration = cycles + (((rnd + 1) & 0xff) == 0 ? inc - 1 : 0);
+      if (skipped + iteration > budget) {
          break;
+      }
+      skipped += iteration;
+      rnd++;
+   }
+
+   if (skipped != 0) {
+      mem_set_byte(cpu, 0x004e, rnd & 0xff);
+      mem_set_byte(cpu, 0x004f, rnd >> 8);
+      cpu->counter += skipped;
+   }
+   return true;
+}
 
-      case EWM_A2P_SS_CLRAN0:
+static uint8_t ewm_two_kbd_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   if (!(two->key & 0x80) && !ewm_two_skip_keyin(cpu)) {
+      cpu_skip_poll_loop(cpu, addr);
+   }
+   return two->key;
+}
+
+static uint8_t ewm_two_kbdstrb_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   ((struct ewm_two_t*) mem->obj)->key &= 0x7f;
+   return 0x00;
+}
+
+static void ewm_two_kbdstrb_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   ((struct ewm_two_t*) mem->obj)->key &= 0x7f;
+}
+
+static uint8_t ewm_two_spkr_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   if (two->spk != NULL) {
+      ewm_spk_toggle(two->spk, cpu->counter);
+   }
+   return 0;
+}
+
+static void ewm_two_spkr_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   ewm_two_spkr_read(cpu, mem, addr);
+}
+
+// $C050 - $C057 come in pairs, the odd address switches the mode on
+
+static uint8_t ewm_two_screen_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   bool on = addr & 0x01;
+   switch (addr & 0x06) {
+      case EWM_A2P_SS_SCREEN_MODE_GRAPHICS & 0x06:
+         ewm_two_set_screen(two, &two->screen_mode, on ? EWM_A2P_SCREEN_MODE_TEXT : EWM_A2P_SCREEN_MODE_GRAPHICS);
          break;
-      case EWM_A2P_SS_CLRAN1:
+      case EWM_A2P_SS_GRAPHICS_STYLE_FULL & 0x06:
+         ewm_two_set_screen(two, &two->screen_graphics_style, on ? EWM_A2P_SCREEN_GRAPHICS_STYLE_MIXED : EWM_A2P_SCREEN_GRAPHICS_STYLE_FULL);
          break;
-      case EWM_A2P_SS_CLRAN2:
+      case EWM_A2P_SS_SCREEN_PAGE1 & 0x06:
+         ewm_two_set_screen(two, &two->screen_page, on ? EWM_A2P_SCREEN_PAGE2 : EWM_A2P_SCREEN_PAGE1);
          break;
-      case EWM_A2P_SS_CLRAN3:
+      case EWM_A2P_SS_GRAPHICS_MODE_LGR & 0x06:
+         ewm_two_set_screen(two, &two->screen_graphics_mode, on ? EWM_A2P_SCREEN_GRAPHICS_MODE_HGR : EWM_A2P_SCREEN_GRAPHICS_MODE_LGR);
          break;
+   }
+   return 0;
+}
+
+static void ewm_two_screen_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   ewm_two_screen_read(cpu, mem, addr);
+}
 
+static uint8_t ewm_two_button_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   switch (addr) {
+      case EWM_A2P_SS_PB0:
+         return two->buttons[0];
+      case EWM_A2P_SS_PB1:
+         return two->buttons[1];
+      case EWM_A2P_SS_PB2:
+         return two->buttons[2];
       default:
-         printf("[A2P] Unexpected write at $%.4X pc is $%.4X\n", addr, cpu->state.pc);
-         break;
+         return two->buttons[3];
+   }
+}
+
+static uint8_t ewm_two_ptrig_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   if (two->joystick != NULL) {
+      ewm_two_trigger_paddle(two, &two->padl0_value, 128 + (two->joystick_axis[0] / 256));
+      ewm_two_trigger_paddle(two, &two->padl1_value, 128 + (two->joystick_axis[1] / 256));
+   }
+   return 0;
+}
+
+static uint8_t ewm_two_padl_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_t *two = (struct ewm_two_t*) mem->obj;
+   return (addr == EWM_TWO_SS_PADL0) ? two->padl0_value : two->padl1_value;
+}
+
+static void ewm_two_set_io(struct ewm_two_t *two, uint16_t addr, mem_read_handler_t read, mem_write_handler_t write) {
+   struct ewm_two_io_t *io = &two->io[addr & 0xff];
+   if (read != NULL) {
+      io->read = read;
+   }
+   if (write != NULL) {
+      io->write = write;
+   }
+   io->read_mem = two->iom;
+   io->write_mem = two->iom;
+}
+
+static void ewm_two_init_io(struct ewm_two_t *two) {
+   for (int i = 0; i < 256; i++) {
+      two->io[i] = (struct ewm_two_io_t) { ewm_two_io_unexpected_read, ewm_two_io_unexpected_write, two->iom, two->iom };
+   }
+
+   // Empty slots do not respond
+   for (int i = 0x80; i < 256; i++) {
+      two->io[i] = (struct ewm_two_io_t) { ewm_two_io_ignore_read, ewm_two_io_ignore_write, two->iom, two->iom };
+   }
+
+   ewm_two_set_io(two, EWM_A2P_SS_KBD, ewm_two_kbd_read, ewm_two_io_ignore_write); // CLR80STORE on the IIe
+   ewm_two_set_io(two, EWM_A2P_SS_KBDSTRB, ewm_two_kbdstrb_read, ewm_two_kbdstrb_write);
+   ewm_two_set_io(two, EWM_A2P_SS_TAPEOUT, ewm_two_io_ignore_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_A2P_SS_SPKR, ewm_two_spkr_read, ewm_two_spkr_write);
+
+   for (uint16_t addr = EWM_A2P_SS_SCREEN_MODE_GRAPHICS; addr <= EWM_A2P_SS_GRAPHICS_MODE_HGR; addr++) {
+      ewm_two_set_io(two, addr, ewm_two_screen_read, ewm_two_screen_write);
+   }
+   for (uint16_t addr = EWM_A2P_SS_SETAN0; addr <= EWM_A2P_SS_CLRAN3; addr++) {
+      ewm_two_set_io(two, addr, ewm_two_io_ignore_read, ewm_two_io_ignore_write);
+   }
+
+   ewm_two_set_io(two, EWM_A2P_SS_PB0, ewm_two_button_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_A2P_SS_PB1, ewm_two_button_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_A2P_SS_PB2, ewm_two_button_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_A2P_SS_PB3, ewm_two_button_read, ewm_two_io_ignore_write);
+
+   ewm_two_set_io(two, EWM_TWO_SS_PTRIG, ewm_two_ptrig_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_TWO_SS_PADL0, ewm_two_padl_read, ewm_two_io_ignore_write);
+   ewm_two_set_io(two, EWM_TWO_SS_PADL1, ewm_two_padl_read, ewm_two_io_ignore_write);
+}
+
+// Takes over the slot I/O region of a card. The region itself is
+// disabled so that page $C0 stays mapped to our handlers alone.
+
+static void ewm_two_add_card_io(struct ewm_two_t *two, struct mem_t *mem) {
+   for (int addr = mem->start; addr <= mem->end; addr++) {
+      struct ewm_two_io_t *io = &two->io[addr & 0xff];
+      *io = (struct ewm_two_io_t) { mem->read_handler, mem->write_handler, mem, mem };
+      if (io->read == NULL) {
+         io->read = ewm_two_io_unexpected_read;
+         io->read_mem = two->iom;
+      }
+      if (io->write == NULL) {
+         io->write = ewm_two_io_unexpected_write;
+         io->write_mem = two->iom;
+      }
    }
+   mem->enabled = false;
+   cpu_remap_mem(two->cpu, mem);
+}
+
+static uint8_t ewm_two_iom_read(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr) {
+   struct ewm_two_io_t *io = &((struct ewm_two_t*) mem->obj)->io[addr & 0xff];
+   return io->read(cpu, io->read_mem, addr);
+}
+
+static void ewm_two_iom_write(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b) {
+   struct ewm_two_io_t *io = &((struct ewm_two_t*) mem->obj)->io[addr & 0xff];
+   io->write(cpu, io->write_mem, addr, b);
 }
 
 static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer, SDL_Joystick *joystick) {
@@ -296,7 +413,14 @@ static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer,
          two->roms[3] = cpu_add_rom_file(two->cpu, 0xe800, "rom/341-0014.bin"); // AppleSoft BASIC E800
          two->roms[4] = cpu_add_rom_file(two->cpu, 0xf000, "rom/341-0015.bin"); // AppleSoft BASIC F000
          two->roms[5] = cpu_add_rom_file(two->cpu, 0xf800, "rom/341-0020.bin"); // Autostart Monitor F800
-         two->iom = cpu_add_iom(two->cpu, 0xc000, 0xc07f, two, ewm_two_iom_read, ewm_two_iom_write);
+         two->iom = cpu_add_iom(two->cpu, 0xc000, 0xc0ff, two, ewm_two_iom_read, ewm_two_iom_write);
+         two->vid[0] = cpu_add_iom(two->cpu, 0x0400, 0x0bff, two, NULL, ewm_two_vid_write); // Text and Lores pages
+         two->vid[1] = cpu_add_iom(two->cpu, 0x2000, 0x5fff, two, NULL, ewm_two_vid_write); // Hires pages
+         two->ram->description = "ram/two/$0000";
+         two->iom->description = "iom/two/$C000";
+         ewm_two_init_io(two);
+         two->vid[0]->description = "iom/two/$0400 (TXT)";
+         two->vid[1]->description = "iom/two/$2000 (HGR)";
 
          two->dsk = ewm_dsk_create(two->cpu);
          if (two->dsk == NULL) {
@@ -310,6 +434,9 @@ static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer,
             return -1;
          }
 
+         ewm_two_add_card_io(two, two->dsk->iom);
+         ewm_two_add_card_io(two, two->alc->iom);
+
          two->scr = ewm_scr_create(two, renderer);
          if (two->scr == NULL) {
             fprintf(stderr, "[TWO] Could not create Screen\n");
@@ -334,6 +461,7 @@ static int ewm_two_init(struct ewm_two_t *two, int type, SDL_Renderer *renderer,
    }
 
    two->joystick = joystick;
+   two->screen_dirty = true;
 
    return 0;
 }
@@ -348,7 +476,34 @@ struct ewm_two_t *ewm_two_create(int type, SDL_Renderer *renderer, SDL_Joystick
 }
 
 void ewm_two_destroy(struct ewm_two_t *two) {
-   // TODO Or maybe not.
+   if (two->spk != NULL) {
+      ewm_spk_destroy(two->spk);
+   }
+   if (two->rewind != NULL) {
+      ewm_rewind_destroy(two->rewind);
+   }
+   if (two->events != NULL) {
+      ewm_spsc_destroy(two->events);
+   }
+   if (two->snapshots != NULL) {
+      ewm_triple_destroy(two->snapshots);
+   }
+   if (two->status_texture != NULL) {
+      SDL_DestroyTexture(two->status_texture);
+   }
+   if (two->trace != NULL) {
+      ewm_trace_destroy(two->trace);
+   }
+   if (two->cap != NULL) {
+      ewm_cap_destroy(two->cap);
+   }
+   ewm_tty_destroy(two->tty);
+   ewm_scr_destroy(two->scr);
+   ewm_alc_destroy(two->alc);
+   ewm_dsk_destroy(two->dsk);
+   cpu_destroy(two->cpu);
+   free(two->cpu);
+   free(two);
 }
 
 #if defined(EWM_LUA)
@@ -430,6 +585,27 @@ static int two_lua_onKeyUp(lua_State *state) {
    return 0;
 }
 
+// two:load(program [, run]) loads right away, wherever the cpu is
+
+static int two_lua_load(lua_State *state) {
+   void *two_data = luaL_checkudata(state, 1, "two_meta_table");
+   struct ewm_two_t *two = *((struct ewm_two_t**) two_data);
+
+   char *spec = strdup(luaL_checkstring(state, 2));
+   bool run = lua_toboolean(state, 3);
+
+   struct ewm_ldr_option_t *loads = NULL;
+   int result = -1;
+   if (spec != NULL && ewm_ldr_add_option(&loads, spec) == 0) {
+      result = ewm_ldr_load(two->cpu, loads, run);
+   }
+   ewm_ldr_free_options(loads);
+   free(spec);
+
+   lua_pushboolean(state, result == 0);
+   return 1;
+}
+
 int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua) {
    two->lua = lua;
 
@@ -443,17 +619,14 @@ int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua) {
    luaL_Reg two_methods[] = {
       {"onKeyDown", two_lua_onKeyDown},
       {"onKeyUp", two_lua_onKeyUp},
+      {"load", two_lua_load},
       {NULL, NULL}
    };
    ewm_lua_register_component(lua, "two_methods", two_methods);
 
    // Register a global cpu instance
 
-   void *two_data = lua_newuserdata(lua->state, sizeof(struct ewm_two_t*));
-   *((struct ewm_two_t**) two_data) = two;
-
-   luaL_getmetatable(lua->state, "two_meta_table");
-   lua_setmetatable(lua->state, -2);
+   ewm_lua_push_two(lua, two);
    lua_setglobal(lua->state, "two");
 
    return 0;
@@ -467,241 +640,529 @@ int ewm_two_load_disk(struct ewm_two_t *two, int drive, char *path) {
    return ewm_dsk_set_disk_file(two->dsk, drive, false, path);
 }
 
-static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // TODO Should window be part of ewm_two_t?
-   SDL_Event event;
-   while (SDL_PollEvent(&event) != 0) {
-      switch (event.type) {
-         case SDL_QUIT:
-            return false;
+// A valid power-up byte makes the autostart ROM skip the slot scan on
+// reset. With the soft entry at $E000 it then cold starts Applesoft.
+// That also skips the HOME of a cold start, so the visible part of the
+// text page is cleared here instead. The screen holes are left alone.
+
+void ewm_two_load_programs(struct ewm_two_t *two, struct ewm_ldr_option_t *loads, bool run) {
+   two->loads = loads;
+   two->loads_run = run;
+
+   if (loads != NULL && !two->dsk->drives[EWM_DSK_DRIVE1].loaded) {
+      mem_set_byte(two->cpu, 0x03f2, EWM_LDR_APPLESOFT_COLD & 0xff);
+      mem_set_byte(two->cpu, 0x03f3, EWM_LDR_APPLESOFT_COLD >> 8);
+      mem_set_byte(two->cpu, 0x03f4, (EWM_LDR_APPLESOFT_COLD >> 8) ^ 0xa5);
+      for (uint16_t offset = 0; offset < 0x0400; offset++) {
+         if (ewm_two_screen_row(offset) != -1) {
+            mem_set_byte(two->cpu, 0x0400 + offset, 0xa0);
+         }
+      }
+   }
+}
 
-         case SDL_WINDOWEVENT:
-            two->screen_dirty = true;
-            break;
+// Snapshots contain the cpu and memory, followed by the state of the
+// devices. Pending paddle timers are stored as the cycle at which they
+// fire, so that they can be scheduled again when loading.
+
+static void ewm_two_save_state(struct ewm_two_t *two, struct ewm_snapshot_t *snapshot) {
+   ewm_snapshot_begin(snapshot, "TWO ");
+   ewm_snapshot_put_u8(snapshot, two->type);
+   ewm_snapshot_put_u8(snapshot, two->screen_mode);
+   ewm_snapshot_put_u8(snapshot, two->screen_graphics_mode);
+   ewm_snapshot_put_u8(snapshot, two->screen_graphics_style);
+   ewm_snapshot_put_u8(snapshot, two->screen_page);
+   ewm_snapshot_put_u8(snapshot, two->key);
+   ewm_snapshot_put_data(snapshot, two->buttons, sizeof(two->buttons));
+   ewm_snapshot_put_u8(snapshot, two->padl0_value);
+   ewm_snapshot_put_u8(snapshot, two->padl1_value);
+   ewm_snapshot_put_u8(snapshot, two->padl2_value);
+   ewm_snapshot_put_u8(snapshot, two->padl3_value);
+   ewm_snapshot_put_u64(snapshot, cpu_scheduled(two->cpu, ewm_two_paddle_timeout, &two->padl0_value));
+   ewm_snapshot_put_u64(snapshot, cpu_scheduled(two->cpu, ewm_two_paddle_timeout, &two->padl1_value));
+   ewm_snapshot_end(snapshot);
+}
+
+static void ewm_two_reschedule_paddle(struct ewm_two_t *two, uint8_t *value, uint64_t when) {
+   if (when != 0) {
+      cpu_schedule(two->cpu, (when > two->cpu->counter) ? when - two->cpu->counter : 0, ewm_two_paddle_timeout, value);
+   }
+}
+
+static int ewm_two_load_state(struct ewm_two_t *two, struct ewm_snapshot_t *snapshot) {
+   struct ewm_snapshot_chunk_t chunk;
+   if (ewm_snapshot_chunk(snapshot, "TWO ", &chunk) != 0) {
+      fprintf(stderr, "[TWO] Snapshot has no machine state\n");
+      return -1;
+   }
+
+   if (ewm_snapshot_get_u8(&chunk) != two->type) {
+      fprintf(stderr, "[TWO] Snapshot is for a different model\n");
+      return -1;
+   }
+
+   two->screen_mode = ewm_snapshot_get_u8(&chunk);
+   two->screen_graphics_mode = ewm_snapshot_get_u8(&chunk);
+   two->screen_graphics_style = ewm_snapshot_get_u8(&chunk);
+   two->screen_page = ewm_snapshot_get_u8(&chunk);
+   two->key = ewm_snapshot_get_u8(&chunk);
+   ewm_snapshot_get_data(&chunk, two->buttons, sizeof(two->buttons));
+   two->padl0_value = ewm_snapshot_get_u8(&chunk);
+   two->padl1_value = ewm_snapshot_get_u8(&chunk);
+   two->padl2_value = ewm_snapshot_get_u8(&chunk);
+   two->padl3_value = ewm_snapshot_get_u8(&chunk);
+   uint64_t padl0_when = ewm_snapshot_get_u64(&chunk);
+   uint64_t padl1_when = ewm_snapshot_get_u64(&chunk);
+
+   if (chunk.error) {
+      return -1;
+   }
+
+   ewm_two_reschedule_paddle(two, &two->padl0_value, padl0_when);
+   ewm_two_reschedule_paddle(two, &two->padl1_value, padl1_when);
+
+   two->screen_dirty = true;
+
+   return 0;
+}
 
-         case SDL_CONTROLLERBUTTONDOWN:
-         case SDL_CONTROLLERBUTTONUP:
-            switch (event.cbutton.button) {
-               case SDL_CONTROLLER_BUTTON_A:
-               case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
-                  two->buttons[0] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+static int ewm_two_save_machine(struct ewm_two_t *two, struct ewm_snapshot_t *snapshot) {
+   int result = cpu_save_snapshot(two->cpu, snapshot);
+   if (result == 0 && two->alc != NULL) {
+      result = ewm_alc_save_snapshot(two->alc, snapshot);
+   }
+   if (result == 0) {
+      result = ewm_dsk_save_snapshot(two->dsk, two->cpu, snapshot);
+   }
+   if (result == 0) {
+      ewm_two_save_state(two, snapshot);
+   }
+   return result;
+}
+
+static int ewm_two_load_machine(struct ewm_two_t *two, struct ewm_snapshot_t *snapshot) {
+   // The cpu goes first, it drops all pending events
+
+   int result = cpu_load_snapshot(two->cpu, snapshot);
+   if (result == 0 && two->alc != NULL) {
+      result = ewm_alc_load_snapshot(two->alc, two->cpu, snapshot);
+   }
+   if (result == 0) {
+      result = ewm_dsk_load_snapshot(two->dsk, two->cpu, snapshot);
+   }
+   if (result == 0) {
+      result = ewm_two_load_state(two, snapshot);
+   }
+   if (two->spk != NULL) {
+      ewm_spk_reset(two->spk, two->cpu->counter);
+   }
+   return result;
+}
+
+int ewm_two_save_snapshot(struct ewm_two_t *two, char *path) {
+   struct ewm_snapshot_t *snapshot = ewm_snapshot_create("TWO ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+
+   ewm_dsk_flush(two->dsk);
+
+   int result = ewm_two_save_machine(two, snapshot);
+   if (result == 0) {
+      result = ewm_snapshot_save(snapshot, path);
+   }
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
+}
+
+int ewm_two_load_snapshot(struct ewm_two_t *two, char *path) {
+   struct ewm_snapshot_t *snapshot = ewm_snapshot_load(path, "TWO ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+
+   int result = ewm_two_load_machine(two, snapshot);
+   if (result == 0 && two->rewind != NULL) {
+      ewm_rewind_reset(two->rewind);
+   }
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
+}
+
+// Rewind frames are snapshots without RAM, the rewind buffer keeps
+// track of that itself. Disks are not rewound.
+
+int ewm_two_enable_rewind(struct ewm_two_t *two, size_t arena_size) {
+   two->rewind = ewm_rewind_create(two->cpu, arena_size);
+   return (two->rewind != NULL) ? 0 : -1;
+}
+
+int ewm_two_record_frame(struct ewm_two_t *two) {
+   struct ewm_snapshot_t *snapshot = ewm_snapshot_create("TWO ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+   snapshot->without_memory = true;
+
+   int result = ewm_two_save_machine(two, snapshot);
+   if (result == 0) {
+      result = ewm_rewind_record(two->rewind, snapshot);
+   }
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
+}
+
+int ewm_two_rewind(struct ewm_two_t *two, int frames) {
+   struct ewm_snapshot_t *snapshot = ewm_rewind_back(two->rewind, frames, "TWO ");
+   if (snapshot == NULL) {
+      return -1;
+   }
+
+   int result = ewm_two_load_machine(two, snapshot);
+
+   ewm_snapshot_destroy(snapshot);
+   return result;
+}
+
+// Input events are handled on the thread that runs the cpu. They are
+// passed from the main thread through the event queue.
+
+static bool ewm_two_handle_event(struct ewm_two_t *two, SDL_Event *event) {
+   switch (event->type) {
+      case SDL_JOYAXISMOTION:
+         if (event->jaxis.axis < 2) {
+            two->joystick_axis[event->jaxis.axis] = event->jaxis.value;
+         }
+         break;
+
+      case SDL_CONTROLLERBUTTONDOWN:
+      case SDL_CONTROLLERBUTTONUP:
+         switch (event->cbutton.button) {
+            case SDL_CONTROLLER_BUTTON_A:
+            case SDL_CONTROLLER_BUTTON_LEFTSHOULDER:
+               two->buttons[0] = event->cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               break;
+            case SDL_CONTROLLER_BUTTON_B:
+            case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
+               two->buttons[1] = event->cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               break;
+            case SDL_CONTROLLER_BUTTON_X:
+               two->buttons[2] = event->cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               break;
+            case SDL_CONTROLLER_BUTTON_Y:
+               two->buttons[3] = event->cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               break;
+         }
+         break;
+
+      case SDL_KEYDOWN:
+#if defined(EWM_LUA)
+         if (two->lua_key_down_fn != LUA_NOREF) {
+            lua_rawgeti(two->lua->state, LUA_REGISTRYINDEX, two->lua_key_down_fn);
+            ewm_lua_push_two(two->lua, two);
+            lua_pushinteger(two->lua->state, event->key.keysym.mod);
+            lua_pushinteger(two->lua->state, event->key.keysym.sym);
+            if (lua_pcall(two->lua->state, 3, 1, 0) != 0) {
+               printf("two: script error: %s\n", lua_tostring(two->lua->state, -1));
+               return true;
+            }
+
+            if (lua_isboolean(two->lua->state, -1) == 0) {
+               printf("two: script error: expected boolean result\n");
+               return true;
+            }
+
+            if (lua_toboolean(two->lua->state, -1)) {
+               return true;
+            }
+         }
+#endif
+
+         if (event->key.keysym.mod & KMOD_CTRL) {
+            if (event->key.keysym.sym >= SDLK_a && event->key.keysym.sym <= SDLK_z) {
+               two->key = (event->key.keysym.sym - SDLK_a + 1) | 0x80;
+            }
+         } else if (event->key.keysym.mod & KMOD_GUI) {
+            switch (event->key.keysym.sym) {
+               case SDLK_ESCAPE:
+                  fprintf(stderr, "[SDL] Reset\n");
+                  cpu_reset(two->cpu);
+                  break;
+               case SDLK_p:
+                  if (two->state == EWM_TWO_STATE_PAUSED) {
+                     two->state = EWM_TWO_STATE_RUNNING;
+                  } else {
+                     two->state = EWM_TWO_STATE_PAUSED;
+                  }
+                  break;
+               case SDLK_r:
+                  if (two->rewind != NULL) {
+                     ewm_two_rewind(two, EWM_TWO_REWIND_FRAMES);
+                  }
+                  break;
+            }
+         } else if (event->key.keysym.mod == KMOD_NONE) {
+            switch (event->key.keysym.sym) {
+               case SDLK_RETURN:
+                  two->key = 0x0d | 0x80; // CR
+                  break;
+               case SDLK_TAB:
+                  two->key = 0x09 | 0x80; // HT
+               case SDLK_DELETE:
+                  two->key = 0x7f | 0x80; // DEL
                   break;
-               case SDL_CONTROLLER_BUTTON_B:
-               case SDL_CONTROLLER_BUTTON_RIGHTSHOULDER:
-                  two->buttons[1] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               case SDLK_BACKSPACE:
+               case SDLK_LEFT:
+                  two->key = 0x08 | 0x80; // BS
                   break;
-               case SDL_CONTROLLER_BUTTON_X:
-                  two->buttons[2] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               case SDLK_RIGHT:
+                  two->key = 0x15 | 0x80; // NAK
                   break;
-               case SDL_CONTROLLER_BUTTON_Y:
-                  two->buttons[3] = event.cbutton.state == SDL_PRESSED ? 0x80 : 0x00;
+               case SDLK_UP:
+                  two->key = 0x0b | 0x80; // VT
+                  break;
+               case SDLK_DOWN:
+                  two->key = 0x0a | 0x80; // LF
+                  break;
+               case SDLK_ESCAPE:
+                  two->key = 0x1b | 0x80; // ESC
                   break;
             }
-            break;
+         }
+         break;
 
-         case SDL_KEYDOWN:
+      case SDL_KEYUP:
 #if defined(EWM_LUA)
-            if (two->lua_key_down_fn != LUA_NOREF) {
-               lua_rawgeti(two->lua->state, LUA_REGISTRYINDEX, two->lua_key_down_fn);
-               ewm_lua_push_two(two->lua, two);
-               lua_pushinteger(two->lua->state, event.key.keysym.mod);
-               lua_pushinteger(two->lua->state, event.key.keysym.sym);
-               if (lua_pcall(two->lua->state, 3, 1, 0) != 0) {
-                  printf("two: script error: %s\n", lua_tostring(two->lua->state, -1));
-                  return true;
-               }
+         if (two->lua_key_up_fn != LUA_NOREF) {
+            lua_rawgeti(two->lua->state, LUA_REGISTRYINDEX, two->lua_key_up_fn);
+            ewm_lua_push_two(two->lua, two);
+            lua_pushinteger(two->lua->state, event->key.keysym.mod);
+            lua_pushinteger(two->lua->state, event->key.keysym.sym);
+            if (lua_pcall(two->lua->state, 3, 1, 0) != 0) {
+               printf("two: script error: %s\n", lua_tostring(two->lua->state, -1));
+               return true;
+            }
 
-               if (lua_isboolean(two->lua->state, -1) == 0) {
-                  printf("two: script error: expected boolean result\n");
-                  return true;
-               }
+            if (lua_isboolean(two->lua->state, -1) == 0) {
+               printf("two: script error: expected boolean result\n");
+               return true;
+            }
 
-               if (lua_toboolean(two->lua->state, -1)) {
-                  return true;
-               }
+            if (lua_toboolean(two->lua->state, -1)) {
+               return true;
             }
+         }
 #endif
 
-            if (event.key.keysym.mod & KMOD_CTRL) {
-               if (event.key.keysym.sym >= SDLK_a && event.key.keysym.sym <= SDLK_z) {
-                  two->key = (event.key.keysym.sym - SDLK_a + 1) | 0x80;
-               }
-            } else if (event.key.keysym.mod & KMOD_GUI) {
+         if (event->key.keysym.mod & KMOD_ALT) {
+            switch (event->key.keysym.sym) {
+               case SDLK_1:
+                  two->buttons[0] = 0;
+                  break;
+               case SDLK_2:
+                  two->buttons[1] = 0;
+                  break;
+               case SDLK_3:
+                  two->buttons[2] = 0;
+                  break;
+               case SDLK_4:
+                  two->buttons[3] = 0;
+                  break;
+            }
+         }
+         break;
+
+      case SDL_TEXTINPUT:
+         if (strlen(event->text.text) == 1) {
+            two->key = toupper(event->text.text[0]) | 0x80;
+         }
+         break;
+   }
+
+   return true;
+}
+
+// Events are polled on the main thread. Things that concern the window
+// are handled right here, everything else is queued for the machine.
+
+static bool ewm_two_poll_event(struct ewm_two_t *two, SDL_Window *window) { // TODO Should window be part of ewm_two_t?
+   SDL_Event event;
+   while (SDL_PollEvent(&event) != 0) {
+      switch (event.type) {
+         case SDL_QUIT:
+            return false;
+
+         case SDL_WINDOWEVENT:
+            two->scr->dirty = true;
+            continue;
+
+         case SDL_KEYDOWN:
+            if (event.key.keysym.mod & KMOD_GUI) {
                switch (event.key.keysym.sym) {
-                  case SDLK_ESCAPE:
-                     fprintf(stderr, "[SDL] Reset\n");
-                     cpu_reset(two->cpu);
-                     break;
                   case SDLK_RETURN:
                      if (SDL_GetWindowFlags(window) & SDL_WINDOW_FULLSCREEN) {
                         SDL_SetWindowFullscreen(window, 0);
                      } else {
                         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
                      }
-                     break;
+                     continue;
                   case SDLK_i:
                      two->status_bar_visible = !two->status_bar_visible;
                      SDL_SetWindowSize(window, 40*7*3, 24*8*3 + (two->status_bar_visible ? (9*3) : 0));
                      SDL_RenderSetLogicalSize(two->scr->renderer, 40*7*3, 24*8*3 + (two->status_bar_visible ? (9*3) : 0));
-                     break;
-                  case SDLK_p:
-                     if (two->state == EWM_TWO_STATE_PAUSED) {
-                        two->state = EWM_TWO_STATE_RUNNING;
-                     } else {
-                        two->state = EWM_TWO_STATE_PAUSED;
-                     }
-                     break;
-               }
-            } else if (event.key.keysym.mod == KMOD_NONE) {
-               switch (event.key.keysym.sym) {
-                  case SDLK_RETURN:
-                     two->key = 0x0d | 0x80; // CR
-                     break;
-                  case SDLK_TAB:
-                     two->key = 0x09 | 0x80; // HT
-                  case SDLK_DELETE:
-                     two->key = 0x7f | 0x80; // DEL
-                     break;
-                  case SDLK_BACKSPACE:
-                  case SDLK_LEFT:
-                     two->key = 0x08 | 0x80; // BS
-                     break;
-                  case SDLK_RIGHT:
-                     two->key = 0x15 | 0x80; // NAK
-                     break;
-                  case SDLK_UP:
-                     two->key = 0x0b | 0x80; // VT
-                     break;
-                  case SDLK_DOWN:
-                     two->key = 0x0a | 0x80; // LF
-                     break;
-                  case SDLK_ESCAPE:
-                     two->key = 0x1b | 0x80; // ESC
-                     break;
+                     continue;
                }
             }
             break;
+      }
 
-         case SDL_KEYUP:
-#if defined(EWM_LUA)
-            if (two->lua_key_up_fn != LUA_NOREF) {
-               lua_rawgeti(two->lua->state, LUA_REGISTRYINDEX, two->lua_key_up_fn);
-               ewm_lua_push_two(two->lua, two);
-               lua_pushinteger(two->lua->state, event.key.keysym.mod);
-               lua_pushinteger(two->lua->state, event.key.keysym.sym);
-               if (lua_pcall(two->lua->state, 3, 1, 0) != 0) {
-                  printf("two: script error: %s\n", lua_tostring(two->lua->state, -1));
-                  return true;
-               }
-
-               if (lua_isboolean(two->lua->state, -1) == 0) {
-                  printf("two: script error: expected boolean result\n");
-                  return true;
-               }
-
-               if (lua_toboolean(two->lua->state, -1)) {
-                  return true;
-               }
-            }
-#endif
+      if (!ewm_spsc_push(two->events, &event)) {
+         fprintf(stderr, "[TWO] Event queue full, dropping event\n");
+      }
+   }
 
-            if (event.key.keysym.mod & KMOD_ALT) {
-               switch (event.key.keysym.sym) {
-                  case SDLK_1:
-                     two->buttons[0] = 0;
-                     break;
-                  case SDLK_2:
-                     two->buttons[1] = 0;
-                     break;
-                  case SDLK_3:
-                     two->buttons[2] = 0;
-                     break;
-                  case SDLK_4:
-                     two->buttons[3] = 0;
-                     break;
-               }
-            }
-            break;
+   // The joystick is read here too, so that the machine only ever
+   // looks at the axis values it was sent.
 
-         case SDL_TEXTINPUT:
-            if (strlen(event.text.text) == 1) {
-               two->key = toupper(event.text.text[0]) | 0x80;
-            }
-            break;
+   if (two->joystick != NULL) {
+      for (int axis = 0; axis < 2; axis++) {
+         SDL_Event motion = { .jaxis = { .type = SDL_JOYAXISMOTION, .axis = axis, .value = SDL_JoystickGetAxis(two->joystick, axis) } };
+         ewm_spsc_push(two->events, &motion);
       }
    }
 
    return true;
 }
 
+// Pending programs are loaded between slices, once the cpu is in the
+// KEYIN loop. The pc can then be changed without upsetting the engine.
+
+static bool ewm_two_apply_loads(struct ewm_two_t *two) {
+   uint16_t pc = two->cpu->state.pc;
+   if (pc < EWM_TWO_KEYIN || pc >= EWM_TWO_KEYIN + sizeof(ewm_two_keyin) || !ewm_two_keyin_mapped(two->cpu)) {
+      return true;
+   }
+
+   struct ewm_ldr_option_t *loads = two->loads;
+   two->loads = NULL;
+   return ewm_ldr_load(two->cpu, loads, two->loads_run) == 0;
+}
+
 static bool ewm_two_step_cpu(struct ewm_two_t *two, int cycles) {
-   while (true) {
-      int ret = cpu_step(two->cpu);
-      if (ret < 0) {
-         // These only happen in strict mode
-         switch (ret) {
-            case EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION:
-               fprintf(stderr, "CPU: Exited because of unimplemented instructions 0x%.2x at 0x%.4x\n",
-                       mem_get_byte(two->cpu, two->cpu->state.pc), two->cpu->state.pc);
-               break;
-            case EWM_CPU_ERR_STACK_OVERFLOW:
-               fprintf(stderr, "CPU: Exited because of stack overflow at 0x%.4x\n", two->cpu->state.pc);
-               break;
-            case EWM_CPU_ERR_STACK_UNDERFLOW:
-               fprintf(stderr, "CPU: Exited because of stack underflow at 0x%.4x\n", two->cpu->state.pc);
-               break;
-         }
-         return false;
+   if (two->loads != NULL && !ewm_two_apply_loads(two)) {
+      return false;
+   }
+
+   int ret = cpu_run(two->cpu, cycles);
+   if (ret < 0) {
+      // These only happen in strict mode
+      switch (ret) {
+         case EWM_CPU_ERR_UNIMPLEMENTED_INSTRUCTION:
+            fprintf(stderr, "CPU: Exited because of unimplemented instructions 0x%.2x at 0x%.4x\n",
+                    mem_get_byte(two->cpu, two->cpu->state.pc), two->cpu->state.pc);
+            break;
+         case EWM_CPU_ERR_STACK_OVERFLOW:
+            fprintf(stderr, "CPU: Exited because of stack overflow at 0x%.4x\n", two->cpu->state.pc);
+            break;
+         case EWM_CPU_ERR_STACK_UNDERFLOW:
+            fprintf(stderr, "CPU: Exited because of stack underflow at 0x%.4x\n", two->cpu->state.pc);
+            break;
       }
-      cycles -= ret;
-      if (cycles <= 0) {
-         break;
+      return false;
+   }
+   return true;
+}
+
+// What the main thread gets to see of the machine when the cpu runs on
+// its own thread. Only video memory is copied.
+
+struct ewm_two_snapshot_t {
+   struct scr_frame_t frame;
+   uint8_t ram[0x6000];
+   int state;
+   bool drive_on;
+   int drive;
+   uint64_t counter;
+};
+
+// The status bar is rendered from the glyph atlas of the screen into
+// its own line of pixels, which is then drawn with a single copy.
+
+static void ewm_two_update_status_bar(struct ewm_two_t *two, struct ewm_two_snapshot_t *snapshot, double mhz) {
+   if (two->status_texture == NULL) {
+      two->status_texture = SDL_CreateTexture(two->scr->renderer, ewm_sdl_pixel_format(two->scr->renderer),
+         SDL_TEXTUREACCESS_STREAMING, 40*7, 8);
+      if (two->status_texture == NULL) {
+         return;
       }
+      SDL_SetTextureBlendMode(two->status_texture, SDL_BLENDMODE_BLEND);
    }
-   return true;
-}
-
-static void ewm_two_update_status_bar(struct ewm_two_t *two, double mhz) {
 
    SDL_Rect rect = { .x = 0, .y = (24*8*3), .w = (40*7*3), .h = (9*3) };
    SDL_SetRenderDrawColor(two->scr->renderer, 39, 39, 39, 0);
    SDL_RenderFillRect(two->scr->renderer, &rect);
 
+   int red = ewm_chr_add_color(two->scr->chr, SDL_MapRGBA(two->scr->surface->format, 255, 0, 0, 255));
+   int green = ewm_chr_add_color(two->scr->chr, SDL_MapRGBA(two->scr->surface->format, 145, 193, 75, 255));
+   if (red == -1 || green == -1) {
+      return;
+   }
+
    char s[41];
    snprintf(s, 41, "%1.3f MHZ                         [1][2]", mhz);
    //               1234567890123456789012345678901234567890
 
    for (int i = 0; i < 40; i++) {
-      int c = s[i] + 0x80;
-      if (two->scr->chr->textures[c] != NULL) {
-         SDL_Rect dst;
-         dst.x = i * 21;
-         dst.y = 24 * 24 + 3;
-         dst.w = 21;
-         dst.h = 24;
-
-         if (two->dsk->on && ((i == 35 && two->dsk->drive == EWM_DSK_DRIVE1) || (i == 38 && two->dsk->drive == EWM_DSK_DRIVE2))) {
-            SDL_SetTextureColorMod(two->scr->chr->textures[c], 145, 193, 75);
-         } else {
-            SDL_SetTextureColorMod(two->scr->chr->textures[c], 255, 0, 0);
-         }
+      int color = red;
+      if (snapshot->drive_on && ((i == 35 && snapshot->drive == EWM_DSK_DRIVE1) || (i == 38 && snapshot->drive == EWM_DSK_DRIVE2))) {
+         color = green;
+      }
 
-         SDL_RenderCopy(two->scr->renderer, two->scr->chr->textures[c], NULL, &dst);
+      uint32_t *src = ewm_chr_glyph_with_color(two->scr->chr, color, (uint8_t) (s[i] + 0x80));
+      uint32_t *dst = two->status_pixels + (i * 7);
+      for (int y = 0; y < 8; y++) {
+         memcpy(dst, src, 7 * sizeof(uint32_t));
+         src += 7;
+         dst += 40 * 7;
       }
    }
+
+   SDL_UpdateTexture(two->status_texture, NULL, two->status_pixels, 40 * 7 * sizeof(uint32_t));
+
+   SDL_Rect dst = { .x = 0, .y = 24 * 24 + 3, .w = 40 * 21, .h = 24 };
+   SDL_RenderCopy(two->scr->renderer, two->status_texture, NULL, &dst);
 }
 
-#define EWM_TWO_OPT_HELP   (0)
-#define EWM_TWO_OPT_DRIVE1 (1)
-#define EWM_TWO_OPT_DRIVE2 (2)
-#define EWM_TWO_OPT_COLOR  (3)
-#define EWM_TWO_OPT_FPS    (4)
-#define EWM_TWO_OPT_MEMORY (5)
-#define EWM_TWO_OPT_TRACE  (6)
-#define EWM_TWO_OPT_STRICT (7)
-#define EWM_TWO_OPT_DEBUG  (8)
+#define EWM_TWO_OPT_HELP     (0)
+#define EWM_TWO_OPT_DRIVE1   (1)
+#define EWM_TWO_OPT_DRIVE2   (2)
+#define EWM_TWO_OPT_COLOR    (3)
+#define EWM_TWO_OPT_FPS      (4)
+#define EWM_TWO_OPT_MEMORY   (5)
+#define EWM_TWO_OPT_TRACE    (6)
+#define EWM_TWO_OPT_STRICT   (7)
+#define EWM_TWO_OPT_DEBUG    (8)
 #if defined(EWM_LUA)
-#define EWM_TWO_OPT_SCRIPT (9)
+#define EWM_TWO_OPT_SCRIPT   (9)
 #endif
+#define EWM_TWO_OPT_HEADLESS (10)
+#define EWM_TWO_OPT_SPEED    (11)
+#define EWM_TWO_OPT_SECONDS  (12)
+#define EWM_TWO_OPT_DUMP     (13)
+#define EWM_TWO_OPT_FAST_DISK (14)
+#define EWM_TWO_OPT_LOAD_SNAPSHOT (15)
+#define EWM_TWO_OPT_SAVE_SNAPSHOT (16)
+#define EWM_TWO_OPT_REWIND   (17)
+#define EWM_TWO_OPT_PROFILE  (18)
+#define EWM_TWO_OPT_VSYNC    (19)
+#define EWM_TWO_OPT_LOAD     (20)
+#define EWM_TWO_OPT_RUN      (21)
+#define EWM_TWO_OPT_CAPTURE  (22)
+#define EWM_TWO_OPT_CAPTURE_SKIP (23)
+#define EWM_TWO_OPT_CAPTURE_CHANGED (24)
 
 static struct option one_options[] = {
    { "help",    no_argument,       NULL, EWM_TWO_OPT_HELP   },
@@ -716,6 +1177,21 @@ static struct option one_options[] = {
 #if defined(EWM_LUA)
    { "script",  required_argument, NULL, EWM_TWO_OPT_SCRIPT },
 #endif
+   { "headless", no_argument,      NULL, EWM_TWO_OPT_HEADLESS },
+   { "speed",   required_argument, NULL, EWM_TWO_OPT_SPEED   },
+   { "seconds", required_argument, NULL, EWM_TWO_OPT_SECONDS },
+   { "dump",    required_argument, NULL, EWM_TWO_OPT_DUMP    },
+   { "fast-disk", no_argument,     NULL, EWM_TWO_OPT_FAST_DISK },
+   { "load-snapshot", required_argument, NULL, EWM_TWO_OPT_LOAD_SNAPSHOT },
+   { "save-snapshot", required_argument, NULL, EWM_TWO_OPT_SAVE_SNAPSHOT },
+   { "rewind",  no_argument,       NULL, EWM_TWO_OPT_REWIND  },
+   { "profile", no_argument,       NULL, EWM_TWO_OPT_PROFILE },
+   { "vsync",   no_argument,       NULL, EWM_TWO_OPT_VSYNC   },
+   { "load",    required_argument, NULL, EWM_TWO_OPT_LOAD    },
+   { "run",     no_argument,       NULL, EWM_TWO_OPT_RUN     },
+   { "capture", required_argument, NULL, EWM_TWO_OPT_CAPTURE },
+   { "capture-skip", required_argument, NULL, EWM_TWO_OPT_CAPTURE_SKIP },
+   { "capture-changed", no_argument, NULL, EWM_TWO_OPT_CAPTURE_CHANGED },
    { NULL,      0,                 NULL, 0 }
 };
 
@@ -726,12 +1202,442 @@ static void usage() {
    fprintf(stderr, "  --color           enable color\n");
    fprintf(stderr, "  --fps <fps>       set fps for display (default: 30)\n");
    fprintf(stderr, "  --memory <region> add memory region (ram|rom:address:path)\n");
-   fprintf(stderr, "  --trace <file>    trace cpu to file\n");
+   fprintf(stderr, "  --trace=<file>    trace cpu to file (default: ewm.trace), see ewm trace-dump\n");
    fprintf(stderr, "  --strict          run emulator in strict mode\n");
    fprintf(stderr, "  --debug           print debug info\n");
 #if defined(EWM_LUA)
    fprintf(stderr, "  --script <script> load Lua script into the emulator\n");
 #endif
+   fprintf(stderr, "  --headless        run without a window\n");
+   fprintf(stderr, "  --speed <speed>   run at max or Nx speed (default: 1x)\n");
+   fprintf(stderr, "  --seconds <n>     stop after n seconds of emulated time\n");
+   fprintf(stderr, "  --dump <what>     print text or memory:start:end at exit\n");
+   fprintf(stderr, "  --fast-disk       read DOS 3.3 sectors without going through the nibbles\n");
+   fprintf(stderr, "  --load-snapshot <path> continue from a snapshot\n");
+   fprintf(stderr, "  --save-snapshot <path> save a snapshot at exit\n");
+   fprintf(stderr, "  --rewind          keep a history that cmd-r steps back through\n");
+   fprintf(stderr, "  --profile         print where the cpu spent its cycles at exit\n");
+   fprintf(stderr, "  --vsync           present frames in sync with the display\n");
+   fprintf(stderr, "  --load <program>  load bin:address:path or bas:path at the first prompt\n");
+   fprintf(stderr, "  --run             run the last program that was loaded\n");
+   fprintf(stderr, "  --capture <spec>  write frames to raw:<path>, pipe:<command> or png:<pattern>\n");
+   fprintf(stderr, "  --capture-skip <n> skip n frames after every captured frame\n");
+   fprintf(stderr, "  --capture-changed only capture frames that differ from the previous one\n");
+}
+
+// Dumping results. This is mostly useful in combination with headless
+// mode, to run a program and then look at what it left behind.
+
+static void ewm_two_dump_text(struct ewm_two_t *two, FILE *fp) {
+   uint16_t base = (two->screen_page == EWM_A2P_SCREEN_PAGE1) ? 0x0400 : 0x0800;
+   for (int row = 0; row < 24; row++) {
+      uint16_t line = base + (row & 0x07) * 0x80 + (row >> 3) * 0x28;
+      for (int column = 0; column < 40; column++) {
+         uint8_t c = two->cpu->ram[line + column] & 0x3f;
+         fputc(c < 0x20 ? c + 0x40 : c, fp);
+      }
+      fputc('\n', fp);
+   }
+}
+
+static void ewm_two_dump_memory(struct ewm_two_t *two, FILE *fp, uint16_t start, uint16_t end) {
+   for (uint32_t addr = start & 0xfff0; addr <= end; addr += 16) {
+      fprintf(fp, "%.4X:", addr);
+      for (uint32_t i = addr; i < addr + 16 && i <= end; i++) {
+         if (i < start) {
+            fprintf(fp, "   ");
+         } else {
+            fprintf(fp, " %.2X", mem_get_byte(two->cpu, i));
+         }
+      }
+      fputc('\n', fp);
+   }
+}
+
+#define EWM_TWO_DUMP_NONE   (0)
+#define EWM_TWO_DUMP_TEXT   (1)
+#define EWM_TWO_DUMP_MEMORY (2)
+
+struct ewm_two_dump_t {
+   int type;
+   unsigned int start, end;
+};
+
+static int ewm_two_parse_dump(struct ewm_two_dump_t *dump, char *what) {
+   if (strcmp(what, "text") == 0) {
+      dump->type = EWM_TWO_DUMP_TEXT;
+      return 0;
+   }
+
+   if (sscanf(what, "memory:%x:%x", &dump->start, &dump->end) == 2 && dump->start <= dump->end && dump->end <= 0xffff) {
+      dump->type = EWM_TWO_DUMP_MEMORY;
+      return 0;
+   }
+
+   return -1;
+}
+
+static void ewm_two_dump(struct ewm_two_t *two, struct ewm_two_dump_t *dump, FILE *fp) {
+   switch (dump->type) {
+      case EWM_TWO_DUMP_TEXT:
+         ewm_two_dump_text(two, fp);
+         break;
+      case EWM_TWO_DUMP_MEMORY:
+         ewm_two_dump_memory(two, fp, dump->start, dump->end);
+         break;
+   }
+}
+
+// Run a job of the batch runner. This is the same as a headless run at
+// max speed, except that it does not exit on errors and that nothing is
+// shared with other machines, so that many jobs can run at once.
+
+int ewm_two_run_job(struct ewm_batch_job_t *job, FILE *out) {
+   struct ewm_two_dump_t dump = { .type = EWM_TWO_DUMP_NONE };
+   if (job->dump != NULL && ewm_two_parse_dump(&dump, job->dump) != 0) {
+      fprintf(stderr, "[TWO] Unknown dump %s\n", job->dump);
+      return -1;
+   }
+
+   struct ewm_two_t *two = ewm_two_create(EWM_TWO_TYPE_APPLE2PLUS, NULL, NULL);
+   if (two == NULL) {
+      return -1;
+   }
+
+   int result = 0;
+#if defined(EWM_LUA)
+   struct ewm_lua_t *lua = NULL;
+#endif
+
+   if (job->drive1 != NULL && ewm_two_load_disk(two, EWM_DSK_DRIVE1, job->drive1) != 0) {
+      fprintf(stderr, "[TWO] Cannot load Drive 1 with %s\n", job->drive1);
+      result = -1;
+   }
+   if (result == 0 && job->drive2 != NULL && ewm_two_load_disk(two, EWM_DSK_DRIVE2, job->drive2) != 0) {
+      fprintf(stderr, "[TWO] Cannot load Drive 2 with %s\n", job->drive2);
+      result = -1;
+   }
+   if (result == 0 && job->memory != NULL) {
+      result = cpu_add_memory_from_options(two->cpu, job->memory);
+   }
+
+   cpu_strict(two->cpu, job->strict);
+   ewm_dsk_set_fast(two->dsk, job->fast_disk);
+
+#if defined(EWM_LUA)
+   if (result == 0 && job->script != NULL) {
+      lua = ewm_lua_create();
+      if (lua == NULL) {
+         result = -1;
+      } else {
+         ewm_two_init_lua(two, lua);
+         ewm_cpu_init_lua(two->cpu, lua);
+         ewm_dsk_init_lua(two->dsk, lua);
+         result = ewm_lua_load_script(lua, job->script);
+      }
+   }
+#endif
+
+   if (result == 0) {
+      ewm_two_load_programs(two, job->loads, job->run);
+      cpu_reset(two->cpu);
+      if (job->snapshot != NULL && ewm_two_load_snapshot(two, job->snapshot) != 0) {
+         fprintf(stderr, "[TWO] Cannot load snapshot from %s\n", job->snapshot);
+         result = -1;
+      }
+   }
+
+   if (result == 0) {
+      uint64_t limit = two->cpu->counter + job->seconds * EWM_TWO_SPEED;
+      while (two->cpu->counter < limit) {
+         if (!ewm_two_step_cpu(two, EWM_TWO_SPEED / EWM_TWO_FPS_DEFAULT)) {
+            result = -1;
+            break;
+         }
+      }
+      ewm_dsk_flush(two->dsk);
+      ewm_two_dump(two, &dump, out);
+   }
+
+#if defined(EWM_LUA)
+   if (lua != NULL) {
+      ewm_lua_destroy(lua);
+   }
+#endif
+   ewm_two_destroy(two);
+
+   return result;
+}
+
+// When running with a window, the cpu runs on its own thread. After
+// every frame it publishes a snapshot of video memory and whatever
+// else the main thread needs to draw the screen. The rows that changed
+// are accumulated separately, after publishing, and taken before
+// picking up a snapshot, so that rows are never lost when the main
+// thread skips snapshots.
+
+#define EWM_TWO_EVENT_QUEUE_SIZE (256)
+
+static void ewm_two_publish_snapshot(struct ewm_two_t *two) {
+   struct ewm_two_snapshot_t *snapshot = ewm_triple_back(two->snapshots);
+
+   struct scr_frame_t frame;
+   ewm_scr_take_frame(two->scr, &frame);
+
+   memcpy(&snapshot->ram[0x0400], &frame.ram[0x0400], 0x0800);
+   memcpy(&snapshot->ram[0x2000], &frame.ram[0x2000], 0x4000);
+   snapshot->frame = frame;
+   snapshot->state = two->state;
+   snapshot->drive_on = two->dsk->on;
+   snapshot->drive = two->dsk->drive;
+   snapshot->counter = two->cpu->counter;
+
+   ewm_triple_publish(two->snapshots);
+
+   for (int page = 0; page < 2; page++) {
+      atomic_fetch_or(&two->snapshot_txt_rows[page], frame.txt_rows[page]);
+      atomic_fetch_or(&two->snapshot_hgr_rows[page], frame.hgr_rows[page]);
+   }
+   if (frame.full) {
+      atomic_store(&two->snapshot_full, true);
+   }
+}
+
+static struct ewm_two_snapshot_t *ewm_two_acquire_snapshot(struct ewm_two_t *two, struct scr_frame_t *frame) {
+   bool full = atomic_exchange(&two->snapshot_full, false);
+   uint32_t txt_rows[2], hgr_rows[2];
+   for (int page = 0; page < 2; page++) {
+      txt_rows[page] = atomic_exchange(&two->snapshot_txt_rows[page], 0);
+      hgr_rows[page] = atomic_exchange(&two->snapshot_hgr_rows[page], 0);
+   }
+
+   bool fresh;
+   struct ewm_two_snapshot_t *snapshot = ewm_triple_acquire(two->snapshots, &fresh);
+
+   *frame = snapshot->frame;
+   frame->ram = snapshot->ram;
+   frame->full = full;
+   for (int page = 0; page < 2; page++) {
+      frame->txt_rows[page] = txt_rows[page];
+      frame->hgr_rows[page] = hgr_rows[page];
+   }
+
+   return snapshot;
+}
+
+// Run the cpu for one frame of the given number of cycles. At max speed
+// we keep running slices until the frame time is used up, or until we
+// hit the cycle limit.
+
+static bool ewm_two_run_frame(struct ewm_two_t *two, int speed, uint32_t fps, uint64_t limit, uint64_t cycles) {
+   if (speed == EWM_TWO_SPEED_MAX) {
+      uint64_t end = SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() / fps;
+      do {
+         if (!ewm_two_step_cpu(two, EWM_TWO_SPEED / fps)) {
+            return false;
+         }
+      } while (SDL_GetPerformanceCounter() < end && (limit == 0 || two->cpu->counter < limit));
+      return true;
+   }
+   return ewm_two_step_cpu(two, cycles);
+}
+
+struct ewm_two_run_t {
+   struct ewm_two_t *two;
+   int speed;
+   uint32_t fps;
+   uint64_t limit; // Stop when the cpu counter reaches this, if not zero
+   bool vsync;
+   struct ewm_pacer_t pacer; // Owned by whoever runs the cpu
+};
+
+// At max speed we do not wait for the next frame, running the frame
+// simply takes all the time it has.
+
+static bool ewm_two_frame_due(struct ewm_two_run_t *run) {
+   if (run->speed == EWM_TWO_SPEED_MAX && run->two->state == EWM_TWO_STATE_RUNNING) {
+      return true;
+   }
+   return ewm_pacer_due(&run->pacer);
+}
+
+// With sound the audio clock paces the cpu, so that the speaker never
+// runs dry or falls behind. The pacer still kicks in if the audio
+// clock stalls for a whole frame.
+
+static bool ewm_two_audio_frame_due(struct ewm_two_run_t *run) {
+   if (run->two->spk == NULL || run->two->state != EWM_TWO_STATE_RUNNING) {
+      return ewm_two_frame_due(run);
+   }
+   return ewm_spk_wants_cycles(run->two->spk, run->two->cpu->counter)
+      || SDL_GetPerformanceCounter() >= run->pacer.deadline + run->pacer.period;
+}
+
+static bool ewm_two_limit_reached(struct ewm_two_run_t *run) {
+   return run->limit != 0 && run->two->cpu->counter >= run->limit;
+}
+
+// Without a window everything runs on the main thread and nothing is
+// rendered, unless frames are captured. Frames are always the same
+// number of cycles here, so that runs with a cycle limit end up in the
+// same state every time. When capturing at max speed a frame is one
+// frame of emulated time instead of wall time, so that the same run
+// captures the same frames.
+
+static void ewm_two_run_headless(struct ewm_two_run_t *run) {
+   struct ewm_two_t *two = run->two;
+   uint32_t phase = 1;
+
+   while (!ewm_two_limit_reached(run)) {
+      if (ewm_two_frame_due(run)) {
+         ewm_pacer_frame(&run->pacer, two->cpu->counter);
+         bool ok;
+         if (two->cap != NULL && run->speed == EWM_TWO_SPEED_MAX) {
+            ok = ewm_two_step_cpu(two, EWM_TWO_SPEED / run->fps);
+         } else {
+            ok = ewm_two_run_frame(two, run->speed, run->fps, run->limit, run->speed * (EWM_TWO_SPEED / run->fps));
+         }
+         if (!ok) {
+            break;
+         }
+         if (two->rewind != NULL) {
+            ewm_two_record_frame(two);
+         }
+         if (two->cap != NULL) {
+            ewm_scr_update(two->scr, phase, run->fps);
+            ewm_cap_frame(two->cap, two->scr->pixels);
+            phase += 1;
+            if (phase == run->fps) {
+               phase = 0;
+            }
+         }
+      } else {
+         ewm_pacer_wait(&run->pacer, 1000 / run->fps);
+      }
+   }
+}
+
+static int ewm_two_cpu_thread(void *data) {
+   struct ewm_two_run_t *run = (struct ewm_two_run_t*) data;
+   struct ewm_two_t *two = run->two;
+
+   while (!atomic_load(&two->quit)) {
+      SDL_Event event;
+      while (ewm_spsc_pop(two->events, &event)) {
+         ewm_two_handle_event(two, &event);
+      }
+
+      if (ewm_two_audio_frame_due(run)) {
+         // When the audio clock paces the cpu, frames are of fixed size
+         uint64_t cycles = ewm_pacer_frame(&run->pacer, two->cpu->counter);
+         if (two->spk != NULL) {
+            cycles = EWM_TWO_SPEED / run->fps;
+         }
+         if (two->state == EWM_TWO_STATE_RUNNING) {
+            if (!ewm_two_run_frame(two, run->speed, run->fps, run->limit, cycles)) {
+               break;
+            }
+            if (two->spk != NULL) {
+               ewm_spk_sync(two->spk, two->cpu->counter);
+            }
+            if (two->rewind != NULL) {
+               ewm_two_record_frame(two);
+            }
+         }
+         ewm_two_publish_snapshot(two);
+         if (ewm_two_limit_reached(run)) {
+            break;
+         }
+      } else if (two->spk != NULL && two->state == EWM_TWO_STATE_RUNNING) {
+         SDL_Delay(1); // The audio clock may want cycles before the deadline
+      } else {
+         ewm_pacer_wait(&run->pacer, 1000 / run->fps);
+      }
+   }
+
+   atomic_store(&two->quit, true);
+   return 0;
+}
+
+static void ewm_two_render_status(struct ewm_two_t *two, char *msg);
+
+// With a window the cpu runs on its own thread, while the main thread
+// polls for events and renders the snapshots that the cpu publishes.
+
+static int ewm_two_run_windowed(struct ewm_two_run_t *run, SDL_Window *window) {
+   struct ewm_two_t *two = run->two;
+
+   two->events = ewm_spsc_create(EWM_TWO_EVENT_QUEUE_SIZE, sizeof(SDL_Event));
+   two->snapshots = ewm_triple_create(sizeof(struct ewm_two_snapshot_t));
+   if (two->events == NULL || two->snapshots == NULL) {
+      fprintf(stderr, "[TWO] Could not create event queue or snapshots\n");
+      return -1;
+   }
+
+   SDL_Thread *thread = SDL_CreateThread(ewm_two_cpu_thread, "cpu", run);
+   if (thread == NULL) {
+      fprintf(stderr, "[TWO] Could not create cpu thread: %s\n", SDL_GetError());
+      return -1;
+   }
+
+   // The screen has its own pacer, unless presenting waits for the
+   // display anyway.
+
+   struct ewm_pacer_t pacer;
+   ewm_pacer_init(&pacer, run->fps, 0);
+   uint32_t phase = 1;
+
+   while (!atomic_load(&two->quit)) {
+      if (!ewm_two_poll_event(two, window)) {
+         break;
+      }
+
+      if (!run->vsync) {
+         if (!ewm_pacer_due(&pacer)) {
+            ewm_pacer_wait(&pacer, 1000 / run->fps);
+            continue;
+         }
+         ewm_pacer_frame(&pacer, 0);
+      }
+
+      // Update the screen. The screen only redraws the parts of video
+      // memory that have changed, and if nothing changed and there is
+      // nothing else to draw, we skip the frame.
+
+      struct scr_frame_t frame;
+      struct ewm_two_snapshot_t *snapshot = ewm_two_acquire_snapshot(two, &frame);
+      bool paused = (snapshot->state == EWM_TWO_STATE_PAUSED);
+
+      ewm_pacer_measure(&pacer, snapshot->counter);
+
+      if (ewm_scr_render(two->scr, &frame, phase, run->fps) || two->status_bar_visible || paused || run->vsync) {
+         if (two->status_bar_visible) {
+            ewm_two_update_status_bar(two, snapshot, pacer.mhz);
+         }
+
+         SDL_RenderCopy(two->scr->renderer, two->scr->texture, NULL, NULL);
+
+         if (paused) {
+            ewm_two_render_status(two, "PAUSED");
+         }
+
+         SDL_RenderPresent(two->scr->renderer);
+      }
+
+      if (two->cap != NULL) {
+         ewm_cap_frame(two->cap, two->scr->pixels);
+      }
+
+      phase += 1;
+      if (phase == run->fps) {
+         phase = 0;
+      }
+   }
+
+   atomic_store(&two->quit, true);
+   SDL_WaitThread(thread, NULL);
+
+   return 0;
 }
 
 static void ewm_two_render_status(struct ewm_two_t *two, char *msg) {
@@ -748,12 +1654,8 @@ static void ewm_two_render_status(struct ewm_two_t *two, char *msg) {
 
    ewm_tty_refresh(two->tty, 0, 0);
 
-   SDL_Texture *texture = SDL_CreateTextureFromSurface(two->tty->renderer, two->tty->surface);
-   if (texture != NULL) {
-      SDL_SetRenderDrawBlendMode(two->scr->renderer, SDL_BLENDMODE_BLEND);
-      SDL_RenderCopy(two->tty->renderer, texture, NULL, NULL);
-      SDL_DestroyTexture(texture);
-   }
+   SDL_SetRenderDrawBlendMode(two->scr->renderer, SDL_BLENDMODE_BLEND);
+   SDL_RenderCopy(two->tty->renderer, two->tty->texture, NULL, NULL);
 }
 
 int ewm_two_main(int argc, char **argv) {
@@ -770,6 +1672,21 @@ int ewm_two_main(int argc, char **argv) {
 #if defined(EWM_LUA)
    char *script_path = NULL;
 #endif
+   bool headless = false;
+   int speed = 1;
+   uint64_t seconds = 0;
+   bool fast_disk = false;
+   char *load_snapshot_path = NULL;
+   char *save_snapshot_path = NULL;
+   bool rewind = false;
+   bool profile = false;
+   bool vsync = false;
+   struct ewm_ldr_option_t *loads = NULL;
+   bool run_loaded = false;
+   char *capture = NULL;
+   int capture_skip = 0;
+   bool capture_changed = false;
+   struct ewm_two_dump_t dump = { .type = EWM_TWO_DUMP_NONE };
 
    int ch;
    while ((ch = getopt_long_only(argc, argv, "", one_options, NULL)) != -1) {
@@ -800,7 +1717,7 @@ int ewm_two_main(int argc, char **argv) {
             break;
          }
          case EWM_TWO_OPT_TRACE:
-            trace_path = optarg ? optarg : "/dev/stderr";
+            trace_path = optarg ? optarg : EWM_TRACE_DEFAULT_PATH;
             break;
          case EWM_TWO_OPT_STRICT:
             strict = true;
@@ -813,6 +1730,69 @@ int ewm_two_main(int argc, char **argv) {
             script_path = optarg;
             break;
 #endif
+         case EWM_TWO_OPT_HEADLESS:
+            headless = true;
+            break;
+         case EWM_TWO_OPT_SPEED:
+            if (strcmp(optarg, "max") == 0) {
+               speed = EWM_TWO_SPEED_MAX;
+            } else {
+               speed = atoi(optarg);
+               if (speed <= 0) {
+                  usage();
+                  exit(1);
+               }
+            }
+            break;
+         case EWM_TWO_OPT_SECONDS:
+            seconds = strtoull(optarg, NULL, 10);
+            break;
+         case EWM_TWO_OPT_DUMP:
+            if (ewm_two_parse_dump(&dump, optarg) != 0) {
+               usage();
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_FAST_DISK:
+            fast_disk = true;
+            break;
+         case EWM_TWO_OPT_LOAD_SNAPSHOT:
+            load_snapshot_path = optarg;
+            break;
+         case EWM_TWO_OPT_SAVE_SNAPSHOT:
+            save_snapshot_path = optarg;
+            break;
+         case EWM_TWO_OPT_REWIND:
+            rewind = true;
+            break;
+         case EWM_TWO_OPT_PROFILE:
+            profile = true;
+            break;
+         case EWM_TWO_OPT_VSYNC:
+            vsync = true;
+            break;
+         case EWM_TWO_OPT_LOAD:
+            if (ewm_ldr_add_option(&loads, optarg) != 0) {
+               usage();
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_RUN:
+            run_loaded = true;
+            break;
+         case EWM_TWO_OPT_CAPTURE:
+            capture = optarg;
+            break;
+         case EWM_TWO_OPT_CAPTURE_SKIP:
+            capture_skip = atoi(optarg);
+            if (capture_skip < 0) {
+               usage();
+               exit(1);
+            }
+            break;
+         case EWM_TWO_OPT_CAPTURE_CHANGED:
+            capture_changed = true;
+            break;
          default: {
             usage();
             exit(1);
@@ -822,28 +1802,47 @@ int ewm_two_main(int argc, char **argv) {
 
    // Initialize SDL
 
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER) < 0) {
+   Uint32 subsystems = headless ? SDL_INIT_TIMER : (SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER);
+   if (!headless && speed == 1) {
+      subsystems |= SDL_INIT_AUDIO;
+   }
+   if (SDL_Init(subsystems) < 0) {
       fprintf(stderr, "Failed to initialize SDL: %s\n", SDL_GetError());
       exit(1);
    }
 
-   SDL_Window *window = SDL_CreateWindow("EWM v0.1 / Apple ][+", 400, 60, 280*3, 192*3, SDL_WINDOW_SHOWN);
-   if (window == NULL) {
-      fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
-      exit(1);
-   }
+   // In headless mode there is no window or renderer. The screen and
+   // character generator then only render into memory, on demand.
 
-   SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-   if (renderer == NULL) {
-      fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
-      exit(1);
-   }
+   SDL_Window *window = NULL;
+   SDL_Renderer *renderer = NULL;
+
+   if (!headless) {
+      window = SDL_CreateWindow("EWM v0.1 / Apple ][+", 400, 60, 280*3, 192*3, SDL_WINDOW_SHOWN);
+      if (window == NULL) {
+         fprintf(stderr, "Failed create window: %s\n", SDL_GetError());
+         exit(1);
+      }
+
+      renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
+      if (renderer == NULL) {
+         fprintf(stderr, "Failed to create renderer: %s\n", SDL_GetError());
+         exit(1);
+      }
 
-   SDL_RenderSetLogicalSize(renderer, 280, 192);
+      SDL_RenderSetLogicalSize(renderer, 280, 192);
+
+      // Without vsync presenting does not wait, so we pace ourselves
+      SDL_RendererInfo info;
+      if (vsync && (SDL_GetRendererInfo(renderer, &info) != 0 || !(info.flags & SDL_RENDERER_PRESENTVSYNC))) {
+         fprintf(stderr, "[TWO] Renderer does not support vsync\n");
+         vsync = false;
+      }
+   }
 
    // Print what renderer we got
 
-   if (debug) {
+   if (debug && renderer != NULL) {
       SDL_RendererInfo info;
       if (SDL_GetRendererInfo(renderer, &info) != 0) {
          fprintf(stderr, "Failed to get renderer info: %s\n", SDL_GetError());
@@ -880,7 +1879,7 @@ int ewm_two_main(int argc, char **argv) {
    SDL_GameController *controller = NULL;
    SDL_Joystick *joystick = NULL;
 
-   if (SDL_NumJoysticks() != 0) {
+   if (!headless && SDL_NumJoysticks() != 0) {
       controller = SDL_GameControllerOpen(0);
       SDL_GameControllerEventState(SDL_ENABLE);
       joystick = SDL_GameControllerGetJoystick(controller);
@@ -918,7 +1917,20 @@ int ewm_two_main(int argc, char **argv) {
    }
 
    cpu_strict(two->cpu, strict);
-   cpu_trace(two->cpu, trace_path);
+   if (trace_path != NULL) {
+      two->trace = ewm_trace_create(trace_path, two->cpu->model);
+      if (two->trace == NULL) {
+         fprintf(stderr, "[TWO] Cannot trace to %s\n", trace_path);
+         exit(1);
+      }
+      cpu_trace(two->cpu, two->trace);
+   }
+
+   if (profile && cpu_profile(two->cpu, true) != 0) {
+      fprintf(stderr, "[TWO] Cannot start the profiler\n");
+      exit(1);
+   }
+   ewm_dsk_set_fast(two->dsk, fast_disk);
 
 #if defined(EWM_LUA)
    // Setup a Lua environment if scripts were specified
@@ -940,81 +1952,93 @@ int ewm_two_main(int argc, char **argv) {
    }
 #endif
 
+   ewm_two_load_programs(two, loads, run_loaded);
+
    // Reset things to a known state
 
    cpu_reset(two->cpu);
 
-   //
-
-   SDL_StartTextInput();
-
-   uint32_t ticks = SDL_GetTicks();
-   uint32_t phase = 1;
-
-   uint64_t counter = two->cpu->counter;
-   double mhz = 1.0;
+   // Continue from a snapshot. It must have been taken with the same
+   // disks and memory configuration.
 
-   while (true) {
-      if (!ewm_two_poll_event(two, window)) {
-         break;
+   if (load_snapshot_path != NULL) {
+      if (ewm_two_load_snapshot(two, load_snapshot_path) != 0) {
+         fprintf(stderr, "[TWO] Cannot load snapshot from %s\n", load_snapshot_path);
+         exit(1);
       }
+   }
 
-      if ((SDL_GetTicks() - ticks) >= (1000 / fps)) {
+   if (rewind) {
+      if (ewm_two_enable_rewind(two, EWM_TWO_REWIND_ARENA_SIZE) != 0) {
+         fprintf(stderr, "[TWO] Cannot create rewind buffer\n");
+         exit(1);
+      }
+   }
 
-         if (two->state == EWM_TWO_STATE_RUNNING) {
-            if (!ewm_two_step_cpu(two, EWM_TWO_SPEED / fps)) {
-               break;
-            }
-         }
+   // The speaker only plays at normal speed. Without an audio device
+   // we simply run silent.
 
-         // Update the screen when it is flagged dirty or if we enter
-         // the second half of the frames we draw each second. The
-         // latter because that is when we update flashing text.
+   if (!headless && speed == 1) {
+      two->spk = ewm_spk_create(EWM_TWO_SPEED, 2 * (EWM_TWO_SPEED / fps));
+      if (two->spk != NULL) {
+         ewm_spk_reset(two->spk, two->cpu->counter);
+      }
+   }
 
-         two->screen_dirty = 1;
-         if (two->screen_dirty) {
-            SDL_SetRenderDrawColor(two->scr->renderer, 0, 0, 0, 255);
-            SDL_RenderClear(two->scr->renderer);
+   if (capture != NULL) {
+      // Only the window has to keep up with real time
+      two->cap = ewm_cap_create(capture, capture_skip, capture_changed, headless, two->scr->surface->format);
+      if (two->cap == NULL) {
+         fprintf(stderr, "[TWO] Cannot capture to %s\n", capture);
+         exit(1);
+      }
+   }
 
-            ewm_scr_update(two->scr, phase, fps);
-            two->screen_dirty = false;
+   //
 
-            if (two->status_bar_visible) {
-               ewm_two_update_status_bar(two, mhz);
-            }
+   struct ewm_two_run_t run = {
+      .two = two,
+      .speed = speed,
+      .fps = fps,
+      .limit = (seconds != 0) ? two->cpu->counter + seconds * EWM_TWO_SPEED : 0,
+      .vsync = vsync
+   };
+   ewm_pacer_init(&run.pacer, fps, speed * EWM_TWO_SPEED);
 
-            SDL_Texture *texture = SDL_CreateTextureFromSurface(two->scr->renderer, two->scr->surface);
-            if (texture != NULL) {
-               SDL_RenderCopy(two->scr->renderer, texture, NULL, NULL);
-               SDL_DestroyTexture(texture);
-            }
+   if (headless) {
+      ewm_two_run_headless(&run);
+   } else {
+      SDL_StartTextInput();
+      if (ewm_two_run_windowed(&run, window) != 0) {
+         exit(1);
+      }
+   }
 
-            if (two->state == EWM_TWO_STATE_PAUSED) {
-               ewm_two_render_status(two, "PAUSED");
-            }
+   //
 
-            SDL_RenderPresent(two->scr->renderer);
-         }
+   if (two->cap != NULL) {
+      ewm_cap_destroy(two->cap);
+      two->cap = NULL;
+   }
 
-         ticks = SDL_GetTicks();
-         phase += 1;
-         if (phase == fps) {
-            phase = 0;
+   ewm_dsk_flush(two->dsk);
+   ewm_two_dump(two, &dump, stdout);
+   cpu_profile_report(two->cpu, stderr, EWM_CPU_PROFILE_TOP);
 
-            // Calculate the number of cycles we have done in the past
-            // second. TODO This will always equal 1023000 - It needs
-            // to be actual clock time based instead. Good for now,
-            // but not ideal.
-            mhz = (two->cpu->counter - counter) / 1000000.0;
-            counter = two->cpu->counter;
-         }
+   if (save_snapshot_path != NULL) {
+      if (ewm_two_save_snapshot(two, save_snapshot_path) != 0) {
+         fprintf(stderr, "[TWO] Cannot save snapshot to %s\n", save_snapshot_path);
       }
    }
 
-   //
+   ewm_ldr_free_options(loads);
 
-   SDL_DestroyRenderer(renderer);
-   SDL_DestroyWindow(window);
+   if (renderer != NULL) {
+      SDL_DestroyRenderer(renderer);
+   }
+   if (window != NULL) {
+      SDL_DestroyWindow(window);
+   }
    SDL_Quit();
 
    return 0;
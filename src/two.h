@@ -23,8 +23,11 @@
 #ifndef EWM_TWO_H
 #define EWM_TWO_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <SDL2/SDL.h>
 
@@ -52,15 +55,39 @@
 
 #define EWM_TWO_FPS_DEFAULT (40)
 #define EWM_TWO_SPEED (1023000)
+#define EWM_TWO_SPEED_MAX (0)
 
 #define EWM_TWO_STATE_RUNNING (0)
 #define EWM_TWO_STATE_PAUSED (1)
 
+#define EWM_TWO_REWIND_ARENA_SIZE (16 * 1024 * 1024)
+#define EWM_TWO_REWIND_FRAMES (EWM_TWO_FPS_DEFAULT) // About a second
+
+struct cpu_t;
 struct mem_t;
 struct ewm_dsk_t;
 struct scr;
 struct ewm_lua_t;
 struct ewm_tty_t;
+struct ewm_spsc_t;
+struct ewm_triple_t;
+struct ewm_rewind_t;
+struct ewm_trace_t;
+struct ewm_spk_t;
+struct ewm_cap_t;
+struct ewm_batch_job_t;
+struct ewm_ldr_option_t;
+
+// Entry of the $C0xx dispatch table. Handlers get the region of the
+// card for slot I/O and the region of the machine for everything else,
+// including the fallbacks for a card that only handles reads or writes.
+
+struct ewm_two_io_t {
+   uint8_t (*read)(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr);
+   void (*write)(struct cpu_t *cpu, struct mem_t *mem, uint16_t addr, uint8_t b);
+   struct mem_t *read_mem;
+   struct mem_t *write_mem;
+};
 
 struct ewm_two_t {
    int type;
@@ -73,6 +100,10 @@ struct ewm_two_t {
    struct mem_t *ram;
    struct mem_t *roms[6];
    struct mem_t *iom;
+   struct mem_t *vid[2];
+
+   struct ewm_two_io_t io[256];
+   uint8_t io_logged[256]; // Unexpected reads (bit 0) and writes (bit 1) that were logged
 
    int screen_mode;
    int screen_graphics_mode;
@@ -80,21 +111,25 @@ struct ewm_two_t {
    int screen_page;
    int screen_dirty;
 
+   // One bit per character row for each text and hires page, set when
+   // video memory is written and cleared when the row is redrawn.
+   uint32_t screen_txt_dirty[2];
+   uint32_t screen_hgr_dirty[2];
+
    uint8_t key;
    uint8_t buttons[EWM_A2P_BUTTON_COUNT];
 
-   uint64_t padl0_time;
    uint8_t padl0_value;
-   uint64_t padl1_time;
    uint8_t padl1_value;
-   uint64_t padl2_time; // Are 2 and 3 actually used? Not sure what to map them to.
-   uint8_t padl2_value;
-   uint64_t padl3_time;
+   uint8_t padl2_value; // Are 2 and 3 actually used? Not sure what to map them to.
    uint8_t padl3_value;
 
    SDL_Joystick *joystick;
+   int16_t joystick_axis[2];
 
    bool status_bar_visible;
+   SDL_Texture *status_texture;
+   uint32_t status_pixels[40 * 7 * 8];
 
    bool debug;
 
@@ -103,6 +138,24 @@ struct ewm_two_t {
 
    int state;
    struct ewm_tty_t *tty;
+
+   struct ewm_rewind_t *rewind; // NULL unless rewinding is enabled
+   struct ewm_trace_t *trace;   // NULL unless tracing
+   struct ewm_spk_t *spk;       // NULL unless the speaker is heard
+   struct ewm_cap_t *cap;       // NULL unless frames are captured
+
+   // Programs to load at the first keyboard prompt. They are not owned
+   // by the machine.
+   struct ewm_ldr_option_t *loads;
+   bool loads_run;
+
+   // Used when the cpu runs on its own thread
+   struct ewm_spsc_t *events;
+   struct ewm_triple_t *snapshots;
+   atomic_bool quit;
+   atomic_bool snapshot_full;
+   _Atomic uint32_t snapshot_txt_rows[2];
+   _Atomic uint32_t snapshot_hgr_rows[2];
 };
 
 struct ewm_two_t *ewm_two_create(int type, SDL_Renderer *renderer, SDL_Joystick *joystick);
@@ -112,6 +165,24 @@ int ewm_two_init_lua(struct ewm_two_t *two, struct ewm_lua_t *lua);
 
 int ewm_two_load_disk(struct ewm_two_t *two, int drive, char *path);
 
+// Loads the programs when the machine first sits waiting for a key,
+// which is when Applesoft or the monitor is ready for them. Without a
+// disk in drive 1 the machine goes straight to Applesoft instead of
+// trying to boot, which needs to be set up before the reset.
+void ewm_two_load_programs(struct ewm_two_t *two, struct ewm_ldr_option_t *loads, bool run);
+
+int ewm_two_save_snapshot(struct ewm_two_t *two, char *path);
+int ewm_two_load_snapshot(struct ewm_two_t *two, char *path);
+
+// With rewinding enabled a frame is recorded after every frame that
+// the cpu ran, and the hotkey goes back EWM_TWO_REWIND_FRAMES frames.
+int ewm_two_enable_rewind(struct ewm_two_t *two, size_t arena_size);
+int ewm_two_record_frame(struct ewm_two_t *two);
+int ewm_two_rewind(struct ewm_two_t *two, int frames);
+
+// Runs a job of the batch runner and writes its dump to out.
+int ewm_two_run_job(struct ewm_batch_job_t *job, FILE *out);
+
 int ewm_two_main(int argc, char **argv);
 
 #endif // EWM_TWO_H